@@ -1,5 +1,6 @@
 
 #include "applysolutionswriter.h"
+#include "profiler.h"
 #include "solutionfile.h"
 #include "matrix2x2.h"
 
@@ -9,7 +10,8 @@ ApplySolutionsWriter::ApplySolutionsWriter(std::unique_ptr<Writer> parentWriter,
 										   size_t bandFineChanStart, size_t nTotalFineChannels) : ForwardingWriter(std::move(parentWriter)),
 																								  _nBandFineChannels(0),
 																								  _bandFineChanStart(bandFineChanStart),
-																								  _nTotalFineChannels(nTotalFineChannels)
+																								  _nTotalFineChannels(nTotalFineChannels),
+																								  _rowTimer("solution apply")
 {
 	SolutionFile solutionFile;
 	solutionFile.OpenForReading(filename.c_str());
@@ -72,6 +74,7 @@ void ApplySolutionsWriter::WriteRow(double time, double timeCentroid, size_t ant
 	// If _nSolutionChannels == _nTotalFineChannels then apply solution channels to data fine channels 1:1
 	// If _nSolutionChannels  > _nTotalFineChannels then skip evey N solution channel when applying to each data channel
 	// If _nSolutionChannels  < _nTotalFineChannels then apply the same solution channel to N consecutive data channels	
+	_rowTimer.Start();
 	int channelRatio;
 	
 	if ( _nSolutionChannels > _nTotalFineChannels )
@@ -100,6 +103,7 @@ void ApplySolutionsWriter::WriteRow(double time, double timeCentroid, size_t ant
 		for(size_t p=0; p!=4; ++p)
 			_correctedData[ch * 4 + p] = dataAsDouble[p];
 	}
+	_rowTimer.Stop(_nBandFineChannels * 4 * sizeof(std::complex<float>));
 
 	ForwardingWriter::WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, _correctedData.data(), flags, weights);
 }
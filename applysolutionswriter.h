@@ -3,6 +3,7 @@
 
 #include "forwardingwriter.h"
 #include "matrix2x2.h"
+#include "profiler.h"
 
 #include <memory>
 #include <string>
@@ -23,6 +24,7 @@ class ApplySolutionsWriter : public ForwardingWriter
 		size_t _nBandFineChannels, _nSolutionAntennas, _nSolutionChannels, _bandFineChanStart, _nTotalFineChannels;
 		std::vector<std::complex<float>> _correctedData;
 		std::vector<MC2x2> _solutions;
+		Profiler::RowTimer _rowTimer;
 };
 
 #endif
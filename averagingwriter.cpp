@@ -1,65 +1,108 @@
 #include "averagingwriter.h"
-
-//#include <xmmintrin.h>
-
-//#define USE_SSE
+#include "checkpoint.h"
+#include "cpufeatures.h"
+#include "profiler.h"
 
 void AveragingWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 {
+	_rowTimer.Start();
 	Buffer &buffer = getBuffer(antenna1, antenna2);
-	size_t srcIndex = 0;
-	for(size_t ch=0; ch!=_avgChannelCount*_freqAvgFactor; ++ch)
+	(this->*_accumulateRow)(buffer, data, flags, weights);
+	buffer._rowTime += time;
+	buffer._rowTimestepCount++;
+	buffer._interval += interval;
+	_rowTimer.Stop(_avgChannelCount * _freqAvgFactor * 4 * sizeof(std::complex<float>));
+	
+	if(buffer._rowTimestepCount == _timeAvgFactor)
+		writeCurrentTimestep(antenna1, antenna2);
+}
+
+void AveragingWriter::SaveState(std::ostream& stream)
+{
+	Checkpoint::Write(stream, _rowsAdded);
+	const size_t valueCount = _avgChannelCount * 4;
+	for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
 	{
-#ifndef USE_SSE
-		for(size_t p=0; p!=4; ++p)
+		for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
 		{
-			const size_t destIndex = (ch / _freqAvgFactor) * 4 + p;
-			buffer._flaggedAndUnflaggedData[destIndex] += data[srcIndex];
-			if(!flags[srcIndex])
+			const Buffer& buffer = getBuffer(antenna1, antenna2);
+			Checkpoint::Write(stream, buffer._rowTimestepCount);
+			// Empty buffers, e.g. when the chunk ended on an averaging boundary, need no values
+			if(buffer._rowTimestepCount != 0)
 			{
-				buffer._rowData[destIndex] += data[srcIndex] * weights[srcIndex];
-				buffer._rowWeights[destIndex] += weights[srcIndex];
-				buffer._rowCounts[destIndex]++;
+				Checkpoint::Write(stream, buffer._rowTime);
+				Checkpoint::Write(stream, buffer._interval);
+				Checkpoint::WriteArray(stream, buffer._rowData, valueCount);
+				Checkpoint::WriteArray(stream, buffer._flaggedAndUnflaggedData, valueCount);
+				Checkpoint::WriteArray(stream, buffer._rowFlags, valueCount);
+				Checkpoint::WriteArray(stream, buffer._rowWeights, valueCount);
+				Checkpoint::WriteArray(stream, buffer._rowCounts, valueCount);
 			}
-			++srcIndex;
 		}
-#else
-		const size_t destIndex = (ch / _freqAvgFactor) * 4;
-		const __m128 dataValA = _mm_load_ps((float*) &data[srcIndex]);
-		const __m128 dataValB = _mm_load_ps((float*) &data[srcIndex+2]);
-		std::complex<float> *allDataPtr = &buffer._flaggedAndUnflaggedData[destIndex];
-		
-		// Perform *allDataPtr += dataVal
-		_mm_store_ps((float*) allDataPtr, _mm_add_ps(_mm_load_ps((float*) allDataPtr), dataValA));
-		_mm_store_ps((float*) (allDataPtr+2), _mm_add_ps(_mm_load_ps((float*) (allDataPtr+2)), dataValB));
-		
-		// Note that if one polarization is flagged, all are flagged
-		if(!flags[srcIndex])
+	}
+	_writer->SaveState(stream);
+}
+
+void AveragingWriter::RestoreState(std::istream& stream)
+{
+	Checkpoint::Read(stream, _rowsAdded);
+	const size_t valueCount = _avgChannelCount * 4;
+	for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
 		{
-			const __m128 weightsA = _mm_set_ps(weights[srcIndex+1], weights[srcIndex+1], weights[srcIndex], weights[srcIndex]);
-			const __m128 weightsB = _mm_set_ps(weights[srcIndex+3], weights[srcIndex+3], weights[srcIndex+2], weights[srcIndex+2]);
-			std::complex<float> *destPtr = &buffer._rowData[destIndex];
-			
-			// Perform *destPtr += dataVal * weights
-			_mm_store_ps((float*) destPtr,     _mm_add_ps(_mm_load_ps((float*) destPtr), _mm_mul_ps(dataValA, weightsA)));
-			_mm_store_ps((float*) (destPtr+2), _mm_add_ps(_mm_load_ps((float*) (destPtr+2)), _mm_mul_ps(dataValB, weightsB)));
-			
-			// Perform buf.weight += weights
-			_mm_store_ps(&buffer._rowWeights[destIndex], _mm_add_ps(_mm_load_ps(&weights[srcIndex]), _mm_load_ps(&buffer._rowWeights[destIndex])));
-			
-			buffer._rowCounts[destIndex]++;
-			buffer._rowCounts[destIndex+1]++;
-			buffer._rowCounts[destIndex+2]++;
-			buffer._rowCounts[destIndex+3]++;
+			Buffer& buffer = getBuffer(antenna1, antenna2);
+			buffer.initZero(_avgChannelCount);
+			Checkpoint::Read(stream, buffer._rowTimestepCount);
+			if(buffer._rowTimestepCount != 0)
+			{
+				Checkpoint::Read(stream, buffer._rowTime);
+				Checkpoint::Read(stream, buffer._interval);
+				Checkpoint::ReadArray(stream, buffer._rowData, valueCount);
+				Checkpoint::ReadArray(stream, buffer._flaggedAndUnflaggedData, valueCount);
+				Checkpoint::ReadArray(stream, buffer._rowFlags, valueCount);
+				Checkpoint::ReadArray(stream, buffer._rowWeights, valueCount);
+				Checkpoint::ReadArray(stream, buffer._rowCounts, valueCount);
+			}
 		}
-		
-		srcIndex += 4;
-#endif
 	}
-	buffer._rowTime += time;
-	buffer._rowTimestepCount++;
-	buffer._interval += interval;
-	
-	if(buffer._rowTimestepCount == _timeAvgFactor)
-		writeCurrentTimestep(antenna1, antenna2);
+	_writer->RestoreState(stream);
+}
+
+template<size_t FreqAvgFactor>
+MULTIVERSIONED_KERNEL
+void AveragingWriter::accumulateRow(Buffer& buffer, const std::complex<float>* data, const bool* flags, const float* weights) const
+{
+	const size_t freqAvgFactor = FreqAvgFactor == 0 ? _freqAvgFactor : FreqAvgFactor;
+	size_t srcIndex = 0;
+	for(size_t avgCh=0; avgCh!=_avgChannelCount; ++avgCh)
+	{
+		const size_t destIndex = avgCh * 4;
+		for(size_t ch=0; ch!=freqAvgFactor; ++ch)
+		{
+			for(size_t p=0; p!=4; ++p)
+			{
+				buffer._flaggedAndUnflaggedData[destIndex + p] += data[srcIndex];
+				if(!flags[srcIndex])
+				{
+					buffer._rowData[destIndex + p] += data[srcIndex] * weights[srcIndex];
+					buffer._rowWeights[destIndex + p] += weights[srcIndex];
+					buffer._rowCounts[destIndex + p]++;
+				}
+				++srcIndex;
+			}
+		}
+	}
+}
+
+AveragingWriter::AccumulateFunction AveragingWriter::selectAccumulateRow(size_t freqAvgFactor)
+{
+	switch(freqAvgFactor)
+	{
+		case 1: return &AveragingWriter::accumulateRow<1>;
+		case 2: return &AveragingWriter::accumulateRow<2>;
+		case 4: return &AveragingWriter::accumulateRow<4>;
+		case 8: return &AveragingWriter::accumulateRow<8>;
+		default: return &AveragingWriter::accumulateRow<0>;
+	}
 }
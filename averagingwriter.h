@@ -1,6 +1,8 @@
 #ifndef AVERAGING_MS_WRITER_H
 #define AVERAGING_MS_WRITER_H
 
+#include "memorytracker.h"
+#include "profiler.h"
 #include "writer.h"
 
 #include <iostream>
@@ -17,7 +19,8 @@ class AveragingWriter : public Writer
 	public:
 		AveragingWriter(std::unique_ptr<Writer>&& writer, size_t timeCount, size_t freqAvgFactor, UVWCalculater& uvwCalculater)
 		: _writer(std::move(writer)), _timeAvgFactor(timeCount), _freqAvgFactor(freqAvgFactor), _rowsAdded(0),
-		_originalChannelCount(0), _avgChannelCount(0), _antennaCount(0), _uvwCalculater(uvwCalculater)
+		_originalChannelCount(0), _avgChannelCount(0), _antennaCount(0), _bufferBytes(0), _uvwCalculater(uvwCalculater),
+		_accumulateRow(selectAccumulateRow(freqAvgFactor)), _rowTimer("averaging")
 		{
 		}
 		
@@ -36,32 +39,39 @@ class AveragingWriter : public Writer
 			_avgChannelCount = channels.size() / _freqAvgFactor;
 			_originalChannelCount = channels.size();
 			
-			std::vector<Writer::ChannelInfo> avgChannels(_avgChannelCount);
-			for(size_t ch=0; ch!=_avgChannelCount; ++ch)
+			std::vector<Writer::ChannelInfo> avgChannels = AverageChannels(channels, _freqAvgFactor);
+			
+			_writer->WriteBandInfo(name, avgChannels, refFreq, totalBandwidth, flagRow);
+			
+			if(_antennaCount != 0)
+				initBuffers();
+		}
+		
+		static std::vector<Writer::ChannelInfo> AverageChannels(const std::vector<Writer::ChannelInfo> &channels, size_t freqAvgFactor)
+		{
+			const size_t avgChannelCount = channels.size() / freqAvgFactor;
+			std::vector<Writer::ChannelInfo> avgChannels(avgChannelCount);
+			for(size_t ch=0; ch!=avgChannelCount; ++ch)
 			{
 				Writer::ChannelInfo channel;
 				channel.chanFreq = 0.0;
 				channel.chanWidth = 0.0;
 				channel.effectiveBW = 0.0;
 				channel.resolution = 0.0;
-				for(size_t i=0; i!=_freqAvgFactor; ++i)
+				for(size_t i=0; i!=freqAvgFactor; ++i)
 				{
-					const Writer::ChannelInfo& curChannel = channels[ch*_freqAvgFactor + i];
+					const Writer::ChannelInfo& curChannel = channels[ch*freqAvgFactor + i];
 					channel.chanFreq += curChannel.chanFreq;
 					channel.chanWidth += curChannel.chanWidth;
 					channel.effectiveBW += curChannel.effectiveBW;
 					channel.resolution += curChannel.resolution;
 				}
 				
-				channel.chanFreq /= (double) _freqAvgFactor;
+				channel.chanFreq /= (double) freqAvgFactor;
 				
 				avgChannels[ch] = channel;
 			}
-			
-			_writer->WriteBandInfo(name, avgChannels, refFreq, totalBandwidth, flagRow);
-			
-			if(_antennaCount != 0)
-				initBuffers();
+			return avgChannels;
 		}
 		
 		virtual void WriteAntennae(const std::vector<Writer::AntennaInfo> &antennae, double time) final override
@@ -114,6 +124,11 @@ class AveragingWriter : public Writer
 			_writer->WriteHistoryItem(commandLine, application, params);
 		}
 		
+		/** Saves the partially averaged timestep of every baseline, followed by the state of the parent writer. */
+		virtual void SaveState(std::ostream& stream) final override;
+		
+		virtual void RestoreState(std::istream& stream) final override;
+		
 		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override {
 			const Buffer &buffer = getBuffer(antenna1, antenna2);
 			return buffer._rowTimestepCount==0;
@@ -173,6 +188,17 @@ class AveragingWriter : public Writer
 			size_t *_rowCounts;
 		};
 		
+		typedef void (AveragingWriter::*AccumulateFunction)(Buffer& buffer, const std::complex<float>* data, const bool* flags, const float* weights) const;
+		
+		/**
+		 * Add a row of input data to the buffer. Not part of WriteRow(), since virtual functions can't be multiversioned.
+		 * It is instantiated for the common averaging factors, so that the channel loops have fixed bounds;
+		 * FreqAvgFactor = 0 is the version for any factor.
+		 */
+		template<size_t FreqAvgFactor>
+		void accumulateRow(Buffer& buffer, const std::complex<float>* data, const bool* flags, const float* weights) const;
+		static AccumulateFunction selectAccumulateRow(size_t freqAvgFactor);
+		
 		void writeCurrentTimestep(size_t antenna1, size_t antenna2)
 		{
 			Buffer& buffer = getBuffer(antenna1, antenna2);
@@ -226,6 +252,9 @@ class AveragingWriter : public Writer
 					setBuffer(antenna1, antenna2, buffer);
 				}
 			}
+			const size_t bytesPerBuffer = _avgChannelCount * 4 * (2 * sizeof(std::complex<float>) + sizeof(bool) + sizeof(float) + sizeof(size_t));
+			_bufferBytes = int64_t(bytesPerBuffer) * _antennaCount * (_antennaCount + 1) / 2;
+			MemoryTracker::Allocate(MemoryTracker::AveragingBuffers, _bufferBytes);
 		}
 		
 		void destroyBuffers()
@@ -239,13 +268,18 @@ class AveragingWriter : public Writer
 				}
 			}
 			_buffers.clear();
+			MemoryTracker::Release(MemoryTracker::AveragingBuffers, _bufferBytes);
+			_bufferBytes = 0;
 		}
 		
 		std::unique_ptr<Writer> _writer;
 		size_t _timeAvgFactor, _freqAvgFactor, _rowsAdded;
 		size_t _originalChannelCount, _avgChannelCount, _antennaCount;
+		int64_t _bufferBytes;
 		UVWCalculater& _uvwCalculater;
+		AccumulateFunction _accumulateRow;
 		std::vector<Buffer*> _buffers;
+		Profiler::RowTimer _rowTimer;
 };
 
 #endif
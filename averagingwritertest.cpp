@@ -0,0 +1,243 @@
+#include "averagingwriter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Averages random rows with the AveragingWriter, of which accumulateRow() has fixed-size
+ * instances for the common frequency averaging factors, and compares the averaged rows
+ * with those of the loop that AveragingWriter::WriteRow() used for any factor before.
+ */
+class AveragingWriterTest
+{
+	public:
+		AveragingWriterTest() : _antennaCount(3), _channelCount(40), _timestepCount(6), _timeAvgFactor(2), _random(1)
+		{ }
+
+		/** Returns the number of averaged rows that differ from those of the original loop. */
+		size_t Compare(size_t freqAvgFactor, double tolerance)
+		{
+			const std::vector<Row> input = randomRows();
+			std::unique_ptr<RecordingWriter> recorder(new RecordingWriter());
+			const std::vector<Row>& actual = recorder->Rows();
+			ZeroUVW uvw;
+			AveragingWriter writer(std::move(recorder), _timeAvgFactor, freqAvgFactor, uvw);
+			std::vector<Writer::ChannelInfo> channels(_channelCount);
+			for(size_t ch=0; ch!=_channelCount; ++ch)
+				channels[ch] = Writer::ChannelInfo{ 150e6 + ch * 40e3, 40e3, 40e3, 40e3 };
+			writer.WriteBandInfo("band", channels, 150e6, _channelCount * 40e3, false);
+			writer.WriteAntennae(std::vector<Writer::AntennaInfo>(_antennaCount), 0.0);
+			for(size_t t=0; t!=_timestepCount; ++t)
+			{
+				writer.AddRows(baselineCount());
+				for(size_t i=0; i!=baselineCount(); ++i)
+				{
+					const Row& row = input[t * baselineCount() + i];
+					std::unique_ptr<bool[]> flags(new bool[row.flags.size()]);
+					std::copy(row.flags.begin(), row.flags.end(), flags.get());
+					writer.WriteRow(row.time, row.time, row.antenna1, row.antenna2, 0.0, 0.0, 0.0, 1.0, row.data.data(), flags.get(), row.weights.data());
+				}
+			}
+
+			const std::vector<Row> expected = averageWithLoop(input, freqAvgFactor);
+			if(actual.size() != expected.size())
+				throw std::runtime_error("The averaging writer wrote " + std::to_string(actual.size()) + " rows instead of " + std::to_string(expected.size()));
+			size_t differences = 0;
+			for(size_t i=0; i!=expected.size(); ++i)
+			{
+				if(!rowsMatch(expected[i], actual[i], tolerance))
+					++differences;
+			}
+			return differences;
+		}
+
+	private:
+		struct Row
+		{
+			double time;
+			size_t antenna1, antenna2;
+			std::vector<std::complex<float>> data;
+			std::vector<bool> flags;
+			std::vector<float> weights;
+		};
+
+		/** Records the rows that the averaging writer writes. */
+		class RecordingWriter : public Writer
+		{
+			public:
+				const std::vector<Row>& Rows() const { return _rows; }
+
+				virtual void WriteBandInfo(const std::string&, const std::vector<ChannelInfo>& channels, double, double, bool) final override
+				{
+					_channelCount = channels.size();
+				}
+				virtual void WriteAntennae(const std::vector<AntennaInfo>&, double) final override { }
+				virtual void WritePolarizationForLinearPols(bool) final override { }
+				virtual void WriteSource(const SourceInfo&) final override { }
+				virtual void WriteField(const FieldInfo&) final override { }
+				virtual void WriteObservation(const ObservationInfo&) final override { }
+				virtual void WriteHistoryItem(const std::string&, const std::string&, const std::vector<std::string>&) final override { }
+				virtual void AddRows(size_t) final override { }
+				virtual void WriteRow(double time, double, size_t antenna1, size_t antenna2, double, double, double, double, const std::complex<float>* data, const bool* flags, const float *weights) final override
+				{
+					Row row;
+					row.time = time;
+					row.antenna1 = antenna1;
+					row.antenna2 = antenna2;
+					row.data.assign(data, data + _channelCount * 4);
+					row.flags.assign(flags, flags + _channelCount * 4);
+					row.weights.assign(weights, weights + _channelCount * 4);
+					_rows.push_back(row);
+				}
+
+			private:
+				size_t _channelCount;
+				std::vector<Row> _rows;
+		};
+
+		class ZeroUVW : public UVWCalculater
+		{
+			public:
+				virtual void CalculateUVW(double, size_t, size_t, double &u, double &v, double &w) final override
+				{
+					u = 0.0; v = 0.0; w = 0.0;
+				}
+		};
+
+		size_t baselineCount() const { return _antennaCount * (_antennaCount + 1) / 2; }
+
+		/** Rows of all baselines of each timestep, in the order in which Cotter writes them. */
+		std::vector<Row> randomRows()
+		{
+			std::normal_distribution<float> dataDistribution;
+			std::uniform_real_distribution<float> weightDistribution(0.5, 2.0);
+			std::vector<Row> rows;
+			for(size_t t=0; t!=_timestepCount; ++t)
+			{
+				for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+				{
+					for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+					{
+						Row row;
+						row.time = 1000.0 + t;
+						row.antenna1 = antenna1;
+						row.antenna2 = antenna2;
+						for(size_t i=0; i!=_channelCount*4; ++i)
+						{
+							row.data.emplace_back(dataDistribution(_random), dataDistribution(_random));
+							// Every fourth baseline is fully flagged, so that averaged samples without unflagged data occur
+							row.flags.push_back(rows.size() % 4 == 3 || _random() % 3 == 0);
+							row.weights.push_back(weightDistribution(_random));
+						}
+						rows.push_back(row);
+					}
+				}
+			}
+			return rows;
+		}
+
+		/** Averages the rows with the loop of AveragingWriter::WriteRow() before it had instances per factor. */
+		std::vector<Row> averageWithLoop(const std::vector<Row>& input, size_t freqAvgFactor) const
+		{
+			const size_t avgChannelCount = _channelCount / freqAvgFactor;
+			std::vector<Row> output;
+			for(size_t t=0; t!=_timestepCount; t+=_timeAvgFactor)
+			{
+				for(size_t i=0; i!=baselineCount(); ++i)
+				{
+					std::vector<std::complex<float>> rowData(avgChannelCount*4), flaggedAndUnflaggedData(avgChannelCount*4);
+					std::vector<float> rowWeights(avgChannelCount*4);
+					std::vector<size_t> rowCounts(avgChannelCount*4);
+					double rowTime = 0.0;
+					for(size_t step=0; step!=_timeAvgFactor; ++step)
+					{
+						const Row& row = input[(t + step) * baselineCount() + i];
+						size_t srcIndex = 0;
+						for(size_t ch=0; ch!=avgChannelCount*freqAvgFactor; ++ch)
+						{
+							for(size_t p=0; p!=4; ++p)
+							{
+								const size_t destIndex = (ch / freqAvgFactor) * 4 + p;
+								flaggedAndUnflaggedData[destIndex] += row.data[srcIndex];
+								if(!row.flags[srcIndex])
+								{
+									rowData[destIndex] += row.data[srcIndex] * row.weights[srcIndex];
+									rowWeights[destIndex] += row.weights[srcIndex];
+									rowCounts[destIndex]++;
+								}
+								++srcIndex;
+							}
+						}
+						rowTime += row.time;
+					}
+
+					Row averaged;
+					averaged.time = rowTime / _timeAvgFactor;
+					averaged.antenna1 = input[t * baselineCount() + i].antenna1;
+					averaged.antenna2 = input[t * baselineCount() + i].antenna2;
+					for(size_t ch=0; ch!=avgChannelCount*4; ++ch)
+					{
+						if(rowCounts[ch] == 0)
+						{
+							averaged.data.push_back(std::complex<float>(
+								flaggedAndUnflaggedData[ch].real() / (_timeAvgFactor*freqAvgFactor),
+								flaggedAndUnflaggedData[ch].imag() / (_timeAvgFactor*freqAvgFactor)));
+							averaged.flags.push_back(true);
+						} else {
+							averaged.data.push_back(std::complex<float>(
+								rowData[ch].real() / rowWeights[ch],
+								rowData[ch].imag() / rowWeights[ch]));
+							averaged.flags.push_back(false);
+						}
+					}
+					averaged.weights = rowWeights;
+					output.push_back(averaged);
+				}
+			}
+			return output;
+		}
+
+		static bool rowsMatch(const Row& expected, const Row& actual, double tolerance)
+		{
+			if(expected.time != actual.time || expected.antenna1 != actual.antenna1 || expected.antenna2 != actual.antenna2 ||
+				expected.data.size() != actual.data.size() || expected.flags != actual.flags)
+				return false;
+			for(size_t i=0; i!=expected.data.size(); ++i)
+			{
+				if(std::abs(expected.data[i] - actual.data[i]) > tolerance * std::max(std::abs(expected.data[i]), std::abs(actual.data[i])) ||
+					std::fabs(expected.weights[i] - actual.weights[i]) > tolerance * expected.weights[i])
+					return false;
+			}
+			return true;
+		}
+
+		size_t _antennaCount, _channelCount, _timestepCount, _timeAvgFactor;
+		std::mt19937 _random;
+};
+
+int main()
+{
+	try {
+		AveragingWriterTest test;
+		bool failed = false;
+		// 1, 2, 4 and 8 have instances of their own, 3 and 5 use the one for any factor
+		for(size_t freqAvgFactor : { 1, 2, 3, 4, 5, 8 })
+		{
+			const size_t differences = test.Compare(freqAvgFactor, 1e-5);
+			std::cout << "Frequency averaging factor " << freqAvgFactor << ": " << differences << " differing rows.\n";
+			if(differences != 0)
+				failed = true;
+		}
+		return failed ? 1 : 0;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
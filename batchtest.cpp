@@ -0,0 +1,155 @@
+#include "cotter.h"
+#include "syntheticobservation.h"
+
+#include <fitsio.h>
+
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+/**
+ * Processes two observations after each other with the same Cotter instance, as cotter does
+ * with -batch. The second gpubox file of the first observation is missing, so its subband should
+ * be flagged in the first observation, but not in the second one.
+ */
+class BatchTest
+{
+	public:
+		BatchTest(const std::string& tempDirectory) :
+			_subbandCount(2),
+			_prefix(tempDirectory + "/batchtest_" + std::to_string(getpid()))
+		{ }
+
+		~BatchTest()
+		{
+			for(const std::string& filename : _files)
+				std::remove(filename.c_str());
+		}
+
+		/** Returns the fraction of flagged samples in the flag files of both gpuboxes of both observations. */
+		std::vector<std::vector<double>> Run()
+		{
+			Cotter cotter;
+			cotter.SetNumaAware(false);
+			cotter.SetThreadCount(2);
+			cotter.SetMemoryLimit(int64_t(1) << 30);
+			cotter.SetSubbandCount(_subbandCount);
+			cotter.SetOutputFormat(Cotter::FlagsOutputFormat);
+			cotter.SetRFIDetection(false);
+			cotter.SetCollectStatistics(false);
+			cotter.SetRemoveFlaggedAntennae(false);
+
+			std::vector<std::vector<double>> flaggedFractions;
+			for(size_t obs=0; obs!=2; ++obs)
+			{
+				const std::string prefix = _prefix + "_obs" + std::to_string(obs+1);
+				SyntheticObservation observation;
+				observation.SetAntennaCount(32);
+				observation.SetSubbandCount(_subbandCount);
+				observation.SetChannelsPerSubband(16);
+				observation.SetScanCount(8);
+				observation.SetGPSTime(1200000000 + obs*600);
+				observation.SetSeed(obs+1);
+
+				const std::string metaFilename = prefix + "_metafits.fits";
+				observation.WriteMetafits(metaFilename);
+				_files.push_back(metaFilename);
+				std::vector<std::string> gpuBoxFiles(_subbandCount);
+				for(size_t gpuBox=0; gpuBox!=_subbandCount; ++gpuBox)
+				{
+					if(obs == 0 && gpuBox == 1)
+						continue;
+					gpuBoxFiles[gpuBox] = SyntheticObservation::GPUBoxFilename(prefix, gpuBox);
+					observation.WriteGPUBoxFile(gpuBoxFiles[gpuBox], gpuBox);
+					_files.push_back(gpuBoxFiles[gpuBox]);
+				}
+
+				cotter.SetMetaFilename(metaFilename.c_str());
+				cotter.SetOutputFilename(prefix + "_%%.mwaf");
+				cotter.SetFileSets(std::vector<std::vector<std::string>>{ gpuBoxFiles });
+				cotter.Run(0.0, 0.0);
+
+				flaggedFractions.emplace_back();
+				for(size_t gpuBox=0; gpuBox!=_subbandCount; ++gpuBox)
+				{
+					const std::string flagFilename = prefix + "_0" + std::to_string(gpuBox+1) + ".mwaf";
+					_files.push_back(flagFilename);
+					flaggedFractions.back().push_back(flaggedFraction(flagFilename));
+				}
+			}
+			return flaggedFractions;
+		}
+
+	private:
+		static void check(int status, const std::string& filename)
+		{
+			if(status)
+			{
+				char statusStr[FLEN_STATUS];
+				fits_get_errstatus(status, statusStr);
+				throw std::runtime_error("Could not read flag file " + filename + ": " + statusStr);
+			}
+		}
+
+		static double flaggedFraction(const std::string& filename)
+		{
+			int status = 0;
+			fitsfile* file;
+			fits_open_file(&file, filename.c_str(), READONLY, &status);
+			check(status, filename);
+			long channelCount;
+			fits_read_key(file, TLONG, "NCHANS", &channelCount, nullptr, &status);
+			int hduType;
+			fits_movabs_hdu(file, 2, &hduType, &status);
+			long rowCount;
+			fits_get_num_rows(file, &rowCount, &status);
+			int column;
+			fits_get_colnum(file, CASEINSEN, const_cast<char*>("FLAGS"), &column, &status);
+			check(status, filename);
+			std::vector<char> flags(channelCount);
+			size_t flaggedCount = 0;
+			for(long row=1; row<=rowCount; ++row)
+			{
+				fits_read_col(file, TBIT, column, row, 1, channelCount, nullptr, flags.data(), nullptr, &status);
+				check(status, filename);
+				for(char flag : flags)
+					if(flag)
+						++flaggedCount;
+			}
+			fits_close_file(file, &status);
+			if(rowCount == 0)
+				throw std::runtime_error("Flag file " + filename + " has no rows");
+			return double(flaggedCount) / (double(rowCount) * channelCount);
+		}
+
+		size_t _subbandCount;
+		std::string _prefix;
+		std::vector<std::string> _files;
+};
+
+int main(int argc, char* argv[])
+{
+	const std::string tempDirectory = argc > 1 ? argv[1] : "/tmp";
+	try {
+		BatchTest test(tempDirectory);
+		const std::vector<std::vector<double>> flaggedFractions = test.Run();
+		for(size_t obs=0; obs!=flaggedFractions.size(); ++obs)
+		{
+			for(size_t gpuBox=0; gpuBox!=flaggedFractions[obs].size(); ++gpuBox)
+				std::cout << "Observation " << (obs+1) << ", gpubox " << (gpuBox+1) << ": " << flaggedFractions[obs][gpuBox]*100.0 << "% flagged.\n";
+		}
+		// Only the missing gpubox of the first observation should be flagged completely
+		const bool failed =
+			flaggedFractions[0][0] == 1.0 || flaggedFractions[0][1] != 1.0 ||
+			flaggedFractions[1][0] == 1.0 || flaggedFractions[1][1] == 1.0;
+		return failed ? 1 : 0;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
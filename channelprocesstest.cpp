@@ -0,0 +1,39 @@
+#include "pipelinetest.h"
+
+/**
+ * Writes a synthetic observation once in a single process and once with its subbands divided
+ * over channel processes, of which the sets are merged into the set of the band as they finish.
+ * Three processes for four subbands give parts of different sizes, which finish in any order.
+ * Both sets should have the same rows and statistics.
+ */
+int main(int argc, char* argv[])
+{
+	const std::string tempDirectory = argc > 1 ? argv[1] : "/tmp";
+	try {
+		const size_t threadCount = 2, subbandCount = 4, scanCount = 20;
+		PipelineTest test(tempDirectory, "channelprocesstest", subbandCount, scanCount);
+		const std::string
+			expectedFilename = test.OutputFilename("singleprocess"),
+			actualFilename = test.OutputFilename("channelprocesses");
+		{
+			Cotter cotter;
+			test.Configure(cotter, expectedFilename, threadCount, test.FullMemoryLimit(threadCount));
+			cotter.Run(0.0, 0.0);
+		}
+		{
+			Cotter cotter;
+			test.Configure(cotter, actualFilename, threadCount, test.FullMemoryLimit(threadCount));
+			cotter.SetChannelProcessCount(3);
+			cotter.Run(0.0, 0.0);
+		}
+		const size_t
+			rowDifferences = PipelineTest::CompareRows(expectedFilename, actualFilename, 1e-6),
+			statisticDifferences = PipelineTest::CompareStatistics(expectedFilename, actualFilename, 1e-4);
+		std::cout << "Channel processes: " << rowDifferences << " differing rows, " << statisticDifferences << " differing statistics.\n";
+		return (rowDifferences != 0 || statisticDifferences != 0) ? 1 : 0;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
@@ -0,0 +1,72 @@
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	// Identifies the file type and the layout version of the state
+	const char Magic[8] = { 'C', 'O', 'T', 'T', 'E', 'R', 'C', 'P' };
+	const unsigned Version = 1;
+
+	int removeEntry(const char* path, const struct stat*, int, struct FTW*)
+	{
+		return std::remove(path);
+	}
+}
+
+void Checkpoint::Save(const std::string& filename, const std::function<void(std::ostream&)>& writeState)
+{
+	const std::string tempFilename = filename + ".tmp";
+	{
+		std::ofstream stream(tempFilename, std::ios::binary | std::ios::trunc);
+		stream.write(Magic, sizeof(Magic));
+		Write(stream, Version);
+		writeState(stream);
+		stream.close();
+		if(!stream)
+			throw std::runtime_error("Could not write checkpoint file " + tempFilename);
+	}
+	// Make sure the state is on disk before it replaces the previous checkpoint
+	int fd = open(tempFilename.c_str(), O_RDONLY);
+	if(fd != -1)
+	{
+		fsync(fd);
+		close(fd);
+	}
+	if(std::rename(tempFilename.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("Could not rename " + tempFilename + " to " + filename);
+}
+
+bool Checkpoint::Open(const std::string& filename, std::ifstream& stream)
+{
+	stream.open(filename, std::ios::binary);
+	if(!stream)
+		return false;
+	char magic[sizeof(Magic)];
+	unsigned version = 0;
+	stream.read(magic, sizeof(magic));
+	if(stream)
+		stream.read(reinterpret_cast<char*>(&version), sizeof(version));
+	if(!stream || std::memcmp(magic, Magic, sizeof(Magic)) != 0)
+		throw std::runtime_error(filename + " is not a Cotter checkpoint file");
+	if(version != Version)
+		throw std::runtime_error(filename + " was written by a different version of Cotter");
+	return true;
+}
+
+void Checkpoint::Remove(const std::string& path)
+{
+	if(Exists(path))
+		nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+bool Checkpoint::Exists(const std::string& path)
+{
+	struct stat info;
+	return lstat(path.c_str(), &info) == 0;
+}
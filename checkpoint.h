@@ -0,0 +1,91 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstddef>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Reading and writing of the state that is saved after every chunk, so that an interrupted
+ * run can continue from the last completed chunk (see Cotter::SetCheckpointing()). Values are
+ * stored in the native binary layout, so a checkpoint can only be resumed on the same kind of machine.
+ */
+class Checkpoint
+{
+	public:
+		/**
+		 * Replace the checkpoint file with the state that writeState writes. The state is written to
+		 * a temporary file that replaces the file when complete, so that an interruption while saving
+		 * leaves the previous checkpoint intact.
+		 */
+		static void Save(const std::string& filename, const std::function<void(std::ostream&)>& writeState);
+
+		/** Open a checkpoint file for reading. Returns false when there is no such file. */
+		static bool Open(const std::string& filename, std::ifstream& stream);
+
+		/** Remove a file, or a directory with all its contents, if it exists. */
+		static void Remove(const std::string& path);
+
+		static bool Exists(const std::string& path);
+
+		template<typename T>
+		static void Write(std::ostream& stream, const T& value)
+		{
+			WriteArray(stream, &value, 1);
+		}
+
+		template<typename T>
+		static void Read(std::istream& stream, T& value)
+		{
+			ReadArray(stream, &value, 1);
+		}
+
+		template<typename T>
+		static void WriteArray(std::ostream& stream, const T* values, size_t count)
+		{
+			stream.write(reinterpret_cast<const char*>(values), count * sizeof(T));
+		}
+
+		template<typename T>
+		static void ReadArray(std::istream& stream, T* values, size_t count)
+		{
+			stream.read(reinterpret_cast<char*>(values), count * sizeof(T));
+			if(!stream)
+				throw std::runtime_error("Checkpoint file is truncated");
+		}
+
+		template<typename T>
+		static void WriteVector(std::ostream& stream, const std::vector<T>& values)
+		{
+			Write(stream, values.size());
+			WriteArray(stream, values.data(), values.size());
+		}
+
+		template<typename T>
+		static void ReadVector(std::istream& stream, std::vector<T>& values)
+		{
+			size_t size;
+			Read(stream, size);
+			values.resize(size);
+			ReadArray(stream, values.data(), size);
+		}
+
+		static void WriteString(std::ostream& stream, const std::string& str)
+		{
+			Write(stream, str.size());
+			stream.write(str.data(), str.size());
+		}
+
+		static void ReadString(std::istream& stream, std::string& str)
+		{
+			size_t size;
+			Read(stream, size);
+			str.resize(size);
+			ReadArray(stream, &str[0], size);
+		}
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include "pipelinetest.h"
+#include "progressstream.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <string>
+#include <utility>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Writes a synthetic observation in several chunks with checkpointing, and kills the process
+ * once the second chunk starts, i.e. after the checkpoint of the first chunk was saved. The
+ * output is then finished from the checkpoint by another run, and should have the same rows
+ * and statistics as a set written without interruption.
+ *
+ * The interrupted run is done in a child process, which is forked before any threads are
+ * started. It reports the start of each chunk over a pipe with the progress stream.
+ */
+class CheckpointTest
+{
+	public:
+		CheckpointTest(const std::string& tempDirectory) :
+			_threadCount(2),
+			_scanCount(80),
+			_test(tempDirectory, "checkpointtest", 2, _scanCount)
+		{ }
+
+		/** Removes what an interrupted or failed run may have left behind. */
+		~CheckpointTest()
+		{
+			for(const std::string& filename : _checkpointedFilenames)
+			{
+				Checkpoint::Remove(filename + ".checkpoint");
+				for(size_t firstChunk=0; firstChunk!=4; ++firstChunk)
+				{
+					Checkpoint::Remove(filename + ".checkpoint-stats" + std::to_string(firstChunk) + "a.qs");
+					Checkpoint::Remove(filename + ".checkpoint-stats" + std::to_string(firstChunk) + "b.qs");
+				}
+			}
+		}
+
+		/** Returns the number of differing rows and statistics. */
+		std::pair<size_t, size_t> Compare()
+		{
+			const std::string
+				expectedFilename = _test.OutputFilename("uninterrupted"),
+				actualFilename = _test.OutputFilename("resumed");
+			_checkpointedFilenames.push_back(actualFilename);
+			interrupt(actualFilename);
+			if(!Checkpoint::Exists(actualFilename + ".checkpoint"))
+				throw std::runtime_error("The interrupted run did not leave a checkpoint");
+			{
+				Cotter cotter;
+				configure(cotter, actualFilename);
+				cotter.SetCheckpointing(true);
+				cotter.Run(0.0, 0.0);
+			}
+			if(Checkpoint::Exists(actualFilename + ".checkpoint"))
+				throw std::runtime_error("The checkpoint was not removed after the resumed run");
+			{
+				Cotter cotter;
+				configure(cotter, expectedFilename);
+				cotter.Run(0.0, 0.0);
+			}
+			return std::make_pair(
+				PipelineTest::CompareRows(expectedFilename, actualFilename, 1e-6),
+				PipelineTest::CompareStatistics(expectedFilename, actualFilename, 1e-4));
+		}
+
+	private:
+		/** Chunks of 20 scans, so that the observation is written in four chunks. */
+		void configure(Cotter& cotter, const std::string& outputFilename) const
+		{
+			_test.Configure(cotter, outputFilename, _threadCount, _test.MemoryLimit(_test.ChannelCount(), 20, _threadCount));
+		}
+
+		/** Runs cotter with checkpointing in a child process, which is killed when the second chunk starts. */
+		void interrupt(const std::string& outputFilename)
+		{
+			int fds[2];
+			if(pipe(fds) != 0)
+				throw std::runtime_error("Could not create a pipe");
+			std::cout.flush();
+			const pid_t pid = fork();
+			if(pid < 0)
+				throw std::runtime_error("Could not fork");
+			if(pid == 0)
+			{
+				close(fds[0]);
+				try {
+					ProgressStream::Instance().OpenDescriptor(fds[1]);
+					Cotter cotter;
+					configure(cotter, outputFilename);
+					cotter.SetCheckpointing(true);
+					cotter.Run(0.0, 0.0);
+				} catch(std::exception& e)
+				{
+					std::cerr << "Error in interrupted run: " << e.what() << '\n';
+					_exit(1);
+				}
+				_exit(0);
+			}
+
+			close(fds[1]);
+			std::string lines;
+			char buffer[4096];
+			bool isKilled = false;
+			ssize_t length;
+			while(!isKilled && (length = read(fds[0], buffer, sizeof buffer)) > 0)
+			{
+				lines.append(buffer, length);
+				size_t end;
+				while(!isKilled && (end = lines.find('\n')) != std::string::npos)
+				{
+					const std::string line = lines.substr(0, end);
+					lines.erase(0, end + 1);
+					if(line.find("\"event\": \"chunk\"") != std::string::npos && line.find("\"chunk\": 0,") == std::string::npos)
+					{
+						kill(pid, SIGKILL);
+						isKilled = true;
+					}
+				}
+			}
+			close(fds[0]);
+			int status;
+			waitpid(pid, &status, 0);
+			if(!isKilled || !WIFSIGNALED(status))
+				throw std::runtime_error("The run with checkpointing finished before it could be interrupted");
+		}
+
+		size_t _threadCount, _scanCount;
+		PipelineTest _test;
+		std::vector<std::string> _checkpointedFilenames;
+};
+
+int main(int argc, char* argv[])
+{
+	const std::string tempDirectory = argc > 1 ? argv[1] : "/tmp";
+	try {
+		CheckpointTest test(tempDirectory);
+		const std::pair<size_t, size_t> differences = test.Compare();
+		std::cout << "Resumed from checkpoint: " << differences.first << " differing rows, " << differences.second << " differing statistics.\n";
+		return (differences.first != 0 || differences.second != 0) ? 1 : 0;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
@@ -0,0 +1,40 @@
+#include "correctionkernels.h"
+#include "cpufeatures.h"
+
+MULTIVERSIONED_KERNEL
+void CorrectionKernels::ScaleRows(float* __restrict__ real, float* __restrict__ imag, size_t width, size_t stride, size_t height, const float* __restrict__ rowFactors, bool conjugate)
+{
+	const float imagSign = conjugate ? -1.0f : 1.0f;
+	for(size_t y=0; y!=height; ++y)
+	{
+		float* __restrict__ realPtr = real + y * stride;
+		float* __restrict__ imagPtr = imag + y * stride;
+		const float realFactor = rowFactors[y], imagFactor = imagSign * rowFactors[y];
+		for(size_t x=0; x!=width; ++x)
+		{
+			realPtr[x] *= realFactor;
+			imagPtr[x] *= imagFactor;
+		}
+	}
+}
+
+MULTIVERSIONED_KERNEL
+void CorrectionKernels::RotateRows(float* __restrict__ real, float* __restrict__ imag, size_t width, size_t stride, size_t height, const std::complex<float>* __restrict__ rowFactors, bool conjugate)
+{
+	// Conjugation changes the sign s of i, so (r + s i j)(fr + fi j) = r fr - i (s fi) + (r fi + i (s fr)) j
+	const float imagSign = conjugate ? -1.0f : 1.0f;
+	for(size_t y=0; y!=height; ++y)
+	{
+		float* __restrict__ realPtr = real + y * stride;
+		float* __restrict__ imagPtr = imag + y * stride;
+		const float
+			factorR = rowFactors[y].real(), factorI = rowFactors[y].imag(),
+			signedFactorI = imagSign * factorI, signedFactorR = imagSign * factorR;
+		for(size_t x=0; x!=width; ++x)
+		{
+			const float r = realPtr[x], i = imagPtr[x];
+			realPtr[x] = factorR * r - signedFactorI * i;
+			imagPtr[x] = factorI * r + signedFactorR * i;
+		}
+	}
+}
@@ -0,0 +1,29 @@
+#ifndef CORRECTION_KERNELS_H
+#define CORRECTION_KERNELS_H
+
+#include <complex>
+#include <cstddef>
+
+/**
+ * Inner loops of the per-baseline corrections in Cotter::processBaseline. They work
+ * on the real and imaginary images of one polarization together, so that every
+ * visibility is loaded and stored once per pass.
+ */
+class CorrectionKernels
+{
+	public:
+		/**
+		 * Multiply row y of both images with rowFactors[y]. Only the first width values
+		 * of each row are touched; the rows are stride floats apart. When conjugate is set,
+		 * the values are conjugated first, i.e. the imaginary values change sign.
+		 */
+		static void ScaleRows(float* __restrict__ real, float* __restrict__ imag, size_t width, size_t stride, size_t height, const float* __restrict__ rowFactors, bool conjugate);
+
+		/**
+		 * Multiply row y of the complex values (real, imag), or of their conjugates when conjugate
+		 * is set, with the complex factor rowFactors[y]. The layout is as for ScaleRows().
+		 */
+		static void RotateRows(float* __restrict__ real, float* __restrict__ imag, size_t width, size_t stride, size_t height, const std::complex<float>* __restrict__ rowFactors, bool conjugate);
+};
+
+#endif
@@ -0,0 +1,278 @@
+#include "correctionkernels.h"
+#include "cpufeatures.h"
+#include "geometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Corrects random visibilities of a baseline once with the loops that Cotter::processBaseline
+ * used before the correction kernels, and once with the per-band tables and kernels as Cotter
+ * uses them now, and compares the results. The images have padding after every row, which
+ * the kernels should not touch. Conjugated polarizations were negated as a whole, including
+ * the padding, before the other corrections; the kernels fold the conjugation into their pass.
+ */
+class CorrectionKernelsTest
+{
+	public:
+		CorrectionKernelsTest() :
+			_subbandCount(4),
+			_sbStart(1),
+			_sbEnd(3),
+			_channelsPerSubband(16),
+			_width(37),
+			_stride(40),
+			_random(1)
+		{
+			std::uniform_real_distribution<double>
+				passbandDistribution(0.8, 1.2),
+				gainDistribution(0.5, 2.0),
+				cableLengthDistribution(-100.0, 100.0);
+			for(size_t p=0; p!=4; ++p)
+			{
+				_subbandCorrectionFactors[p].resize(_channelsPerSubband);
+				for(float& factor : _subbandCorrectionFactors[p])
+					factor = passbandDistribution(_random);
+			}
+			// The inputs 1X, 1Y, 2X and 2Y of the baseline
+			for(size_t input=0; input!=4; ++input)
+			{
+				_pfbGains[input].resize(_subbandCount);
+				for(double& gain : _pfbGains[input])
+					gain = gainDistribution(_random);
+				_cableLenDelta[input] = cableLengthDistribution(_random);
+			}
+			_channelFrequenciesHz.resize(height());
+			for(size_t ch=0; ch!=height(); ++ch)
+				_channelFrequenciesHz[ch] = 150e6 + ch * 40e3;
+		}
+
+		/**
+		 * Rows of width visibilities, the start of which are stride values apart. Widths that are not
+		 * a multiple of the vector size of the kernels test their remainder loops, and strides that
+		 * are not a multiple of it test unaligned rows.
+		 */
+		void SetImageShape(size_t width, size_t stride)
+		{
+			_width = width;
+			_stride = stride;
+		}
+
+		/**
+		 * Returns the number of visibilities that differ more than the relative tolerance, or that
+		 * were changed although they are in the padding.
+		 */
+		size_t Compare(bool correctCableLength, const bool* conjugate, double tolerance)
+		{
+			std::vector<float> original = randomImages();
+			std::vector<float> expected = original, actual = original;
+			correctWithLoops(expected, correctCableLength, conjugate);
+			correctWithKernels(actual, correctCableLength, conjugate);
+			size_t differences = 0;
+			for(size_t p=0; p!=4; ++p)
+			{
+				for(size_t i=0; i!=height() * _stride; ++i)
+				{
+					std::vector<float>& reference = (i % _stride < _width) ? expected : original;
+					const std::complex<float>
+						expectedValue(image(reference, p*2)[i], image(reference, p*2+1)[i]),
+						actualValue(image(actual, p*2)[i], image(actual, p*2+1)[i]);
+					if(std::abs(expectedValue - actualValue) > tolerance * std::max(std::abs(expectedValue), std::abs(actualValue)))
+						++differences;
+				}
+			}
+			return differences;
+		}
+
+	private:
+		size_t height() const { return (_sbEnd - _sbStart) * _channelsPerSubband; }
+
+		/** The real and imaginary images of the four polarizations, each of height() rows of _stride values. */
+		std::vector<float> randomImages()
+		{
+			std::normal_distribution<float> distribution;
+			std::vector<float> images(8 * height() * _stride);
+			for(float& value : images)
+				value = distribution(_random);
+			return images;
+		}
+
+		float* image(std::vector<float>& images, size_t index) const { return &images[index * height() * _stride]; }
+
+		/** Cotter::correctConjugated(), which was called before the other corrections. */
+		void correctConjugatedWithLoop(std::vector<float>& images, size_t imgImageIndex) const
+		{
+			float *imags = image(images, imgImageIndex);
+			for(size_t y=0; y!=height(); ++y)
+			{
+				for(size_t x=0; x!=_stride; ++x)
+				{
+					*imags = -*imags;
+					++imags;
+				}
+			}
+		}
+
+		/** The cable length correction of Cotter::processBaseline before the phasors per input. */
+		void correctCableLengthWithLoop(std::vector<float>& images, size_t polarization, double cableDelay) const
+		{
+			float *reals = image(images, polarization*2);
+			float *imags = image(images, polarization*2+1);
+			for(size_t y=0; y!=height(); ++y)
+			{
+				double angle = -2.0 * M_PI * cableDelay * _channelFrequenciesHz[y] / SPEED_OF_LIGHT;
+				double rotSinl, rotCosl;
+				sincos(angle, &rotSinl, &rotCosl);
+				float rotSin = rotSinl, rotCos = rotCosl;
+				float *realPtr = reals + y * _stride;
+				float *imagPtr = imags + y * _stride;
+				for(size_t x=0; x!=_width; ++x)
+				{
+					float r = *realPtr;
+					*realPtr = rotCos * r - rotSin * (*imagPtr);
+					*imagPtr = rotSin * r + rotCos * (*imagPtr);
+					++realPtr;
+					++imagPtr;
+				}
+			}
+		}
+
+		/** The corrections of Cotter::processBaseline before the per-band tables and kernels. */
+		void correctWithLoops(std::vector<float>& images, bool correctCableLength, const bool* conjugate) const
+		{
+			for(size_t p=0; p!=4; ++p)
+			{
+				if(conjugate[p])
+					correctConjugatedWithLoop(images, p*2+1);
+			}
+			if(correctCableLength)
+			{
+				correctCableLengthWithLoop(images, 0, _cableLenDelta[2] - _cableLenDelta[0]);
+				correctCableLengthWithLoop(images, 1, _cableLenDelta[3] - _cableLenDelta[0]);
+				correctCableLengthWithLoop(images, 2, _cableLenDelta[2] - _cableLenDelta[1]);
+				correctCableLengthWithLoop(images, 3, _cableLenDelta[3] - _cableLenDelta[1]);
+			}
+			for(size_t i=0; i!=8; ++i)
+			{
+				const double* subbandGains1Ptr = (i<4) ? _pfbGains[0].data() : _pfbGains[1].data();
+				const double* subbandGains2Ptr = (i==0 || i==1 || i==4 || i==5) ? _pfbGains[2].data() : _pfbGains[3].data();
+				for(size_t sb=0; sb!=_sbEnd - _sbStart; ++sb)
+				{
+					double subbandGainCorrection = 1.0 / (subbandGains1Ptr[sb+_sbStart] * subbandGains2Ptr[sb+_sbStart]);
+					for(size_t ch=0; ch!=_channelsPerSubband; ++ch)
+					{
+						float *channelPtr = image(images, i) + (ch+sb*_channelsPerSubband) * _stride;
+						const float correctionFactor = _subbandCorrectionFactors[i/2][ch] * subbandGainCorrection;
+						for(size_t x=0; x!=_width; ++x)
+						{
+							*channelPtr *= correctionFactor;
+							++channelPtr;
+						}
+					}
+				}
+			}
+		}
+
+		/** The tables of Cotter::initCorrectionTables() and the kernel calls of Cotter::correctCableLengthAndPassband(). */
+		void correctWithKernels(std::vector<float>& images, bool correctCableLength, const bool* conjugate) const
+		{
+			std::vector<float> passbandFactors[4], inputGainFactors[4];
+			std::vector<std::complex<float>> inputPhasors[4];
+			for(size_t p=0; p!=4; ++p)
+			{
+				passbandFactors[p].resize(height());
+				for(size_t ch=0; ch!=height(); ++ch)
+					passbandFactors[p][ch] = _subbandCorrectionFactors[p][ch % _channelsPerSubband];
+			}
+			for(size_t input=0; input!=4; ++input)
+			{
+				inputGainFactors[input].resize(height());
+				for(size_t ch=0; ch!=height(); ++ch)
+					inputGainFactors[input][ch] = 1.0 / _pfbGains[input][_sbStart + ch / _channelsPerSubband];
+				inputPhasors[input].resize(height());
+				for(size_t ch=0; ch!=height(); ++ch)
+				{
+					double angle = -2.0 * M_PI * _cableLenDelta[input] * _channelFrequenciesHz[ch] / SPEED_OF_LIGHT;
+					double rotSin, rotCos;
+					sincos(angle, &rotSin, &rotCos);
+					inputPhasors[input][ch] = std::complex<float>(rotCos, rotSin);
+				}
+			}
+
+			const size_t inputs1[4] = { 0, 0, 1, 1 }, inputs2[4] = { 2, 3, 2, 3 };
+			std::vector<float> rowFactors(height());
+			std::vector<std::complex<float>> rowPhasors(height());
+			for(size_t p=0; p!=4; ++p)
+			{
+				const float
+					*passband = passbandFactors[p].data(),
+					*gains1 = inputGainFactors[inputs1[p]].data(),
+					*gains2 = inputGainFactors[inputs2[p]].data();
+				for(size_t ch=0; ch!=height(); ++ch)
+					rowFactors[ch] = passband[ch] * gains1[ch] * gains2[ch];
+				if(correctCableLength)
+				{
+					const std::complex<float>
+						*phasors1 = inputPhasors[inputs1[p]].data(),
+						*phasors2 = inputPhasors[inputs2[p]].data();
+					for(size_t ch=0; ch!=height(); ++ch)
+						rowPhasors[ch] = phasors2[ch] * std::conj(phasors1[ch]) * rowFactors[ch];
+					CorrectionKernels::RotateRows(image(images, p*2), image(images, p*2+1), _width, _stride, height(), rowPhasors.data(), conjugate[p]);
+				}
+				else {
+					CorrectionKernels::ScaleRows(image(images, p*2), image(images, p*2+1), _width, _stride, height(), rowFactors.data(), conjugate[p]);
+				}
+			}
+		}
+
+		size_t _subbandCount, _sbStart, _sbEnd, _channelsPerSubband, _width, _stride;
+		std::vector<float> _subbandCorrectionFactors[4];
+		std::vector<double> _pfbGains[4];
+		double _cableLenDelta[4];
+		std::vector<double> _channelFrequenciesHz;
+		std::mt19937 _random;
+};
+
+int main()
+{
+	try {
+		CorrectionKernelsTest test;
+		bool failed = false;
+		const bool
+			notConjugated[4] = { false, false, false, false },
+			conjugated[4] = { false, true, true, false };
+		for(bool correctCableLength : { false, true })
+		{
+			for(const bool* conjugate : { notConjugated, conjugated })
+			{
+				const size_t differences = test.Compare(correctCableLength, conjugate, 1e-5);
+				std::cout << (correctCableLength ? "Cable length and passband" : "Passband")
+					<< (conjugate == conjugated ? ", conjugated: " : ": ") << differences << " differing visibilities.\n";
+				if(differences != 0)
+					failed = true;
+			}
+		}
+
+		// The variant of the kernels for this cpu is chosen when the program is loaded
+		size_t shapeDifferences = 0;
+		for(size_t width=1; width!=68; ++width)
+		{
+			test.SetImageShape(width, width + 1);
+			shapeDifferences += test.Compare(true, conjugated, 1e-5);
+		}
+		std::cout << "Row widths of 1 to 67 with " << CPUFeatures::KernelInstructionSet() << " kernels: " << shapeDifferences << " differing visibilities.\n";
+		if(shapeDifferences != 0)
+			failed = true;
+		return failed ? 1 : 0;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
@@ -2,42 +2,63 @@
 
 #include "applysolutionswriter.h"
 #include "baselinebuffer.h"
+#include "checkpoint.h"
+#include "correctionkernels.h"
+#include "cpufeatures.h"
 #include "flagreader.h"
 #include "flagwriter.h"
 #include "fitswriter.h"
 #include "geometry.h"
+#include "lineprefixbuffer.h"
+#include "memorytracker.h"
 #include "mswriter.h"
 #include "mwafits.h"
 #include "mwams.h"
+#include "profiler.h"
+#include "progressstream.h"
 #include "subbandpassband.h"
 #include "progressbar.h"
 #include "threadedwriter.h"
 #include "radeccoord.h"
 #include "version.h"
 
+#include <algorithm>
 #include <thread>
 #include <functional>
 
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <cerrno>
 #include <cmath>
 #include <complex>
+#include <cstring>
 
-//#include <xmmintrin.h>
-
-//#define USE_SSE
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace aoflagger;
 
 Cotter::Cotter() :
 	_unflaggedAntennaCount(0),
 	_threadCount(1),
-	_maxBufferSize(0),
+	_bandProcessCount(1),
+	_channelProcessCount(1),
+	_hasForked(false),
+	_memoryLimit(0),
 	_subbandCount(24),
 	_quackInitSampleCount(4),
 	_subbandEdgeFlagWidthKHz(80.0),
 	_subbandEdgeFlagCount(2),
+	_curChunkStart(0),
+	_curChunkEnd(0),
+	_correctedScanCount(0),
+	_frequencyPartitioning(false),
+	_streamWindow(0),
+	_streamMargin(0),
+	_streamTimeout(0.0),
+	_checkpointing(false),
 	_defaultFilename(true),
 	_rfiDetection(true),
 	_collectStatistics(true),
@@ -45,6 +66,8 @@ Cotter::Cotter() :
 	_usePointingCentre(false),
 	_outputFormat(MSOutputFormat),
 	_applySolutionsBeforeAveraging(false),
+	_imageSetCapacity(0),
+	_imageSetBytes(0),
 	_disableGeometricCorrections(false),
 	_removeFlaggedAntennae(true),
 	_removeAutoCorrelations(false),
@@ -67,18 +90,53 @@ Cotter::Cotter() :
 	_dyscoDistribution("TruncatedGaussian"),
 	_dyscoNormalization("AF"),
 	_dyscoDistTruncation(2.5),
+	_numa(NumaTopology::Detect()),
 	_outputData(empty_aligned<std::complex<float>>()),
-	_outputWeights(empty_aligned<float>())
+	_outputWeights(empty_aligned<float>()),
+	_gatherBaseline(&Cotter::gatherBaselineFor<0>)
 {
+	_bandPartition.isPartitioned = false;
 }
 
-Cotter::~Cotter() { }
+Cotter::~Cotter()
+{
+	// The flag writer and reader use the worker pool, which is destructed before them
+	_writer.reset();
+	_flagReader.reset();
+	releaseImageSets();
+}
 
 void Cotter::Run(double timeRes_s, double freqRes_kHz)
 {
+	// In batch mode, the same Cotter processes several observations. The state of the previous
+	// observation is cleared, but its strategies and buffers are kept.
+	_mwaConfig.Clear();
+	for(std::vector<double>& factors : _subbandCorrectionFactors)
+		factors.clear();
+	_flaggedSubbands = _userFlaggedSubbands;
+	_readWatch.Reset();
+	_processWatch.Reset();
+	_writeWatch.Reset();
+	
+	if(!_profileFilename.empty())
+	{
+		// Each observation writes a report of its own
+		Profiler::Instance().Reset();
+		Profiler::Instance().Enable();
+	}
+	if(_numa.NodeCount() > 1)
+		std::cout << "Threads and visibility buffers are divided over " << _numa.NodeCount() << " NUMA nodes.\n";
 	_readWatch.Start();
 	bool lockPointing = false;
 	
+	if(_checkpointing)
+	{
+		if(_outputFormat != MSOutputFormat)
+			throw std::runtime_error("Checkpointing is only possible when writing a measurement set");
+		if(_frequencyPartitioning || _streamWindow != 0 || _channelProcessCount > 1)
+			throw std::runtime_error("Checkpointing can not be combined with frequency partitioning, streaming or channel processes");
+	}
+	
 	if(_metaFilename.empty())
 		throw std::runtime_error("No metafits file specified! This is required since 2013-08-02, because the text files (header/instr_config/antenna_location) are missing some of the information (e.g. digital gains). You can still override the information in the metafits file with a text file (see the -a, -h and -i options)");
 	_mwaConfig.ReadMetaFits(_metaFilename.c_str(), lockPointing);
@@ -141,12 +199,23 @@ void Cotter::Run(double timeRes_s, double freqRes_kHz)
 	if(_subbandEdgeFlagCount > _mwaConfig.Header().nChannels / (_subbandCount*2))
 		throw std::runtime_error("Tried to flag more edge channels than available");
 	
+	_hasForked = false;
 	processAllContiguousBands(timeAvgFactor, freqAvgFactor);
 	
-	std::cout
-		<< "Wall-clock time in reading: " << _readWatch.ToString()
-		<< " processing: " << _processWatch.ToString()
-		<< " writing: " << _writeWatch.ToString() << '\n';
+	// Processes report their own times
+	if(!_hasForked)
+	{
+		std::cout
+			<< "Wall-clock time in reading: " << _readWatch.ToString()
+			<< " processing: " << _processWatch.ToString()
+			<< " writing: " << _writeWatch.ToString() << '\n';
+	}
+	
+	if(!_profileFilename.empty())
+	{
+		std::cout << "Writing profile report to " << _profileFilename << ".\n";
+		Profiler::Instance().WriteReport(_profileFilename);
+	}
 }
 
 void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFactor)
@@ -179,7 +248,9 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 		if(_defaultFilename)
 			_outputFilename = "preprocessed.ms";
 	
-		processOneContiguousBand(_outputFilename, timeAvgFactor, freqAvgFactor);
+		processBand(_outputFilename, timeAvgFactor, freqAvgFactor);
+		if(_checkpointing)
+			Checkpoint::Remove(checkpointFilename(_outputFilename));
 	}
 	else {
 		std::cout << "Observation's bandwidth is non-contiguous.\n";
@@ -199,6 +270,15 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 			bandFilename = bandFilename.substr(0, dotPos) + "\?\?\?-\?\?\?" + bandFilename.substr(dotPos);
 		}
 		
+		// Every band has its own output files (for flag output, the gpubox files of a band
+		// are not shared with other bands), so bands can be processed by separate processes.
+		const size_t bandProcessCount = std::min(_bandProcessCount, contiguousSBRanges.size());
+		if(bandProcessCount > 1)
+			std::cout << "Processing " << bandProcessCount << " contiguous bands concurrently.\n";
+		std::vector<pid_t> bandProcesses;
+		// The checkpoints of completed bands are kept until all bands are done
+		std::vector<std::string> bandFilenames;
+		
 		for(size_t bandIndex = 0; bandIndex!=contiguousSBRanges.size(); ++bandIndex)
 		{
 			_curSbStart = contiguousSBRanges[bandIndex].first;
@@ -228,15 +308,317 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 				bandFilename[dotPos+5] = (char) ('0' + ((chEndNo/10)%10));
 				bandFilename[dotPos+6] = (char) ('0' + (chEndNo%10));
 			}
+			bandFilenames.push_back(bandFilename);
 			std::cout << " |=== BAND " << (bandIndex+1) << " / " << contiguousSBRanges.size() << " ===|\n";
 			std::cout << "Writing contiguous band " << (bandIndex+1) << " to " << bandFilename << ".\n";
-			processOneContiguousBand(bandFilename, timeAvgFactor, freqAvgFactor);
+			if(bandProcessCount > 1)
+			{
+				if(bandProcesses.size() == bandProcessCount)
+					waitForProcess(bandProcesses, "contiguous bands");
+				bandProcesses.push_back(startProcess("contiguous band " + bandFilename, "band" + std::to_string(bandIndex+1), bandProcessCount,
+					[&]() { processBand(bandFilename, timeAvgFactor, freqAvgFactor); }));
+			}
+			else {
+				processBand(bandFilename, timeAvgFactor, freqAvgFactor);
+			}
+		}
+		while(!bandProcesses.empty())
+			waitForProcess(bandProcesses, "contiguous bands");
+		if(_checkpointing)
+		{
+			for(const std::string& filename : bandFilenames)
+				Checkpoint::Remove(checkpointFilename(filename));
+		}
+	}
+}
+
+pid_t Cotter::startProcess(const std::string& description, const std::string& label, size_t processCount, const std::function<void()>& task)
+{
+	// Only the forking thread exists in the child, so locks that other threads hold (e.g. of
+	// malloc or the iostreams) would stay locked there. The helper threads are stopped first.
+	_prefetcher.Stop();
+	_workerPool.reset();
+	_hasForked = true;
+	std::cout << std::flush;
+	std::cerr << std::flush;
+	pid_t pid = fork();
+	if(pid == -1)
+		throw std::runtime_error("Could not fork a process for processing " + description);
+	if(pid == 0)
+	{
+		// This is the child: it gets its share of the cpus and memory,
+		// performs the task and exits.
+		int result = 0;
+		LinePrefixBuffer
+			coutBuffer(std::cout.rdbuf(), "[" + label + "] "),
+			cerrBuffer(std::cerr.rdbuf(), "[" + label + "] ");
+		std::cout.rdbuf(&coutBuffer);
+		std::cerr.rdbuf(&cerrBuffer);
+		_prefetchFiles.clear();
+		try {
+			_threadCount = std::max<size_t>(1, _threadCount / processCount);
+			_memoryLimit /= processCount;
+			task();
+			std::cout
+				<< "Wall-clock time in reading: " << _readWatch.ToString()
+				<< " processing: " << _processWatch.ToString()
+				<< " writing: " << _writeWatch.ToString() << '\n';
+			if(!_profileFilename.empty())
+				Profiler::Instance().WriteReport(profileFilenameWithSuffix("-" + label));
+		} catch(std::exception& e) {
+			std::cerr << "\nAn exception occured while processing " << description << ":\n" << e.what() << '\n';
+			result = 1;
+		}
+		coutBuffer.Finish();
+		cerrBuffer.Finish();
+		_exit(result);
+	}
+	return pid;
+}
+
+WorkerPool& Cotter::workerPool()
+{
+	if(!_workerPool)
+		_workerPool.reset(new WorkerPool(_threadCount));
+	return *_workerPool;
+}
+
+std::string Cotter::profileFilenameWithSuffix(const std::string& suffix) const
+{
+	// report.json becomes report-band1.json
+	size_t dotPos = _profileFilename.rfind('.');
+	if(dotPos == std::string::npos || _profileFilename.find('/', dotPos) != std::string::npos)
+		return _profileFilename + suffix;
+	else
+		return _profileFilename.substr(0, dotPos) + suffix + _profileFilename.substr(dotPos);
+}
+
+pid_t Cotter::waitForProcess(std::vector<pid_t>& processes, const std::string& description)
+{
+	// Block until a child has finished, without reaping it: children that are not ours
+	// (e.g. of a library) keep their exit status. When it is not one of ours, wait for
+	// our first process instead.
+	siginfo_t info;
+	info.si_pid = 0;
+	int result;
+	do {
+		result = waitid(P_ALL, 0, &info, WEXITED | WNOWAIT);
+	} while(result == -1 && errno == EINTR);
+	std::vector<pid_t>::iterator iter = std::find(processes.begin(), processes.end(), info.si_pid);
+	if(result == -1 || iter == processes.end())
+		iter = processes.begin();
+	
+	int status = 0;
+	while(waitpid(*iter, &status, 0) == -1)
+	{
+		if(errno != EINTR)
+			throw std::runtime_error("Failed to wait for the processing of " + description);
+	}
+	const pid_t finished = *iter;
+	processes.erase(iter);
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		// The output is incomplete, so the other processes would only waste time
+		for(pid_t remaining : processes)
+			kill(remaining, SIGTERM);
+		for(pid_t remaining : processes)
+			waitpid(remaining, &status, 0);
+		processes.clear();
+		throw std::runtime_error("Processing of one of the " + description + " failed");
+	}
+	return finished;
+}
+
+void Cotter::processBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor)
+{
+	const size_t
+		nChannels = nChannelsInCurSBRange(),
+		nChannelPerSb = _mwaConfig.Header().nChannels / _subbandCount;
+	if(_channelProcessCount > 1 && _curSbEnd - _curSbStart > 1)
+	{
+		processBandInChannelProcesses(outputFilename, timeAvgFactor, freqAvgFactor);
+		return;
+	}
+	// In streaming mode, the windows keep the memory use low
+	if(!_frequencyPartitioning || _streamWindow != 0 || _curSbEnd - _curSbStart == 1 ||
+		makeMemoryPlanner(nChannels, timeAvgFactor, freqAvgFactor).FitsInOneChunk(_memoryLimit, _threadCount))
+	{
+		processOneContiguousBand(outputFilename, timeAvgFactor, freqAvgFactor);
+		return;
+	}
+	
+	if(_outputFormat == FitsOutputFormat)
+		throw std::runtime_error("Frequency partitioning can not be used when writing uvfits files");
+	if(_outputFormat == MSOutputFormat && _useDysco)
+		throw std::runtime_error("Frequency partitioning can not be combined with Dysco compression");
+	if(nChannelPerSb % freqAvgFactor != 0)
+		throw std::runtime_error("With frequency partitioning, the number of channels per subband should be a multiple of the frequency averaging factor");
+	
+	// Find the largest number of subbands for which all scans fit in memory
+	const size_t
+		bandSbStart = _curSbStart,
+		bandSbEnd = _curSbEnd;
+	size_t sbPerPart = bandSbEnd - bandSbStart - 1;
+	while(sbPerPart > 1 && !makeMemoryPlanner(sbPerPart*nChannelPerSb, timeAvgFactor, freqAvgFactor).FitsInOneChunk(_memoryLimit, _threadCount))
+		--sbPerPart;
+	if(sbPerPart == 1 && !makeMemoryPlanner(nChannelPerSb, timeAvgFactor, freqAvgFactor).FitsInOneChunk(_memoryLimit, _threadCount))
+		std::cout << "WARNING! Not even a single subband fits in memory with all scans; subbands will be processed in time chunks.\n";
+	const size_t partCount = (bandSbEnd - bandSbStart + sbPerPart - 1) / sbPerPart;
+	std::cout << "Band does not fit fully in memory, will partition data in " << partCount << " frequency ranges of at most " << sbPerPart << " subbands.\n";
+	
+	const std::vector<double> bandFrequenciesHz = _channelFrequenciesHz;
+	_bandPartition.isPartitioned = true;
+	_bandPartition.bandFrequenciesHz = bandFrequenciesHz;
+	for(size_t partIndex = 0; partIndex != partCount; ++partIndex)
+	{
+		_curSbStart = bandSbStart + partIndex*sbPerPart;
+		_curSbEnd = std::min(bandSbEnd, _curSbStart + sbPerPart);
+		_bandPartition.isFirst = (partIndex == 0);
+		_bandPartition.isLast = (partIndex+1 == partCount);
+		_bandPartition.channelStart = (_curSbStart - bandSbStart) * nChannelPerSb;
+		_channelFrequenciesHz.assign(
+			bandFrequenciesHz.begin() + _bandPartition.channelStart,
+			bandFrequenciesHz.begin() + _bandPartition.channelStart + nChannelsInCurSBRange());
+		
+		std::cout << "=== Processing frequency range " << (partIndex+1) << " of " << partCount << " (subbands " << _curSbStart << "-" << (_curSbEnd-1) << ") ===\n";
+		processOneContiguousBand(outputFilename, timeAvgFactor, freqAvgFactor);
+	}
+	_bandPartition.isPartitioned = false;
+	_bandPartition.bandFrequenciesHz.clear();
+	_curSbStart = bandSbStart;
+	_curSbEnd = bandSbEnd;
+	_channelFrequenciesHz = bandFrequenciesHz;
+}
+
+void Cotter::processBandInChannelProcesses(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor)
+{
+	const size_t nChannelPerSb = _mwaConfig.Header().nChannels / _subbandCount;
+	if(_outputFormat != MSOutputFormat)
+		throw std::runtime_error("Channel processes can only be used when writing a measurement set");
+	if(_useDysco)
+		throw std::runtime_error("Channel processes can not be combined with Dysco compression");
+	if(_frequencyPartitioning)
+		throw std::runtime_error("Channel processes can not be combined with frequency partitioning");
+	if(nChannelPerSb % freqAvgFactor != 0)
+		throw std::runtime_error("With channel processes, the number of channels per subband should be a multiple of the frequency averaging factor");
+	
+	const size_t
+		bandSbStart = _curSbStart,
+		bandSbEnd = _curSbEnd,
+		processCount = std::min(_channelProcessCount, bandSbEnd - bandSbStart);
+	const std::vector<double> bandFrequenciesHz = _channelFrequenciesHz;
+	std::cout << "Processing the band in " << processCount << " processes of " << (bandSbEnd - bandSbStart) / processCount << " or more subbands.\n";
+	
+	// The first process writes the set of the band like the first frequency partition. The others
+	// write their channels and statistics into sets of their own, which are merged into the set of the band.
+	std::vector<pid_t> processes, processIds(processCount);
+	std::vector<std::string> partFilenames(processCount);
+	std::vector<size_t> partChannelStarts(processCount);
+	for(size_t processIndex = 0; processIndex != processCount; ++processIndex)
+	{
+		_curSbStart = bandSbStart + (bandSbEnd - bandSbStart) * processIndex / processCount;
+		_curSbEnd = bandSbStart + (bandSbEnd - bandSbStart) * (processIndex+1) / processCount;
+		const size_t channelStart = (_curSbStart - bandSbStart) * nChannelPerSb;
+		_channelFrequenciesHz.assign(
+			bandFrequenciesHz.begin() + channelStart,
+			bandFrequenciesHz.begin() + channelStart + nChannelsInCurSBRange());
+		
+		const std::string description = "subbands " + std::to_string(_curSbStart) + "-" + std::to_string(_curSbEnd-1);
+		std::cout << "Starting process " << (processIndex+1) << " of " << processCount << " for " << description << ".\n";
+		std::string processOutputFilename = outputFilename;
+		if(processIndex == 0)
+		{
+			_bandPartition.isPartitioned = true;
+			_bandPartition.isFirst = true;
+			_bandPartition.isLast = true;
+			_bandPartition.channelStart = 0;
+			_bandPartition.bandFrequenciesHz = bandFrequenciesHz;
+		}
+		else {
+			processOutputFilename = outputFilename + ".part" + std::to_string(processIndex);
+			partFilenames[processIndex] = processOutputFilename;
+			partChannelStarts[processIndex] = channelStart / freqAvgFactor;
+		}
+		// The statistics of the other processes are added from their sets when these are merged
+		const std::string qualityStatisticsFilename = _qualityStatisticsFilename;
+		if(processIndex != 0)
+			_qualityStatisticsFilename.clear();
+		processIds[processIndex] = startProcess(description, "subbands" + std::to_string(_curSbStart) + "-" + std::to_string(_curSbEnd-1), processCount,
+			[&]() { processOneContiguousBand(processOutputFilename, timeAvgFactor, freqAvgFactor); });
+		processes.push_back(processIds[processIndex]);
+		_qualityStatisticsFilename = qualityStatisticsFilename;
+		_bandPartition.isPartitioned = false;
+		_bandPartition.bandFrequenciesHz.clear();
+	}
+	_curSbStart = bandSbStart;
+	_curSbEnd = bandSbEnd;
+	_channelFrequenciesHz = bandFrequenciesHz;
+	
+	// A set is merged as soon as its process has finished, but not before the set of the band exists
+	std::vector<size_t> finishedParts;
+	bool isBandWritten = false;
+	while(!processes.empty())
+	{
+		const pid_t finished = waitForProcess(processes, "channel ranges");
+		const size_t processIndex = std::find(processIds.begin(), processIds.end(), finished) - processIds.begin();
+		if(processIndex == 0)
+			isBandWritten = true;
+		else
+			finishedParts.push_back(processIndex);
+		if(!isBandWritten)
+			continue;
+		
+		_writeWatch.Start();
+		for(size_t part : finishedParts)
+		{
+			std::cout << "Merging " << partFilenames[part] << " into " << outputFilename << "...\n";
+			MSWriter::MergeChannelPartition(outputFilename, partFilenames[part], partChannelStarts[part]);
+			if(_collectStatistics)
+			{
+				MSWriter::MergeQualityStatistics(outputFilename, partFilenames[part]);
+				if(!_qualityStatisticsFilename.empty())
+					MSWriter::MergeQualityStatistics(_qualityStatisticsFilename, partFilenames[part]);
+			}
+			Checkpoint::Remove(partFilenames[part]);
 		}
+		finishedParts.clear();
+		_writeWatch.Pause();
 	}
 }
 
+MemoryPlanner Cotter::makeMemoryPlanner(size_t channelCount, size_t timeAvgFactor, size_t freqAvgFactor) const
+{
+	MemoryPlanner planner(_mwaConfig.NAntennae(), channelCount, _mwaConfig.Header().nChannels / _subbandCount, _mwaConfig.Header().nScans);
+	planner.SetRFIDetection(_rfiDetection);
+	if(freqAvgFactor != 1 || timeAvgFactor != 1)
+		planner.SetAveragedChannelCount(channelCount / freqAvgFactor);
+	return planner;
+}
+
 void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor)
 {
+	// When the band is partitioned in frequency, the first partition writes the meta data
+	// and the last partition writes the statistics.
+	const bool
+		isFirstPartition = !_bandPartition.isPartitioned || _bandPartition.isFirst,
+		isLastPartition = !_bandPartition.isPartitioned || _bandPartition.isLast;
+	
+	// An interrupted run continues after the last chunk in the checkpoint of the band
+	CheckpointState checkpoint;
+	std::ifstream checkpointStream;
+	const bool isResumed = _checkpointing && readCheckpoint(outputFilename, checkpoint, checkpointStream, timeAvgFactor, freqAvgFactor);
+	if(isResumed && checkpoint.isComplete)
+	{
+		std::cout << "According to its checkpoint, " << outputFilename << " has already been written.\n";
+		return;
+	}
+	
+	std::string bandName = outputFilename;
+	if(_bandPartition.isPartitioned)
+		bandName += " subbands " + std::to_string(_curSbStart) + "-" + std::to_string(_curSbEnd-1);
+	Profiler::Instance().StartBand(bandName);
+	ProgressStream::Instance().StartBand(bandName);
+
 	switch(_outputFormat)
 	{
 		case FlagsOutputFormat:
@@ -245,7 +627,7 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 				throw std::runtime_error("You have specified time or frequency averaging and outputting only flags: this is incompatible");
 			if(_removeFlaggedAntennae || _removeAutoCorrelations)
 				throw std::runtime_error("Can't prune flagged/auto-correlated antennas when writing flag file");
-			_writer.reset(new FlagWriter(outputFilename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbStart, _curSbEnd, _subbandOrder));
+			_writer.reset(new FlagWriter(outputFilename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbStart, _curSbEnd, _subbandOrder, &workerPool()));
 			break;
 		case FitsOutputFormat:
 			_writer.reset(new ThreadedWriter(std::unique_ptr<FitsWriter>(new FitsWriter(outputFilename))));
@@ -254,6 +636,16 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			std::unique_ptr<MSWriter> msWriter(new MSWriter(outputFilename));
 			if(_useDysco)
 				msWriter->EnableCompression(_dyscoDataBitRate, _dyscoWeightBitRate, _dyscoDistribution, _dyscoDistTruncation, _dyscoNormalization);
+			if(_bandPartition.isPartitioned)
+			{
+				std::string name;
+				std::vector<Writer::ChannelInfo> channels;
+				double refFreq, totalBandwidth;
+				makeBandInfo(_bandPartition.bandFrequenciesHz, name, channels, refFreq, totalBandwidth);
+				if(freqAvgFactor != 1)
+					channels = AveragingWriter::AverageChannels(channels, freqAvgFactor);
+				msWriter->SetChannelPartition(name, channels, refFreq, totalBandwidth, _bandPartition.channelStart / freqAvgFactor, isFirstPartition);
+			}
 			_writer.reset(new ThreadedWriter(std::move(msWriter)));
 		} break;
 	}
@@ -263,48 +655,54 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	}
 	if(freqAvgFactor != 1 || timeAvgFactor != 1)
 	{
-		_writer.reset(new ThreadedWriter(std::unique_ptr<AveragingWriter>(new AveragingWriter(std::move(_writer), timeAvgFactor, freqAvgFactor, *this))));
+		_writer.reset(new ThreadedWriter(std::unique_ptr<AveragingWriter>(new AveragingWriter(std::move(_writer), timeAvgFactor, freqAvgFactor, *this)), "averaging hand-off"));
 	}
 	if(!_solutionFilename.empty() && _applySolutionsBeforeAveraging)
 	{
 		_writer.reset(new ApplySolutionsWriter(std::move(_writer), _solutionFilename, (_curSbStart * _mwaConfig.Header().nChannels) / _subbandCount, _mwaConfig.Header().nChannels));
 	}
 	writeAntennae();
-	writeSPW();
+	writeSPW(_channelFrequenciesHz);
 	writeSource();
 	writeField();
 	_writer->WritePolarizationForLinearPols(false);
 	writeObservation();
 
-	if(!_qualityStatisticsFilename.empty())
-	{
-		std::unique_ptr<Writer> qsWriter(new MSWriter(_qualityStatisticsFilename));
-		std::swap(qsWriter, _writer);
-		writeAntennae();
-		writeSPW();
-		writeSource();
-		writeField();
-		_writer->WritePolarizationForLinearPols(false);
-		writeObservation();
-		std::swap(qsWriter, _writer);
-	}
+	if(!_qualityStatisticsFilename.empty() && isFirstPartition)
+		createStatisticsSet(_qualityStatisticsFilename, _bandPartition.isPartitioned ? _bandPartition.bandFrequenciesHz : _channelFrequenciesHz);
 	
 	_hduOffsetsPerGPUBox.assign(_subbandCount, 9999);
 	const size_t
 		nChannels = nChannelsInCurSBRange(),
-		antennaCount = _mwaConfig.NAntennae();
-	size_t maxScansPerPart = _maxBufferSize / (nChannels*(antennaCount+1)*antennaCount*2);
+		antennaCount = _mwaConfig.NAntennae(),
+		baselineCount = antennaCount * (antennaCount + 1) / 2;
+	const MemoryPlanner planner = makeMemoryPlanner(nChannels, timeAvgFactor, freqAvgFactor);
+	const MemoryPlanner::Plan memoryPlan = planner.Make(_memoryLimit, _threadCount);
+	planner.Print(memoryPlan, _memoryLimit, std::cout);
 	
-	if(maxScansPerPart<1)
+	if(memoryPlan.TotalBytes() > _memoryLimit)
 	{
 		std::cout << "WARNING! The given amount of memory is not even enough for one scan and therefore below the minimum that Cotter will need; will use more memory. Expect swapping and very poor flagging accuracy.\nWARNING! This is a *VERY BAD* condition, so better make sure to resolve it!";
-		maxScansPerPart = 1;
-	} else if(maxScansPerPart<20 && _rfiDetection)
+	} else if(memoryPlan.scansPerChunk<MemoryPlanner::MinAccurateScanCount && memoryPlan.chunkCount>1 && _rfiDetection)
 	{
 		std::cout << "WARNING! This computer does not have enough memory for accurate flagging; expect non-optimal flagging accuracy.\n"; 
 	}
-	size_t partCount = 1 + _mwaConfig.Header().nScans / maxScansPerPart;
-	if(partCount == 1)
+	// The thread count of the plan is used for this band only
+	const size_t requestedThreadCount = _threadCount;
+	_threadCount = memoryPlan.threadCount;
+	size_t partCount = memoryPlan.chunkCount;
+	if(isResumed)
+	{
+		// The chunks should be the same as those of the interrupted run
+		partCount = checkpoint.chunkCount;
+		std::cout << "Continuing from checkpoint: chunk " << (checkpoint.nextChunk+1) << " of " << partCount << " is next.\n";
+	}
+	else if(_streamWindow != 0)
+	{
+		partCount = (_mwaConfig.Header().nScans + _streamWindow - 1) / _streamWindow;
+		std::cout << "Streaming " << partCount << " windows of " << _streamWindow << " scans, each flagged with a margin of " << _streamMargin << " scans.\n";
+	}
+	else if(partCount == 1)
 		std::cout << "All " << _mwaConfig.Header().nScans << " scans fit in memory; no partitioning necessary.\n";
 	else
 		std::cout << "Observation does not fit fully in memory, will partition data in " << partCount << " chunks of at least " << (_mwaConfig.Header().nScans/partCount) << " scans.\n";
@@ -315,6 +713,8 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 		double dateMJD = _mwaConfig.Header().dateFirstScanMJD * 86400.0 + t * _mwaConfig.Header().integrationTime;
 		_scanTimes[t] = dateMJD;
 	}
+	initCorrectionTables();
+	selectKernels();
 	
 	std::vector<std::string> params;
 	std::stringstream paramStr;
@@ -325,35 +725,116 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	if(_strategyFilename.empty())
 		_strategyFilename = _flagger.FindStrategyFile(TelescopeId::MWA_TELESCOPE);
 		
+	size_t firstChunk = 0;
+	std::vector<std::string> earlierStatisticsFiles;
 	std::vector<std::vector<std::string> >::const_iterator
 		currentFileSetPtr = _fileSets.begin();
-	createReader(*currentFileSetPtr);
+	if(isResumed)
+	{
+		firstChunk = checkpoint.nextChunk;
+		earlierStatisticsFiles = checkpoint.statisticsFiles;
+		currentFileSetPtr += checkpoint.fileSetIndex;
+		restoreCheckpoint(checkpointStream);
+		checkpointStream.close();
+	}
+	// After the last file set, its reader stays in use
+	createReader(currentFileSetPtr == _fileSets.end() ? _fileSets.back() : *currentFileSetPtr);
+	if(isResumed)
+		_reader->SetScanPosition(checkpoint.scanPosition);
 	
 	_readWatch.Pause();
 	
-	for(size_t chunkIndex = 0; chunkIndex != partCount; ++chunkIndex)
+	MemoryTracker::ResetPeaks();
+	MemoryTracker::Usage peakUsage = MemoryTracker::Sample();
+	for(size_t chunkIndex = firstChunk; chunkIndex != partCount; ++chunkIndex)
 	{
 		std::cout << "=== Processing chunk " << (chunkIndex+1) << " of " << partCount << " ===\n";
+		MemoryTracker::ResetPeaks();
+		Profiler::Instance().StartChunk(chunkIndex);
+		ProgressStream::Instance().StartChunk(chunkIndex, partCount);
 		_readWatch.Start();
 		
-		_curChunkStart = _mwaConfig.Header().nScans*chunkIndex/partCount;
-		_curChunkEnd = _mwaConfig.Header().nScans*(chunkIndex+1)/partCount;
+		// The scans in [writeStart, writeEnd) are written after this chunk. In streaming mode,
+		// the chunk also holds the margins around them, of which the overlap with the previous
+		// chunk is kept in the buffers.
+		size_t writeStart, writeEnd, overlap = 0;
+		const size_t previousChunkStart = _curChunkStart, previousChunkEnd = _curChunkEnd;
+		if(_streamWindow == 0)
+		{
+			_curChunkStart = _mwaConfig.Header().nScans*chunkIndex/partCount;
+			_curChunkEnd = _mwaConfig.Header().nScans*(chunkIndex+1)/partCount;
+			writeStart = _curChunkStart;
+			writeEnd = _curChunkEnd;
+		}
+		else {
+			writeStart = chunkIndex * _streamWindow;
+			writeEnd = std::min(writeStart + _streamWindow, _mwaConfig.Header().nScans);
+			_curChunkStart = writeStart - std::min(writeStart, _streamMargin);
+			_curChunkEnd = std::min(writeEnd + _streamMargin, _mwaConfig.Header().nScans);
+			if(chunkIndex != 0)
+				overlap = previousChunkEnd - _curChunkStart;
+		}
 		
 		// Initialize buffers
-		if(chunkIndex == 0)
+		if(chunkIndex == firstChunk)
 		{
-			// First time: allocate the buffers
-			const size_t requiredWidthCapacity = (_mwaConfig.Header().nScans+partCount-1)/partCount;
-			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+			// First time: allocate the buffers, unless those of the previous band or observation have the same shape
+			const size_t requiredWidthCapacity = (_streamWindow == 0) ?
+				(_mwaConfig.Header().nScans+partCount-1)/partCount :
+				std::min(_streamWindow + 2*_streamMargin, _mwaConfig.Header().nScans);
+			const bool reuseBuffers = !_imageSetBuffers.empty() &&
+				_imageSetBuffers.size() == baselineCount &&
+				_imageSetBuffers.begin()->second.Height() == nChannels &&
+				_imageSetCapacity == requiredWidthCapacity;
+			if(reuseBuffers)
 			{
-				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+				for(auto& buffer : _imageSetBuffers)
 				{
-					_imageSetBuffers.emplace(
-						std::pair<size_t,size_t>(antenna1, antenna2),
-						_flagger.MakeImageSet(_curChunkEnd-_curChunkStart, nChannels, 8, 0.0f, requiredWidthCapacity)
-					);
+					buffer.second.ResizeWithoutReallocation(_curChunkEnd-_curChunkStart);
+					buffer.second.Set(0.0f);
+				}
+			}
+			else {
+				releaseImageSets();
+				// The image sets of a node are made by a thread on that node, so that
+				// their memory is allocated where the threads that process them run
+				std::vector<std::vector<std::pair<std::pair<size_t,size_t>, ImageSet>>> nodeImageSets(_numa.NodeCount());
+				auto makeImageSets = [&](size_t node) {
+					_numa.PinToNode(node);
+					for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+					{
+						for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+						{
+							if(nodeOfBaseline(antenna1, antenna2) == node)
+								nodeImageSets[node].emplace_back(
+									std::pair<size_t,size_t>(antenna1, antenna2),
+									_flagger.MakeImageSet(_curChunkEnd-_curChunkStart, nChannels, 8, 0.0f, requiredWidthCapacity)
+								);
+						}
+					}
+				};
+				if(_numa.NodeCount() == 1)
+					makeImageSets(0);
+				else {
+					std::vector<std::thread> threadGroup;
+					for(size_t node=0; node!=_numa.NodeCount(); ++node)
+						threadGroup.emplace_back(makeImageSets, node);
+					for(std::thread& t : threadGroup)
+						t.join();
 				}
+				for(auto& imageSets : nodeImageSets)
+				{
+					for(auto& imageSet : imageSets)
+						_imageSetBuffers.emplace(imageSet.first, std::move(imageSet.second));
+				}
+				// The stride includes the full width capacity
+				const ImageSet& imageSet = _imageSetBuffers.begin()->second;
+				_imageSetCapacity = requiredWidthCapacity;
+				_imageSetBytes = int64_t(imageSet.HorizontalStride()) * imageSet.Height() * imageSet.ImageCount() * sizeof(float) * _imageSetBuffers.size();
+				MemoryTracker::Allocate(MemoryTracker::ImageSets, _imageSetBytes);
 			}
+			// Like the image sets, the flag masks are allocated once, on the nodes of their baselines, and reused for all chunks
+			_flagMasks.Reserve(antennaCount, requiredWidthCapacity, nChannels, _numa);
 		} else {
 			// Resize the buffers, but don't reallocate. I used to reallocate all buffers
 			// here, but this gave awful memory fragmentation issues, since the buffers can have slightly
@@ -361,11 +842,16 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			for(auto& buffer : _imageSetBuffers)
 			{
 				buffer.second.ResizeWithoutReallocation(_curChunkEnd-_curChunkStart);
-				buffer.second.Set(0.0f);
+				if(overlap == 0)
+					buffer.second.Set(0.0f);
+				else
+					slideImageSet(buffer.second, _curChunkStart - previousChunkStart, overlap);
 			}
 		}
 		
-		size_t bufferPos = 0;
+		// In streaming mode, the overlap was already read and corrected for the previous chunk
+		size_t bufferPos = overlap;
+		_correctedScanCount = overlap;
 		bool continueWithNextFile;
 		do {
 			initializeReader();
@@ -429,6 +915,13 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 		} else {
 			_missingEndScans = 0;
 		}
+		
+		// Once the last gpubox files have been read, the next observation of a batch can be read ahead
+		if(chunkIndex+1 == partCount && _curSbEnd == _subbandCount && !_prefetchFiles.empty())
+		{
+			_prefetcher.Start(_prefetchFiles);
+			_prefetchFiles.clear();
+		}
 		if(_curChunkEnd + _quackEndSampleCount > _mwaConfig.Header().nScans)
 		{
 			size_t extraSamples = (_curChunkEnd + _quackEndSampleCount) - _mwaConfig.Header().nScans;
@@ -439,56 +932,59 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 		_fullysetMask = FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), true));
 		_correlatorMask = FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false));
 		flagBadCorrelatorSamples(_correlatorMask);
+		MemoryTracker::Allocate(MemoryTracker::FlagMasks, 2 * maskBytes(_correlatorMask));
+		if(_streamWindow != 0 && _collectStatistics)
+		{
+			// The margins are also part of the neighbouring chunks, so they are left out of the statistics
+			_statisticsMask = _flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount());
+			for(size_t y=0; y!=_statisticsMask.Height(); ++y)
+			{
+				const bool* correlatorRow = _correlatorMask.Buffer() + y * _correlatorMask.HorizontalStride();
+				bool* row = _statisticsMask.Buffer() + y * _statisticsMask.HorizontalStride();
+				for(size_t x=0; x!=_statisticsMask.Width(); ++x)
+				{
+					const size_t t = x + _curChunkStart;
+					row[x] = correlatorRow[x] || t < writeStart || t >= writeEnd;
+				}
+			}
+			MemoryTracker::Allocate(MemoryTracker::FlagMasks, maskBytes(_statisticsMask));
+		}
+		_flagMasks.StartChunk(_curChunkEnd-_curChunkStart);
 		
+		_baselinesToProcess.resize(_numa.NodeCount());
 		for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
 		{
 			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-			{
-				_baselinesToProcess.push(std::pair<size_t,size_t>(antenna1, antenna2));
-				
-				// We will put a place holder in the flagbuffer map, so we don't have to write (and lock)
-				// during multi threaded processing.
-				_flagBuffers.emplace(
-					std::pair<size_t,size_t>(antenna1, antenna2),
-					FlagMask()
-				);
-			}
+				_baselinesToProcess[nodeOfBaseline(antenna1, antenna2)].push(std::pair<size_t,size_t>(antenna1, antenna2));
 		}
-		_baselinesToProcessCount = _baselinesToProcess.size();
+		_baselinesToProcessCount = baselineCount;
 		
 		_readWatch.Pause();
 		_processWatch.Start();
 		
 		if(!_flagFileTemplate.empty())
 		{
-			_progressBar.reset(new ProgressBar("Reading flags"));
+			_progressBar.reset(new ProgressBar("Reading flags", baselineCount * nChannels * 4));
 			if(_flagReader.get() == 0)
-				_flagReader.reset(new FlagReader(_flagFileTemplate, _hduOffsetsPerGPUBox, _subbandOrder, _curSbStart, _curSbEnd));
-			// Create the flag masks
+				_flagReader.reset(new FlagReader(_flagFileTemplate, _hduOffsetsPerGPUBox, _subbandOrder, _curSbStart, _curSbEnd, &workerPool()));
+			// The flags are read directly into the pooled masks
+			std::vector<bool*> maskBuffers;
+			const size_t stride = _flagMasks.Stride();
 			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
 			{
 				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-				{
-					FlagMask& baseline = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
-					baseline = FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount()));
-				}
+					maskBuffers.push_back(_flagMasks.Buffer(antenna1, antenna2));
 			}
-			// Fill the flag masks by reading the files
-			for(size_t t=_curChunkStart; t!=_curChunkEnd; ++t)
+			// Fill the flag masks by reading the files, a block of timesteps at a time
+			const size_t timestepsPerRead = 16;
+			std::vector<bool*> blockBuffers(maskBuffers.size());
+			for(size_t t=_curChunkStart; t<_curChunkEnd; t+=timestepsPerRead)
 			{
 				_progressBar->SetProgress(t-_curChunkStart, _curChunkEnd-_curChunkStart);
-				size_t baselineIndex = 0;
-				for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
-				{
-					for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-					{
-						FlagMask& mask = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
-						size_t stride = mask.HorizontalStride();
-						bool* bufferPos = mask.Buffer() + (t - _curChunkStart);
-						_flagReader->Read(t, baselineIndex, bufferPos, stride);
-						++baselineIndex;
-					}
-				}
+				const size_t blockSize = std::min(timestepsPerRead, _curChunkEnd - t);
+				for(size_t i=0; i!=maskBuffers.size(); ++i)
+					blockBuffers[i] = maskBuffers[i] + (t - _curChunkStart);
+				_flagReader->ReadTimesteps(t, blockSize, blockBuffers.data(), stride);
 			}
 			_progressBar.reset();
 		}
@@ -508,13 +1004,18 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			else
 				taskDescription = "Conjugations, subband ordering and cable length corrections";
 		}
-		_progressBar.reset(new ProgressBar(taskDescription));
+		_progressBar.reset(new ProgressBar(taskDescription, (_curChunkEnd-_curChunkStart) * nChannels * 4));
 		
+		// Strategies are loaded by their thread when first used, and kept for the rest of the run
+		if(_strategies.size() < _threadCount)
+			_strategies.resize(_threadCount);
+		_threadStatistics.resize(_threadCount);
 		std::vector<std::thread> threadGroup;
 		for(size_t i=0; i!=_threadCount; ++i)
-			threadGroup.emplace_back(std::bind(&Cotter::baselineProcessThreadFunc, this));
+			threadGroup.emplace_back(std::bind(&Cotter::baselineProcessThreadFunc, this, i));
 		for(std::thread& t : threadGroup)
 			t.join();
+		reduceStatistics();
 		
 		_progressBar.reset();
 		_processWatch.Pause();
@@ -525,13 +1026,15 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			std::cout << "Skipping writing of visibilities.\n";
 		}
 		else {
-			_progressBar.reset(new ProgressBar("Writing"));
+			_progressBar.reset(new ProgressBar("Writing", baselineCount * nChannels * 4));
 			_outputFlags.reset(new bool[nChannels*4]);
+			_fullyFlaggedRow.reset(new bool[nChannels*4]);
+			std::fill_n(_fullyFlaggedRow.get(), nChannels*4, true);
 			_outputData = make_aligned<std::complex<float>>(nChannels*4, 16);
 			_outputWeights = make_aligned<float>(nChannels*4, 16);
-			for(size_t t=_curChunkStart; t!=_curChunkEnd; ++t)
+			for(size_t t=writeStart; t!=writeEnd; ++t)
 			{
-				_progressBar->SetProgress(t-_curChunkStart, _curChunkEnd-_curChunkStart);
+				_progressBar->SetProgress(t-writeStart, writeEnd-writeStart);
 				if(_outputFormat == FlagsOutputFormat)
 					processAndWriteTimestepFlagsOnly(t);
 				else
@@ -540,18 +1043,55 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			_outputData.reset();
 			_outputWeights.reset();
 			_outputFlags.reset();
+			_fullyFlaggedRow.reset();
 			_progressBar.reset();
 		}
 		
-		_flagBuffers.clear();
-		
+		MemoryTracker::Release(MemoryTracker::FlagMasks, 2 * maskBytes(_correlatorMask));
 		_correlatorMask = FlagMask();
 		_fullysetMask = FlagMask();
+		if(_streamWindow != 0 && _collectStatistics)
+		{
+			MemoryTracker::Release(MemoryTracker::FlagMasks, maskBytes(_statisticsMask));
+			_statisticsMask = FlagMask();
+		}
+		
+		if(_checkpointing)
+		{
+			Profiler::Scope scope("checkpoint");
+			checkpoint.isComplete = false;
+			checkpoint.chunkCount = partCount;
+			checkpoint.nextChunk = chunkIndex + 1;
+			checkpoint.fileSetIndex = currentFileSetPtr - _fileSets.begin();
+			checkpoint.scanPosition = _reader->ScanPosition();
+			checkpoint.statisticsFiles = earlierStatisticsFiles;
+			if(_collectStatistics)
+			{
+				// The statistics are saved as a quality statistics set, which is added to the statistics of the output
+				// when the band is finished. Two sets are used in turn, so that the set of the previous checkpoint
+				// stays intact until this checkpoint is saved.
+				const std::string statisticsFilename = checkpointFilename(outputFilename) + "-stats" +
+					std::to_string(firstChunk) + ((chunkIndex % 2 == 0) ? "a" : "b") + ".qs";
+				createStatisticsSet(statisticsFilename, _channelFrequenciesHz);
+				_statistics->WriteStatistics(statisticsFilename);
+				checkpoint.statisticsFiles.push_back(statisticsFilename);
+			}
+			saveCheckpoint(outputFilename, checkpoint, timeAvgFactor, freqAvgFactor);
+		}
 		
 		_writeWatch.Pause();
+		const MemoryTracker::Usage usage = MemoryTracker::Sample();
+		for(size_t i=0; i!=MemoryTracker::SubsystemCount; ++i)
+			peakUsage.peak[i] = std::max(peakUsage.peak[i], usage.peak[i]);
+		peakUsage.peakTracked = std::max(peakUsage.peakTracked, usage.peakTracked);
+		peakUsage.peakResident = std::max(peakUsage.peakResident, usage.peakResident);
+		Profiler::Instance().EndChunk(usage);
 	} // end for chunkIndex!=partCount
 	
-	_imageSetBuffers.clear();
+	MemoryPlanner::PrintUsage(memoryPlan, peakUsage, std::cout);
+	
+	// The image sets and flag masks are kept, so that a next band or observation of
+	// the same shape (as in batch mode) does not need to allocate them again.
 	
 	_writeWatch.Start();
 	
@@ -565,16 +1105,38 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	// Necessary to make sure it is reinitialized in the following cont band:
 	_flagReader.reset();
 	
-	if(_collectStatistics && writerSupportsStatistics) {
+	// With frequency partitioning, statistics are accumulated over all partitions of the band
+	_threadCount = requestedThreadCount;
+	if(!isLastPartition)
+	{
+		_writeWatch.Pause();
+		return;
+	}
+	
+	// A run that continues from a checkpoint after the last chunk has no statistics of its own
+	if(_collectStatistics && writerSupportsStatistics && _statistics) {
 		std::cout << "Writing statistics to measurement set...\n";
 		_statistics->WriteStatistics(outputFilename);
 	}
 	
-	if(_collectStatistics && !_qualityStatisticsFilename.empty()) {
+	if(_collectStatistics && !_qualityStatisticsFilename.empty() && _statistics) {
 		std::cout << "Writing statistics to " << _qualityStatisticsFilename << "...\n";
 		_statistics->WriteStatistics(_qualityStatisticsFilename);
 	}
 	
+	// The statistics of the chunks before the run was interrupted are added from the sets of the checkpoint
+	if(_collectStatistics && !earlierStatisticsFiles.empty())
+	{
+		std::cout << "Adding the statistics of the interrupted run...\n";
+		for(const std::string& filename : earlierStatisticsFiles)
+		{
+			if(writerSupportsStatistics)
+				MSWriter::MergeQualityStatistics(outputFilename, filename);
+			if(!_qualityStatisticsFilename.empty())
+				MSWriter::MergeQualityStatistics(_qualityStatisticsFilename, filename);
+		}
+	}
+	
 	// Reset statistics so that a potentially next subband starts with empty statistics
 	_statistics.reset();
 	
@@ -589,6 +1151,25 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 		writeMWAFieldsToUVFits(outputFilename);
 	}
 	
+	if(_checkpointing)
+	{
+		// A new run skips the band while the checkpoints of other bands are still in use
+		checkpoint.isComplete = true;
+		checkpoint.chunkCount = partCount;
+		checkpoint.nextChunk = partCount;
+		checkpoint.statisticsFiles.clear();
+		saveCheckpoint(outputFilename, checkpoint, timeAvgFactor, freqAvgFactor);
+		// All statistics have been written with the output
+		if(_collectStatistics)
+		{
+			const std::string statisticsPrefix = checkpointFilename(outputFilename) + "-stats" + std::to_string(firstChunk);
+			Checkpoint::Remove(statisticsPrefix + "a.qs");
+			Checkpoint::Remove(statisticsPrefix + "b.qs");
+			for(const std::string& filename : earlierStatisticsFiles)
+				Checkpoint::Remove(filename);
+		}
+	}
+	
 	_writeWatch.Pause();
 }
 
@@ -597,6 +1178,7 @@ void Cotter::createReader(const std::vector<std::string>& curFileset)
 	_reader.reset();
 	_reader.reset(new GPUFileReader(_mwaConfig.NAntennae(), nChannelsInCurSBRange(), _threadCount, _offlineGPUBoxFormat));
 	_reader->SetHDUOffsetsChangeCallback(std::bind(&Cotter::onHDUOffsetsChange, this, std::placeholders::_1));
+	_reader->SetNumaTopology(_numa);
 
 	// Add the gpubox files in the right order
 	for(size_t sb=_curSbStart; sb!=_curSbEnd; ++sb)
@@ -606,6 +1188,40 @@ void Cotter::createReader(const std::vector<std::string>& curFileset)
 	}
 
 	_reader->Initialize(_mwaConfig.Header().integrationTime, _doAlign);
+	if(_streamWindow != 0)
+		_reader->SetWaitTimeout(_streamTimeout);
+}
+
+void Cotter::slideImageSet(ImageSet& imageSet, size_t shift, size_t overlap)
+{
+	const size_t stride = imageSet.HorizontalStride();
+	for(size_t i=0; i!=imageSet.ImageCount(); ++i)
+	{
+		float* row = imageSet.ImageBuffer(i);
+		for(size_t y=0; y!=imageSet.Height(); ++y)
+		{
+			std::memmove(row, row + shift, overlap * sizeof(float));
+			std::fill(row + overlap, row + imageSet.Width(), 0.0f);
+			row += stride;
+		}
+	}
+}
+
+size_t Cotter::nodeOfBaseline(size_t antenna1, size_t antenna2) const
+{
+	// Index of the baseline in the order antenna1 <= antenna2
+	const size_t
+		antennaCount = _mwaConfig.NAntennae(),
+		index = antenna1 * (2 * antennaCount - antenna1 + 1) / 2 + (antenna2 - antenna1);
+	return _numa.NodeOf(index, antennaCount * (antennaCount + 1) / 2);
+}
+
+void Cotter::releaseImageSets()
+{
+	_imageSetBuffers.clear();
+	MemoryTracker::Release(MemoryTracker::ImageSets, _imageSetBytes);
+	_imageSetBytes = 0;
+	_imageSetCapacity = 0;
 }
 
 void Cotter::initializeReader()
@@ -629,6 +1245,7 @@ void Cotter::initializeReader()
 				buffer.imag[p] = imageSet.ImageBuffer(p*2+1);
 			}
 			buffer.nElementsPerRow = imageSet.HorizontalStride();
+			buffer.node = nodeOfBaseline(antenna1, antenna2);
 			_reader->SetDestBaselineBuffer(antenna1, antenna2, buffer);
 		}
 	}
@@ -656,6 +1273,7 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 	_writer->AddRows(rowsPerTimescan());
 	
 	double cosAngles[nChannels], sinAngles[nChannels];
+	Profiler::RowTimer gatherTimer("gather/phase");
 	
 	initializeWeights(_outputWeights);
 	for(size_t antenna1=0; antenna1!=antennaCount; ++antenna1)
@@ -665,113 +1283,111 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 			if(outputBaseline(antenna1, antenna2))
 			{
 				const ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
-				const FlagMask& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				const bool isFullyFlagged = _flagMasks.IsFullyFlagged(antenna1, antenna2);
+				const bool* flags = isFullyFlagged ? nullptr : _flagMasks.Mask(antenna1, antenna2);
 				
-				const size_t stride = imageSet.HorizontalStride();
-				const size_t flagStride = flagMask.HorizontalStride();
 				double
 					u = antU[antenna1] - antU[antenna2],
 					v = antV[antenna1] - antV[antenna2],
 					w = antW[antenna1] - antW[antenna2];
 					
-				// Pre-calculate rotation coefficients for geometric phase delay correction
-				if(_mwaConfig.Header().geomCorrection)
-				{
-					for(size_t ch=0; ch!=nChannels; ++ch)
-					{
-						double angle = -2.0*M_PI*w*_channelFrequenciesHz[ch] / SPEED_OF_LIGHT;
-						double sinAng, cosAng;
-						sincos(angle, &sinAng, &cosAng);
-						sinAngles[ch] = sinAng; cosAngles[ch] = cosAng;
-					}
-				}
+				gatherTimer.Start();
+				gatherBaseline(imageSet, flags, _flagMasks.Stride(), timeIndex - _curChunkStart, w, cosAngles, sinAngles);
+				gatherTimer.Stop(nChannels * 4 * sizeof(std::complex<float>));
 				
-				size_t bufferIndex = timeIndex - _curChunkStart;
-	#ifndef USE_SSE
-				for(size_t p=0; p!=4; ++p)
-				{
-					const float
-						*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
-						*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
-					const bool *flagPtr = flagMask.Buffer()+bufferIndex;
-					std::complex<float> *outDataPtr = &_outputData[p];
-					bool *outputFlagPtr = &_outputFlags[p];
-					for(size_t ch=0; ch!=nChannels; ++ch)
-					{
-						// Apply geometric phase delay (for w)
-						if(_mwaConfig.Header().geomCorrection)
-						{
-							const float rtmp = *realPtr, itmp = *imagPtr;
-							*outDataPtr = std::complex<float>(
-								cosAngles[ch] * rtmp - sinAngles[ch] * itmp,
-								sinAngles[ch] * rtmp + cosAngles[ch] * itmp
-							);
-						} else {
-							*outDataPtr = std::complex<float>(*realPtr, *imagPtr);
-						}
-						*outputFlagPtr = *flagPtr;
-						realPtr += stride;
-						imagPtr += stride;
-						flagPtr += flagStride;
-						outDataPtr += 4;
-						outputFlagPtr += 4;
-					}
-				}
-	#else
-				const float
-					*realAPtr = imageSet.ImageBuffer(0)+bufferIndex,
-					*imagAPtr = imageSet.ImageBuffer(1)+bufferIndex,
-					*realBPtr = imageSet.ImageBuffer(2)+bufferIndex,
-					*imagBPtr = imageSet.ImageBuffer(3)+bufferIndex,
-					*realCPtr = imageSet.ImageBuffer(4)+bufferIndex,
-					*imagCPtr = imageSet.ImageBuffer(5)+bufferIndex,
-					*realDPtr = imageSet.ImageBuffer(6)+bufferIndex,
-					*imagDPtr = imageSet.ImageBuffer(7)+bufferIndex;
-				const bool *flagPtr = flagMask.Buffer()+bufferIndex;
-				std::complex<float> *outDataPtr = &_outputData[0];
-				bool *outputFlagPtr = &_outputFlags[0];
-				for(size_t ch=0; ch!=nChannels; ++ch)
+				_writer->WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, u, v, w, _mwaConfig.Header().integrationTime, _outputData.get(), isFullyFlagged ? _fullyFlaggedRow.get() : _outputFlags.get(), _outputWeights.get());
+			}
+		}
+	}
+}
+
+template<size_t ChannelsPerSubband>
+MULTIVERSIONED_KERNEL
+void Cotter::gatherBaselineFor(const ImageSet& imageSet, const bool* flags, size_t flagStride, size_t bufferIndex, double w, double* cosAngles, double* sinAngles)
+{
+	const size_t nChannels = nChannelsInCurSBRange();
+	const size_t stride = imageSet.HorizontalStride();
+	// The channels are processed per subband when its size is known at compile time, and otherwise as one block
+	const size_t
+		blockSize = ChannelsPerSubband == 0 ? nChannels : ChannelsPerSubband,
+		blockCount = nChannels / blockSize;
+	
+	// Pre-calculate rotation coefficients for geometric phase delay correction
+	if(_mwaConfig.Header().geomCorrection)
+	{
+		for(size_t ch=0; ch!=nChannels; ++ch)
+		{
+			double angle = -2.0*M_PI*w*_channelFrequenciesHz[ch] / SPEED_OF_LIGHT;
+			double sinAng, cosAng;
+			sincos(angle, &sinAng, &cosAng);
+			sinAngles[ch] = sinAng; cosAngles[ch] = cosAng;
+		}
+	}
+	
+	for(size_t p=0; p!=4; ++p)
+	{
+		const float
+			*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
+			*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
+		std::complex<float> *outDataPtr = &_outputData[p];
+		for(size_t block=0; block!=blockCount; ++block)
+		{
+			const double
+				*blockCos = cosAngles + block*blockSize,
+				*blockSin = sinAngles + block*blockSize;
+			for(size_t ch=0; ch!=blockSize; ++ch)
+			{
+				// Apply geometric phase delay (for w)
+				if(_mwaConfig.Header().geomCorrection)
 				{
-					// Apply geometric phase delay (for w)
-					if(_mwaConfig.Header().geomCorrection)
-					{
-						// Note that order within set_ps is reversed; for the four complex numbers,
-						// the first two compl are loaded corresponding to set_ps(imag2, real2, imag1, real1).
-						__m128 ra = _mm_set_ps(*realBPtr, *realBPtr, *realAPtr, *realAPtr);
-						__m128 rb = _mm_set_ps(*realDPtr, *realDPtr, *realCPtr, *realCPtr);
-						__m128 rgeom = _mm_set_ps(sinAngles[ch], cosAngles[ch], sinAngles[ch], cosAngles[ch]);
-						__m128 ia = _mm_set_ps(*imagBPtr, *imagBPtr, *imagAPtr, *imagAPtr);
-						__m128 ib = _mm_set_ps(*imagDPtr, *imagDPtr, *imagCPtr, *imagCPtr);
-						__m128 igeom = _mm_set_ps(cosAngles[ch], -sinAngles[ch], cosAngles[ch], -sinAngles[ch]);
-						__m128 outa = _mm_add_ps(_mm_mul_ps(ra, rgeom), _mm_mul_ps(ia, igeom));
-						__m128 outb = _mm_add_ps(_mm_mul_ps(rb, rgeom), _mm_mul_ps(ib, igeom));
-						_mm_store_ps((float*) outDataPtr, outa);
-						_mm_store_ps((float*) (outDataPtr+2), outb);
-					} else {
-						*outDataPtr = std::complex<float>(*realAPtr, *imagAPtr);
-						*(outDataPtr+1) = std::complex<float>(*realBPtr, *imagBPtr);
-						*(outDataPtr+2) = std::complex<float>(*realCPtr, *imagCPtr);
-						*(outDataPtr+3) = std::complex<float>(*realDPtr, *imagDPtr);
-					}
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					realAPtr += stride; imagAPtr += stride;
-					realBPtr += stride; imagBPtr += stride;
-					realCPtr += stride; imagCPtr += stride;
-					realDPtr += stride; imagDPtr += stride;
-					flagPtr += flagStride;
-					outDataPtr += 4;
+					const float rtmp = *realPtr, itmp = *imagPtr;
+					*outDataPtr = std::complex<float>(
+						blockCos[ch] * rtmp - blockSin[ch] * itmp,
+						blockSin[ch] * rtmp + blockCos[ch] * itmp
+					);
+				} else {
+					*outDataPtr = std::complex<float>(*realPtr, *imagPtr);
 				}
-	#endif
-				
-				_writer->WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, u, v, w, _mwaConfig.Header().integrationTime, _outputData.get(), _outputFlags.get(), _outputWeights.get());
+				realPtr += stride;
+				imagPtr += stride;
+				outDataPtr += 4;
+			}
+		}
+	}
+	
+	// The four polarizations share their flag. Fully flagged baselines don't need
+	// their flags gathered; they are written with the pre-built _fullyFlaggedRow.
+	if(flags != nullptr)
+	{
+		const bool *flagPtr = flags+bufferIndex;
+		bool *outputFlagPtr = &_outputFlags[0];
+		for(size_t block=0; block!=blockCount; ++block)
+		{
+			for(size_t ch=0; ch!=blockSize; ++ch)
+			{
+				const bool flag = *flagPtr;
+				outputFlagPtr[0] = flag;
+				outputFlagPtr[1] = flag;
+				outputFlagPtr[2] = flag;
+				outputFlagPtr[3] = flag;
+				flagPtr += flagStride;
+				outputFlagPtr += 4;
 			}
 		}
 	}
 }
 
+void Cotter::selectKernels()
+{
+	const size_t channelsPerSubband = _mwaConfig.Header().nChannels / _subbandCount;
+	switch(channelsPerSubband)
+	{
+		case 32: _gatherBaseline = &Cotter::gatherBaselineFor<32>; break;
+		case 128: _gatherBaseline = &Cotter::gatherBaselineFor<128>; break;
+		default: _gatherBaseline = &Cotter::gatherBaselineFor<0>; break;
+	}
+}
+
 void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 {
 	const size_t antennaCount = _mwaConfig.NAntennae();
@@ -787,14 +1403,19 @@ void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 		{
 			if(outputBaseline(antenna1, antenna2))
 			{
-				const FlagMask& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				if(_flagMasks.IsFullyFlagged(antenna1, antenna2))
+				{
+					_writer->WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, 0.0, 0.0, 0.0, _mwaConfig.Header().integrationTime, _outputData.get(), _fullyFlaggedRow.get(), _outputWeights.get());
+					continue;
+				}
 				
-				const size_t flagStride = flagMask.HorizontalStride();
+				const bool* flags = _flagMasks.Mask(antenna1, antenna2);
+				const size_t flagStride = _flagMasks.Stride();
 				
 				size_t bufferIndex = timeIndex - _curChunkStart;
 				for(size_t p=0; p!=4; ++p)
 				{
-					const bool *flagPtr = flagMask.Buffer()+bufferIndex;
+					const bool *flagPtr = flags+bufferIndex;
 					bool *outputFlagPtr = &_outputFlags[p];
 					for(size_t ch=0; ch!=nChannels; ++ch)
 					{
@@ -831,33 +1452,47 @@ void Cotter::CalculateUVW(double date, size_t antenna1, size_t antenna2, double
 	w = w1 - w2;
 }
 
-void Cotter::baselineProcessThreadFunc()
+void Cotter::baselineProcessThreadFunc(size_t threadIndex)
 {
 	try {
-		QualityStatistics threadStatistics =
-			_flagger.MakeQualityStatistics(&_scanTimes[_curChunkStart], _curChunkEnd-_curChunkStart, &_channelFrequenciesHz[0], _channelFrequenciesHz.size(), 4, _collectHistograms);
-		Strategy strategy;
-		if(_rfiDetection)
-			strategy = _flagger.LoadStrategyFile(_strategyFilename);
+		// Pinned before anything is allocated, so that the thread's own buffers are local too
+		const size_t node = _numa.NodeOf(threadIndex, _threadCount);
+		_numa.PinToNode(node);
+		// The statistics cover the times of one chunk, so these are made per chunk
+		_threadStatistics[threadIndex].reset(new QualityStatistics(
+			_flagger.MakeQualityStatistics(&_scanTimes[_curChunkStart], _curChunkEnd-_curChunkStart, &_channelFrequenciesHz[0], _channelFrequenciesHz.size(), 4, _collectHistograms)));
+		QualityStatistics& threadStatistics = *_threadStatistics[threadIndex];
+		std::unique_ptr<Strategy>& strategy = _strategies[threadIndex];
+		if(strategy == nullptr)
+		{
+			if(_rfiDetection)
+				strategy.reset(new Strategy(_flagger.LoadStrategyFile(_strategyFilename)));
+			else
+				strategy.reset(new Strategy());
+		}
 		
 		std::unique_lock<std::mutex> lock(_mutex);
-		while(!_baselinesToProcess.empty())
+		while(true)
 		{
-			std::pair<size_t, size_t> baseline = _baselinesToProcess.front();
-			size_t currentTaskCount = _baselinesToProcess.size();
+			// The baselines of the thread's own node come first. When those are done, the
+			// thread helps the other nodes, so that no thread idles while work remains.
+			size_t queueIndex = node;
+			for(size_t i=0; i!=_baselinesToProcess.size() && _baselinesToProcess[queueIndex].empty(); ++i)
+				queueIndex = (queueIndex + 1) % _baselinesToProcess.size();
+			std::queue<std::pair<size_t, size_t>>& queue = _baselinesToProcess[queueIndex];
+			if(queue.empty())
+				break;
+			std::pair<size_t, size_t> baseline = queue.front();
+			size_t currentTaskCount = 0;
+			for(const std::queue<std::pair<size_t, size_t>>& nodeQueue : _baselinesToProcess)
+				currentTaskCount += nodeQueue.size();
 			_progressBar->SetProgress(_baselinesToProcessCount - currentTaskCount, _baselinesToProcessCount);
-			_baselinesToProcess.pop();
+			queue.pop();
 			lock.unlock();
 			
-			processBaseline(baseline.first, baseline.second, strategy, threadStatistics);
+			processBaseline(baseline.first, baseline.second, *strategy, threadStatistics);
 			lock.lock();
 		}
-		
-		// Mutex still needs to be locked
-		if(!_statistics)
-			_statistics.reset(new QualityStatistics(threadStatistics));
-		else
-			(*_statistics) += threadStatistics;
 	}
 	catch(std::exception& exception)
 	{
@@ -871,6 +1506,26 @@ void Cotter::baselineProcessThreadFunc()
 	}
 }
 
+void Cotter::reduceStatistics()
+{
+	// Pairwise reduction tree: in every round, statistics i+step are merged into i,
+	// with the merges of a round running in parallel on the worker pool.
+	for(size_t step=1; step < _threadStatistics.size(); step *= 2)
+	{
+		const size_t mergeCount = (_threadStatistics.size() - step + step*2 - 1) / (step*2);
+		workerPool().Run(mergeCount, [this, step](size_t merge) {
+			const size_t i = merge * step * 2;
+			*_threadStatistics[i] += *_threadStatistics[i+step];
+			_threadStatistics[i+step].reset();
+		});
+	}
+	if(!_statistics)
+		_statistics = std::move(_threadStatistics[0]);
+	else
+		(*_statistics) += *_threadStatistics[0];
+	_threadStatistics.clear();
+}
+
 void Cotter::processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strategy& strategy, QualityStatistics& statistics)
 {
 	ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t,size_t>(antenna1, antenna2))->second;
@@ -880,62 +1535,37 @@ void Cotter::processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strate
 		&input2X = _mwaConfig.AntennaXInput(antenna2),
 		&input2Y = _mwaConfig.AntennaYInput(antenna2);
 		
-	// Correct conjugated baselines
-	if(_reader->IsConjugated(antenna1, antenna2, 0, 0)) {
-		correctConjugated(imageSet, 1);
-	}
-	if(_reader->IsConjugated(antenna1, antenna2, 0, 1)) {
-		correctConjugated(imageSet, 3);
-	}
-	if(_reader->IsConjugated(antenna1, antenna2, 1, 0)) {
-		correctConjugated(imageSet, 5);
-	}
-	if(_reader->IsConjugated(antenna1, antenna2, 1, 1)) {
-		correctConjugated(imageSet, 7);
-	}
+	const uint64_t imageSetBytes = uint64_t(8) * imageSet.Height() * imageSet.Width() * sizeof(float);
+	Profiler::Scope correctionScope("correction passes", imageSetBytes);
 	
-	// Correct cable delay
-    if(_doCorrectCableLength) {
-	correctCableLength(imageSet, 0, input2X.cableLenDelta - input1X.cableLenDelta);
-	correctCableLength(imageSet, 1, input2Y.cableLenDelta - input1X.cableLenDelta);
-	correctCableLength(imageSet, 2, input2X.cableLenDelta - input1Y.cableLenDelta);
-	correctCableLength(imageSet, 3, input2Y.cableLenDelta - input1Y.cableLenDelta);
-    }
+	// Correct cable delay and passband, and conjugate the correlation products that the correlator stores conjugated
+	const bool conjugate[4] = {
+		_reader->IsConjugated(antenna1, antenna2, 0, 0),
+		_reader->IsConjugated(antenna1, antenna2, 0, 1),
+		_reader->IsConjugated(antenna1, antenna2, 1, 0),
+		_reader->IsConjugated(antenna1, antenna2, 1, 1)
+	};
+	correctCableLengthAndPassband(imageSet, input1X, input1Y, input2X, input2Y, conjugate);
 	
-	// Correct passband
-	for(size_t i=0; i!=8; ++i)
-	{
-		const double* subbandGains1Ptr = (i<4) ? input1X.pfbGains : input1Y.pfbGains;
-		const double* subbandGains2Ptr = (i==0 || i==1 || i==4 || i==5) ? input2X.pfbGains : input2Y.pfbGains;
-		
-		const size_t channelsPerSubband = imageSet.Height()/(_curSbEnd - _curSbStart);
-		for(size_t sb=0; sb!=_curSbEnd - _curSbStart; ++sb)
-		{
-			double subbandGainCorrection = 1.0 / (subbandGains1Ptr[sb+_curSbStart] * subbandGains2Ptr[sb+_curSbStart]);
-			
-			for(size_t ch=0; ch!=channelsPerSubband; ++ch)
-			{
-				float *channelPtr = imageSet.ImageBuffer(i) + (ch+sb*channelsPerSubband) * imageSet.HorizontalStride();
-				const float correctionFactor = _subbandCorrectionFactors[i/2][ch] * subbandGainCorrection;
-				for(size_t x=0; x!=imageSet.Width(); ++x)
-				{
-					*channelPtr *= correctionFactor;
-					++channelPtr;
-				}
-			}
-		}
-	}
+	correctionScope.End();
 	
 	FlagMask flagMask;
+	// Either flagMask or, for fully flagged baselines, the shared mask
+	const FlagMask *baselineMask = &flagMask;
 	FlagMask *correlatorMask;
 	// Perform RFI detection, if baseline is not flagged.
 	bool skipFlagging = input1X.isFlagged || input1Y.isFlagged || input2X.isFlagged || input2Y.isFlagged || _isAntennaFlaggedMap[antenna1] || _isAntennaFlaggedMap[antenna2];
+	// Flags that were read from a file for a skipped baseline stay in the pool as they are
+	const bool isInPool = skipFlagging && !_flagFileTemplate.empty();
 	if(skipFlagging)
 	{
 		if(_flagFileTemplate.empty())
-			flagMask = _fullysetMask;
-		else
-			flagMask = std::move(_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
+			baselineMask = &_fullysetMask;
+		else if(_collectStatistics)
+		{
+			flagMask = _flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount());
+			_flagMasks.Load(antenna1, antenna2, flagMask);
+		}
 		correlatorMask = &_fullysetMask;
 	}
 	else 
@@ -943,14 +1573,18 @@ void Cotter::processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strate
 		correlatorMask = &_correlatorMask;
 		if(!_flagFileTemplate.empty())
 		{
-			flagMask = std::move(_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
 			if(antenna1 == antenna2)
-			{
 				flagMask = _flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false);
+			else {
+				flagMask = _flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount());
+				_flagMasks.Load(antenna1, antenna2, flagMask);
 			}
 		}
 		else if(_rfiDetection && (antenna1 != antenna2))
+		{
+			Profiler::Scope scope("strategy.Run", imageSetBytes);
 			flagMask = strategy.Run(imageSet, *correlatorMask);
+		}
 		else
 			flagMask = _flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false);
 		flagBadCorrelatorSamples(flagMask);
@@ -958,53 +1592,53 @@ void Cotter::processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strate
 	
 	// Collect statistics
 	if(_collectStatistics)
-		statistics.CollectStatistics(imageSet, flagMask, *correlatorMask, antenna1, antenna2);
-	
-	// If this is an auto-correlation, it wouldn't have been flagged yet
-	// to allow collecting its statistics. But we want to flag it...
-	if(antenna1 == antenna2 && _flagAutos)
 	{
-		flagMask = _fullysetMask;
+		Profiler::Scope scope("statistics", imageSetBytes);
+		const FlagMask& statisticsMask = (_streamWindow != 0 && correlatorMask == &_correlatorMask) ? _statisticsMask : *correlatorMask;
+		statistics.CollectStatistics(imageSet, *baselineMask, statisticsMask, antenna1, antenna2);
 	}
 	
-	_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second = std::move(flagMask);
+	// If this is an auto-correlation, it wouldn't have been flagged yet
+	// to allow collecting its statistics. But we want to flag it...
+	if((antenna1 == antenna2 && _flagAutos) || baselineMask == &_fullysetMask)
+		_flagMasks.SetFullyFlagged(antenna1, antenna2);
+	else if(!isInPool)
+		_flagMasks.Store(antenna1, antenna2, flagMask);
 }
 
-void Cotter::correctConjugated(ImageSet& imageSet, size_t imgImageIndex) const
+void Cotter::correctCableLengthAndPassband(ImageSet& imageSet, const MWAInput& input1X, const MWAInput& input1Y, const MWAInput& input2X, const MWAInput& input2Y, const bool* conjugate) const
 {
-	float *imags = imageSet.ImageBuffer(imgImageIndex);
-	for(size_t y=0; y!=imageSet.Height(); ++y)
+	const size_t height = imageSet.Height();
+	const MWAInput
+		*inputs1[4] = { &input1X, &input1X, &input1Y, &input1Y },
+		*inputs2[4] = { &input2X, &input2Y, &input2X, &input2Y };
+	std::vector<float> rowFactors(height);
+	std::vector<std::complex<float>> rowPhasors(_doCorrectCableLength ? height : 0);
+	for(size_t p=0; p!=4; ++p)
 	{
-		for(size_t x=0; x!=imageSet.HorizontalStride(); ++x)
+		const float
+			*passband = _passbandFactors[p].data(),
+			*gains1 = &_inputGainFactors[inputs1[p]->inputIndex * height],
+			*gains2 = &_inputGainFactors[inputs2[p]->inputIndex * height];
+		for(size_t ch=0; ch!=height; ++ch)
+			rowFactors[ch] = passband[ch] * gains1[ch] * gains2[ch];
+		// Scans that were kept from the previous chunk are already corrected
+		float
+			*reals = imageSet.ImageBuffer(p*2) + _correctedScanCount,
+			*imags = imageSet.ImageBuffer(p*2+1) + _correctedScanCount;
+		const size_t width = imageSet.Width() - _correctedScanCount;
+		if(_doCorrectCableLength)
 		{
-			*imags = -*imags;
-			++imags;
+			// The delay of the baseline is the difference of the delays of its inputs, hence its phasor is p2 conj(p1)
+			const std::complex<float>
+				*phasors1 = &_inputPhasors[inputs1[p]->inputIndex * height],
+				*phasors2 = &_inputPhasors[inputs2[p]->inputIndex * height];
+			for(size_t ch=0; ch!=height; ++ch)
+				rowPhasors[ch] = phasors2[ch] * std::conj(phasors1[ch]) * rowFactors[ch];
+			CorrectionKernels::RotateRows(reals, imags, width, imageSet.HorizontalStride(), height, rowPhasors.data(), conjugate[p]);
 		}
-	}
-}
-
-void Cotter::correctCableLength(ImageSet& imageSet, size_t polarization, double cableDelay) const
-{
-	float *reals = imageSet.ImageBuffer(polarization*2);
-	float *imags = imageSet.ImageBuffer(polarization*2+1);
-	
-	for(size_t y=0; y!=imageSet.Height(); ++y)
-	{
-		double angle = -2.0 * M_PI * cableDelay * _channelFrequenciesHz[y] / SPEED_OF_LIGHT;
-		double rotSinl, rotCosl;
-		sincos(angle, &rotSinl, &rotCosl);
-		float rotSin = rotSinl, rotCos = rotCosl;
-		
-		/// @todo This should use actual time step count in window
-		float *realPtr = reals + y * imageSet.HorizontalStride();
-		float *imagPtr = imags + y * imageSet.HorizontalStride();
-		for(size_t x=0; x!=imageSet.Width(); ++x)
-		{
-			float r = *realPtr;
-			*realPtr = rotCos * r - rotSin * (*imagPtr);
-			*imagPtr = rotSin * r + rotCos * (*imagPtr);
-			++realPtr;
-			++imagPtr;
+		else {
+			CorrectionKernels::ScaleRows(reals, imags, width, imageSet.HorizontalStride(), height, rowFactors.data(), conjugate[p]);
 		}
 	}
 }
@@ -1066,26 +1700,37 @@ void Cotter::writeAntennae()
 	_writer->WriteAntennae(antennae, _mwaConfig.Header().dateFirstScanMJD*86400.0);
 }
 
-void Cotter::writeSPW()
+void Cotter::makeBandInfo(const std::vector<double>& channelFrequenciesHz, std::string& name, std::vector<Writer::ChannelInfo>& channels, double& refFreq, double& totalBandwidth) const
 {
-	const size_t nCurChannels = nChannelsInCurSBRange();
-	std::vector<MSWriter::ChannelInfo> channels(nCurChannels);
+	const size_t nCurChannels = channelFrequenciesHz.size();
+	channels.resize(nCurChannels);
 	std::ostringstream str;
-	double centreFrequencyMHz = 0.0000005 * (_channelFrequenciesHz[nCurChannels/2-1] + _channelFrequenciesHz[nCurChannels/2]);
+	double centreFrequencyMHz = 0.0000005 * (channelFrequenciesHz[nCurChannels/2-1] + channelFrequenciesHz[nCurChannels/2]);
 	str << "MWA_BAND_" << (round(centreFrequencyMHz*10.0)/10.0);
 	const double chWidth = _mwaConfig.Header().bandwidthMHz * 1000000.0 / _mwaConfig.Header().nChannels;
 	for(size_t ch=0;ch!=nCurChannels;++ch)
 	{
 		MSWriter::ChannelInfo &channel = channels[ch];
-		channel.chanFreq = _channelFrequenciesHz[ch];
+		channel.chanFreq = channelFrequenciesHz[ch];
 		channel.chanWidth = chWidth;
 		channel.effectiveBW = chWidth;
 		channel.resolution = chWidth;
 	}
-	_writer->WriteBandInfo(str.str(),
+	name = str.str();
+	refFreq = centreFrequencyMHz*1000000.0;
+	totalBandwidth = nCurChannels*chWidth;
+}
+
+void Cotter::writeSPW(const std::vector<double>& channelFrequenciesHz)
+{
+	std::string name;
+	std::vector<Writer::ChannelInfo> channels;
+	double refFreq, totalBandwidth;
+	makeBandInfo(channelFrequenciesHz, name, channels, refFreq, totalBandwidth);
+	_writer->WriteBandInfo(name,
 		channels,
-		centreFrequencyMHz*1000000.0,
-		nCurChannels*chWidth,
+		refFreq,
+		totalBandwidth,
 		false
 	);
 }
@@ -1247,6 +1892,42 @@ void Cotter::initPerInputSubbandGains()
 	}
 }
 
+void Cotter::initCorrectionTables()
+{
+	const size_t
+		nChannels = nChannelsInCurSBRange(),
+		channelsPerSubband = _subbandCorrectionFactors[0].size();
+	for(size_t p=0; p!=4; ++p)
+	{
+		_passbandFactors[p].resize(nChannels);
+		for(size_t ch=0; ch!=nChannels; ++ch)
+			_passbandFactors[p][ch] = _subbandCorrectionFactors[p][ch % channelsPerSubband];
+	}
+	_inputGainFactors.resize(_mwaConfig.NAntennae() * 2 * nChannels);
+	_inputPhasors.resize(_mwaConfig.NAntennae() * 2 * nChannels);
+	for(size_t inpIndex=0; inpIndex!=_mwaConfig.NAntennae()*2; ++inpIndex)
+		initInputCorrections(_mwaConfig.Input(inpIndex));
+}
+
+void Cotter::initInputCorrections(const MWAInput& input)
+{
+	const size_t
+		nChannels = nChannelsInCurSBRange(),
+		channelsPerSubband = _subbandCorrectionFactors[0].size();
+	float* gains = &_inputGainFactors[input.inputIndex * nChannels];
+	for(size_t ch=0; ch!=nChannels; ++ch)
+		gains[ch] = 1.0 / input.pfbGains[_curSbStart + ch / channelsPerSubband];
+	
+	std::complex<float>* phasors = &_inputPhasors[input.inputIndex * nChannels];
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		double angle = -2.0 * M_PI * input.cableLenDelta * _channelFrequenciesHz[ch] / SPEED_OF_LIGHT;
+		double rotSin, rotCos;
+		sincos(angle, &rotSin, &rotCos);
+		phasors[ch] = std::complex<float>(rotCos, rotSin);
+	}
+}
+
 void Cotter::flagBadCorrelatorSamples(FlagMask &flagMask) const
 {
 	// Flag MWA side and centre channels
@@ -1378,7 +2059,7 @@ void Cotter::initializeSbOrder()
 			{
 				size_t sb = _subbandOrder[i];
 				std::cout << "At least one file is missing from gpubox " << (i+1) << ": flagging subband " << sb << ".\n";
-				FlagSubband(sb);
+				_flaggedSubbands.insert(sb);
 			}
 		}
 	}
@@ -1428,6 +2109,7 @@ void Cotter::writeAlignmentScans()
 
 void Cotter::writeMWAFieldsToMS(const std::string& outputFilename, size_t flagWindowSize)
 {
+	Profiler::Scope scope("MWA field writing");
 	MWAMS mwaMs(outputFilename);
 	mwaMs.InitializeMWAFields();
 	
@@ -1476,6 +2158,7 @@ void Cotter::writeMWAFieldsToMS(const std::string& outputFilename, size_t flagWi
 
 void Cotter::writeMWAFieldsToUVFits(const std::string& outputFilename)
 {
+	Profiler::Scope scope("MWA field writing");
 	MWAFits mwaFits(outputFilename);
 	mwaFits.WriteMWAKeywords(_mwaConfig.HeaderExt().metaDataVersion, _mwaConfig.HeaderExt().mwaPyVersion, COTTER_VERSION_STR, COTTER_VERSION_DATE);
 }
@@ -1503,3 +2186,97 @@ void Cotter::onHDUOffsetsChange(const std::vector<int>& newHDUOffsets)
 		}
 	}
 }
+
+std::vector<size_t> Cotter::checkpointSettings(size_t timeAvgFactor, size_t freqAvgFactor) const
+{
+	return std::vector<size_t> {
+		_mwaConfig.Header().nScans, _mwaConfig.NAntennae(), nChannelsInCurSBRange(), _curSbStart, _curSbEnd,
+		timeAvgFactor, freqAvgFactor, size_t(_removeFlaggedAntennae), size_t(_removeAutoCorrelations)
+	};
+}
+
+void Cotter::saveCheckpoint(const std::string& outputFilename, const CheckpointState& state, size_t timeAvgFactor, size_t freqAvgFactor)
+{
+	Checkpoint::Save(checkpointFilename(outputFilename), [&](std::ostream& stream)
+	{
+		Checkpoint::WriteVector(stream, checkpointSettings(timeAvgFactor, freqAvgFactor));
+		Checkpoint::Write(stream, state.isComplete);
+		Checkpoint::Write(stream, state.chunkCount);
+		Checkpoint::Write(stream, state.nextChunk);
+		Checkpoint::Write(stream, state.fileSetIndex);
+		Checkpoint::Write(stream, state.scanPosition);
+		Checkpoint::Write(stream, state.statisticsFiles.size());
+		for(const std::string& filename : state.statisticsFiles)
+			Checkpoint::WriteString(stream, filename);
+		if(!state.isComplete)
+		{
+			// The start time might have been replaced by the one in the raw files
+			const MWAHeader& header = _mwaConfig.Header();
+			Checkpoint::Write(stream, header.year);
+			Checkpoint::Write(stream, header.month);
+			Checkpoint::Write(stream, header.day);
+			Checkpoint::Write(stream, header.refHour);
+			Checkpoint::Write(stream, header.refMinute);
+			Checkpoint::Write(stream, header.refSecond);
+			Checkpoint::Write(stream, header.dateFirstScanMJD);
+			Checkpoint::WriteVector(stream, _hduOffsetsPerGPUBox);
+			_writer->SaveState(stream);
+		}
+	});
+	if(state.isComplete)
+		std::cout << "Saved checkpoint of completed band.\n";
+	else
+		std::cout << "Saved checkpoint after chunk " << state.nextChunk << " of " << state.chunkCount << ".\n";
+}
+
+bool Cotter::readCheckpoint(const std::string& outputFilename, CheckpointState& state, std::ifstream& stream, size_t timeAvgFactor, size_t freqAvgFactor) const
+{
+	const std::string filename = checkpointFilename(outputFilename);
+	if(!Checkpoint::Open(filename, stream))
+		return false;
+	std::vector<size_t> settings;
+	Checkpoint::ReadVector(stream, settings);
+	if(settings != checkpointSettings(timeAvgFactor, freqAvgFactor))
+		throw std::runtime_error("Checkpoint " + filename + " was made with different settings. Remove it to start from the beginning.");
+	Checkpoint::Read(stream, state.isComplete);
+	Checkpoint::Read(stream, state.chunkCount);
+	Checkpoint::Read(stream, state.nextChunk);
+	Checkpoint::Read(stream, state.fileSetIndex);
+	Checkpoint::Read(stream, state.scanPosition);
+	size_t statisticsFileCount;
+	Checkpoint::Read(stream, statisticsFileCount);
+	state.statisticsFiles.resize(statisticsFileCount);
+	for(std::string& statisticsFile : state.statisticsFiles)
+		Checkpoint::ReadString(stream, statisticsFile);
+	if(state.fileSetIndex > _fileSets.size())
+		throw std::runtime_error("Checkpoint " + filename + " refers to more gpubox files than were given.");
+	std::cout << "Read checkpoint " << filename << ".\n";
+	return true;
+}
+
+void Cotter::restoreCheckpoint(std::istream& stream)
+{
+	MWAHeader& header = _mwaConfig.HeaderRW();
+	Checkpoint::Read(stream, header.year);
+	Checkpoint::Read(stream, header.month);
+	Checkpoint::Read(stream, header.day);
+	Checkpoint::Read(stream, header.refHour);
+	Checkpoint::Read(stream, header.refMinute);
+	Checkpoint::Read(stream, header.refSecond);
+	Checkpoint::Read(stream, header.dateFirstScanMJD);
+	Checkpoint::ReadVector(stream, _hduOffsetsPerGPUBox);
+	_writer->RestoreState(stream);
+}
+
+void Cotter::createStatisticsSet(const std::string& filename, const std::vector<double>& channelFrequenciesHz)
+{
+	std::unique_ptr<Writer> qsWriter(new MSWriter(filename));
+	std::swap(qsWriter, _writer);
+	writeAntennae();
+	writeSPW(channelFrequenciesHz);
+	writeSource();
+	writeField();
+	_writer->WritePolarizationForLinearPols(false);
+	writeObservation();
+	std::swap(qsWriter, _writer);
+}
@@ -3,19 +3,28 @@
 
 #include "aligned_ptr.h"
 #include "averagingwriter.h"
+#include "fileprefetcher.h"
+#include "flagmaskpool.h"
 #include "gpufilereader.h"
+#include "memoryplanner.h"
 #include "mwaconfig.h"
+#include "numatopology.h"
 #include "stopwatch.h"
 #include "progressbar.h"
+#include "workerpool.h"
 
 #include <aoflagger.h>
 
+#include <functional>
+#include <iosfwd>
 #include <memory>
 #include <vector>
 #include <queue>
 #include <set>
 #include <string>
 
+#include <sys/types.h>
+
 class GPUFileReader;
 class MSWriter;
 
@@ -33,6 +42,51 @@ class Cotter : private UVWCalculater
 		void SetOutputFormat(enum OutputFormat format) { _outputFormat = format; }
 		void SetFileSets(const std::vector<std::vector<std::string> >& fileSets) { _fileSets = fileSets; }
 		void SetThreadCount(size_t threadCount) { _threadCount = threadCount; }
+		/**
+		 * Set the number of non-contiguous bands that are processed at the same time. Each band
+		 * is processed by a separate process that gets an equal share of the threads and memory.
+		 */
+		void SetBandProcessCount(size_t bandProcessCount) { _bandProcessCount = bandProcessCount; }
+		/**
+		 * Split every contiguous band over the given number of processes, each of which processes a range
+		 * of its subbands. The first process writes the measurement set of the band, the others write
+		 * temporary sets that are merged into it afterwards. Only for measurement set output.
+		 */
+		void SetChannelProcessCount(size_t channelProcessCount) { _channelProcessCount = channelProcessCount; }
+		/**
+		 * On machines with several NUMA nodes, the baselines are divided over the nodes: their image
+		 * sets are allocated on the node, and the threads that process and read them are pinned to it.
+		 * Enabled by default.
+		 */
+		void SetNumaAware(bool numaAware) { _numa = numaAware ? NumaTopology::Detect() : NumaTopology(); }
+		/**
+		 * When a band does not fit in memory, process it in groups of subbands that each contain all
+		 * timesteps, instead of splitting it in time chunks. This keeps the full time series available to the flagger.
+		 */
+		void SetFrequencyPartitioning(bool frequencyPartitioning) { _frequencyPartitioning = frequencyPartitioning; }
+		/**
+		 * Process the observation in windows of the given number of scans, which are written as soon
+		 * as they are flagged. A window is flagged together with the given number of margin scans on
+		 * both sides. The gpubox files may still be growing: the reader waits for the scans of a window
+		 * until the files have not grown for timeout seconds.
+		 */
+		void SetStreaming(size_t windowScans, size_t marginScans, double timeout)
+		{
+			_streamWindow = windowScans;
+			_streamMargin = marginScans;
+			_streamTimeout = timeout;
+		}
+		/**
+		 * Save a checkpoint next to the output after every chunk. When a checkpoint of the output
+		 * exists, the run continues after its last completed chunk. Only for measurement set output.
+		 */
+		void SetCheckpointing(bool checkpointing) { _checkpointing = checkpointing; }
+		/**
+		 * Files to read ahead into the page cache once all gpubox files have been read, such as those of
+		 * the next observation in batch mode. They are read in the background while the processing continues.
+		 * Bands that are processed in separate processes do not prefetch.
+		 */
+		void SetPrefetchFiles(const std::vector<std::string>& filenames) { _prefetchFiles = filenames; }
 		void SetRFIDetection(bool performRFIDetection) { _rfiDetection = performRFIDetection; }
 		void SetCollectStatistics(bool collectStatistics) { _collectStatistics = collectStatistics; }
 		void SetCollectHistograms(bool collectHistograms) { _collectHistograms = collectHistograms; }
@@ -41,7 +95,11 @@ class Cotter : private UVWCalculater
 		void SetAntennaLocationsFilename(const char *filename) { _antennaLocationsFilename = filename; }
 		void SetHeaderFilename(const char *filename) { _headerFilename = filename; }
 		void SetInstrConfigFilename(const char *filename) { _instrConfigFilename = filename; }
-		void SetMaxBufferSize(const size_t bufferSizeInSamples) { _maxBufferSize = bufferSizeInSamples; }
+		/**
+		 * Set the number of bytes that the large buffers may use together. The chunk size and
+		 * the number of threads are chosen to stay within this limit.
+		 */
+		void SetMemoryLimit(int64_t memoryLimit) { _memoryLimit = memoryLimit; }
 		void SetDisableGeometricCorrections(bool disableCorrections) { _disableGeometricCorrections = disableCorrections; }
 		void SetOverridePhaseCentre(long double newRARad, long double newDecRad)
 		{
@@ -70,9 +128,15 @@ class Cotter : private UVWCalculater
 		void SetFlagDCChannels(bool flagDCChannels) { _flagDCChannels = flagDCChannels; }
 		void SetFlagFileTemplate(const std::string& flagFileTemplate) { _flagFileTemplate = flagFileTemplate; }
 		void SetSaveQualityStatistics(const std::string& file) { _qualityStatisticsFilename = file; }
+		/**
+		 * Write a JSON report with the time spent per stage, chunk and band to the given file.
+		 * When bands or channel ranges are processed in separate processes, each writes its own report
+		 * (see profileFilenameWithSuffix()).
+		 */
+		void SetProfileFilename(const std::string& file) { _profileFilename = file; }
 		void SetSkipWriting(bool skipWriting) { _skipWriting = skipWriting; }
 		void FlagAntenna(size_t antIndex) { _userFlaggedAntennae.push_back(antIndex); }
-		void FlagSubband(size_t sbIndex) { _flaggedSubbands.insert(sbIndex); }
+		void FlagSubband(size_t sbIndex) { _userFlaggedSubbands.insert(sbIndex); }
 		void SetSubbandEdgeFlagWidth(double edgeFlagWidth) { _subbandEdgeFlagWidthKHz = edgeFlagWidth; }
 		void SetOfflineGPUBoxFormat(bool offlineFormat) { _offlineGPUBoxFormat = offlineFormat; }
 		void SetUseDysco(bool useDysco) { _useDysco = useDysco; }
@@ -96,45 +160,86 @@ class Cotter : private UVWCalculater
 		aoflagger::AOFlagger _flagger;
 		
 		std::vector<double> _subbandCorrectionFactors[4];
+		/**
+		 * Correction tables of the current band with one value per channel, made by initCorrectionTables():
+		 * the passband factor of each polarization, and the inverse PFB gain and cable delay phasor of each input.
+		 */
+		std::vector<float> _passbandFactors[4], _inputGainFactors;
+		std::vector<std::complex<float>> _inputPhasors;
 		std::unique_ptr<bool[]> _isAntennaFlaggedMap;
 		size_t _unflaggedAntennaCount;
 		
 		Stopwatch _readWatch, _processWatch, _writeWatch;
 		
 		std::vector<std::vector<std::string> > _fileSets;
-		size_t _threadCount;
-		size_t _maxBufferSize;
+		size_t _threadCount, _bandProcessCount, _channelProcessCount;
+		/** Whether the current observation was processed by forked processes, which report their own times. */
+		bool _hasForked;
+		int64_t _memoryLimit;
 		size_t _subbandCount;
 		size_t _quackInitSampleCount, _quackEndSampleCount;
 		double _subbandEdgeFlagWidthKHz;
 		size_t _subbandEdgeFlagCount;
 		size_t _missingEndScans;
 		size_t _curChunkStart, _curChunkEnd, _curSbStart, _curSbEnd;
+		/** Number of scans at the start of the chunk that were kept from the previous chunk, and need no corrections. */
+		size_t _correctedScanCount;
+		bool _frequencyPartitioning;
+		size_t _streamWindow, _streamMargin;
+		double _streamTimeout;
+		bool _checkpointing;
+		/** Progress of a band as saved in its checkpoint, see saveCheckpoint(). */
+		struct CheckpointState
+		{
+			bool isComplete;
+			size_t chunkCount, nextChunk;
+			/** The file set that is being read and the position of its reader. */
+			size_t fileSetIndex, scanPosition;
+			/** The quality statistics sets of the runs that were interrupted, the last one being of this run. */
+			std::vector<std::string> statisticsFiles;
+		};
+		struct {
+			bool isPartitioned, isFirst, isLast;
+			size_t channelStart;
+			std::vector<double> bandFrequenciesHz;
+		} _bandPartition;
 		bool _defaultFilename, _rfiDetection, _collectStatistics, _collectHistograms, _usePointingCentre;
 		enum OutputFormat _outputFormat;
 		std::string _outputFilename, _commandLine;
 		std::string _metaFilename, _antennaLocationsFilename, _headerFilename, _instrConfigFilename;
-		std::string _subbandPassbandFilename, _flagFileTemplate, _qualityStatisticsFilename;
+		std::string _subbandPassbandFilename, _flagFileTemplate, _qualityStatisticsFilename, _profileFilename;
 		bool _applySolutionsBeforeAveraging;
 		std::string _solutionFilename;
 		std::string _strategyFilename;
 		std::vector<size_t> _userFlaggedAntennae;
-		std::set<size_t> _flaggedSubbands;
+		/** The subbands given with FlagSubband(), and those together with the missing subbands of the observation. */
+		std::set<size_t> _userFlaggedSubbands, _flaggedSubbands;
 		
 		std::map<std::pair<size_t, size_t>, aoflagger::ImageSet> _imageSetBuffers;
-		std::map<std::pair<size_t, size_t>, aoflagger::FlagMask> _flagBuffers;
+		size_t _imageSetCapacity;
+		int64_t _imageSetBytes;
+		FlagMaskPool _flagMasks;
+		std::vector<std::string> _prefetchFiles;
+		FilePrefetcher _prefetcher;
 		std::vector<double> _channelFrequenciesHz;
 		std::vector<double> _scanTimes;
-		std::queue<std::pair<size_t,size_t> > _baselinesToProcess;
+		/** The baselines that remain to be processed in the current chunk, per NUMA node. */
+		std::vector<std::queue<std::pair<size_t,size_t> >> _baselinesToProcess;
 		std::unique_ptr<ProgressBar> _progressBar;
 		size_t _baselinesToProcessCount;
 		std::vector<size_t> _subbandOrder;
 		std::vector<int> _hduOffsetsPerGPUBox;
 		std::unique_ptr<class FlagReader> _flagReader;
+		/** Threads for the short parallel loops over files, kept between chunks and bands; see workerPool(). */
+		std::unique_ptr<WorkerPool> _workerPool;
 		
 		std::mutex _mutex;
 		std::unique_ptr<aoflagger::QualityStatistics> _statistics;
+		std::vector<std::unique_ptr<aoflagger::QualityStatistics>> _threadStatistics;
+		std::vector<std::unique_ptr<aoflagger::Strategy>> _strategies;
 		aoflagger::FlagMask _correlatorMask, _fullysetMask;
+		/** In streaming mode, the correlator mask with the margins of the chunk flagged, used for the statistics. */
+		aoflagger::FlagMask _statisticsMask;
 		
 		bool _disableGeometricCorrections, _removeFlaggedAntennae, _removeAutoCorrelations, _flagAutos;
 		bool _overridePhaseCentre, _doAlign, _doFlagMissingSubbands, _applySBGains, _flagDCChannels, _skipWriting, _doCorrectCableLength;
@@ -149,26 +254,88 @@ class Cotter : private UVWCalculater
 		std::string _dyscoNormalization;
 		double _dyscoDistTruncation;
 		
+		NumaTopology _numa;
+		
 		std::unique_ptr<bool[]> _outputFlags;
+		/** All-true flags of one row, written for fully flagged baselines. */
+		std::unique_ptr<bool[]> _fullyFlaggedRow;
 		aligned_ptr<std::complex<float>> _outputData;
 		aligned_ptr<float> _outputWeights;
+		typedef void (Cotter::*GatherFunction)(const aoflagger::ImageSet& imageSet, const bool* flags, size_t flagStride, size_t bufferIndex, double w, double* cosAngles, double* sinAngles);
+		GatherFunction _gatherBaseline;
 		
 		void processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFactor);
+		void processBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor);
+		MemoryPlanner makeMemoryPlanner(size_t channelCount, size_t timeAvgFactor, size_t freqAvgFactor) const;
 		void processOneContiguousBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor);
+		void processBandInChannelProcesses(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor);
+		/**
+		 * Fork a process that performs the task with its share of the cpus and memory, and exits.
+		 * The description is used in error messages. The label prefixes the output lines of the
+		 * process and names its profile report.
+		 */
+		pid_t startProcess(const std::string& description, const std::string& label, size_t processCount, const std::function<void()>& task);
+		std::string profileFilenameWithSuffix(const std::string& suffix) const;
+		WorkerPool& workerPool();
+		/** Wait until one of the processes has finished, remove it from the list and return it. Throws when it failed. */
+		pid_t waitForProcess(std::vector<pid_t>& processes, const std::string& description);
+		static std::string checkpointFilename(const std::string& outputFilename) { return outputFilename + ".checkpoint"; }
+		std::vector<size_t> checkpointSettings(size_t timeAvgFactor, size_t freqAvgFactor) const;
+		/**
+		 * Save the state of the band after a chunk: the given progress, the state of the reader and the
+		 * writer, and the start time when it was taken from the raw files.
+		 */
+		void saveCheckpoint(const std::string& outputFilename, const CheckpointState& state, size_t timeAvgFactor, size_t freqAvgFactor);
+		/**
+		 * Read the progress from the checkpoint of the band, if there is one. The rest of the state is
+		 * read by restoreCheckpoint() from the stream, once the reader and writer have been set up.
+		 */
+		bool readCheckpoint(const std::string& outputFilename, CheckpointState& state, std::ifstream& stream, size_t timeAvgFactor, size_t freqAvgFactor) const;
+		void restoreCheckpoint(std::istream& stream);
+		/** Create a measurement set without visibilities to store quality statistics in. */
+		void createStatisticsSet(const std::string& filename, const std::vector<double>& channelFrequenciesHz);
 		void createReader(const std::vector<std::string> &curFileset);
 		void initializeReader();
+		/** The NUMA node whose threads process the baseline and hold its image set. */
+		size_t nodeOfBaseline(size_t antenna1, size_t antenna2) const;
+		/** Free the image sets that are kept between bands and observations. */
+		void releaseImageSets();
+		/** Move the overlap of the previous chunk, which starts at column shift, to the start of the buffers and clear the rest. */
+		static void slideImageSet(aoflagger::ImageSet& imageSet, size_t shift, size_t overlap);
 		void processAndWriteTimestep(size_t timeIndex);
+		/**
+		 * Copy one scan of a baseline into the output row buffers, applying the geometric phase
+		 * correction. The angle arrays are scratch space of at least nChannelsInCurSBRange() elements.
+		 * When flags is null, the baseline is fully flagged and the output flags are left untouched.
+		 */
+		void gatherBaseline(const aoflagger::ImageSet& imageSet, const bool* flags, size_t flagStride, size_t bufferIndex, double w, double* cosAngles, double* sinAngles)
+		{
+			(this->*_gatherBaseline)(imageSet, flags, flagStride, bufferIndex, w, cosAngles, sinAngles);
+		}
+		/** Instantiated for the common numbers of channels per subband; ChannelsPerSubband = 0 is the version for any number. */
+		template<size_t ChannelsPerSubband>
+		void gatherBaselineFor(const aoflagger::ImageSet& imageSet, const bool* flags, size_t flagStride, size_t bufferIndex, double w, double* cosAngles, double* sinAngles);
+		/** Choose the kernel instantiations for the channel count of the observation. */
+		void selectKernels();
 		void processAndWriteTimestepFlagsOnly(size_t timeIndex);
-		void baselineProcessThreadFunc();
+		void baselineProcessThreadFunc(size_t threadIndex);
+		/** Merge the statistics of the threads of a chunk into _statistics. */
+		void reduceStatistics();
 		void processBaseline(size_t antenna1, size_t antenna2, aoflagger::Strategy& strategy, aoflagger::QualityStatistics& statistics);
-		void correctConjugated(aoflagger::ImageSet& imageSet, size_t imageIndex) const;
-		void correctCableLength(aoflagger::ImageSet& imageSet, size_t polarization, double cableDelay) const;
+		/**
+		 * Apply the cable length, passband and PFB gain corrections to the four polarizations of a baseline
+		 * in one pass. The polarizations for which conjugate[p] is set are conjugated before they are corrected.
+		 */
+		void correctCableLengthAndPassband(aoflagger::ImageSet& imageSet, const MWAInput& input1X, const MWAInput& input1Y, const MWAInput& input2X, const MWAInput& input2Y, const bool* conjugate) const;
 		void writeAntennae();
-		void writeSPW();
+		void makeBandInfo(const std::vector<double>& channelFrequenciesHz, std::string& name, std::vector<Writer::ChannelInfo>& channels, double& refFreq, double& totalBandwidth) const;
+		void writeSPW(const std::vector<double>& channelFrequenciesHz);
 		void writeSource();
 		void writeField();
 		void writeObservation();
 		void initPerInputSubbandGains();
+		void initCorrectionTables();
+		void initInputCorrections(const MWAInput& input);
 		void readSubbandPassbandFile();
 		void initializeSubbandPassband();
 		void flagBadCorrelatorSamples(aoflagger::FlagMask &flagMask) const;
@@ -212,6 +379,10 @@ class Cotter : private UVWCalculater
 		{
 			return _mwaConfig.Header().nChannels * (_curSbEnd - _curSbStart) / _subbandCount;
 		}
+		static int64_t maskBytes(const aoflagger::FlagMask& mask)
+		{
+			return int64_t(mask.HorizontalStride()) * mask.Height() * sizeof(bool);
+		}
 		static std::string twoDigits(int value)
 		{
 			std::string str("  ");
@@ -223,6 +394,9 @@ class Cotter : private UVWCalculater
 		// Implementing UVWCalculater
 		virtual void CalculateUVW(double date, size_t antenna1, size_t antenna2, double &u, double &v, double &w);
 
+		// The benchmark program calls the kernels directly on synthetic data
+		friend class CotterBench;
+		
 		Cotter(const Cotter&) = delete;
 		void operator=(const Cotter&) = delete;
 };
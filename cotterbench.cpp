@@ -0,0 +1,541 @@
+#include "applysolutionswriter.h"
+#include "averagingwriter.h"
+#include "cotter.h"
+#include "cpufeatures.h"
+#include "fitswriter.h"
+#include "flagwriter.h"
+#include "numberlist.h"
+#include "solutionfile.h"
+
+#include <aoflagger.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace aoflagger;
+
+/**
+ * Writer that drops everything, used at the end of the forwarding writers so that
+ * only the work of the writer itself is timed.
+ */
+class NullWriter : public Writer
+{
+	public:
+		void WriteBandInfo(const std::string&, const std::vector<ChannelInfo>&, double, double, bool) override { }
+		void WriteAntennae(const std::vector<AntennaInfo>&, double) override { }
+		void WritePolarizationForLinearPols(bool) override { }
+		void WriteSource(const SourceInfo&) override { }
+		void WriteField(const FieldInfo&) override { }
+		void WriteObservation(const ObservationInfo&) override { }
+		void WriteHistoryItem(const std::string&, const std::string&, const std::vector<std::string>&) override { }
+		void AddRows(size_t) override { }
+		void WriteRow(double, double, size_t, size_t, double, double, double, double, const std::complex<float>*, const bool*, const float*) override { }
+};
+
+/**
+ * Times the hot kernels of cotter on synthetic data of the size of one MWA coarse channel.
+ * Every kernel is run over all baselines of a chunk, and the fastest of a number of
+ * repetitions is reported. A visibility is one complex sample of one polarization, and
+ * the bandwidth is the number of bytes that the kernel reads and writes divided by its time.
+ */
+class CotterBench : private UVWCalculater
+{
+	public:
+		CotterBench(size_t antennaCount, size_t channelCount, size_t scanCount, size_t repeatCount, const std::string& tempDirectory) :
+			_antennaCount(antennaCount),
+			_channelCount(channelCount),
+			_scanCount(scanCount),
+			_repeatCount(repeatCount),
+			_tempDirectory(tempDirectory),
+			_random(1)
+		{ }
+
+		void Run();
+
+		static void PrintHeader();
+
+	private:
+		size_t baselineCount() const { return _antennaCount * (_antennaCount + 1) / 2; }
+		size_t visibilityCount() const { return baselineCount() * _channelCount * _scanCount * 4; }
+
+		void initialize();
+		void benchShuffle();
+		void benchCorrections();
+		void benchFlagging();
+		void benchGather();
+		void benchAveraging();
+		void benchApplySolutions();
+		void benchFitsWriter();
+		void benchFlagWriter();
+
+		std::vector<Writer::ChannelInfo> channelInfo() const;
+		std::vector<Writer::AntennaInfo> antennaInfo() const;
+		void writeRows(Writer& writer);
+
+		/** Runs the kernel the requested number of times and returns the fastest time in seconds. */
+		template<typename Kernel>
+		double time(Kernel kernel)
+		{
+			double best = 0.0;
+			for(size_t i=0; i!=_repeatCount; ++i)
+			{
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				kernel();
+				double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				if(i == 0 || duration < best)
+					best = duration;
+			}
+			return best;
+		}
+
+		void report(const std::string& kernel, double seconds, size_t visibilities, double bytesPerVisibility) const;
+
+		// Implementing UVWCalculater; the averaging writer asks for the uvw of the averaged rows
+		virtual void CalculateUVW(double, size_t antenna1, size_t antenna2, double &u, double &v, double &w) final override
+		{
+			u = double(antenna1) - double(antenna2);
+			v = u * 0.5;
+			w = u * 0.25;
+		}
+
+		size_t _antennaCount, _channelCount, _scanCount, _repeatCount;
+		std::string _tempDirectory;
+		std::mt19937 _random;
+		std::unique_ptr<Cotter> _cotter;
+		std::vector<FlagMask> _flagMasks;
+		std::vector<std::complex<float>> _rowData;
+		std::unique_ptr<bool[]> _rowFlags;
+		std::vector<float> _rowWeights;
+};
+
+void CotterBench::PrintHeader()
+{
+	std::cout << "Vector kernels use " << CPUFeatures::KernelInstructionSet() << ".\n";
+	std::cout
+		<< std::left << std::setw(28) << "kernel" << std::right
+		<< std::setw(7) << "tiles"
+		<< std::setw(7) << "chan"
+		<< std::setw(7) << "scans"
+		<< std::setw(11) << "ms"
+		<< std::setw(10) << "ns/vis"
+		<< std::setw(9) << "GB/s" << '\n';
+}
+
+void CotterBench::report(const std::string& kernel, double seconds, size_t visibilities, double bytesPerVisibility) const
+{
+	std::cout
+		<< std::left << std::setw(28) << kernel << std::right
+		<< std::setw(7) << _antennaCount
+		<< std::setw(7) << _channelCount
+		<< std::setw(7) << _scanCount
+		<< std::fixed
+		<< std::setw(11) << std::setprecision(2) << seconds * 1e3
+		<< std::setw(10) << std::setprecision(3) << seconds * 1e9 / visibilities
+		<< std::setw(9) << std::setprecision(2) << bytesPerVisibility * visibilities / (seconds * 1e9)
+		<< std::defaultfloat << '\n';
+}
+
+void CotterBench::Run()
+{
+	initialize();
+	benchShuffle();
+	benchCorrections();
+	benchFlagging();
+	benchGather();
+	benchAveraging();
+	benchApplySolutions();
+	benchFitsWriter();
+	benchFlagWriter();
+	_cotter.reset();
+}
+
+void CotterBench::initialize()
+{
+	// The benchmark processes one coarse channel, as one gpubox file would provide
+	_cotter.reset(new Cotter());
+	Cotter& cotter = *_cotter;
+	MWAHeader& header = cotter._mwaConfig.HeaderRW();
+	header.nChannels = _channelCount;
+	header.geomCorrection = true;
+	cotter._subbandCount = 1;
+	cotter._curSbStart = 0;
+	cotter._curSbEnd = 1;
+	cotter._curChunkStart = 0;
+	cotter._curChunkEnd = _scanCount;
+	cotter._missingEndScans = 0;
+	cotter._subbandEdgeFlagCount = std::max<size_t>(1, _channelCount / 16);
+	cotter.initializeSubbandPassband();
+	cotter.selectKernels();
+
+	cotter._channelFrequenciesHz.resize(_channelCount);
+	for(size_t ch=0; ch!=_channelCount; ++ch)
+		cotter._channelFrequenciesHz[ch] = 150e6 + 1.28e6 * ch / _channelCount;
+
+	std::normal_distribution<float> gaussian;
+	cotter._flagMasks.Reserve(_antennaCount, _scanCount, _channelCount);
+	cotter._flagMasks.StartChunk(_scanCount);
+	for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+		{
+			const std::pair<size_t, size_t> baseline(antenna1, antenna2);
+			ImageSet imageSet = cotter._flagger.MakeImageSet(_scanCount, _channelCount, 8, 0.0f, _scanCount);
+			for(size_t i=0; i!=8; ++i)
+			{
+				float* buffer = imageSet.ImageBuffer(i);
+				for(size_t j=0; j!=imageSet.HorizontalStride() * imageSet.Height(); ++j)
+					buffer[j] = gaussian(_random);
+			}
+			cotter._imageSetBuffers.emplace(baseline, std::move(imageSet));
+			_flagMasks.emplace_back(cotter._flagger.MakeFlagMask(_scanCount, _channelCount, false));
+			cotter._flagMasks.Store(antenna1, antenna2, _flagMasks.back());
+		}
+	}
+
+	cotter._outputData = make_aligned<std::complex<float>>(_channelCount*4, 16);
+	cotter._outputFlags.reset(new bool[_channelCount*4]);
+	cotter._outputWeights = make_aligned<float>(_channelCount*4, 16);
+
+	_rowData.resize(_channelCount*4);
+	_rowFlags.reset(new bool[_channelCount*4]);
+	_rowWeights.assign(_channelCount*4, 1.0f);
+	std::uniform_real_distribution<float> uniform;
+	for(size_t i=0; i!=_channelCount*4; ++i)
+	{
+		_rowData[i] = std::complex<float>(gaussian(_random), gaussian(_random));
+		// A few percent of flagged data, as is typical after flagging
+		_rowFlags[i] = uniform(_random) < 0.05;
+	}
+}
+
+void CotterBench::benchShuffle()
+{
+	Cotter& cotter = *_cotter;
+	GPUFileReader reader(_antennaCount, _channelCount, 1, false);
+	reader.Initialize(0.5, false);
+	for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+		{
+			ImageSet& imageSet = cotter._imageSetBuffers.find(std::make_pair(antenna1, antenna2))->second;
+			BaselineBuffer buffer;
+			for(size_t p=0; p!=4; ++p)
+			{
+				buffer.real[p] = imageSet.ImageBuffer(p*2);
+				buffer.imag[p] = imageSet.ImageBuffer(p*2+1);
+			}
+			buffer.nElementsPerRow = imageSet.HorizontalStride();
+			reader.SetDestBaselineBuffer(antenna1, antenna2, buffer);
+		}
+	}
+	// The correlator input mapping only covers the legacy correlator, so the benchmark
+	// writes the baselines in correlator order without remapping them.
+	reader._mappedBuffers = reader._buffers;
+
+	std::vector<std::complex<float>> gpuMatrix(_channelCount * baselineCount() * 4);
+	std::normal_distribution<float> gaussian;
+	for(std::complex<float>& value : gpuMatrix)
+		value = std::complex<float>(gaussian(_random), gaussian(_random));
+
+	double seconds = time([&]() {
+		for(size_t scan=0; scan!=_scanCount; ++scan)
+			reader.shuffleBuffer(0, _channelCount, scan, gpuMatrix.data(), 0);
+	});
+	// Reads a complex value and writes the real and imaginary images
+	report("GPUFileReader::shuffleBuffer", seconds, visibilityCount(), 2.0 * sizeof(std::complex<float>));
+}
+
+void CotterBench::benchCorrections()
+{
+	Cotter& cotter = *_cotter;
+	std::vector<MWAInput> inputs(_antennaCount*2);
+	std::uniform_real_distribution<double> cableLength(0.0, 500.0);
+	std::uniform_real_distribution<double> pfbGain(0.5, 1.5);
+	cotter.initCorrectionTables();
+	cotter._inputGainFactors.resize(inputs.size() * _channelCount);
+	cotter._inputPhasors.resize(inputs.size() * _channelCount);
+	for(size_t i=0; i!=inputs.size(); ++i)
+	{
+		inputs[i].inputIndex = i;
+		inputs[i].cableLenDelta = cableLength(_random);
+		inputs[i].pfbGains[0] = pfbGain(_random);
+		cotter.initInputCorrections(inputs[i]);
+	}
+
+	// Conjugation is folded into the correction factors, so conjugating some products costs nothing extra
+	const bool conjugate[4] = { false, true, true, false };
+	auto correctAll = [&]() {
+		for(std::pair<const std::pair<size_t, size_t>, ImageSet>& baseline : cotter._imageSetBuffers)
+		{
+			const size_t antenna1 = baseline.first.first, antenna2 = baseline.first.second;
+			cotter.correctCableLengthAndPassband(baseline.second, inputs[antenna1*2], inputs[antenna1*2+1], inputs[antenna2*2], inputs[antenna2*2+1], conjugate);
+		}
+	};
+	cotter._doCorrectCableLength = false;
+	double seconds = time(correctAll);
+	report("correctPassband", seconds, visibilityCount(), 4.0 * sizeof(float));
+
+	cotter._doCorrectCableLength = true;
+	seconds = time(correctAll);
+	report("correctCableLengthAndPassband", seconds, visibilityCount(), 4.0 * sizeof(float));
+}
+
+void CotterBench::benchFlagging()
+{
+	Cotter& cotter = *_cotter;
+	double seconds = time([&]() {
+		for(FlagMask& flagMask : _flagMasks)
+			cotter.flagBadCorrelatorSamples(flagMask);
+	});
+	// One flag is shared by the four polarizations
+	report("flagBadCorrelatorSamples", seconds, visibilityCount(), sizeof(bool) / 4.0);
+}
+
+void CotterBench::benchGather()
+{
+	Cotter& cotter = *_cotter;
+	std::vector<double> cosAngles(_channelCount), sinAngles(_channelCount);
+	double seconds = time([&]() {
+		for(size_t scan=0; scan!=_scanCount; ++scan)
+		{
+			for(const std::pair<const std::pair<size_t, size_t>, ImageSet>& baseline : cotter._imageSetBuffers)
+			{
+				const bool* flags = cotter._flagMasks.Mask(baseline.first.first, baseline.first.second);
+				const double w = double(baseline.first.second) - double(baseline.first.first);
+				cotter.gatherBaseline(baseline.second, flags, cotter._flagMasks.Stride(), scan, w, cosAngles.data(), sinAngles.data());
+			}
+		}
+	});
+	// Reads the real and imaginary images and the shared flag, writes the complex value and flag
+	report("gatherBaseline", seconds, visibilityCount(), 2.0 * sizeof(float) + sizeof(bool) / 4.0 + sizeof(std::complex<float>) + sizeof(bool));
+
+	// Fully flagged baselines skip the flags
+	seconds = time([&]() {
+		for(size_t scan=0; scan!=_scanCount; ++scan)
+		{
+			for(const std::pair<const std::pair<size_t, size_t>, ImageSet>& baseline : cotter._imageSetBuffers)
+			{
+				const double w = double(baseline.first.second) - double(baseline.first.first);
+				cotter.gatherBaseline(baseline.second, nullptr, 0, scan, w, cosAngles.data(), sinAngles.data());
+			}
+		}
+	});
+	report("gatherBaseline (flagged)", seconds, visibilityCount(), 2.0 * sizeof(float) + sizeof(std::complex<float>));
+}
+
+std::vector<Writer::ChannelInfo> CotterBench::channelInfo() const
+{
+	std::vector<Writer::ChannelInfo> channels(_channelCount);
+	for(size_t ch=0; ch!=_channelCount; ++ch)
+	{
+		channels[ch].chanFreq = _cotter->_channelFrequenciesHz[ch];
+		channels[ch].chanWidth = 1.28e6 / _channelCount;
+		channels[ch].effectiveBW = channels[ch].chanWidth;
+		channels[ch].resolution = channels[ch].chanWidth;
+	}
+	return channels;
+}
+
+std::vector<Writer::AntennaInfo> CotterBench::antennaInfo() const
+{
+	std::vector<Writer::AntennaInfo> antennae(_antennaCount);
+	for(size_t i=0; i!=_antennaCount; ++i)
+	{
+		Writer::AntennaInfo& antenna = antennae[i];
+		antenna.name = "Tile" + std::to_string(i);
+		antenna.station = "MWA";
+		antenna.type = "GROUND-BASED";
+		antenna.mount = "ALT-AZ";
+		antenna.x = double(i);
+		antenna.y = double(i % 16);
+		antenna.z = 0.0;
+		antenna.diameter = 4.0;
+		antenna.flag = false;
+	}
+	return antennae;
+}
+
+void CotterBench::writeRows(Writer& writer)
+{
+	for(size_t scan=0; scan!=_scanCount; ++scan)
+	{
+		const double rowTime = 4.8e9 + scan * 0.5;
+		writer.AddRows(baselineCount());
+		for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+		{
+			for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+				writer.WriteRow(rowTime, rowTime, antenna1, antenna2, 1.0, 2.0, 3.0, 0.5, _rowData.data(), _rowFlags.get(), _rowWeights.data());
+		}
+	}
+}
+
+void CotterBench::benchAveraging()
+{
+	// Averaging by 2 in time and to at most 8 output channels, which is the typical 40 kHz resolution
+	const size_t freqAvgFactor = std::max<size_t>(1, _channelCount / 8);
+	std::unique_ptr<AveragingWriter> writer;
+	double seconds = time([&]() {
+		writer.reset(new AveragingWriter(std::unique_ptr<Writer>(new NullWriter()), 2, freqAvgFactor, *this));
+		writer->WriteBandInfo("bench", channelInfo(), 150e6, 1.28e6, false);
+		writer->WriteAntennae(antennaInfo(), 0.0);
+		writeRows(*writer);
+	});
+	writer.reset();
+	// Reads the complex value, flag and weight and accumulates them in the row buffers
+	report("AveragingWriter::WriteRow", seconds, visibilityCount(), sizeof(std::complex<float>) + sizeof(bool) + sizeof(float));
+}
+
+void CotterBench::benchApplySolutions()
+{
+	const std::string solutionFilename = _tempDirectory + "/cotter_bench_solutions.bin";
+	{
+		SolutionFile solutionFile;
+		solutionFile.SetAntennaCount(_antennaCount);
+		solutionFile.SetChannelCount(_channelCount);
+		solutionFile.SetPolarizationCount(4);
+		solutionFile.SetIntervalCount(1);
+		solutionFile.OpenForWriting(solutionFilename.c_str());
+		std::normal_distribution<double> gaussian(0.0, 0.1);
+		for(size_t antenna=0; antenna!=_antennaCount; ++antenna)
+		{
+			for(size_t ch=0; ch!=_channelCount; ++ch)
+			{
+				for(size_t p=0; p!=4; ++p)
+				{
+					const double diagonal = (p==0 || p==3) ? 1.0 : 0.0;
+					solutionFile.WriteSolution(std::complex<double>(diagonal + gaussian(_random), gaussian(_random)), 0, antenna, ch, p);
+				}
+			}
+		}
+	}
+
+	std::unique_ptr<ApplySolutionsWriter> writer(new ApplySolutionsWriter(std::unique_ptr<Writer>(new NullWriter()), solutionFilename, 0, _channelCount));
+	writer->WriteBandInfo("bench", channelInfo(), 150e6, 1.28e6, false);
+	double seconds = time([&]() {
+		writeRows(*writer);
+	});
+	writer.reset();
+	std::remove(solutionFilename.c_str());
+	report("ApplySolutionsWriter::WriteRow", seconds, visibilityCount(), 2.0 * sizeof(std::complex<float>));
+}
+
+void CotterBench::benchFitsWriter()
+{
+	const std::string filename = _tempDirectory + "/cotter_bench.uvfits";
+	std::unique_ptr<FitsWriter> writer;
+	double seconds = time([&]() {
+		writer.reset(new FitsWriter(filename));
+		writer->WriteBandInfo("bench", channelInfo(), 150e6, 1.28e6, false);
+		writer->WriteAntennae(antennaInfo(), 4.8e9);
+		writer->WritePolarizationForLinearPols(false);
+		writeRows(*writer);
+	});
+	writer.reset();
+	std::remove(filename.c_str());
+	// Reads the complex value, flag and weight and writes the real, imaginary and weight
+	report("FitsWriter::WriteRow", seconds, visibilityCount(), sizeof(std::complex<float>) + sizeof(bool) + 2.0 * sizeof(float) + 3.0 * sizeof(float));
+}
+
+void CotterBench::benchFlagWriter()
+{
+	const std::string filenameTemplate = _tempDirectory + "/cotter_bench%%.mwaf";
+	const std::vector<size_t> subbandToGPUBox(1, 0);
+	std::unique_ptr<FlagWriter> writer;
+	double seconds = time([&]() {
+		writer.reset(new FlagWriter(filenameTemplate, 1100000000, _scanCount, 0, 1, subbandToGPUBox));
+		writer->WriteBandInfo("bench", channelInfo(), 150e6, 1.28e6, false);
+		writer->WriteAntennae(antennaInfo(), 4.8e9);
+		writer->WritePolarizationForLinearPols(false);
+		writeRows(*writer);
+	});
+	writer.reset();
+	std::remove((_tempDirectory + "/cotter_bench01.mwaf").c_str());
+	// Reads the flags and writes one bit per channel
+	report("FlagWriter::writeRow", seconds, visibilityCount(), sizeof(bool) + 1.0 / 32.0);
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<int> antennaCounts, channelCounts;
+	size_t scanCount = 8, repeatCount = 5;
+	std::string tempDirectory = "/tmp";
+
+	int argi = 1;
+	while(argi != argc)
+	{
+		const std::string param = argv[argi][0] == '-' ? &argv[argi][1] : "";
+		if(param == "antennas" && argi+1 != argc)
+		{
+			++argi;
+			NumberList::ParseIntList(argv[argi], antennaCounts);
+		}
+		else if(param == "channels" && argi+1 != argc)
+		{
+			++argi;
+			NumberList::ParseIntList(argv[argi], channelCounts);
+		}
+		else if(param == "scans" && argi+1 != argc)
+		{
+			++argi;
+			scanCount = atoi(argv[argi]);
+		}
+		else if(param == "repeat" && argi+1 != argc)
+		{
+			++argi;
+			repeatCount = atoi(argv[argi]);
+		}
+		else if(param == "tempdir" && argi+1 != argc)
+		{
+			++argi;
+			tempDirectory = argv[argi];
+		}
+		else {
+			std::cout <<
+				"cotter_bench times the hot kernels of cotter on synthetic data of one coarse channel.\n\n"
+				"Syntax: cotter_bench [options]\n\n"
+				"Options:\n"
+				"  -antennas <list>    Comma-separated tile counts to benchmark (default: 128,256).\n"
+				"  -channels <list>    Comma-separated channel counts per coarse channel (default: 32,128).\n"
+				"  -scans <count>      Number of scans per chunk (default: 8).\n"
+				"  -repeat <count>     Number of repetitions of each kernel; the fastest is reported (default: 5).\n"
+				"  -tempdir <dir>      Directory for the files written by the uvfits and flag writers (default: /tmp).\n";
+			return -1;
+		}
+		++argi;
+	}
+	if(antennaCounts.empty())
+		antennaCounts = { 128, 256 };
+	if(channelCounts.empty())
+		channelCounts = { 32, 128 };
+	if(scanCount == 0 || repeatCount == 0)
+	{
+		std::cerr << "Scan and repeat counts should be at least one.\n";
+		return -1;
+	}
+
+	try {
+		CotterBench::PrintHeader();
+		for(int antennaCount : antennaCounts)
+		{
+			for(int channelCount : channelCounts)
+			{
+				CotterBench bench(antennaCount, channelCount, scanCount, repeatCount, tempDirectory);
+				bench.Run();
+			}
+		}
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return -1;
+	}
+	return 0;
+}
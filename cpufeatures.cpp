@@ -0,0 +1,19 @@
+#include "cpufeatures.h"
+
+std::string CPUFeatures::KernelInstructionSet()
+{
+#ifdef HAVE_MULTIVERSIONED_KERNELS
+	// Same order of preference as the resolver of the target_clones attribute
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+		return "AVX-512";
+	else if(__builtin_cpu_supports("avx2"))
+		return "AVX2";
+	else if(__builtin_cpu_supports("sse4.2"))
+		return "SSE4.2";
+	else
+		return "x86-64 baseline";
+#else
+	return "compile-time target only";
+#endif
+}
@@ -0,0 +1,34 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#include <string>
+
+/**
+ * The hot loops are compiled for several instruction sets, and the variant for the CPU
+ * that runs the program is selected when it is loaded (function multiversioning with an
+ * ifunc resolver). This keeps wide vectors available in portable builds, which only
+ * target the x86-64 baseline.
+ *
+ * A kernel is multiversioned by prefixing its definition with MULTIVERSIONED_KERNEL.
+ * Its loops should be written such that the compiler can vectorize them.
+ */
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define HAVE_MULTIVERSIONED_KERNELS
+#endif
+#endif
+
+#ifdef HAVE_MULTIVERSIONED_KERNELS
+#define MULTIVERSIONED_KERNEL __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define MULTIVERSIONED_KERNEL
+#endif
+
+class CPUFeatures
+{
+	public:
+		/** Name of the instruction set of the kernel variants that run on this CPU. */
+		static std::string KernelInstructionSet();
+};
+
+#endif
@@ -0,0 +1,38 @@
+#include "fileprefetcher.h"
+
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+void FilePrefetcher::Start(const std::vector<std::string>& filenames)
+{
+	Stop();
+	_stop = false;
+	_thread = std::thread(&FilePrefetcher::prefetchFiles, this, filenames);
+}
+
+void FilePrefetcher::Stop()
+{
+	_stop = true;
+	if(_thread.joinable())
+		_thread.join();
+}
+
+void FilePrefetcher::prefetchFiles(const std::vector<std::string>& filenames)
+{
+	for(const std::string& filename : filenames)
+	{
+		if(_stop)
+			return;
+		int fd = open(filename.c_str(), O_RDONLY);
+		if(fd == -1)
+		{
+			std::cout << "Warning: could not open " << filename << " for prefetching.\n";
+			continue;
+		}
+		// The kernel reads the whole file ahead; this returns when the reads have been issued
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
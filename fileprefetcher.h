@@ -0,0 +1,36 @@
+#ifndef FILE_PREFETCHER_H
+#define FILE_PREFETCHER_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Reads files into the page cache in a background thread, so that they are read from memory
+ * when they are opened later. In batch mode, this is used for the gpubox files of the next
+ * observation while the current one is being processed.
+ */
+class FilePrefetcher
+{
+	public:
+		FilePrefetcher() : _stop(false) { }
+		~FilePrefetcher() { Stop(); }
+		
+		FilePrefetcher(const FilePrefetcher&) = delete;
+		FilePrefetcher& operator=(const FilePrefetcher&) = delete;
+		
+		/** Start prefetching the files, after stopping a prefetch that is still running. */
+		void Start(const std::vector<std::string>& filenames);
+		
+		/** Stop prefetching after the current file. */
+		void Stop();
+		
+	private:
+		void prefetchFiles(const std::vector<std::string>& filenames);
+		
+		std::atomic<bool> _stop;
+		std::thread _thread;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "flagmaskpool.h"
+#include "memorytracker.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+void FlagMaskPool::Reserve(size_t antennaCount, size_t maxWidth, size_t height, const NumaTopology& numa)
+{
+	const size_t baselineCount = antennaCount * (antennaCount + 1) / 2;
+	// Rows are padded to a multiple of 8 flags, like the aoflagger masks
+	const size_t stride = (maxWidth + 7) / 8 * 8;
+	if(_storage != nullptr && antennaCount == _antennaCount && height == _height && maxWidth <= _capacity)
+		return;
+
+	Clear();
+	_antennaCount = antennaCount;
+	_capacity = stride;
+	_height = height;
+	_stride = stride;
+	_storage.reset(new bool[baselineCount * stride * height]);
+	_fullySetMask.reset(new bool[stride * height]);
+	std::fill_n(_fullySetMask.get(), stride * height, true);
+	_isFullyFlagged.assign(baselineCount, true);
+	_allocatedBytes = int64_t(baselineCount + 1) * stride * height * sizeof(bool);
+	MemoryTracker::Allocate(MemoryTracker::FlagMasks, _allocatedBytes);
+
+	// The storage is not touched yet; a thread on each node touches the masks of the baselines
+	// of its node first, so that they are allocated there, like the image sets
+	if(numa.NodeCount() > 1)
+	{
+		std::vector<std::thread> threads;
+		for(size_t node=0; node!=numa.NodeCount(); ++node)
+		{
+			threads.emplace_back([&, node]() {
+				numa.PinToNode(node);
+				for(size_t index=0; index!=baselineCount; ++index)
+				{
+					if(numa.NodeOf(index, baselineCount) == node)
+						std::fill_n(&_storage[index * stride * height], stride * height, false);
+				}
+			});
+		}
+		for(std::thread& thread : threads)
+			thread.join();
+	}
+}
+
+void FlagMaskPool::Clear()
+{
+	_storage.reset();
+	_fullySetMask.reset();
+	_isFullyFlagged.clear();
+	MemoryTracker::Release(MemoryTracker::FlagMasks, _allocatedBytes);
+	_allocatedBytes = 0;
+	_antennaCount = 0;
+	_width = 0;
+	_capacity = 0;
+}
+
+void FlagMaskPool::StartChunk(size_t width)
+{
+	_width = width;
+	std::fill(_isFullyFlagged.begin(), _isFullyFlagged.end(), true);
+}
+
+void FlagMaskPool::Store(size_t antenna1, size_t antenna2, const aoflagger::FlagMask& mask)
+{
+	bool* destination = Buffer(antenna1, antenna2);
+	const bool* source = mask.Buffer();
+	const size_t width = std::min(mask.Width(), _width);
+	for(size_t y=0; y!=_height; ++y)
+	{
+		std::memcpy(destination, source, width * sizeof(bool));
+		destination += _stride;
+		source += mask.HorizontalStride();
+	}
+}
+
+void FlagMaskPool::Load(size_t antenna1, size_t antenna2, aoflagger::FlagMask& mask) const
+{
+	const bool* source = Mask(antenna1, antenna2);
+	bool* destination = mask.Buffer();
+	const size_t width = std::min(mask.Width(), _width);
+	for(size_t y=0; y!=_height; ++y)
+	{
+		std::memcpy(destination, source, width * sizeof(bool));
+		source += _stride;
+		destination += mask.HorizontalStride();
+	}
+}
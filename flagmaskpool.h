@@ -0,0 +1,96 @@
+#ifndef FLAG_MASK_POOL_H
+#define FLAG_MASK_POOL_H
+
+#include "numatopology.h"
+
+#include <aoflagger.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * Stores the flag masks of all baselines of a band in one allocation, which is made once
+ * per band and reused for every chunk. Allocating a new mask per baseline and chunk
+ * fragments the heap in the same way as reallocating the image sets did.
+ *
+ * The masks have the layout of an aoflagger::FlagMask: one row per channel, with
+ * Stride() flags between the rows. Baselines that are fully flagged refer to a single
+ * shared mask in which all flags are set, and have no storage of their own in use.
+ */
+class FlagMaskPool
+{
+	public:
+		FlagMaskPool() : _antennaCount(0), _width(0), _capacity(0), _height(0), _stride(0), _allocatedBytes(0) { }
+		~FlagMaskPool() { Clear(); }
+
+		FlagMaskPool(const FlagMaskPool&) = delete;
+		FlagMaskPool& operator=(const FlagMaskPool&) = delete;
+
+		/**
+		 * Allocate the masks of all baselines between the given number of antennas, for chunks
+		 * of at most maxWidth timesteps. Nothing is reallocated when the current storage is
+		 * large enough. With several NUMA nodes, the masks of the baselines of a node are
+		 * placed in its memory.
+		 */
+		void Reserve(size_t antennaCount, size_t maxWidth, size_t height, const NumaTopology& numa = NumaTopology());
+
+		/** Release the storage, e.g. at the end of a band. */
+		void Clear();
+
+		/** Start a chunk of the given number of timesteps. All baselines are set to be fully flagged. */
+		void StartChunk(size_t width);
+
+		size_t Width() const { return _width; }
+		size_t Height() const { return _height; }
+		size_t Stride() const { return _stride; }
+
+		/** Storage of the baseline, for filling it directly. This makes the baseline not fully flagged. */
+		bool* Buffer(size_t antenna1, size_t antenna2)
+		{
+			const size_t index = baselineIndex(antenna1, antenna2);
+			_isFullyFlagged[index] = false;
+			return &_storage[index * _stride * _height];
+		}
+
+		/** The flags of the baseline; this is the shared mask when the baseline is fully flagged. */
+		const bool* Mask(size_t antenna1, size_t antenna2) const
+		{
+			const size_t index = baselineIndex(antenna1, antenna2);
+			if(_isFullyFlagged[index])
+				return _fullySetMask.get();
+			else
+				return &_storage[index * _stride * _height];
+		}
+
+		bool IsFullyFlagged(size_t antenna1, size_t antenna2) const
+		{
+			return _isFullyFlagged[baselineIndex(antenna1, antenna2)];
+		}
+
+		void SetFullyFlagged(size_t antenna1, size_t antenna2)
+		{
+			_isFullyFlagged[baselineIndex(antenna1, antenna2)] = true;
+		}
+
+		/** Copy the mask into the storage of the baseline. Different baselines can be stored from different threads. */
+		void Store(size_t antenna1, size_t antenna2, const aoflagger::FlagMask& mask);
+
+		/** Copy the flags of the baseline into the mask, which should have the size of the chunk. */
+		void Load(size_t antenna1, size_t antenna2, aoflagger::FlagMask& mask) const;
+
+	private:
+		size_t baselineIndex(size_t antenna1, size_t antenna2) const
+		{
+			return antenna1 * _antennaCount - antenna1 * (antenna1 + 1) / 2 + antenna2;
+		}
+
+		size_t _antennaCount, _width, _capacity, _height, _stride;
+		int64_t _allocatedBytes;
+		std::unique_ptr<bool[]> _storage, _fullySetMask;
+		// Not a vector<bool>, because baselines are set from different threads
+		std::vector<unsigned char> _isFullyFlagged;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include "flagmaskpool.h"
+#include "numatopology.h"
+
+#include <aoflagger.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+/**
+ * Fills a FlagMaskPool over several chunks of different widths in the ways that Cotter does:
+ * by storing a mask of the flagger, by writing into the buffer of a baseline and by marking a
+ * baseline as fully flagged. Every chunk is compared with a separate FlagMask per baseline,
+ * as Cotter kept them before the pool. The storage should not be reallocated between chunks.
+ */
+class FlagMaskPoolTest
+{
+	public:
+		FlagMaskPoolTest() : _antennaCount(6), _maxWidth(13), _height(10), _random(1)
+		{ }
+
+		/** Returns the number of baselines whose flags differ from those of the separate masks. */
+		size_t Run(const NumaTopology& numa)
+		{
+			FlagMaskPool pool;
+			pool.Reserve(_antennaCount, _maxWidth, _height, numa);
+			const bool* storage = nullptr;
+			size_t differences = 0;
+			for(size_t width : { size_t(13), size_t(7), size_t(13), size_t(1) })
+			{
+				pool.Reserve(_antennaCount, _maxWidth, _height, numa);
+				pool.StartChunk(width);
+				std::map<std::pair<size_t,size_t>, aoflagger::FlagMask> expected;
+				for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+				{
+					for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+					{
+						aoflagger::FlagMask mask = _flagger.MakeFlagMask(width, _height, true);
+						switch(_random() % 3)
+						{
+							case 0:
+								// Fully flagged: stored by StartChunk() or SetFullyFlagged()
+								if(_random() % 2 == 0)
+									pool.SetFullyFlagged(antenna1, antenna2);
+								break;
+							case 1:
+								randomize(mask);
+								pool.Store(antenna1, antenna2, mask);
+								break;
+							case 2: {
+								randomize(mask);
+								bool* buffer = pool.Buffer(antenna1, antenna2);
+								for(size_t y=0; y!=_height; ++y)
+								{
+									for(size_t x=0; x!=width; ++x)
+										buffer[y * pool.Stride() + x] = mask.Buffer()[y * mask.HorizontalStride() + x];
+								}
+							} break;
+						}
+						expected.emplace(std::make_pair(antenna1, antenna2), std::move(mask));
+					}
+				}
+				// The storage of the first baseline that is not fully flagged should stay in place
+				for(const auto& baseline : expected)
+				{
+					if(!pool.IsFullyFlagged(baseline.first.first, baseline.first.second))
+					{
+						const bool* baselineStorage = pool.Mask(baseline.first.first, baseline.first.second) - pool.Stride() * _height * baselineIndex(baseline.first.first, baseline.first.second);
+						if(storage != nullptr && baselineStorage != storage)
+							throw std::runtime_error("The flag masks were reallocated between chunks");
+						storage = baselineStorage;
+						break;
+					}
+				}
+				for(const auto& baseline : expected)
+				{
+					if(!matches(pool, baseline.first.first, baseline.first.second, baseline.second))
+						++differences;
+				}
+			}
+			return differences;
+		}
+
+	private:
+		size_t baselineIndex(size_t antenna1, size_t antenna2) const
+		{
+			return antenna1 * _antennaCount - antenna1 * (antenna1 + 1) / 2 + antenna2;
+		}
+
+		void randomize(aoflagger::FlagMask& mask)
+		{
+			for(size_t y=0; y!=mask.Height(); ++y)
+			{
+				for(size_t x=0; x!=mask.Width(); ++x)
+					mask.Buffer()[y * mask.HorizontalStride() + x] = (_random() % 2 == 0);
+			}
+		}
+
+		/** Compare the flags of the baseline, both as given by Mask() and as loaded into a FlagMask. */
+		bool matches(const FlagMaskPool& pool, size_t antenna1, size_t antenna2, const aoflagger::FlagMask& expected)
+		{
+			aoflagger::FlagMask loaded = _flagger.MakeFlagMask(expected.Width(), expected.Height(), false);
+			pool.Load(antenna1, antenna2, loaded);
+			const bool* mask = pool.Mask(antenna1, antenna2);
+			for(size_t y=0; y!=expected.Height(); ++y)
+			{
+				for(size_t x=0; x!=expected.Width(); ++x)
+				{
+					const bool flag = expected.Buffer()[y * expected.HorizontalStride() + x];
+					if(mask[y * pool.Stride() + x] != flag || loaded.Buffer()[y * loaded.HorizontalStride() + x] != flag)
+						return false;
+				}
+			}
+			return true;
+		}
+
+		size_t _antennaCount, _maxWidth, _height;
+		aoflagger::AOFlagger _flagger;
+		std::mt19937 _random;
+};
+
+int main()
+{
+	try {
+		FlagMaskPoolTest test;
+		// Pinning to cpu 0 works on any machine; the test is about the division of the baselines
+		const NumaTopology twoNodes(std::vector<std::vector<int>>{ { 0 }, { 0 } });
+		const size_t
+			oneNodeDifferences = test.Run(NumaTopology()),
+			twoNodeDifferences = test.Run(twoNodes);
+		std::cout << "One node: " << oneNodeDifferences << " differing baselines.\n"
+			"Two nodes: " << twoNodeDifferences << " differing baselines.\n";
+		return (oneNodeDifferences != 0 || twoNodeDifferences != 0) ? 1 : 0;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
@@ -2,9 +2,11 @@
 #define FLAG_READER_H
 
 #include "fitsuser.h"
+#include "workerpool.h"
 
 #include <fitsio.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <stdexcept>
@@ -13,14 +15,17 @@
 class FlagReader : private FitsUser
 {
 public:
-	FlagReader(const std::string& templateName, const std::vector<int>& hduOffsetsPerGPUBox, const std::vector<size_t>& subbandToGPUBoxFileIndex, size_t sbStart, size_t sbEnd)
+	/** When workers is given, ReadTimesteps() reads the files in parallel with its threads. */
+	FlagReader(const std::string& templateName, const std::vector<int>& hduOffsetsPerGPUBox, const std::vector<size_t>& subbandToGPUBoxFileIndex, size_t sbStart, size_t sbEnd, WorkerPool* workers = nullptr)
 		:
 		_hduOffsets(hduOffsetsPerGPUBox),
 		_files(sbEnd - sbStart),
 		_colNums(sbEnd - sbStart),
+		_blockBuffers(sbEnd - sbStart),
 		_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex),
 		_sbStart(sbStart),
-		_sbEnd(sbEnd)
+		_sbEnd(sbEnd),
+		_workers(workers)
 	{
 		size_t numberPos = templateName.find("%%");
 		if(numberPos == std::string::npos)
@@ -48,6 +53,7 @@ public:
 				_antennaCount = nAnt;
 				_baselineCount = (nAnt * (nAnt+1)) / 2;
 				_scanCount = nScans;
+				_rowStride = (_channelsPerGPUBox + 7) / 8;
 				_buffer.resize(_channelsPerGPUBox);
 			}
 			else {
@@ -95,17 +101,99 @@ public:
 		}
 	}
 	
+	/**
+	 * Read the flags of all baselines for a range of timesteps. Each file is read with a single
+	 * call, and files are read in parallel when cfitsio is reentrant.
+	 * @param baselineBuffers For each baseline, a pointer to the flag of the first channel of
+	 * the first timestep. Successive timesteps are assumed to be consecutive in memory.
+	 * @param bufferStride Distance between two channels in the baseline buffers.
+	 */
+	void ReadTimesteps(size_t timestepStart, size_t timestepCount, bool* const* baselineBuffers, size_t bufferStride)
+	{
+		const size_t fileCount = _sbEnd - _sbStart;
+		if(_workers != nullptr && fileCount > 1 && fits_is_reentrant())
+		{
+			_workers->Run(fileCount, [&](size_t fileIndex) {
+				readFileBlock(fileIndex, timestepStart, timestepCount, baselineBuffers, bufferStride);
+			});
+		}
+		else {
+			for(size_t fileIndex=0; fileIndex!=fileCount; ++fileIndex)
+				readFileBlock(fileIndex, timestepStart, timestepCount, baselineBuffers, bufferStride);
+		}
+	}
+	
+	size_t BaselineCount() const { return _baselineCount; }
 	size_t ChannelsPerGPUBox() const { return _channelsPerGPUBox; }
 	size_t AntennaCount() const { return _antennaCount; }
 	size_t ScanCount() const { return _scanCount; }
 private:
+	void readFileBlock(size_t fileIndex, size_t timestepStart, size_t timestepCount, bool* const* baselineBuffers, size_t bufferStride)
+	{
+		const size_t subband = fileIndex + _sbStart;
+		const int offset = _hduOffsets[_subbandToGPUBoxFileIndex[subband]];
+		// Timesteps before the start of this file are not stored
+		size_t skippedTimesteps = 0;
+		if(int(timestepStart) < offset)
+			skippedTimesteps = std::min<size_t>(offset - timestepStart, timestepCount);
+		const size_t readTimesteps = timestepCount - skippedTimesteps;
+		if(readTimesteps == 0)
+			return;
+		
+		// Reading the bit column as TBYTE gives the flags packed by 8 per byte, and
+		// reads over row boundaries when more than one row of elements is requested.
+		std::vector<unsigned char>& block = _blockBuffers[fileIndex];
+		block.resize(readTimesteps * _baselineCount * _rowStride);
+		const size_t firstRow = (timestepStart + skippedTimesteps - offset) * _baselineCount + 1;
+		int status = 0;
+		fits_read_col(_files[fileIndex], TBYTE, /*colnum*/ _colNums[fileIndex], /*firstrow*/ firstRow, /*firstelem*/ 1,
+			/*nelements*/ block.size(), /*(*)nulval*/ 0, block.data(), 0 /*(*)anynul*/, &status);
+		checkStatus(status);
+		
+		const unsigned char* rowPtr = block.data();
+		for(size_t t=skippedTimesteps; t!=timestepCount; ++t)
+		{
+			for(size_t baseline=0; baseline!=_baselineCount; ++baseline)
+			{
+				bool* dest = baselineBuffers[baseline] + t + fileIndex*_channelsPerGPUBox*bufferStride;
+				unpackRow(rowPtr, _channelsPerGPUBox, dest, bufferStride);
+				rowPtr += _rowStride;
+			}
+		}
+	}
+	
+	static void unpackRow(const unsigned char* packed, size_t channelCount, bool* dest, size_t stride)
+	{
+		const size_t fullBytes = channelCount / 8;
+		for(size_t byteIndex=0; byteIndex!=fullBytes; ++byteIndex)
+		{
+			const unsigned char byte = packed[byteIndex];
+			dest[0] = byte & 0x80;
+			dest[stride] = byte & 0x40;
+			dest[stride*2] = byte & 0x20;
+			dest[stride*3] = byte & 0x10;
+			dest[stride*4] = byte & 0x08;
+			dest[stride*5] = byte & 0x04;
+			dest[stride*6] = byte & 0x02;
+			dest[stride*7] = byte & 0x01;
+			dest += stride*8;
+		}
+		for(size_t bit=0; bit!=channelCount%8; ++bit)
+		{
+			*dest = (packed[fullBytes] >> (7-bit)) & 1;
+			dest += stride;
+		}
+	}
+	
 	std::vector<int> _hduOffsets;
 	std::vector<fitsfile*> _files;
 	std::vector<int> _colNums;
 	std::vector<char> _buffer;
+	std::vector<std::vector<unsigned char>> _blockBuffers;
 	const std::vector<size_t> _subbandToGPUBoxFileIndex;
-	size_t _channelsPerGPUBox, _antennaCount, _baselineCount, _scanCount;
+	size_t _channelsPerGPUBox, _rowStride, _antennaCount, _baselineCount, _scanCount;
 	size_t _sbStart, _sbEnd;
+	WorkerPool* _workers;
 };
 
 #endif
@@ -1,28 +1,35 @@
 #include "flagwriter.h"
 
+#include <algorithm>
 #include <stdexcept>
 #include <cstdio>
+#include <cstring>
 
 #include "version.h"
+#include "workerpool.h"
 
 const uint16_t
 	FlagWriter::VERSION_MINOR = 0,
 	FlagWriter::VERSION_MAJOR = 1;
 
-FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t sbStart, size_t sbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex) :
+FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t sbStart, size_t sbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex, WorkerPool* workers) :
 	_timestepCount(timestepCount),
 	_antennaCount(0),
 	_channelCount(0),
 	_channelsPerGPUBox(0),
 	_polarizationCount(0),
-//	_rowStride(0),
+	_rowStride(0),
 	_rowsAdded(0),
 	_rowsWritten(0),
 	_sbStart(sbStart),
 	_sbEnd(sbEnd),
+	_bufferedRows(0),
+	_bufferRowCapacity(0),
+	_workers(workers),
 	_gpsTime(gpsTime),
 	_files(sbEnd - sbStart),
-	_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex)
+	_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex),
+	_packBuffers(sbEnd - sbStart)
 {
 	if(_sbEnd - _sbStart == 0)
 		throw std::runtime_error("Flagwriter was initialized with zero gpuboxes");
@@ -52,6 +59,11 @@ FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestep
 
 FlagWriter::~FlagWriter()
 {
+	try {
+		flush();
+	} catch(std::exception& e) {
+		std::cerr << "Error while writing last rows to flag files: " << e.what() << '\n';
+	}
 	for(std::vector<fitsfile*>::iterator i=_files.begin(); i!=_files.end(); ++i)
 	{
 		int status = 0;
@@ -106,10 +118,21 @@ void FlagWriter::setStride()
 	_channelsPerGPUBox = _channelCount / (_sbEnd-_sbStart);
 	
 	// we assume we write only one polarization here
-//	_rowStride = (_channelsPerGPUBox + 7) / 8;
+	_rowStride = (_channelsPerGPUBox + 7) / 8;
 	
-	_singlePolBuffer.resize(_channelsPerGPUBox);
-//	_packBuffer.resize(_rowStride);
+	const size_t capacity = _bufferRowCapacity;
+	_bufferRowCapacity = 0;
+	reserveRows(capacity);
+}
+
+void FlagWriter::reserveRows(size_t rowCount)
+{
+	if(rowCount > _bufferRowCapacity)
+	{
+		for(std::vector<unsigned char>& buffer : _packBuffers)
+			buffer.resize(rowCount * _rowStride);
+		_bufferRowCapacity = rowCount;
+	}
 }
 
 void FlagWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
@@ -119,34 +142,108 @@ void FlagWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
 	_hduOffsets = offsets;
 }
 
-void FlagWriter::writeRow(size_t antenna1, size_t antenna2, const bool* flags)
+void FlagWriter::packFlags(const bool* flags, size_t channelCount, size_t polarizationCount, unsigned char* dest)
 {
-	++_rowsWritten;
-	const size_t baselineCount = _antennaCount * (_antennaCount+1) / 2;
-	for(size_t subband=_sbStart; subband != _sbEnd; ++subband)
+	const size_t fullBytes = channelCount / 8;
+	if(polarizationCount == 4)
 	{
-		std::vector<unsigned char>::iterator singlePolIter = _singlePolBuffer.begin();
-		for(size_t i=0; i!=_channelsPerGPUBox; ++i)
+		// A bool is one byte, so the four polarizations of a channel can be tested
+		// at once by loading them as a 32-bit word.
+		for(size_t byteIndex=0; byteIndex!=fullBytes; ++byteIndex)
+		{
+			uint32_t words[8];
+			std::memcpy(words, flags, sizeof words);
+			unsigned char packed = 0;
+			for(size_t bit=0; bit!=8; ++bit)
+				packed |= (words[bit] != 0) << (7-bit);
+			dest[byteIndex] = packed;
+			flags += 32;
+		}
+	}
+	else {
+		for(size_t byteIndex=0; byteIndex!=fullBytes; ++byteIndex)
 		{
-			*singlePolIter = *flags ? 1 : 0;
-			++flags;
-			
-			for(size_t p=1; p!=_polarizationCount; ++p)
+			unsigned char packed = 0;
+			for(size_t bit=0; bit!=8; ++bit)
 			{
-				*singlePolIter |= *flags ? 1 : 0;
-				++flags;
+				bool isFlagged = false;
+				for(size_t p=0; p!=polarizationCount; ++p)
+					isFlagged = isFlagged || flags[p];
+				packed |= isFlagged << (7-bit);
+				flags += polarizationCount;
 			}
-			++singlePolIter;
+			dest[byteIndex] = packed;
 		}
-		
-		int status = 0;
-		int offset = _hduOffsets[_subbandToGPUBoxFileIndex[subband]];
-		if(_rowsWritten > offset * baselineCount + 1)
+	}
+	const size_t remainingChannels = channelCount % 8;
+	if(remainingChannels != 0)
+	{
+		unsigned char packed = 0;
+		for(size_t bit=0; bit!=remainingChannels; ++bit)
 		{
-			size_t unalignedRow = _rowsWritten - offset * baselineCount;
-			fits_write_col(_files[subband-_sbStart], TBIT, 1 /*colnum*/, unalignedRow /*firstrow*/,
-				1 /*firstelem*/, _channelsPerGPUBox /*nelements*/, &_singlePolBuffer[0], &status);
-			checkStatus(status);
+			bool isFlagged = false;
+			for(size_t p=0; p!=polarizationCount; ++p)
+				isFlagged = isFlagged || flags[p];
+			packed |= isFlagged << (7-bit);
+			flags += polarizationCount;
 		}
+		dest[fullBytes] = packed;
+	}
+}
+
+void FlagWriter::writeRow(size_t antenna1, size_t antenna2, const bool* flags)
+{
+	// Rows are packed into the buffers, and are written to the files once all rows
+	// that were added have been received (normally one timestep).
+	reserveRows(_bufferedRows + 1);
+	for(size_t fileIndex=0; fileIndex != _sbEnd - _sbStart; ++fileIndex)
+	{
+		unsigned char* dest = &_packBuffers[fileIndex][_bufferedRows * _rowStride];
+		packFlags(flags, _channelsPerGPUBox, _polarizationCount, dest);
+		flags += _channelsPerGPUBox * _polarizationCount;
+	}
+	++_bufferedRows;
+	++_rowsWritten;
+	if(_rowsWritten == _rowsAdded)
+		flush();
+}
+
+void FlagWriter::flush()
+{
+	if(_bufferedRows == 0)
+		return;
+	
+	const size_t fileCount = _sbEnd - _sbStart;
+	// Cfitsio can only be used from multiple threads (even on separate files)
+	// when it was compiled to be reentrant.
+	if(_workers != nullptr && fileCount > 1 && fits_is_reentrant())
+	{
+		_workers->Run(fileCount, [&](size_t fileIndex) { flushFile(fileIndex); });
+	}
+	else {
+		for(size_t fileIndex=0; fileIndex!=fileCount; ++fileIndex)
+			flushFile(fileIndex);
+	}
+	_bufferedRows = 0;
+}
+
+void FlagWriter::flushFile(size_t fileIndex)
+{
+	const long long
+		baselineCount = _antennaCount * (_antennaCount+1) / 2,
+		offsetRows = _hduOffsets[_subbandToGPUBoxFileIndex[fileIndex + _sbStart]] * baselineCount,
+		firstRow = _rowsWritten - _bufferedRows + 1;
+	// Rows before the aligned start of this file are not written
+	const long long firstWrittenRow = std::max(firstRow, offsetRows + 2);
+	const long long lastRow = _rowsWritten;
+	if(firstWrittenRow <= lastRow)
+	{
+		// Writing the bit column with TBYTE writes 8 packed flags per byte. Cfitsio
+		// continues on the next rows when more than one row of elements is given.
+		int status = 0;
+		unsigned char* data = &_packBuffers[fileIndex][(firstWrittenRow - firstRow) * _rowStride];
+		fits_write_col(_files[fileIndex], TBYTE, 1 /*colnum*/, firstWrittenRow - offsetRows /*firstrow*/,
+			1 /*firstelem*/, (lastRow - firstWrittenRow + 1) * _rowStride /*nelements*/, data, &status);
+		checkStatus(status);
 	}
 }
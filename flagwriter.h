@@ -4,6 +4,8 @@
 #include "writer.h"
 #include "fitsuser.h"
 
+class WorkerPool;
+
 #include <stdint.h>
 
 #include <iostream>
@@ -12,7 +14,8 @@
 class FlagWriter : public Writer, private FitsUser
 {
 	public:
-		FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t sbStart, size_t sbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex);
+		/** When workers is given, the files are written in parallel by its threads. */
+		FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t sbStart, size_t sbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex, WorkerPool* workers = nullptr);
 		
 		~FlagWriter();
 		
@@ -51,6 +54,7 @@ class FlagWriter : public Writer, private FitsUser
 			if(_rowsAdded == 0)
 				writeHeader();
 			_rowsAdded += rowCount;
+			reserveRows(_rowsAdded - _rowsWritten + _bufferedRows);
 		}
 		
 		void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
@@ -72,6 +76,16 @@ class FlagWriter : public Writer, private FitsUser
 		void writeHeader();
 		void writeRow(size_t antenna1, size_t antenna2, const bool* flags);
 		void setStride();
+		void reserveRows(size_t rowCount);
+		void flush();
+		void flushFile(size_t fileIndex);
+		
+		/**
+		 * OR the polarizations of each channel together and pack the result in bits,
+		 * most significant bit first, as the FITS 'X' column format requires.
+		 */
+		static void packFlags(const bool* flags, size_t channelCount, size_t polarizationCount, unsigned char* dest);
+		
 		struct Header
 		{
 			char fileIdentifier[4];
@@ -89,17 +103,19 @@ class FlagWriter : public Writer, private FitsUser
 		}
 		
 		size_t _timestepCount, _antennaCount, _channelCount, _channelsPerGPUBox, _polarizationCount;
-		//size_t _rowStride;
+		size_t _rowStride;
 		size_t _rowsAdded, _rowsWritten, _sbStart, _sbEnd;
+		size_t _bufferedRows, _bufferRowCapacity;
+		WorkerPool* _workers;
 		int _gpsTime;
 		std::vector<fitsfile*> _files;
 		
 		const static uint16_t VERSION_MINOR, VERSION_MAJOR;
 		
 		std::vector<size_t> _subbandToGPUBoxFileIndex;
-		std::vector<unsigned char> _singlePolBuffer;
 		std::vector<int> _hduOffsets;
-		//std::vector<unsigned char> _packBuffer;
+		// One buffer of packed rows per file
+		std::vector<std::vector<unsigned char>> _packBuffers;
 };
 
 #endif
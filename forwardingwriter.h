@@ -71,6 +71,16 @@ class ForwardingWriter : public Writer
 			_writer->WriteHistoryItem(commandLine, application, params);
 		}
 		
+		virtual void SaveState(std::ostream& stream) override
+		{
+			_writer->SaveState(stream);
+		}
+		
+		virtual void RestoreState(std::istream& stream) override
+		{
+			_writer->RestoreState(stream);
+		}
+		
 		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) override {
 			return _writer->IsTimeAligned(antenna1, antenna2);
 		}
@@ -0,0 +1,39 @@
+#include "pipelinetest.h"
+
+/**
+ * Writes a synthetic observation that does not fit in memory as a whole, once with all scans
+ * in one chunk and once with frequency partitioning, where the subbands are processed in
+ * parts that each fit with all scans. Both sets should have the same rows and statistics.
+ */
+int main(int argc, char* argv[])
+{
+	const std::string tempDirectory = argc > 1 ? argv[1] : "/tmp";
+	try {
+		const size_t threadCount = 2, subbandCount = 4, scanCount = 40;
+		PipelineTest test(tempDirectory, "frequencypartitiontest", subbandCount, scanCount);
+		const std::string
+			expectedFilename = test.OutputFilename("onechunk"),
+			actualFilename = test.OutputFilename("partitioned");
+		{
+			Cotter cotter;
+			test.Configure(cotter, expectedFilename, threadCount, test.FullMemoryLimit(threadCount));
+			cotter.Run(0.0, 0.0);
+		}
+		{
+			// Only half of the subbands fit in memory with all scans
+			Cotter cotter;
+			test.Configure(cotter, actualFilename, threadCount, test.MemoryLimit(test.ChannelCount() / 2, scanCount, threadCount));
+			cotter.SetFrequencyPartitioning(true);
+			cotter.Run(0.0, 0.0);
+		}
+		const size_t
+			rowDifferences = PipelineTest::CompareRows(expectedFilename, actualFilename, 1e-6),
+			statisticDifferences = PipelineTest::CompareStatistics(expectedFilename, actualFilename, 1e-4);
+		std::cout << "Frequency partitioning: " << rowDifferences << " differing rows, " << statisticDifferences << " differing statistics.\n";
+		return (rowDifferences != 0 || statisticDifferences != 0) ? 1 : 0;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
@@ -1,18 +1,33 @@
 #include "gpufilereader.h"
+#include "cpufeatures.h"
+#include "memorytracker.h"
+#include "profiler.h"
 #include "progressbar.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <complex>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <thread>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 void GPUFileReader::openFiles()
 {
+	Profiler::Scope scope("file open");
 	int status = 0;
 	bool hasWarnedAboutDifferentTimes = false;
 	_hasStartTime = false;
 	std::vector<long> startTimePerFile(_filenames.size());
+	_fileSizes.assign(_filenames.size(), 0);
 	for(size_t i=0; i!=_filenames.size(); ++i)
 	{
 		const std::string &curFilename = _filenames[i];
@@ -30,6 +45,11 @@ void GPUFileReader::openFiles()
 			int hduCount;
 			fits_get_num_hdus(fptr, &hduCount, &status);
 			checkStatus(status);
+			if(_waitTimeout != 0.0)
+			{
+				_fileSizes[i] = fileSize(curFilename);
+				hduCount = completeHDUCount(i, hduCount);
+			}
 			
 			_fitsHDUCounts.push_back(hduCount);
 			std::cout << "There are " << hduCount << " HDUs in file " << _filenames[i];
@@ -109,6 +129,8 @@ void GPUFileReader::closeFiles()
 }
 
 bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
+	if(_waitTimeout != 0.0 && _isOpen)
+		waitForHDUs(bufferPos, bufferLength);
 	// If we are already past the end of the files, stop immediately
 	if(_currentHDU > _stopHDU)
 		return false;
@@ -117,48 +139,47 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
 	const size_t gpuMatrixSizePerFile = _nChannelsInTotal * nBaselines * nPol / _filenames.size(); // cuda matrix length per file
 
-	_shuffleTasks.clear();
+	MemoryTracker::Allocation allocation(MemoryTracker::ReaderBuffers, int64_t(_threadCount) * gpuMatrixSizePerFile * sizeof(std::complex<float>));
+	// Every matrix is shuffled by one thread of each node. Each node needs a thread, even when
+	// there are fewer threads than nodes, because only its own threads fill its baselines.
+	const size_t
+		nodeCount = _shuffleTasks.size(),
+		shuffleThreadCount = std::max(_threadCount, nodeCount);
+	for(ao::lane<ShuffleTask>& nodeTasks : _shuffleTasks)
+		nodeTasks.clear();
 	_availableGPUMatrixBuffers.clear();
 	std::vector<std::vector<std::complex<float> > > gpuMatrixBuffers(_threadCount);
-	std::vector<std::thread> threadGroup;
+	std::unique_ptr<std::atomic<size_t>[]> remainingNodes(new std::atomic<size_t>[_threadCount]);
 	for(size_t i=0; i!=_threadCount; ++i)
 	{
 		gpuMatrixBuffers[i].resize(gpuMatrixSizePerFile);
-		_availableGPUMatrixBuffers.write(&gpuMatrixBuffers[i][0]);
-		threadGroup.emplace_back(&GPUFileReader::shuffleThreadFunc, this);
+		_availableGPUMatrixBuffers.write(i);
 	}
+	std::vector<std::thread> threadGroup;
+	for(size_t i=0; i!=shuffleThreadCount; ++i)
+		threadGroup.emplace_back(&GPUFileReader::shuffleThreadFunc, this, i * nodeCount / shuffleThreadCount);
 
 	if(!_isOpen)
 	{
 		openFiles();
 		
-		_currentHDU = _offlineFormat ? 1 : 2; // header to start reading
+		_currentHDU = firstDataHDU() + _startScan; // header to start reading
 		findStopHDU();
+		if(_waitTimeout != 0.0)
+			waitForHDUs(bufferPos, bufferLength);
 	}
 	
 	initMapping();
 
-	ProgressBar progressBar("Reading GPU files");
+	ProgressBar progressBar("Reading GPU files", nBaselines * (_nChannelsInTotal / _filenames.size()) * nPol);
 	
 	size_t endingBufferPos = bufferLength;
 	bool moreAvailable = false;
 	for (size_t iFile = 0; iFile != _filenames.size(); ++iFile) {
 		if(!_filenames[iFile].empty())
 		{
-			size_t
-				fileBufferPos = bufferPos,
-				fileHDU = _currentHDU;
-			
-			if(_doAlign)
-			{
-				// These statements will align a file with the times given in the individual gpubox fits files.
-				if(_hduOffsetsPerFile[iFile] <= (int) bufferPos)
-					fileBufferPos = bufferPos - _hduOffsetsPerFile[iFile];
-				else {
-					fileHDU += _hduOffsetsPerFile[iFile] - bufferPos;
-					fileBufferPos = bufferPos;
-				}
-			}
+			size_t fileBufferPos, fileHDU;
+			fileReadStart(iFile, bufferPos, fileHDU, fileBufferPos);
 			size_t fileStopHDU = _fitsHDUCounts[iFile];
 			size_t hdusAvailable = fileStopHDU - fileHDU + 1;
 			if(endingBufferPos > bufferPos + hdusAvailable) endingBufferPos = bufferPos + hdusAvailable;
@@ -201,17 +222,25 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 						throw std::runtime_error(s.str());
 					}
 
-					std::complex<float> *matrixPtr = 0;
-					_availableGPUMatrixBuffers.read(matrixPtr);
-					fits_read_img(fptr, TFLOAT, fpixel, channelsInFile * baselTimesPolInFile, &nullval, (float *) matrixPtr, &anynull, &status);
+					size_t matrixIndex = 0;
+					_availableGPUMatrixBuffers.read(matrixIndex);
+					std::complex<float> *matrixPtr = gpuMatrixBuffers[matrixIndex].data();
+					{
+						Profiler::Scope scope("HDU read", channelsInFile * baselTimesPolInFile * sizeof(float));
+						fits_read_img(fptr, TFLOAT, fpixel, channelsInFile * baselTimesPolInFile, &nullval, (float *) matrixPtr, &anynull, &status);
+					}
 					checkStatus(status);
 					
 					ShuffleTask shuffleTask;
 					shuffleTask.iFile = iFile;
 					shuffleTask.channelsInFile = channelsInFile;
 					shuffleTask.fileBufferPos = fileBufferPos;
+					shuffleTask.matrixIndex = matrixIndex;
 					shuffleTask.gpuMatrix = matrixPtr;
-					_shuffleTasks.write(shuffleTask);
+					shuffleTask.remainingNodes = &remainingNodes[matrixIndex];
+					remainingNodes[matrixIndex] = nodeCount;
+					for(ao::lane<ShuffleTask>& nodeTasks : _shuffleTasks)
+						nodeTasks.write(shuffleTask);
 				}
 				++fileHDU;
 				++fileBufferPos;
@@ -221,30 +250,221 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 		}
 	}
 	
-	_shuffleTasks.write_end();
+	for(ao::lane<ShuffleTask>& nodeTasks : _shuffleTasks)
+		nodeTasks.write_end();
 	for(std::thread& t : threadGroup)
 		t.join();
 	
 	_currentHDU += endingBufferPos - bufferPos;
 	bufferPos = endingBufferPos;
 	
-	if(!moreAvailable)
+	// Files that are being written are kept open, since more HDUs might follow
+	if(!moreAvailable && _waitTimeout == 0.0)
 		closeFiles();
 	return moreAvailable;
 }
 
-void GPUFileReader::shuffleThreadFunc()
+void GPUFileReader::fileReadStart(size_t iFile, size_t bufferPos, size_t& fileHDU, size_t& fileBufferPos) const
+{
+	fileBufferPos = bufferPos;
+	fileHDU = _currentHDU;
+	if(_doAlign)
+	{
+		// These statements will align a file with the times given in the individual gpubox fits files.
+		if(_hduOffsetsPerFile[iFile] <= (int) bufferPos)
+			fileBufferPos = bufferPos - _hduOffsetsPerFile[iFile];
+		else {
+			fileHDU += _hduOffsetsPerFile[iFile] - bufferPos;
+			fileBufferPos = bufferPos;
+		}
+	}
+}
+
+void GPUFileReader::waitForHDUs(size_t bufferPos, size_t bufferLength)
 {
+	auto isComplete = [&]() -> bool
+	{
+		for(size_t iFile=0; iFile!=_filenames.size(); ++iFile)
+		{
+			if(!_filenames[iFile].empty())
+			{
+				size_t fileHDU, fileBufferPos;
+				fileReadStart(iFile, bufferPos, fileHDU, fileBufferPos);
+				if(fileBufferPos < bufferLength && fileHDU + (bufferLength - fileBufferPos) > _fitsHDUCounts[iFile] + 1)
+					return false;
+			}
+		}
+		return true;
+	};
+	
+	// A writer that is running appends an HDU every integration, so when the files grew during the
+	// wait but not in the last few integrations, the writer has stopped.
+	const std::chrono::duration<double>
+		timeout(_waitTimeout),
+		settleTime(std::min(_waitTimeout, std::max(2.0, 4.0 * _integrationTime)));
+	std::chrono::steady_clock::time_point lastGrowth = std::chrono::steady_clock::now();
+	bool hasGrown = false, hasReported = false;
+	while(!isComplete())
+	{
+		const std::chrono::steady_clock::duration idleTime = std::chrono::steady_clock::now() - lastGrowth;
+		if(idleTime >= timeout || (hasGrown && idleTime >= settleTime))
+		{
+			std::cout << "WARNING: GPU files did not grow for " << std::round(std::chrono::duration<double>(idleTime).count()) << " seconds; continuing with the available data.\n";
+			break;
+		}
+		if(!hasReported)
+		{
+			std::cout << "Waiting for the GPU files to be written...\n";
+			hasReported = true;
+		}
+		Profiler::Scope scope("waiting for data");
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		// The done files are checked before the sizes, so that the last HDUs are counted
+		const bool isFinished = isWritingFinished();
+		if(refreshHDUCounts())
+		{
+			lastGrowth = std::chrono::steady_clock::now();
+			hasGrown = true;
+		}
+		if(isFinished)
+		{
+			if(!isComplete())
+				std::cout << "WARNING: GPU files were finished before all scans were written; continuing with the available data.\n";
+			break;
+		}
+	}
+}
+
+bool GPUFileReader::refreshHDUCounts()
+{
+	// CFITSIO determines the size of a file when opening it, so appended HDUs are only seen after
+	// reopening. Only the files that have grown are reopened.
+	bool hasGrown = false;
+	for(size_t i=0; i!=_fitsFiles.size(); ++i)
+	{
+		if(_fitsFiles[i] != 0)
+		{
+			const uint64_t size = fileSize(_filenames[i]);
+			if(size != _fileSizes[i])
+			{
+				hasGrown = true;
+				_fileSizes[i] = size;
+				int status = 0, hduCount = 0;
+				fits_close_file(_fitsFiles[i], &status);
+				checkStatus(status);
+				fits_open_file(&_fitsFiles[i], _filenames[i].c_str(), READONLY, &status);
+				checkStatus(status);
+				fits_get_num_hdus(_fitsFiles[i], &hduCount, &status);
+				checkStatus(status);
+				_fitsHDUCounts[i] = std::max(_fitsHDUCounts[i], completeHDUCount(i, hduCount));
+			}
+		}
+	}
+	_stopHDU = std::numeric_limits<size_t>::max();
+	for(size_t i=0; i!=_fitsHDUCounts.size(); ++i)
+	{
+		if(!_filenames[i].empty())
+			_stopHDU = std::min(_stopHDU, _fitsHDUCounts[i]);
+	}
+	return hasGrown;
+}
+
+size_t GPUFileReader::completeHDUCount(size_t fileIndex, size_t hduCount) const
+{
+	if(hduCount == 0)
+		return 0;
+	// The header of the last HDU gives the size of its data, which should be within the file
+	fitsfile *fptr = _fitsFiles[fileIndex];
+	int status = 0, currentHDU = 0, hduType = 0, bitpix = 0, naxis = 0;
+	long naxes[2] = { 0, 0 };
+	LONGLONG headerStart = 0, dataStart = 0, dataEnd = 0;
+	fits_get_hdu_num(fptr, &currentHDU);
+	fits_movabs_hdu(fptr, hduCount, &hduType, &status);
+	fits_get_hduaddrll(fptr, &headerStart, &dataStart, &dataEnd, &status);
+	fits_get_img_param(fptr, 2, &bitpix, &naxis, naxes, &status);
+	const bool isHeaderComplete = (status == 0);
+	// The keywords of the first HDU are read after this
+	status = 0;
+	fits_clear_errmsg();
+	fits_movabs_hdu(fptr, currentHDU, &hduType, &status);
+	checkStatus(status);
+	if(!isHeaderComplete)
+		return hduCount - 1;
+	uint64_t dataSize = 0;
+	if(naxis != 0)
+		dataSize = uint64_t(std::abs(bitpix) / 8) * naxes[0] * (naxis > 1 ? naxes[1] : 1);
+	if(uint64_t(dataStart) + dataSize > _fileSizes[fileIndex])
+		return hduCount - 1;
+	return hduCount;
+}
+
+bool GPUFileReader::isWritingFinished() const
+{
+	for(const std::string& filename : _filenames)
+	{
+		if(!filename.empty() && access((filename + ".done").c_str(), F_OK) != 0)
+			return false;
+	}
+	return true;
+}
+
+uint64_t GPUFileReader::fileSize(const std::string& filename)
+{
+	struct stat info;
+	if(stat(filename.c_str(), &info) != 0)
+		throw std::runtime_error("Could not determine the size of GPU file " + filename);
+	return info.st_size;
+}
+
+void GPUFileReader::SetNumaTopology(const NumaTopology& numa)
+{
+	_numa = numa;
+	// The baselines are divided over all nodes, so every node needs its lane. Each lane has
+	// its own statistics, which would be garbled when the lanes of several nodes shared them.
+	_shuffleTasks.clear();
+	for(size_t node=0; node!=_numa.NodeCount(); ++node)
+	{
+		_shuffleTasks.emplace_back(_threadCount);
+		const std::string name = _numa.NodeCount() == 1 ? "shuffle tasks" : "shuffle tasks node " + std::to_string(node);
+		_shuffleTasks.back().set_statistics(Profiler::Instance().QueueStatistics(name));
+	}
+}
+
+void GPUFileReader::shuffleThreadFunc(size_t node)
+{
+	if(_shuffleTasks.size() > 1)
+		_numa.PinToNode(node);
 	ShuffleTask task;
-	while(_shuffleTasks.read(task))
+	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
+	while(_shuffleTasks[node].read(task))
+	{
+		{
+			Profiler::Scope scope("shuffle", task.channelsInFile * nBaselines * 4 * sizeof(std::complex<float>) / _shuffleTasks.size());
+			shuffleBuffer(task.iFile, task.channelsInFile, task.fileBufferPos, task.gpuMatrix, node);
+		}
+		// The last node to finish makes the matrix available for the next HDU
+		if(task.remainingNodes->fetch_sub(1) == 1)
+			_availableGPUMatrixBuffers.write(task.matrixIndex);
+	}
+}
+
+void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix, size_t node)
+{
+	// A gpubox file holds one coarse channel, which normally has 32 or 128 channels
+	switch(channelsInFile)
 	{
-		shuffleBuffer(task.iFile, task.channelsInFile, task.fileBufferPos, task.gpuMatrix);
-		_availableGPUMatrixBuffers.write(task.gpuMatrix);
+		case 32: shuffleChannels<32>(iFile, channelsInFile, fileBufferPos, gpuMatrix, node); break;
+		case 128: shuffleChannels<128>(iFile, channelsInFile, fileBufferPos, gpuMatrix, node); break;
+		default: shuffleChannels<0>(iFile, channelsInFile, fileBufferPos, gpuMatrix, node); break;
 	}
 }
 
-void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix)
+template<size_t ChannelsInFile>
+MULTIVERSIONED_KERNEL
+void GPUFileReader::shuffleChannels(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix, size_t node)
 {
+	if(ChannelsInFile != 0)
+		channelsInFile = ChannelsInFile;
 	const size_t nPol = 4;
 	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
 	
@@ -257,13 +477,17 @@ void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fi
 		for(size_t antenna2=0; antenna2<=antenna1; ++antenna2)
 		{
 			size_t channelStart = iFile * channelsInFile;
-			size_t channelEnd = (iFile+1) * channelsInFile;
 			size_t index = correlationIndex * nPol;
 			// Because possibly antenna2 <= antenna1 in the GPU file, and Casa MS expects it the other way
 			// around, we change the order and take the complex conjugates later.
 			BaselineBuffer &buffer = getMappedBuffer(antenna2, antenna1);
+			if(buffer.node != node)
+			{
+				++correlationIndex;
+				continue;
+			}
 			size_t destChanIndex = fileBufferPos + channelStart * _bufferSize;
-			for(size_t ch=channelStart; ch!=channelEnd; ++ch)
+			for(size_t ch=0; ch!=channelsInFile; ++ch)
 			{
 				const std::complex<float> *dataPtr = &gpuMatrix[index];
 				
@@ -362,6 +586,9 @@ void GPUFileReader::initMapping()
 						getMappedBuffer(a1, a2).real[p1 * 2 + p2] = getBuffer(actA2, actA1).real[actP2 * 2 + actP1];
 						getMappedBuffer(a1, a2).imag[p1 * 2 + p2] = getBuffer(actA2, actA1).imag[actP2 * 2 + actP1];
 					}
+					// A mapped buffer is filled by the node of its first polarization
+					if(p1 == 0 && p2 == 0)
+						getMappedBuffer(a1, a2).node = (actA1 <= actA2) ? getBuffer(actA1, actA2).node : getBuffer(actA2, actA1).node;
 				}
 			}
 		}
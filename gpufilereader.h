@@ -1,7 +1,10 @@
 #include "baselinebuffer.h"
 #include "fitsuser.h"
 #include "lane.h"
+#include "numatopology.h"
+#include "profiler.h"
 
+#include <atomic>
 #include <functional>
 #include <string>
 #include <vector>
@@ -37,7 +40,6 @@ class GPUFileReader : private FitsUser
 {
 	public:
 		GPUFileReader(size_t nAntenna, size_t nChannelsInTotal, size_t threadCount, bool offlineFormat) :
-			_shuffleTasks(threadCount),
 			_availableGPUMatrixBuffers(threadCount),
 			_isOpen(false),
 			_nAntenna(nAntenna),
@@ -45,13 +47,18 @@ class GPUFileReader : private FitsUser
 			_bufferSize(0),
 			_currentHDU(0),
 			_stopHDU(0),
+			_startScan(0),
 			_startTime(0),
 			_hasStartTime(false),
 			_threadCount(threadCount),
 			_integrationTime(0.0),
 			_doAlign(true),
-			_offlineFormat(offlineFormat)
-		{ }
+			_offlineFormat(offlineFormat),
+			_waitTimeout(0.0)
+		{
+			SetNumaTopology(NumaTopology());
+			_availableGPUMatrixBuffers.set_statistics(Profiler::Instance().QueueStatistics("free GPU matrix buffers"));
+		}
 		~GPUFileReader() { closeFiles(); }
 		
 		void AddFile(const char *filename) { _filenames.push_back(std::string(filename)); }
@@ -81,12 +88,34 @@ class GPUFileReader : private FitsUser
 			}
 			getBuffer(antenna1, antenna2) = buffer;
 		}
+		/**
+		 * Divide the shuffle threads over the nodes, and let the threads of a node only fill the
+		 * baseline buffers of that node (see BaselineBuffer::node). Every node gets a shuffle
+		 * thread, also when there are more nodes than threads.
+		 */
+		void SetNumaTopology(const NumaTopology& numa);
 		void SetCorrInputToOutput(size_t input, size_t outputAnt, size_t outputPol)
 		{
 			_corrInputToOutput[input] = outputAnt*2 + outputPol;
 		}
 		
 		bool Read(size_t &bufferPos, size_t bufferLength);
+		/**
+		 * Read files that are still being written. When Read() needs HDUs that are not yet in the
+		 * files, it checks the sizes of the files a few times per second and waits until the HDUs are
+		 * complete. It stops waiting when the writer has created a "<gpubox file>.done" file next to each
+		 * of the files, when the files grew and then stopped growing for a few integrations, or when
+		 * none of the files has grown for the given number of seconds. Zero (the default) reads the
+		 * files as they are.
+		 */
+		void SetWaitTimeout(double seconds) { _waitTimeout = seconds; }
+		/**
+		 * The number of scans that Read() has moved through the files. This is saved in checkpoints
+		 * and given to SetScanPosition() of a new reader of the same files to continue from there.
+		 */
+		size_t ScanPosition() const { return _currentHDU == 0 ? _startScan : _currentHDU - firstDataHDU(); }
+		/** Start reading at the given position; should be called before the first Read(). */
+		void SetScanPosition(size_t scan) { _startScan = scan; }
 		bool IsConjugated(size_t ant1, size_t ant2, size_t pol1, size_t pol2) const
 		{
 			return _isConjugated[(ant1 * 2 + pol1) * _nAntenna * 2 + (ant2 * 2 + pol2)];
@@ -99,26 +128,52 @@ class GPUFileReader : private FitsUser
 			_onHDUOffsetsChange = onHDUOffsetsChange;
 		}
 	private:
+		friend class CotterBench;
+		
 		struct ShuffleTask
 		{
-			size_t iFile, channelsInFile, fileBufferPos;
+			size_t iFile, channelsInFile, fileBufferPos, matrixIndex;
 			std::complex<float> *gpuMatrix;
+			/** The number of nodes that have not yet shuffled the matrix. */
+			std::atomic<size_t> *remainingNodes;
 		};
-		ao::lane<ShuffleTask> _shuffleTasks;
-		ao::lane<std::complex<float> *> _availableGPUMatrixBuffers;
+		/** The tasks of the shuffle threads of each node. */
+		std::vector<ao::lane<ShuffleTask>> _shuffleTasks;
+		ao::lane<size_t> _availableGPUMatrixBuffers;
 		
 		const static int single_pfb_output_to_input[64];
 		std::vector<int> pfb_output_to_input;
 		
-		GPUFileReader(const GPUFileReader &) : _shuffleTasks(0), _availableGPUMatrixBuffers(0) { }
+		GPUFileReader(const GPUFileReader &) : _availableGPUMatrixBuffers(0) { }
 		void operator=(const GPUFileReader &) { }
 		void openFiles();
 		void closeFiles();
+		size_t firstDataHDU() const { return _offlineFormat ? 1 : 2; }
 		void findStopHDU();
+		/** The first HDU of the file to read and the buffer position it goes to, for a read starting at bufferPos. */
+		void fileReadStart(size_t iFile, size_t bufferPos, size_t& fileHDU, size_t& fileBufferPos) const;
+		void waitForHDUs(size_t bufferPos, size_t bufferLength);
+		/** Reopen the files that have grown to see the HDUs that were appended. Returns true when any file has grown. */
+		bool refreshHDUCounts();
+		/**
+		 * The number of HDUs of an open file of which the data has been written completely, given that
+		 * CFITSIO sees hduCount HDUs. The last HDU of a file that is being written may be incomplete.
+		 */
+		size_t completeHDUCount(size_t fileIndex, size_t hduCount) const;
+		/** Whether the writer has marked every file as done. */
+		bool isWritingFinished() const;
+		static uint64_t fileSize(const std::string& filename);
 		void initMapping();
 		void initializePFBMapping();
-		void shuffleThreadFunc();
-		void shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix);
+		void shuffleThreadFunc(size_t node);
+		/**
+		 * Selects the instantiation of shuffleChannels() for the number of channels in the file.
+		 * Only the baseline buffers of the given node are filled.
+		 */
+		void shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix, size_t node);
+		/** ChannelsInFile = 0 is the version for any number of channels. */
+		template<size_t ChannelsInFile>
+		void shuffleChannels(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix, size_t node);
 		BaselineBuffer &getBuffer(size_t antenna1, size_t antenna2)
 		{
 			return _buffers[_nAntenna*antenna1 + antenna2];
@@ -129,9 +184,11 @@ class GPUFileReader : private FitsUser
 		}
 		
 		bool _isOpen;
-		size_t _nAntenna, _nChannelsInTotal, _bufferSize, _currentHDU, _stopHDU;
+		size_t _nAntenna, _nChannelsInTotal, _bufferSize, _currentHDU, _stopHDU, _startScan;
 		std::vector<std::string> _filenames;
 		std::vector<size_t> _fitsHDUCounts;
+		/** The sizes of the files when their HDUs were last counted, to see whether they have grown. */
+		std::vector<uint64_t> _fileSizes;
 		std::vector<fitsfile *> _fitsFiles;
 		
 		std::vector<BaselineBuffer> _buffers;
@@ -141,8 +198,10 @@ class GPUFileReader : private FitsUser
 		std::time_t _startTime;
 		bool _hasStartTime;
 		size_t _threadCount;
+		NumaTopology _numa;
 		std::vector<int> _hduOffsetsPerFile;
 		double _integrationTime;
 		bool _doAlign, _offlineFormat;
+		double _waitTimeout;
 		std::function<void(const std::vector<int>&)> _onHDUOffsetsChange;
 };
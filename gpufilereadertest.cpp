@@ -0,0 +1,119 @@
+#include "gpufilereader.h"
+#include "numatopology.h"
+#include "syntheticobservation.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+/**
+ * Reads a synthetic gpubox file with the GPUFileReader, once on a single node and once with
+ * its baselines divided over several nodes, and checks that the visibilities are the same.
+ * With fewer threads than nodes, every node should still get its baselines filled.
+ */
+class GPUFileReaderTest
+{
+	public:
+		GPUFileReaderTest(const std::string& tempDirectory) :
+			_antennaCount(32),
+			_channelCount(32),
+			_scanCount(4),
+			_filename(tempDirectory + "/gpufilereadertest_" + std::to_string(getpid()) + "_gpubox01_00.fits")
+		{
+			SyntheticObservation observation;
+			observation.SetAntennaCount(_antennaCount);
+			observation.SetSubbandCount(1);
+			observation.SetChannelsPerSubband(_channelCount);
+			observation.SetScanCount(_scanCount);
+			observation.WriteGPUBoxFile(_filename, 0);
+		}
+
+		~GPUFileReaderTest() { std::remove(_filename.c_str()); }
+
+		/** Returns the number of visibilities that differ from those of a single-node read. */
+		size_t Compare(size_t threadCount, const NumaTopology& numa)
+		{
+			const std::vector<float> expected = read(1, NumaTopology());
+			const std::vector<float> actual = read(threadCount, numa);
+			size_t differences = 0;
+			for(size_t i=0; i!=expected.size(); ++i)
+			{
+				// Samples that were not filled are still nan
+				if(actual[i] != expected[i] && !(std::isnan(actual[i]) && std::isnan(expected[i])))
+					++differences;
+			}
+			return differences;
+		}
+
+	private:
+		size_t baselineCount() const { return _antennaCount * (_antennaCount + 1) / 2; }
+
+		/** Reads all scans into a real and imaginary buffer for every polarization of every baseline. */
+		std::vector<float> read(size_t threadCount, const NumaTopology& numa)
+		{
+			const size_t bufferSize = _scanCount * _channelCount;
+			std::vector<float> data(baselineCount() * 8 * bufferSize, std::nanf(""));
+			GPUFileReader reader(_antennaCount, _channelCount, threadCount, false);
+			reader.SetHDUOffsetsChangeCallback([](const std::vector<int>&) { });
+			reader.SetNumaTopology(numa);
+			reader.AddFile(_filename.c_str());
+			reader.Initialize(0.5, true);
+			for(size_t input=0; input!=_antennaCount*2; ++input)
+				reader.SetCorrInputToOutput(input, input/2, input%2);
+			reader.ResetBuffers();
+			size_t baseline = 0;
+			for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+			{
+				for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+				{
+					BaselineBuffer buffer;
+					for(size_t p=0; p!=4; ++p)
+					{
+						buffer.real[p] = &data[(baseline*8 + p*2) * bufferSize];
+						buffer.imag[p] = &data[(baseline*8 + p*2 + 1) * bufferSize];
+					}
+					buffer.nElementsPerRow = _scanCount;
+					buffer.node = numa.NodeOf(baseline, baselineCount());
+					reader.SetDestBaselineBuffer(antenna1, antenna2, buffer);
+					++baseline;
+				}
+			}
+			size_t bufferPos = 0;
+			reader.Read(bufferPos, _scanCount);
+			if(bufferPos != _scanCount)
+				throw std::runtime_error("Reader did not read all scans of " + _filename);
+			return data;
+		}
+
+		size_t _antennaCount, _channelCount, _scanCount;
+		std::string _filename;
+};
+
+int main(int argc, char* argv[])
+{
+	const std::string tempDirectory = argc > 1 ? argv[1] : "/tmp";
+	try {
+		GPUFileReaderTest test(tempDirectory);
+		// Pinning to cpu 0 works on any machine; the test is about the division of the baselines
+		const NumaTopology twoNodes(std::vector<std::vector<int>>{ { 0 }, { 0 } });
+		bool failed = false;
+		for(size_t threadCount : { 1, 2, 3 })
+		{
+			const size_t differences = test.Compare(threadCount, twoNodes);
+			std::cout << "Two nodes, " << threadCount << " thread(s): " << differences << " differing samples.\n";
+			if(differences != 0)
+				failed = true;
+		}
+		return failed ? 1 : 0;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef JSON_ESCAPE_H
+#define JSON_ESCAPE_H
+
+#include <string>
+
+/** Escapes a string for use inside a quoted JSON string, as written by the profiler and the progress stream. */
+inline std::string jsonEscape(const std::string& str)
+{
+	std::string result;
+	for(char c : str)
+	{
+		if(c == '"' || c == '\\')
+			result += '\\';
+		if(c == '\n')
+			result += "\\n";
+		else
+			result += c;
+	}
+	return result;
+}
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef AO_LANE_11_H
 #define AO_LANE_11_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <deque>
 #include <mutex>
@@ -41,6 +44,50 @@ namespace ao
 
 #endif
 
+/**
+ * @brief Counters that a lane updates while it is used.
+ * @details Statistics are enabled at runtime by giving the lane a
+ * lane_statistics object with lane::set_statistics(). Several lanes can
+ * share one object. The counters are atomic, so they can be sampled from
+ * another thread while the lanes are in use.
+ *
+ * Waits are only timed when they happen, so the overhead of
+ * an operation that does not need to wait is a few atomic increments.
+ */
+struct lane_statistics
+{
+	/** @brief Number of bins in the occupancy histogram. */
+	static constexpr std::size_t histogram_size = 9;
+	
+	lane_statistics() noexcept :
+		capacity(0),
+		write_count(0), read_count(0),
+		write_wait_count(0), read_wait_count(0),
+		write_wait_ns(0), read_wait_ns(0)
+	{
+		for(std::size_t i=0; i!=histogram_size; ++i)
+			occupancy_histogram[i] = 0;
+	}
+	
+	/** @brief Register the occupancy at the moment of a read or write operation.
+	 * @details Bin 0 counts operations on an empty lane, bin i
+	 * counts operations on a lane that is filled up to i/8th of its capacity.
+	 */
+	void register_occupancy(std::size_t size, std::size_t lane_capacity) noexcept
+	{
+		std::size_t bin = 0;
+		if(size != 0 && lane_capacity != 0)
+			bin = 1 + (size - 1) * (histogram_size - 1) / lane_capacity;
+		occupancy_histogram[bin].fetch_add(1, std::memory_order_relaxed);
+	}
+	
+	std::atomic<std::size_t> capacity;
+	std::atomic<uint64_t> occupancy_histogram[histogram_size];
+	std::atomic<uint64_t> write_count, read_count;
+	std::atomic<uint64_t> write_wait_count, read_wait_count;
+	std::atomic<uint64_t> write_wait_ns, read_wait_ns;
+};
+
 /**
  * @brief The lane is an efficient cyclic buffer that is synchronized.
  * @details
@@ -117,7 +164,8 @@ class lane
 			_capacity(0),
 			_write_position(0),
 			_free_write_space(0),
-			_status(status_normal)
+			_status(status_normal),
+			_statistics(nullptr)
 		{
 		}
 		
@@ -130,7 +178,8 @@ class lane
 			_capacity(capacity),
 			_write_position(0),
 			_free_write_space(_capacity),
-			_status(status_normal)
+			_status(status_normal),
+			_statistics(nullptr)
 		{
 		}
 		
@@ -146,7 +195,8 @@ class lane
 			_capacity(0),
 			_write_position(0),
 			_free_write_space(0),
-			_status(status_normal)
+			_status(status_normal),
+			_statistics(nullptr)
 		{
 			swap(source);
 		}
@@ -185,6 +235,7 @@ class lane
 			std::swap(_write_position, other._write_position);
 			std::swap(_free_write_space, other._free_write_space);
 			std::swap(_status, other._status);
+			std::swap(_statistics, other._statistics);
 		}
 		
 		/** @brief Clear the contents and reset the state of the lane.
@@ -219,12 +270,13 @@ class lane
 				while(_free_write_space == 0)
 				{
 					LANE_REGISTER_DEBUG_WRITE_WAIT;
-					_writing_possible_condition.wait(lock);
+					wait_for_writing(lock);
 				}
 				
 				_buffer[_write_position] = element;
 				_write_position = (_write_position+1) % _capacity;
 				--_free_write_space;
+				register_write(1);
 				// Now that there is less free write space, there is more free read
 				// space and thus readers can possibly continue.
 				_reading_possible_condition.notify_all();
@@ -249,12 +301,13 @@ class lane
 				while(_free_write_space == 0)
 				{
 					LANE_REGISTER_DEBUG_WRITE_WAIT;
-					_writing_possible_condition.wait(lock);
+					wait_for_writing(lock);
 				}
 				
 				_buffer[_write_position] = std::move(element);
 				_write_position = (_write_position+1) % _capacity;
 				--_free_write_space;
+				register_write(1);
 				// Now that there is less free write space, there is more free read
 				// space and thus readers can possibly continue.
 				_reading_possible_condition.notify_all();
@@ -278,7 +331,7 @@ class lane
 			while(free_read_space() == 0 && _status == status_normal)
 			{
 				LANE_REGISTER_DEBUG_READ_WAIT;
-				_reading_possible_condition.wait(lock);
+				wait_for_reading(lock);
 			}
 			if(free_read_space() == 0)
 				return false;
@@ -286,6 +339,7 @@ class lane
 			{
 				destination = std::move(_buffer[read_position()]);
 				++_free_write_space;
+				register_read(1);
 				// Now that there is more free write space, writers can possibly continue.
 				_writing_possible_condition.notify_all();
 				return true;
@@ -310,7 +364,7 @@ class lane
 				
 				do {
 					LANE_REGISTER_DEBUG_READ_WAIT;
-					_reading_possible_condition.wait(lock);
+					wait_for_reading(lock);
 				} while(free_read_space() == 0 && _status == status_normal);
 				
 				free_space = free_read_space();
@@ -347,6 +401,19 @@ class lane
 			return _capacity == _free_write_space;
 		}
 		
+		/**
+		 * @brief Let the lane update the given statistics, or stop updating
+		 * statistics when @p statistics is nullptr.
+		 * @details This method is not thread safe. The statistics object
+		 * should outlive the lane.
+		 */
+		void set_statistics(lane_statistics* statistics) noexcept
+		{
+			_statistics = statistics;
+			if(_statistics)
+				_statistics->capacity = _capacity;
+		}
+		
 		/**
 		 * Change the capacity of the lane. This will erase all data in the lane.
 		 */
@@ -359,6 +426,8 @@ class lane
 			_write_position = 0;
 			_free_write_space = new_capacity;
 			_status = status_normal;
+			if(_statistics)
+				_statistics->capacity = new_capacity;
 		}
 		
 #ifdef LANE_DEBUG_MODE
@@ -388,6 +457,52 @@ class lane
 		
 		std::condition_variable _writing_possible_condition, _reading_possible_condition;
 		
+		lane_statistics* _statistics;
+		
+		void wait_for_writing(std::unique_lock<std::mutex>& lock)
+		{
+			if(_statistics)
+			{
+				const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				_writing_possible_condition.wait(lock);
+				_statistics->write_wait_count.fetch_add(1, std::memory_order_relaxed);
+				_statistics->write_wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+			}
+			else
+				_writing_possible_condition.wait(lock);
+		}
+		
+		void wait_for_reading(std::unique_lock<std::mutex>& lock)
+		{
+			if(_statistics)
+			{
+				const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				_reading_possible_condition.wait(lock);
+				_statistics->read_wait_count.fetch_add(1, std::memory_order_relaxed);
+				_statistics->read_wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+			}
+			else
+				_reading_possible_condition.wait(lock);
+		}
+		
+		void register_write(size_t n) noexcept
+		{
+			if(_statistics)
+			{
+				_statistics->write_count.fetch_add(n, std::memory_order_relaxed);
+				_statistics->register_occupancy(_capacity - _free_write_space, _capacity);
+			}
+		}
+		
+		void register_read(size_t n) noexcept
+		{
+			if(_statistics)
+			{
+				_statistics->read_count.fetch_add(n, std::memory_order_relaxed);
+				_statistics->register_occupancy(_capacity - _free_write_space, _capacity);
+			}
+		}
+		
 		size_t read_position() const noexcept
 		{
 			return (_write_position + _free_write_space) % _capacity;
@@ -416,7 +531,7 @@ class lane
 				
 					do {
 						LANE_REGISTER_DEBUG_WRITE_WAIT;
-						_writing_possible_condition.wait(lock);
+						wait_for_writing(lock);
 					} while(_free_write_space == 0 && _status == status_normal);
 					
 					write_size = _free_write_space > n ? n : _free_write_space;
@@ -455,6 +570,7 @@ class lane
 				}
 				
 				_free_write_space -= n;
+				register_write(n);
 				
 				// Now that there is less free write space, there is more free read
 				// space and thus readers can possibly continue.
@@ -489,6 +605,7 @@ class lane
 				}
 				
 				_free_write_space += n;
+				register_read(n);
 				
 				// Now that there is more free write space, writers can possibly continue.
 				_writing_possible_condition.notify_all();
@@ -0,0 +1,54 @@
+#ifndef LINE_PREFIX_BUFFER_H
+#define LINE_PREFIX_BUFFER_H
+
+#include <streambuf>
+#include <string>
+
+/**
+ * Stream buffer that writes every line with a prefix to another stream buffer. A line is
+ * written and flushed at once when it is complete, so that the lines of processes that
+ * write to the same terminal do not mix. Incomplete lines, like a progress bar that is
+ * being drawn, are held back until they are complete or Finish() is called.
+ */
+class LinePrefixBuffer : public std::streambuf
+{
+	public:
+		LinePrefixBuffer(std::streambuf* destination, const std::string& prefix) :
+			_destination(destination), _prefix(prefix)
+		{ }
+		
+		/** Write the incomplete line, if any, and end it. */
+		void Finish()
+		{
+			if(!_line.empty())
+			{
+				_line += '\n';
+				writeLine();
+			}
+		}
+		
+	protected:
+		virtual int_type overflow(int_type c) final override
+		{
+			if(traits_type::eq_int_type(c, traits_type::eof()))
+				return traits_type::not_eof(c);
+			_line += traits_type::to_char_type(c);
+			if(traits_type::to_char_type(c) == '\n')
+				writeLine();
+			return c;
+		}
+		
+	private:
+		void writeLine()
+		{
+			const std::string output = _prefix + _line;
+			_destination->sputn(output.data(), output.size());
+			_destination->pubsync();
+			_line.clear();
+		}
+		
+		std::streambuf* _destination;
+		std::string _prefix, _line;
+};
+
+#endif
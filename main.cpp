@@ -1,5 +1,8 @@
 #include "cotter.h"
+#include "cpufeatures.h"
+#include "memoryplanner.h"
 #include "numberlist.h"
+#include "progressstream.h"
 #include "radeccoord.h"
 #include "version.h"
 
@@ -7,7 +10,9 @@
 
 #include <boost/algorithm/string.hpp>
 
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <vector>
 
 bool isDigit(char c)
@@ -58,20 +63,183 @@ bool isMWAFlagFile(const std::string &filename)
 	return false;
 }
 
+enum Cotter::OutputFormat outputFormatFromFilename(const std::string &filename)
+{
+	if(isFitsFile(filename))
+		return Cotter::FitsOutputFormat;
+	else if(isMWAFlagFile(filename))
+		return Cotter::FlagsOutputFormat;
+	else
+		return Cotter::MSOutputFormat;
+}
+
+void setOutputFormat(Cotter &cotter, const std::string &outputFilename, bool saveQualityStatistics)
+{
+	switch(outputFormatFromFilename(outputFilename))
+	{
+		case Cotter::FitsOutputFormat:
+			cotter.SetCollectStatistics(saveQualityStatistics);
+			cotter.SetFlagAutoCorrelations(false);
+			cotter.SetOutputFormat(Cotter::FitsOutputFormat);
+			break;
+		case Cotter::FlagsOutputFormat:
+			cotter.SetCollectStatistics(saveQualityStatistics);
+			cotter.SetOutputFormat(Cotter::FlagsOutputFormat);
+			cotter.SetRemoveFlaggedAntennae(false);
+			break;
+		case Cotter::MSOutputFormat:
+			break;
+	}
+}
+
+/**
+ * Sort the gpubox files by time range and gpu box number, and check that the set is complete.
+ */
+std::vector<std::vector<std::string>> makeFileSets(const std::vector<std::string> &unsortedFiles, size_t sbStart, size_t subbandCount, bool allowMissingFiles)
+{
+	size_t gpuBoxCount = 0;
+	std::vector<std::vector<std::string> > fileSets;
+	for(std::vector<std::string>::const_iterator i=unsortedFiles.begin(); i!=unsortedFiles.end(); ++i)
+	{
+		checkInputFilename(*i);
+		size_t gpuFilenameNumber = gpuBoxNumberFromFilename(*i);
+		if(gpuFilenameNumber < sbStart-1)
+		{
+			std::ostringstream errmsg;
+			errmsg << "A GPU box file was specified with number " << (gpuFilenameNumber+1) << ", which is lower than the expected start number of " << sbStart << ".";
+			throw std::runtime_error(errmsg.str());
+		}
+		size_t gpuNum = gpuFilenameNumber - sbStart + 1;
+		size_t timeNum = timeStepNumberFromFilename(*i);
+		if(fileSets.size() <= timeNum)
+			fileSets.resize(timeNum+1);
+		std::vector<std::string> &timestepSets = fileSets[timeNum];
+		if(timestepSets.size() <= gpuNum)
+			timestepSets.resize(gpuNum+1);
+		if(!timestepSets[gpuNum].empty())
+		{
+			std::ostringstream errmsg;
+			errmsg << "Two files in the list describe the same raw gpu box file: did you specify the same file more than once?\nGPU box number: " << (gpuNum+sbStart)
+				<< " time range index: " << timeNum;
+			throw std::runtime_error(errmsg.str());
+		}
+		timestepSets[gpuNum] = *i;
+		if(gpuNum+1 > gpuBoxCount) gpuBoxCount = gpuNum+1;
+	}
+	
+	bool aFileIsMissing = false;
+	for(size_t j=0; j!=fileSets.size(); ++j)
+	{
+		for(size_t i=0; i!=subbandCount; ++i)
+		{
+			if(i >= fileSets[j].size() || fileSets[j][i].empty()) {
+				std::ostringstream errstr;
+				std::cout << "Missing information from GPU box " << (i+sbStart) << ", timerange " << j << ". Maybe you are missing an input file?\n";
+				aFileIsMissing = true;
+			}
+		}
+	}
+	if(aFileIsMissing && !allowMissingFiles)
+	{
+		throw std::runtime_error("Because at least one input file is missing, I will refuse to continue. This is to prevent download errors cause incomplete observations. If you are missing input files because some of the files are not available (e.g. because of a correlator GPU box failure), specify '-allowmissing' to continue with missing files.");
+	}
+	if(gpuBoxCount > subbandCount)
+	{
+		std::ostringstream errstr;
+		errstr << "The highest GPU box number (" << gpuBoxCount << ") is higher than the number of subbands (" << subbandCount << "). Either a wrong -sbcount was specified, or files are not correctly named.";
+		throw std::runtime_error(errstr.str());
+	}
+	std::cout << "Input filenames succesfully parsed: using " << unsortedFiles.size() << " files covering " << fileSets.size() << " timeranges from " << gpuBoxCount << " GPU boxes.\n";
+	return fileSets;
+}
+
+struct BatchEntry
+{
+	std::string metaFilename, outputFilename;
+	std::vector<std::string> gpuFilenames;
+};
+
+/**
+ * Read a batch manifest. Every line describes one observation as the metafits file, the output
+ * filename and the gpubox files, separated by white space. Empty lines and lines starting with '#'
+ * are skipped.
+ */
+std::vector<BatchEntry> readBatchManifest(const std::string &filename)
+{
+	std::ifstream file(filename);
+	if(!file)
+		throw std::runtime_error("Could not open batch manifest " + filename);
+	std::vector<BatchEntry> entries;
+	std::string line;
+	size_t lineNumber = 0;
+	while(std::getline(file, line))
+	{
+		++lineNumber;
+		std::istringstream lineStr(line);
+		BatchEntry entry;
+		if(!(lineStr >> entry.metaFilename) || entry.metaFilename[0] == '#')
+			continue;
+		std::string gpuFilename;
+		lineStr >> entry.outputFilename;
+		while(lineStr >> gpuFilename)
+			entry.gpuFilenames.push_back(gpuFilename);
+		if(entry.gpuFilenames.empty())
+		{
+			std::ostringstream errstr;
+			errstr << "Line " << lineNumber << " of batch manifest " << filename << " should list a metafits file, an output filename and the gpubox files.";
+			throw std::runtime_error(errstr.str());
+		}
+		if(outputFormatFromFilename(entry.outputFilename) != outputFormatFromFilename(entries.empty() ? entry.outputFilename : entries.front().outputFilename))
+			throw std::runtime_error("All outputs of batch manifest " + filename + " should have the same format, but " + entry.outputFilename + " differs from " + entries.front().outputFilename);
+		entries.push_back(std::move(entry));
+	}
+	if(entries.empty())
+		throw std::runtime_error("Batch manifest " + filename + " does not list any observations");
+	return entries;
+}
+
 void usage()
 {
 	std::cout << "usage: cotter [options] <gpufiles> \n"
+	"       cotter [options] -batch <manifest>\n"
 	"Options:\n"
 	"  -o <filename>      Save output to given filename. Default is 'preprocessed.ms'.\n"
 	"                     If the files' extension is .uvfits, it will be outputted in uvfits format\n"
 	"                     and extension .mwaf is the flag-only format for input into the RTS.\n"
 	"  -m <filename>      Read meta data from given fits filename..\n"
+	"  -batch <manifest>  Process several observations after each other with the same options. Every\n"
+	"                     line of the manifest lists the metafits file, the output filename and the\n"
+	"                     gpubox files of an observation. The flagging strategy and the buffers are\n"
+	"                     kept between observations, and the files of the next observation are read\n"
+	"                     ahead while the current one is processed. All outputs should have the same format.\n"
 	"  -a <filename>      Read antenna locations from given text file (overrides the metadata).\n"
 	"  -h <filename>      Read header data from given text file (overrides the metadata.)\n"
 	"  -i <filename>      Read meta data from given fits filename (overrides the metadata).\n"
-	"  -mem <percentage>  Use at most the given percentage of memory.\n"
+	"  -mem <percentage>  Use at most the given percentage of memory. When running in a cgroup with a\n"
+	"                     memory limit, the percentage is taken of that limit. Default: 90.\n"
 	"  -absmem <gb>       Use at most the given amount of memory, specified in gigabytes.\n"
+	"  -freqpartition     When the observation does not fit in memory, split it in ranges of subbands\n"
+	"                     instead of in time chunks, so that flagging sees all timesteps. Not available\n"
+	"                     for uvfits output or with Dysco compression.\n"
+	"  -stream <window> <margin> Process the observation in windows of the given number of scans,\n"
+	"                     while the gpubox files are still being written. Each window is flagged together\n"
+	"                     with the given number of scans on either side, which are written with the\n"
+	"                     neighbouring window. Frequency partitioning is disabled.\n"
+	"  -stream-timeout <s> With -stream, give up waiting for new data after this many seconds without\n"
+	"                     growth of the gpubox files. Default: 60. Waiting also stops when the files stop\n"
+	"                     growing for a few integrations, or when the writer has created a file named\n"
+	"                     <gpubox file>.done for every gpubox file.\n"
+	"  -checkpoint        Save the progress next to the output after every chunk. When the output has a\n"
+	"                     checkpoint, continue after its last completed chunk. The other options should be\n"
+	"                     the same as those of the interrupted run. Only for measurement set output.\n"
 	"  -j <ncpus>         Number of CPUs to use. Default is to use all.\n"
+	"  -parallel-bands <n> Process up to n non-contiguous bands at the same time. The CPUs and memory\n"
+	"                     are divided over the bands. Default: 1.\n"
+	"  -channel-processes <n> Split every contiguous band over n processes that each process a range of\n"
+	"                     its subbands, and merge their output into one measurement set. The CPUs and\n"
+	"                     memory are divided over the processes. The statistics of all but the first range\n"
+	"                     are saved to separate .qs files. Not available for uvfits or flag output, with Dysco\n"
+	"                     compression or with -freqpartition. Default: 1.\n"
 	"  -timeres <s>       Average nr of sec of timesteps together before writing to measurement set.\n"
 	"  -freqres <kHz>     Average kHz bandwidth of channels together before writing to measurement set.\n"
 	"                     When averaging: flagging, collecting statistics and cable length fixes are done\n"
@@ -82,6 +250,9 @@ void usage()
 	"  -noalign           Do not align GPU boxes according to the time in their header.\n"
 	"  -noantennapruning  Do not remove the flagged antennae.\n"
 	"  -noautos           Do not output auto-correlations.\n"
+	"  -nonuma            Do not divide the baselines over the NUMA nodes of the machine. By default, each\n"
+	"                     node holds the visibilities of its share of the baselines, and the threads that\n"
+	"                     read and process them are pinned to the node.\n"
 	"  -noflagautos       Do not flag auto-correlations (default for uvfits file output).\n"
 	"  -nosbgains         Do not correct for the digital gains.\n"
 	"  -noflagmissings    Do not flag missing gpu box files (only makes sense with -allowmissing).\n"
@@ -108,6 +279,14 @@ void usage()
 	"  -offline-gpubox-format Assume the GPU Box do not have an initial HDU for metadata. This is\n"
 	"                     used for offline correlation of VCS observations.\n"
 	"  -skipwrite         Skip the writing step completely: only collect statistics.\n"
+	"  -profile <file>    Write the time spent in each processing stage, per band and chunk, to the\n"
+	"                     given JSON file, together with the memory use of each chunk. With\n"
+	"                     -parallel-bands, each band writes its own file.\n"
+	"  -progress <file>   Write the progress as JSON lines to the given file: the stage, band, chunk,\n"
+	"                     items done and in total, visibilities per second and the estimated remaining\n"
+	"                     time of the stage. While a stage makes progress, a line is written about every 5 s.\n"
+	"                     With -batch, the start and end of every observation are also reported.\n"
+	"  -progress-fd <n>   Write the JSON progress lines to the already opened file descriptor n.\n"
 	"  -apply <file>      Apply a solution file after averaging. The solution file should have as many\n"
 	"                     channels as that the observation will have after the given averaging settings.\n"
 	"  -full-apply <file> Apply a solution file before averaging. The solution file should have as many\n"
@@ -128,7 +307,8 @@ int main(int argc, char **argv)
 {
 	std::cout << "Running Cotter MWA preprocessing pipeline, version " << COTTER_VERSION_STR <<
 		" (" << COTTER_VERSION_DATE << ").\n"
-		"Flagging is performed by AOFlagger " << aoflagger::AOFlagger::GetVersionString() << " (" << aoflagger::AOFlagger::GetVersionDate() << ").\n";
+		"Flagging is performed by AOFlagger " << aoflagger::AOFlagger::GetVersionString() << " (" << aoflagger::AOFlagger::GetVersionDate() << ").\n"
+		"Vector kernels use " << CPUFeatures::KernelInstructionSet() << ".\n";
 	
 	int result = 0;
 	try {
@@ -147,8 +327,11 @@ int cotterMain(int argc, const char* const* argv)
 	int argi = 1;
 	double freqRes = 0.0, timeRes = 0.0;
 	double memPercentage = 90.0, memLimit = 0.0;
+	size_t streamWindow = 0, streamMargin = 0;
+	double streamTimeout = 60.0;
 	Cotter cotter;
 	const char *outputFilename = 0;
+	const char *batchFilename = 0;
 	bool saveQualityStatistics = false;
 	bool allowMissingFiles = false;
 	size_t nCPUs = 0, sbStart = 1;
@@ -166,18 +349,12 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				++argi;
 				outputFilename = argv[argi];
-				if(isFitsFile(outputFilename))
-				{
-					cotter.SetCollectStatistics(saveQualityStatistics);
-					cotter.SetFlagAutoCorrelations(false);
-					cotter.SetOutputFormat(Cotter::FitsOutputFormat);
-				}
-				else if(isMWAFlagFile(outputFilename))
-				{
-					cotter.SetCollectStatistics(saveQualityStatistics);
-					cotter.SetOutputFormat(Cotter::FlagsOutputFormat);
-					cotter.SetRemoveFlaggedAntennae(false);
-				}
+				setOutputFormat(cotter, outputFilename, saveQualityStatistics);
+			}
+			else if(param == "batch")
+			{
+				++argi;
+				batchFilename = argv[argi];
 			}
 			else if(param == "m")
 			{
@@ -204,6 +381,16 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				nCPUs = atoi(argv[argi]);
 			}
+			else if(param == "parallel-bands")
+			{
+				++argi;
+				cotter.SetBandProcessCount(atoi(argv[argi]));
+			}
+			else if(param == "channel-processes")
+			{
+				++argi;
+				cotter.SetChannelProcessCount(atoi(argv[argi]));
+			}
 			else if(param == "mem")
 			{
 				++argi;
@@ -214,6 +401,28 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				memLimit = atof(argv[argi]);
 			}
+			else if(param == "freqpartition")
+			{
+				cotter.SetFrequencyPartitioning(true);
+			}
+			else if(param == "stream")
+			{
+				++argi;
+				streamWindow = atoi(argv[argi]);
+				++argi;
+				streamMargin = atoi(argv[argi]);
+				if(streamWindow == 0)
+					throw std::runtime_error("The window of -stream should be at least one scan");
+			}
+			else if(param == "stream-timeout")
+			{
+				++argi;
+				streamTimeout = atof(argv[argi]);
+			}
+			else if(param == "checkpoint")
+			{
+				cotter.SetCheckpointing(true);
+			}
 			else if(param == "noflagautos")
 			{
 				cotter.SetFlagAutoCorrelations(false);
@@ -246,6 +455,10 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				cotter.SetRemoveFlaggedAntennae(false);
 			}
+			else if(param == "nonuma")
+			{
+				cotter.SetNumaAware(false);
+			}
 			else if(param == "noautos")
 			{
 				cotter.SetRemoveAutoCorrelations(true);
@@ -360,6 +573,21 @@ int cotterMain(int argc, const char* const* argv)
 				if(memLimit == 0.0)
 					memLimit = 2.0;
 			}
+			else if(param == "profile")
+			{
+				++argi;
+				cotter.SetProfileFilename(argv[argi]);
+			}
+			else if(param == "progress")
+			{
+				++argi;
+				ProgressStream::Instance().Open(argv[argi]);
+			}
+			else if(param == "progress-fd")
+			{
+				++argi;
+				ProgressStream::Instance().OpenDescriptor(atoi(argv[argi]));
+			}
 			else if(param == "saveqs")
 			{
 				++argi;
@@ -414,65 +642,19 @@ int cotterMain(int argc, const char* const* argv)
 		++argi;
 	}
 	
-	if(argc == 1 || unsortedFiles.empty())
-	{
-		usage();
-		return -1;
-	}
-	
-	size_t gpuBoxCount = 0;
-	std::vector<std::vector<std::string> > fileSets;
-	for(std::vector<std::string>::const_iterator i=unsortedFiles.begin(); i!=unsortedFiles.end(); ++i)
-	{
-		checkInputFilename(*i);
-		size_t gpuFilenameNumber = gpuBoxNumberFromFilename(*i);
-		if(gpuFilenameNumber < sbStart-1)
-		{
-			std::ostringstream errmsg;
-			errmsg << "A GPU box file was specified with number " << (gpuFilenameNumber+1) << ", which is lower than the expected start number of " << sbStart << ".";
-			throw std::runtime_error(errmsg.str());
-		}
-		size_t gpuNum = gpuFilenameNumber - sbStart + 1;
-		size_t timeNum = timeStepNumberFromFilename(*i);
-		if(fileSets.size() <= timeNum)
-			fileSets.resize(timeNum+1);
-		std::vector<std::string> &timestepSets = fileSets[timeNum];
-		if(timestepSets.size() <= gpuNum)
-			timestepSets.resize(gpuNum+1);
-		if(!timestepSets[gpuNum].empty())
-		{
-			std::ostringstream errmsg;
-			errmsg << "Two files in the list describe the same raw gpu box file: did you specify the same file more than once?\nGPU box number: " << (gpuNum+sbStart)
-				<< " time range index: " << timeNum;
-			throw std::runtime_error(errmsg.str());
-		}
-		timestepSets[gpuNum] = *i;
-		if(gpuNum+1 > gpuBoxCount) gpuBoxCount = gpuNum+1;
-	}
-	
-	bool aFileIsMissing = false;
-	for(size_t j=0; j!=fileSets.size(); ++j)
-	{
-		for(size_t i=0; i!=cotter.SubbandCount(); ++i)
-		{
-			if(i >= fileSets[j].size() || fileSets[j][i].empty()) {
-				std::ostringstream errstr;
-				std::cout << "Missing information from GPU box " << (i+sbStart) << ", timerange " << j << ". Maybe you are missing an input file?\n";
-				aFileIsMissing = true;
-			}
-		}
-	}
-	if(aFileIsMissing && !allowMissingFiles)
+	std::vector<BatchEntry> batch;
+	if(batchFilename != 0)
 	{
-		throw std::runtime_error("Because at least one input file is missing, I will refuse to continue. This is to prevent download errors cause incomplete observations. If you are missing input files because some of the files are not available (e.g. because of a correlator GPU box failure), specify '-allowmissing' to continue with missing files.");
+		if(!unsortedFiles.empty() || outputFilename != 0)
+			throw std::runtime_error("With -batch, the gpubox files and output filenames are given in the manifest");
+		batch = readBatchManifest(batchFilename);
+		setOutputFormat(cotter, batch.front().outputFilename, saveQualityStatistics);
 	}
-	if(gpuBoxCount > cotter.SubbandCount())
+	else if(argc == 1 || unsortedFiles.empty())
 	{
-		std::ostringstream errstr;
-		errstr << "The highest GPU box number (" << gpuBoxCount << ") is higher than the number of subbands (" << cotter.SubbandCount() << "). Either a wrong -sbcount was specified, or files are not correctly named.";
-		throw std::runtime_error(errstr.str());
+		usage();
+		return -1;
 	}
-	std::cout << "Input filenames succesfully parsed: using " << unsortedFiles.size() << " files covering " << fileSets.size() << " timeranges from " << gpuBoxCount << " GPU boxes.\n";
 	
 	std::ostringstream commandLineStr;
 	commandLineStr << argv[0];
@@ -480,8 +662,8 @@ int cotterMain(int argc, const char* const* argv)
 		commandLineStr << ' ' << '\"' << argv[i] << '\"';
 	cotter.SetHistoryInfo(commandLineStr.str());
 	
-	long int pageCount = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
-	int64_t memSize = (int64_t) pageCount * (int64_t) pageSize;
+	// Physical memory, or the memory limit of the cgroup that we are running in
+	int64_t memSize = MemoryPlanner::AvailableMemory();
 	double memSizeInGB = (double) memSize / (1024.0*1024.0*1024.0);
 	if(memLimit == 0.0)
 		std::cout << "Detected " << round(memSizeInGB*10.0)/10.0 << " GB of system memory.\n";
@@ -491,15 +673,46 @@ int cotterMain(int argc, const char* const* argv)
 		memPercentage = 100.0;
 	}
 	
-	cotter.SetFileSets(fileSets);
-	cotter.SetMaxBufferSize(memSize*memPercentage/(100*(sizeof(float)*2+1)));
+	if(streamWindow != 0)
+		cotter.SetStreaming(streamWindow, streamMargin, streamTimeout);
+	cotter.SetMemoryLimit(int64_t(memSize*memPercentage/100.0));
 	if(nCPUs == 0)
 		cotter.SetThreadCount(sysconf(_SC_NPROCESSORS_ONLN));
 	else
 		cotter.SetThreadCount(nCPUs);
-	if(outputFilename != 0)
-		cotter.SetOutputFilename(outputFilename);
-	cotter.Run(timeRes, freqRes);
+	if(batch.empty())
+	{
+		cotter.SetFileSets(makeFileSets(unsortedFiles, sbStart, cotter.SubbandCount(), allowMissingFiles));
+		if(outputFilename != 0)
+			cotter.SetOutputFilename(outputFilename);
+		cotter.Run(timeRes, freqRes);
+	}
+	else {
+		for(size_t i=0; i!=batch.size(); ++i)
+		{
+			const BatchEntry &entry = batch[i];
+			std::cout << "Processing observation " << (i+1) << " of " << batch.size() << " in the batch: " << entry.metaFilename << '\n';
+			try {
+				cotter.SetMetaFilename(entry.metaFilename.c_str());
+				cotter.SetOutputFilename(entry.outputFilename);
+				cotter.SetFileSets(makeFileSets(entry.gpuFilenames, sbStart, cotter.SubbandCount(), allowMissingFiles));
+				std::vector<std::string> nextFiles;
+				if(i+1 != batch.size())
+				{
+					nextFiles.push_back(batch[i+1].metaFilename);
+					nextFiles.insert(nextFiles.end(), batch[i+1].gpuFilenames.begin(), batch[i+1].gpuFilenames.end());
+				}
+				cotter.SetPrefetchFiles(nextFiles);
+				ProgressStream::Instance().StartObservation(entry.metaFilename, i, batch.size());
+				cotter.Run(timeRes, freqRes);
+				ProgressStream::Instance().FinishObservation();
+			} catch(std::exception &e)
+			{
+				throw std::runtime_error("Processing observation " + entry.metaFilename + " failed: " + e.what());
+			}
+		}
+	}
+	ProgressStream::Instance().Finish();
 	
 	return 0;
 }
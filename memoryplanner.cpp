@@ -0,0 +1,151 @@
+#include "memoryplanner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+namespace {
+	// The flagger works on copies of the visibilities and creates several temporary images
+	// (e.g. for the Stokes conversion, the high-pass filter and the SumThreshold passes)
+	// while processing a baseline. This is an estimate of the number of time-frequency
+	// images that one flagging thread has allocated at its peak.
+	const size_t FlaggerImagesPerThread = 16;
+
+	// The image sets and masks store a row with its width rounded up for alignment.
+	size_t alignedWidth(size_t width)
+	{
+		return (width + 7) / 8 * 8;
+	}
+
+	std::string formatBytes(int64_t bytes)
+	{
+		std::ostringstream str;
+		const double gb = double(bytes) / (1024.0*1024.0*1024.0);
+		if(gb >= 1.0)
+			str << std::round(gb*10.0)/10.0 << " GB";
+		else
+			str << std::round(double(bytes) / (1024.0*1024.0)) << " MB";
+		return str.str();
+	}
+}
+
+const size_t MemoryPlanner::MinAccurateScanCount;
+
+MemoryPlanner::Plan MemoryPlanner::Estimate(size_t scansPerChunk, size_t threadCount) const
+{
+	const int64_t
+		baselineCount = _antennaCount * (_antennaCount + 1) / 2,
+		nPol = 4,
+		imageSize = int64_t(_channelCount) * alignedWidth(scansPerChunk);
+
+	Plan plan;
+	plan.scansPerChunk = scansPerChunk;
+	plan.chunkCount = scansPerChunk == 0 ? 0 : (_scanCount + scansPerChunk - 1) / scansPerChunk;
+	plan.threadCount = threadCount;
+	// One image set of 8 float images (real and imaginary for each polarization) per baseline
+	plan.visibilityBytes = baselineCount * 8 * imageSize * sizeof(float);
+	// The pooled mask of each baseline and its shared fully set mask, plus the correlator and fully set masks of the chunk
+	plan.flagMaskBytes = (baselineCount + 3) * imageSize * sizeof(bool);
+	if(_rfiDetection)
+		plan.flagMaskBytes += threadCount * imageSize * sizeof(bool);
+	plan.flaggerBytes = _rfiDetection ? int64_t(threadCount) * FlaggerImagesPerThread * imageSize * sizeof(float) : 0;
+	// Every reader thread has the correlation matrix of one gpubox file in flight
+	plan.readerBytes = int64_t(threadCount) * _channelsPerFile * baselineCount * nPol * sizeof(std::complex<float>);
+	// Averaging keeps a row of data, unflagged data, flags, weights and counts per baseline
+	plan.averagingBytes = baselineCount * _avgChannelCount * nPol *
+		(2 * sizeof(std::complex<float>) + sizeof(bool) + sizeof(float) + sizeof(size_t));
+	// The row being written and the copy in the writer thread
+	plan.outputBytes = 2 * int64_t(_channelCount) * nPol * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float));
+	return plan;
+}
+
+MemoryPlanner::Plan MemoryPlanner::Make(int64_t memoryLimit, size_t maxThreadCount) const
+{
+	auto largestChunk = [&](size_t threadCount) -> Plan
+	{
+		// The usage is nearly linear in the chunk size, so solve for it and correct for the rounding
+		const Plan empty = Estimate(0, threadCount);
+		const int64_t perScan = Estimate(8, threadCount).TotalBytes() - empty.TotalBytes();
+		int64_t scans = perScan <= 0 ? _scanCount : 8 * (memoryLimit - empty.TotalBytes()) / perScan;
+		scans = std::max<int64_t>(1, std::min<int64_t>(scans, _scanCount));
+		Plan plan = Estimate(scans, threadCount);
+		while(plan.scansPerChunk > 1 && plan.TotalBytes() > memoryLimit)
+			plan = Estimate(plan.scansPerChunk - 1, threadCount);
+		return plan;
+	};
+
+	maxThreadCount = std::max<size_t>(1, maxThreadCount);
+	Plan plan = largestChunk(maxThreadCount);
+	const size_t requiredScans = std::min(_scanCount, MinAccurateScanCount);
+	if(plan.scansPerChunk < requiredScans && largestChunk(1).scansPerChunk >= requiredScans)
+	{
+		// Fewer threads leave enough memory for chunks that can be flagged accurately
+		size_t threadCount = maxThreadCount;
+		while(plan.scansPerChunk < requiredScans)
+		{
+			--threadCount;
+			plan = largestChunk(threadCount);
+		}
+	}
+	return plan;
+}
+
+void MemoryPlanner::Print(const Plan& plan, int64_t memoryLimit, std::ostream& stream) const
+{
+	stream
+		<< "Memory plan for " << _channelCount << " channels and " << _antennaCount << " antennas: "
+		<< plan.chunkCount << " chunk(s) of at most " << plan.scansPerChunk << " scans, " << plan.threadCount << " threads.\n"
+		<< "  Visibilities:      " << formatBytes(plan.visibilityBytes) << '\n'
+		<< "  Flag masks:        " << formatBytes(plan.flagMaskBytes) << '\n'
+		<< "  Flagger workspace: " << formatBytes(plan.flaggerBytes) << '\n'
+		<< "  Reader buffers:    " << formatBytes(plan.readerBytes) << '\n'
+		<< "  Averaging buffers: " << formatBytes(plan.averagingBytes) << '\n'
+		<< "  Output rows:       " << formatBytes(plan.outputBytes) << '\n'
+		<< "  Total:             " << formatBytes(plan.TotalBytes()) << " of " << formatBytes(memoryLimit) << " available.\n";
+}
+
+void MemoryPlanner::PrintUsage(const Plan& plan, const MemoryTracker::Usage& usage, std::ostream& stream)
+{
+	stream
+		<< "Peak memory use (planned):\n"
+		<< "  Visibilities:      " << formatBytes(usage.peak[MemoryTracker::ImageSets]) << " (" << formatBytes(plan.visibilityBytes) << ")\n"
+		<< "  Flag masks:        " << formatBytes(usage.peak[MemoryTracker::FlagMasks]) << " (" << formatBytes(plan.flagMaskBytes) << ")\n"
+		<< "  Reader buffers:    " << formatBytes(usage.peak[MemoryTracker::ReaderBuffers]) << " (" << formatBytes(plan.readerBytes) << ")\n"
+		<< "  Averaging buffers: " << formatBytes(usage.peak[MemoryTracker::AveragingBuffers]) << " (" << formatBytes(plan.averagingBytes) << ")\n"
+		<< "  Output rows:       " << formatBytes(usage.peak[MemoryTracker::WriterRows]) << " (" << formatBytes(plan.outputBytes) << ")\n"
+		<< "  Untracked:         " << formatBytes(usage.PeakUntracked()) << " (" << formatBytes(plan.flaggerBytes) << " flagger workspace)\n"
+		<< "  Resident:          " << formatBytes(usage.peakResident) << " (" << formatBytes(plan.TotalBytes()) << ")\n";
+}
+
+int64_t MemoryPlanner::AvailableMemory()
+{
+	long int pageCount = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
+	int64_t memSize = (int64_t) pageCount * (int64_t) pageSize;
+
+	// cgroup v2 and v1 respectively
+	int64_t cgroupLimit = readCGroupLimit("/sys/fs/cgroup/memory.max");
+	if(cgroupLimit == 0)
+		cgroupLimit = readCGroupLimit("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+	if(cgroupLimit != 0 && cgroupLimit < memSize)
+		memSize = cgroupLimit;
+	return memSize;
+}
+
+int64_t MemoryPlanner::readCGroupLimit(const char* filename)
+{
+	std::ifstream file(filename);
+	std::string value;
+	if(!file || !(file >> value) || value == "max")
+		return 0;
+	try {
+		return std::stoll(value);
+	} catch(std::exception&) {
+		return 0;
+	}
+}
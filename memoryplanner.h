@@ -0,0 +1,85 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include "memorytracker.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+/**
+ * Estimates the memory used by all the large allocations of the pipeline, and uses this
+ * to choose how many scans are processed per chunk and with how many threads.
+ */
+class MemoryPlanner
+{
+	public:
+		struct Plan
+		{
+			size_t scansPerChunk, chunkCount, threadCount;
+			int64_t visibilityBytes, flagMaskBytes, flaggerBytes, readerBytes, averagingBytes, outputBytes;
+
+			int64_t TotalBytes() const
+			{
+				return visibilityBytes + flagMaskBytes + flaggerBytes + readerBytes + averagingBytes + outputBytes;
+			}
+		};
+
+		MemoryPlanner(size_t antennaCount, size_t channelCount, size_t channelsPerFile, size_t scanCount) :
+			_antennaCount(antennaCount),
+			_channelCount(channelCount),
+			_channelsPerFile(channelsPerFile),
+			_scanCount(scanCount),
+			_rfiDetection(true),
+			_avgChannelCount(0)
+		{ }
+
+		void SetRFIDetection(bool rfiDetection) { _rfiDetection = rfiDetection; }
+
+		/** Set the number of channels after frequency averaging, or 0 when there is no averaging. */
+		void SetAveragedChannelCount(size_t avgChannelCount) { _avgChannelCount = avgChannelCount; }
+
+		/**
+		 * Estimate the memory used when processing chunks of the given number of scans.
+		 */
+		Plan Estimate(size_t scansPerChunk, size_t threadCount) const;
+
+		/**
+		 * Choose the largest chunk size that fits in the memory limit. When the full observation
+		 * does not fit with the given number of threads, fewer threads are used if that makes
+		 * the chunks large enough to be flagged accurately.
+		 */
+		Plan Make(int64_t memoryLimit, size_t maxThreadCount) const;
+
+		/** Whether all scans fit in a single chunk. */
+		bool FitsInOneChunk(int64_t memoryLimit, size_t threadCount) const
+		{
+			return Estimate(_scanCount, threadCount).TotalBytes() <= memoryLimit;
+		}
+
+		void Print(const Plan& plan, int64_t memoryLimit, std::ostream& stream) const;
+
+		/**
+		 * Compare the plan with the high-water marks that were measured. The flagger workspace
+		 * is not tracked, and is part of the resident memory that is not in a tracked buffer.
+		 */
+		static void PrintUsage(const Plan& plan, const MemoryTracker::Usage& usage, std::ostream& stream);
+
+		/**
+		 * The memory that this process can use: the physical memory, limited by the memory
+		 * limit of the cgroup when one is set.
+		 */
+		static int64_t AvailableMemory();
+
+		/** Minimum number of scans per chunk for the flagger to be accurate. */
+		static const size_t MinAccurateScanCount = 20;
+
+	private:
+		size_t _antennaCount, _channelCount, _channelsPerFile, _scanCount;
+		bool _rfiDetection;
+		size_t _avgChannelCount;
+
+		static int64_t readCGroupLimit(const char* filename);
+};
+
+#endif
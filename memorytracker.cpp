@@ -0,0 +1,87 @@
+#include "memorytracker.h"
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+namespace {
+	std::atomic<int64_t>
+		currentBytes[MemoryTracker::SubsystemCount],
+		peakBytes[MemoryTracker::SubsystemCount],
+		totalBytes(0),
+		peakTotalBytes(0);
+
+	void raisePeak(std::atomic<int64_t>& peak, int64_t value)
+	{
+		int64_t previous = peak.load(std::memory_order_relaxed);
+		while(value > previous && !peak.compare_exchange_weak(previous, value, std::memory_order_relaxed))
+		{ }
+	}
+}
+
+void MemoryTracker::Allocate(Subsystem subsystem, int64_t bytes)
+{
+	raisePeak(peakBytes[subsystem], currentBytes[subsystem].fetch_add(bytes, std::memory_order_relaxed) + bytes);
+	raisePeak(peakTotalBytes, totalBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+}
+
+void MemoryTracker::Release(Subsystem subsystem, int64_t bytes)
+{
+	currentBytes[subsystem].fetch_sub(bytes, std::memory_order_relaxed);
+	totalBytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+MemoryTracker::Usage MemoryTracker::Sample()
+{
+	Usage usage;
+	for(size_t i=0; i!=SubsystemCount; ++i)
+	{
+		usage.current[i] = currentBytes[i].load(std::memory_order_relaxed);
+		usage.peak[i] = peakBytes[i].load(std::memory_order_relaxed);
+	}
+	usage.tracked = totalBytes.load(std::memory_order_relaxed);
+	usage.peakTracked = peakTotalBytes.load(std::memory_order_relaxed);
+	usage.resident = readStatusField("VmRSS:");
+	usage.peakResident = readStatusField("VmHWM:");
+	return usage;
+}
+
+void MemoryTracker::ResetPeaks()
+{
+	for(size_t i=0; i!=SubsystemCount; ++i)
+		peakBytes[i].store(currentBytes[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	peakTotalBytes.store(totalBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	// Writing 5 to clear_refs resets the peak resident set size (VmHWM) of the process.
+	// This is not available on all kernels, in which case the peak covers the whole run.
+	std::ofstream clearRefs("/proc/self/clear_refs");
+	if(clearRefs)
+		clearRefs << "5";
+}
+
+const char* MemoryTracker::Name(Subsystem subsystem)
+{
+	switch(subsystem)
+	{
+		case ImageSets: return "image sets";
+		case FlagMasks: return "flag masks";
+		case ReaderBuffers: return "reader buffers";
+		case AveragingBuffers: return "averaging buffers";
+		case WriterRows: return "writer rows";
+		default: return "unknown";
+	}
+}
+
+int64_t MemoryTracker::readStatusField(const char* field)
+{
+	// Fields in /proc/self/status are given in kB, e.g. "VmRSS:     123456 kB"
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	const size_t fieldLength = strlen(field);
+	while(std::getline(status, line))
+	{
+		if(line.compare(0, fieldLength, field) == 0)
+			return std::stoll(line.substr(fieldLength)) * 1024;
+	}
+	return 0;
+}
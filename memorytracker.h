@@ -0,0 +1,70 @@
+#ifndef MEMORY_TRACKER_H
+#define MEMORY_TRACKER_H
+
+#include <cstdint>
+
+/**
+ * Counts the bytes held by the large buffers of the pipeline, per subsystem, together
+ * with their high-water marks. Memory that is not allocated by cotter itself, like the
+ * flagger workspace and the casacore caches, is covered by sampling the resident set
+ * size of the process. The counters are always active; they are only updated when
+ * buffers are (re)allocated, which is rare compared to the processing.
+ */
+class MemoryTracker
+{
+	public:
+		enum Subsystem {
+			ImageSets,
+			FlagMasks,
+			ReaderBuffers,
+			AveragingBuffers,
+			WriterRows,
+			SubsystemCount
+		};
+
+		struct Usage
+		{
+			int64_t current[SubsystemCount], peak[SubsystemCount];
+			/** Sum over all subsystems, and the high-water mark of that sum. */
+			int64_t tracked, peakTracked;
+			/** Resident set size of the process, and its high-water mark. */
+			int64_t resident, peakResident;
+
+			/** Resident memory at the peak that is not in one of the tracked buffers, e.g. casacore caches or fragmentation. */
+			int64_t PeakUntracked() const { return peakResident > peakTracked ? peakResident - peakTracked : 0; }
+		};
+
+		/** RAII allocation, for buffers that live within a single scope. */
+		class Allocation
+		{
+			public:
+				Allocation(Subsystem subsystem, int64_t bytes) : _subsystem(subsystem), _bytes(bytes)
+				{
+					Allocate(_subsystem, _bytes);
+				}
+				~Allocation() { Release(_subsystem, _bytes); }
+
+				Allocation(const Allocation&) = delete;
+				Allocation& operator=(const Allocation&) = delete;
+
+			private:
+				Subsystem _subsystem;
+				int64_t _bytes;
+		};
+
+		static void Allocate(Subsystem subsystem, int64_t bytes);
+		static void Release(Subsystem subsystem, int64_t bytes);
+
+		/** Current usage and the high-water marks since the last call to ResetPeaks(). */
+		static Usage Sample();
+
+		/** Start new high-water marks from the current usage, e.g. at the start of a chunk. */
+		static void ResetPeaks();
+
+		static const char* Name(Subsystem subsystem);
+
+	private:
+		static int64_t readStatusField(const char* field);
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "memorytracker.h"
+#include "pipelinetest.h"
+
+#include <thread>
+
+/**
+ * Checks the counters of the MemoryTracker: allocations from several threads at the same time,
+ * the high-water marks and their reset, and that a run of the pipeline releases all the
+ * buffers that it tracks.
+ */
+class MemoryTrackerTest
+{
+	public:
+		MemoryTrackerTest(const std::string& tempDirectory) : _tempDirectory(tempDirectory), _failed(false)
+		{ }
+
+		bool Run()
+		{
+			checkCounters();
+			checkPipeline();
+			return !_failed;
+		}
+
+	private:
+		void expect(bool condition, const std::string& description)
+		{
+			std::cout << (condition ? "OK: " : "FAILED: ") << description << '\n';
+			if(!condition)
+				_failed = true;
+		}
+
+		void checkCounters()
+		{
+			const size_t threadCount = 4, repeatCount = 10000;
+			const int64_t bytes = 1000;
+			std::vector<std::thread> threads;
+			for(size_t t=0; t!=threadCount; ++t)
+			{
+				threads.emplace_back([&]() {
+					for(size_t i=0; i!=repeatCount; ++i)
+					{
+						MemoryTracker::Allocate(MemoryTracker::ReaderBuffers, bytes);
+						MemoryTracker::Release(MemoryTracker::ReaderBuffers, bytes);
+					}
+				});
+			}
+			for(std::thread& thread : threads)
+				thread.join();
+			MemoryTracker::Usage usage = MemoryTracker::Sample();
+			expect(usage.current[MemoryTracker::ReaderBuffers] == 0, "concurrent allocations are all released");
+			expect(usage.peak[MemoryTracker::ReaderBuffers] >= bytes && usage.peak[MemoryTracker::ReaderBuffers] <= int64_t(threadCount) * bytes,
+				"peak of concurrent allocations is between one and all threads");
+
+			MemoryTracker::ResetPeaks();
+			{
+				MemoryTracker::Allocation imageSets(MemoryTracker::ImageSets, 3000);
+				MemoryTracker::Allocate(MemoryTracker::FlagMasks, 2000);
+				MemoryTracker::Release(MemoryTracker::FlagMasks, 2000);
+				usage = MemoryTracker::Sample();
+				expect(usage.current[MemoryTracker::ImageSets] == 3000 && usage.tracked == 3000, "current usage of a scoped allocation");
+				expect(usage.peak[MemoryTracker::FlagMasks] == 2000 && usage.peakTracked == 5000, "peaks of overlapping allocations");
+			}
+			usage = MemoryTracker::Sample();
+			expect(usage.current[MemoryTracker::ImageSets] == 0 && usage.tracked == 0, "scoped allocation is released");
+			MemoryTracker::ResetPeaks();
+			usage = MemoryTracker::Sample();
+			expect(usage.peak[MemoryTracker::ImageSets] == 0 && usage.peakTracked == 0, "peaks restart from the current usage");
+			expect(usage.resident > 0 && usage.peakResident >= usage.resident, "resident set size is sampled");
+		}
+
+		void checkPipeline()
+		{
+			const size_t threadCount = 2;
+			PipelineTest test(_tempDirectory, "memorytrackertest", 2, 20);
+			{
+				Cotter cotter;
+				test.Configure(cotter, test.OutputFilename("averaged"), threadCount, test.FullMemoryLimit(threadCount));
+				// Time averaging, so that the averaging buffers are used as well
+				cotter.Run(1.0, 0.0);
+			}
+			const MemoryTracker::Usage usage = MemoryTracker::Sample();
+			const MemoryTracker::Subsystem usedSubsystems[] = {
+				MemoryTracker::ImageSets, MemoryTracker::FlagMasks, MemoryTracker::ReaderBuffers, MemoryTracker::AveragingBuffers };
+			for(MemoryTracker::Subsystem subsystem : usedSubsystems)
+				expect(usage.peak[subsystem] > 0, std::string("the pipeline tracks its ") + MemoryTracker::Name(subsystem));
+			for(size_t i=0; i!=MemoryTracker::SubsystemCount; ++i)
+				expect(usage.current[i] == 0, std::string("the pipeline releases its ") + MemoryTracker::Name(MemoryTracker::Subsystem(i)));
+		}
+
+		std::string _tempDirectory;
+		bool _failed;
+};
+
+int main(int argc, char* argv[])
+{
+	const std::string tempDirectory = argc > 1 ? argv[1] : "/tmp";
+	try {
+		MemoryTrackerTest test(tempDirectory);
+		return test.Run() ? 0 : 1;
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+}
@@ -1,4 +1,6 @@
 #include "mswriter.h"
+#include "checkpoint.h"
+#include "profiler.h"
 
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
@@ -7,14 +9,22 @@
 #include <casacore/tables/Tables/ArrColDesc.h>
 #include <casacore/tables/Tables/ScalarColumn.h>
 #include <casacore/tables/Tables/SetupNewTab.h>
+#include <casacore/tables/Tables/TableColumn.h>
 #include <casacore/tables/Tables/TableRecord.h>
 
+#include <casacore/casa/Arrays/ArrayLogical.h>
+#include <casacore/casa/Arrays/ArrayMath.h>
+#include <casacore/casa/Arrays/Slicer.h>
 #include <casacore/casa/Containers/Record.h>
 
 #include <casacore/measures/TableMeasures/TableMeasDesc.h>
 
 #include <casacore/measures/Measures/MFrequency.h>
 
+#include <algorithm>
+#include <map>
+#include <tuple>
+
 using namespace casacore;
 
 class MSWriterData
@@ -49,9 +59,15 @@ private:
 MSWriter::MSWriter(const std::string& filename) :
 	_data(new MSWriterData()),
 	_isInitialized(false),
+	_isResumed(false),
 	_rowIndex(0),
 	_filename(filename),
-	_useDysco(false)
+	_useDysco(false),
+	_isPartitioned(false),
+	_isFirstPartition(true),
+	_partitionStart(0),
+	_partitionChannelCount(0),
+	_rowTimer("casacore put")
 {
 }
 
@@ -72,10 +88,32 @@ void MSWriter::EnableCompression(size_t dataBitRate, size_t weightBitRate, const
 	_data->_dyscoDistTruncation = distTruncation;
 }
 
+void MSWriter::SetChannelPartition(const std::string& bandName, const std::vector<ChannelInfo>& bandChannels, double refFreq, double totalBandwidth, size_t channelStart, bool isFirstPartition)
+{
+	if(_useDysco)
+		throw std::runtime_error("Dysco compression can not be combined with writing a band in partitions");
+	_isPartitioned = true;
+	_isFirstPartition = isFirstPartition;
+	_partitionStart = channelStart;
+	_bandInfo.name = bandName;
+	_bandInfo.channels = bandChannels;
+	_bandInfo.refFreq = refFreq;
+	_bandInfo.totalBandwidth = totalBandwidth;
+	_bandInfo.flagRow = false;
+}
+
 void MSWriter::initialize()
 {
 	_isInitialized = true;
 	
+	if(_isResumed || (_isPartitioned && !_isFirstPartition))
+	{
+		// The set and its sub tables have been written by the first partition or the interrupted run
+		_data->_ms = MeasurementSet(_filename, Table::Update);
+		initializeColumns();
+		return;
+	}
+	
 	TableDesc tableDesc = MS::requiredTableDesc();
 	
 	DataManagerCtor dyscoConstructor = 0;
@@ -133,6 +171,20 @@ void MSWriter::initialize()
 	MSSource sourceTable(newSourceTable);
 	ms.rwKeywordSet().defineTable(MS::keywordName(casacore::MSMainEnums::SOURCE), sourceTable);
 	
+	initializeColumns();
+	
+	writeBandInfo();
+	writeAntennae();
+	writePolarizationForLinearPols();
+	writeField();
+	writeSource();
+	writeObservation();
+	writeHistoryItem();
+}
+
+void MSWriter::initializeColumns()
+{
+	MeasurementSet &ms = _data->_ms;
 	_data->_timeCol = ScalarColumn<double>(ms, MS::columnName(casacore::MSMainEnums::TIME));
 	_data->_timeCentroidCol = ScalarColumn<double>(ms, MS::columnName(casacore::MSMainEnums::TIME_CENTROID));
 	_data->_antenna1Col = ScalarColumn<int>(ms, MS::columnName(casacore::MSMainEnums::ANTENNA1));
@@ -149,14 +201,6 @@ void MSWriter::initialize()
 	_data->_weightCol = ArrayColumn<float>(ms, MS::columnName(casacore::MSMainEnums::WEIGHT));
 	_data->_weightSpectrumCol = ArrayColumn<float>(ms, MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM));
 	_data->_flagCol = ArrayColumn<bool>(ms, MS::columnName(casacore::MSMainEnums::FLAG));
-	
-	writeBandInfo();
-	writeAntennae();
-	writePolarizationForLinearPols();
-	writeField();
-	writeSource();
-	writeObservation();
-	writeHistoryItem();
 }
 
 void MSWriterData::GetDyscoSpec(casacore::Record& dyscoSpec) const
@@ -179,6 +223,13 @@ void MSWriterData::GetDyscoSpec(casacore::Record& dyscoSpec) const
 
 void MSWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
 {
+	if(_isPartitioned)
+	{
+		if(_partitionStart + channels.size() > _bandInfo.channels.size())
+			throw std::runtime_error("Channel partition falls outside the band");
+		_partitionChannelCount = channels.size();
+		return;
+	}
 	_bandInfo.name = name;
 	_bandInfo.channels = channels;
 	_bandInfo.refFreq = refFreq;
@@ -492,35 +543,71 @@ void MSWriter::AddRows(size_t count)
 {
 	if(!_isInitialized)
 		initialize();
-	_data->_ms.addRow(count);
+	if(_isFirstPartition)
+		_data->_ms.addRow(count);
+}
+
+void MSWriter::SaveState(std::ostream& stream)
+{
+	if(!_isInitialized)
+		initialize();
+	_data->_ms.flush(true);
+	Checkpoint::Write(stream, size_t(_data->_ms.nrow()));
+	Checkpoint::Write(stream, _rowIndex);
+}
+
+void MSWriter::RestoreState(std::istream& stream)
+{
+	size_t rowCount;
+	Checkpoint::Read(stream, rowCount);
+	Checkpoint::Read(stream, _rowIndex);
+	_isResumed = true;
+	initialize();
+	MeasurementSet& ms = _data->_ms;
+	if(ms.nrow() < rowCount)
+		throw std::runtime_error("Measurement set " + _filename + " has fewer rows than its checkpoint");
+	// The rows that were added after the checkpoint are removed in one call
+	if(ms.nrow() > rowCount)
+	{
+		casacore::Vector<casacore::rownr_t> rows(ms.nrow() - rowCount);
+		indgen(rows, casacore::rownr_t(rowCount));
+		ms.removeRow(rows);
+	}
 }
 
 void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 {
-	_data->_timeCol.put(_rowIndex, time);
-	_data->_timeCentroidCol.put(_rowIndex, timeCentroid);
-	_data->_antenna1Col.put(_rowIndex, antenna1);
-	_data->_antenna2Col.put(_rowIndex, antenna2);
-	_data->_dataDescIdCol.put(_rowIndex, 0);
-	
-	casacore::Vector<double> uvwVec(3);
-	uvwVec[0] = u; uvwVec[1] = v; uvwVec[2] = w;
-	_data->_uvwCol.put(_rowIndex, uvwVec);
-	
-	_data->_intervalCol.put(_rowIndex, interval);
-	_data->_exposureCol.put(_rowIndex, interval);
-	_data->_processorIdCol.put(_rowIndex, -1);
-	_data->_scanNumberCol.put(_rowIndex, 1);
-	_data->_stateIdCol.put(_rowIndex, -1);
-	
 	size_t nPol = 4;
+	const size_t rowChannelCount = _isPartitioned ? _partitionChannelCount : _bandInfo.channels.size();
+	_rowTimer.Start();
 	
-	casacore::Vector<float> sigmaArr(nPol);
-	for(size_t p=0; p!=nPol; ++p) sigmaArr[p] = 1.0;
-	_data->_sigmaCol.put(_rowIndex, sigmaArr);
+	// Later partitions only fill in their channels
+	if(_isFirstPartition)
+	{
+		_data->_timeCol.put(_rowIndex, time);
+		_data->_timeCentroidCol.put(_rowIndex, timeCentroid);
+		_data->_antenna1Col.put(_rowIndex, antenna1);
+		_data->_antenna2Col.put(_rowIndex, antenna2);
+		_data->_dataDescIdCol.put(_rowIndex, 0);
+		
+		casacore::Vector<double> uvwVec(3);
+		uvwVec[0] = u; uvwVec[1] = v; uvwVec[2] = w;
+		_data->_uvwCol.put(_rowIndex, uvwVec);
+		
+		_data->_intervalCol.put(_rowIndex, interval);
+		_data->_exposureCol.put(_rowIndex, interval);
+		_data->_processorIdCol.put(_rowIndex, -1);
+		_data->_scanNumberCol.put(_rowIndex, 1);
+		_data->_stateIdCol.put(_rowIndex, -1);
+		
+		casacore::Vector<float> sigmaArr(nPol);
+		for(size_t p=0; p!=nPol; ++p) sigmaArr[p] = 1.0;
+		_data->_sigmaCol.put(_rowIndex, sigmaArr);
+	}
 	
-	size_t valCount = _bandInfo.channels.size() * nPol;
-	casacore::IPosition shape(2, nPol, _bandInfo.channels.size());
+	const size_t nChannels = _isPartitioned ? _partitionChannelCount : _bandInfo.channels.size();
+	size_t valCount = nChannels * nPol;
+	casacore::IPosition shape(2, nPol, nChannels);
 	casacore::Array<std::complex<float> > dataArr(shape);
 	casacore::Array<bool> flagArr(shape);
 	casacore::Array<float> weightSpectrumArr(shape);
@@ -538,18 +625,202 @@ void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_
 	
 	casacore::Vector<float> weightsArr(nPol);
 	for(size_t p=0; p!=nPol; ++p) weightsArr[p] = 0.0;
-	for(size_t ch=0; ch!=_bandInfo.channels.size(); ++ch)
+	for(size_t ch=0; ch!=nChannels; ++ch)
 	{
 		for(size_t p=0; p!=nPol; ++p)
 			weightsArr[p] += weights[ch*nPol + p];
 	}
 	
-	_data->_dataCol.put(_rowIndex, dataArr);
-	_data->_flagCol.put(_rowIndex, flagArr);
-	_data->_weightCol.put(_rowIndex, weightsArr);
-	_data->_weightSpectrumCol.put(_rowIndex, weightSpectrumArr);
+	if(_isPartitioned)
+	{
+		casacore::Slicer slicer(casacore::IPosition(2, 0, _partitionStart), shape);
+		_data->_dataCol.putSlice(_rowIndex, slicer, dataArr);
+		_data->_flagCol.putSlice(_rowIndex, slicer, flagArr);
+		_data->_weightSpectrumCol.putSlice(_rowIndex, slicer, weightSpectrumArr);
+		// The weight is the sum over all channels, so includes the previous partitions
+		if(!_isFirstPartition)
+		{
+			casacore::Vector<float> previousWeights = _data->_weightCol.get(_rowIndex);
+			for(size_t p=0; p!=nPol; ++p)
+				weightsArr[p] += previousWeights[p];
+		}
+		_data->_weightCol.put(_rowIndex, weightsArr);
+	}
+	else {
+		_data->_dataCol.put(_rowIndex, dataArr);
+		_data->_flagCol.put(_rowIndex, flagArr);
+		_data->_weightCol.put(_rowIndex, weightsArr);
+		_data->_weightSpectrumCol.put(_rowIndex, weightSpectrumArr);
+	}
 	
 	++_rowIndex;
+	_rowTimer.Stop(rowChannelCount * nPol * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float)));
+}
+
+void MSWriter::MergeChannelPartition(const std::string& filename, const std::string& partFilename, size_t channelStart)
+{
+	MeasurementSet ms(filename, Table::Update), partMS(partFilename);
+	const size_t nRow = ms.nrow();
+	if(partMS.nrow() != nRow)
+		throw std::runtime_error("Can not merge " + partFilename + " into " + filename + ": the number of rows differs");
+	
+	ScalarColumn<double>
+		timeCol(ms, MS::columnName(casacore::MSMainEnums::TIME)),
+		partTimeCol(partMS, MS::columnName(casacore::MSMainEnums::TIME));
+	ArrayColumn<std::complex<float> >
+		dataCol(ms, MS::columnName(casacore::MSMainEnums::DATA)),
+		partDataCol(partMS, MS::columnName(casacore::MSMainEnums::DATA));
+	ArrayColumn<bool>
+		flagCol(ms, MS::columnName(casacore::MSMainEnums::FLAG)),
+		partFlagCol(partMS, MS::columnName(casacore::MSMainEnums::FLAG));
+	ArrayColumn<float>
+		weightCol(ms, MS::columnName(casacore::MSMainEnums::WEIGHT)),
+		partWeightCol(partMS, MS::columnName(casacore::MSMainEnums::WEIGHT)),
+		weightSpectrumCol(ms, MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM)),
+		partWeightSpectrumCol(partMS, MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM));
+	if(nRow == 0)
+		return;
+	const casacore::IPosition partShape = partDataCol.shape(0);
+	if(channelStart + partShape[1] > size_t(dataCol.shape(0)[1]))
+		throw std::runtime_error("Can not merge " + partFilename + " into " + filename + ": its channels fall outside the band");
+	
+	// The columns are copied in blocks of rows, which is much faster than row by row
+	const size_t blockSize = std::max<size_t>(1, (size_t(64)<<20) / (partShape.product() * sizeof(std::complex<float>)));
+	const casacore::Slicer channelSlicer(casacore::IPosition(2, 0, channelStart), partShape);
+	for(size_t blockStart = 0; blockStart < nRow; blockStart += blockSize)
+	{
+		const size_t blockRows = std::min(blockSize, nRow - blockStart);
+		const casacore::Slicer rowSlicer(casacore::IPosition(1, blockStart), casacore::IPosition(1, blockRows));
+		if(!allEQ(timeCol.getColumnRange(rowSlicer), partTimeCol.getColumnRange(rowSlicer)))
+			throw std::runtime_error("Can not merge " + partFilename + " into " + filename + ": the times of the rows differ");
+		dataCol.putColumnRange(rowSlicer, channelSlicer, partDataCol.getColumnRange(rowSlicer));
+		flagCol.putColumnRange(rowSlicer, channelSlicer, partFlagCol.getColumnRange(rowSlicer));
+		weightSpectrumCol.putColumnRange(rowSlicer, channelSlicer, partWeightSpectrumCol.getColumnRange(rowSlicer));
+		// The weight is the sum over all channels
+		casacore::Array<float> weights = weightCol.getColumnRange(rowSlicer);
+		weights += partWeightCol.getColumnRange(rowSlicer);
+		weightCol.putColumnRange(rowSlicer, weights);
+	}
+}
+
+void MSWriter::MergeQualityStatistics(const std::string& filename, const std::string& statisticsFilename)
+{
+	const char* kindTableName = "QUALITY_KIND_NAME";
+	const char* statisticTableNames[] = { "QUALITY_TIME_STATISTIC", "QUALITY_FREQUENCY_STATISTIC", "QUALITY_BASELINE_STATISTIC", "QUALITY_BASELINE_TIME_STATISTIC" };
+	Table set(filename, Table::Update);
+	const Table source(statisticsFilename);
+	if(!source.keywordSet().isDefined(kindTableName))
+		return;
+	// Tables that the set does not have yet are created empty, with the layout of those of the source
+	for(size_t i=0; i!=5; ++i)
+	{
+		const std::string name = (i==0) ? kindTableName : statisticTableNames[i-1];
+		if(source.keywordSet().isDefined(name) && !set.keywordSet().isDefined(name))
+		{
+			Table(statisticsFilename + "/" + name).deepCopy(filename + "/" + name, Table::New, false, Table::AipsrcEndian, true);
+			set.rwKeywordSet().defineTable(name, Table(filename + "/" + name));
+		}
+	}
+	
+	// The kinds are numbered per set, so they are matched by name
+	Table
+		kindTable(filename + "/" + kindTableName, Table::Update),
+		sourceKindTable(statisticsFilename + "/" + kindTableName);
+	TableColumn
+		kindIdCol(kindTable, "KIND_ID"),
+		sourceKindIdCol(sourceKindTable, "KIND_ID");
+	ScalarColumn<String>
+		kindNameCol(kindTable, "NAME"),
+		sourceKindNameCol(sourceKindTable, "NAME");
+	int nextKindId = 0;
+	for(rownr_t row=0; row!=kindTable.nrow(); ++row)
+		nextKindId = std::max(nextKindId, kindIdCol.asInt(row) + 1);
+	std::map<int, int> kindIds;
+	for(rownr_t sourceRow=0; sourceRow!=sourceKindTable.nrow(); ++sourceRow)
+	{
+		const String name = sourceKindNameCol(sourceRow);
+		rownr_t row = 0;
+		while(row != kindTable.nrow() && kindNameCol(row) != name)
+			++row;
+		if(row == kindTable.nrow())
+		{
+			kindTable.addRow();
+			kindIdCol.putScalar(row, nextKindId);
+			kindNameCol.put(row, name);
+			++nextKindId;
+		}
+		kindIds[sourceKindIdCol.asInt(sourceRow)] = kindIdCol.asInt(row);
+	}
+	
+	// A statistic is identified by its kind and those of the time, frequency and antennas that its table has
+	typedef std::tuple<int, double, double, int, int> Key;
+	for(const char* name : statisticTableNames)
+	{
+		if(!source.keywordSet().isDefined(name))
+			continue;
+		Table
+			table(filename + "/" + name, Table::Update),
+			sourceTable(statisticsFilename + "/" + name);
+		const bool
+			hasTime = table.tableDesc().isColumn("TIME"),
+			hasAntennas = table.tableDesc().isColumn("ANTENNA1");
+		TableColumn
+			kindCol(table, "KIND_ID"), sourceKindCol(sourceTable, "KIND_ID"),
+			frequencyCol(table, "FREQUENCY"), sourceFrequencyCol(sourceTable, "FREQUENCY"),
+			timeCol, sourceTimeCol, antenna1Col, sourceAntenna1Col, antenna2Col, sourceAntenna2Col;
+		if(hasTime)
+		{
+			timeCol.attach(table, "TIME");
+			sourceTimeCol.attach(sourceTable, "TIME");
+		}
+		if(hasAntennas)
+		{
+			antenna1Col.attach(table, "ANTENNA1");
+			sourceAntenna1Col.attach(sourceTable, "ANTENNA1");
+			antenna2Col.attach(table, "ANTENNA2");
+			sourceAntenna2Col.attach(sourceTable, "ANTENNA2");
+		}
+		ArrayColumn<std::complex<float>>
+			valueCol(table, "VALUE"),
+			sourceValueCol(sourceTable, "VALUE");
+		
+		std::map<Key, rownr_t> rows;
+		for(rownr_t row=0; row!=table.nrow(); ++row)
+		{
+			rows.emplace(Key(kindCol.asInt(row), hasTime ? timeCol.asdouble(row) : 0.0, frequencyCol.asdouble(row),
+				hasAntennas ? antenna1Col.asInt(row) : 0, hasAntennas ? antenna2Col.asInt(row) : 0), row);
+		}
+		for(rownr_t sourceRow=0; sourceRow!=sourceTable.nrow(); ++sourceRow)
+		{
+			const std::map<int, int>::const_iterator kind = kindIds.find(sourceKindCol.asInt(sourceRow));
+			if(kind == kindIds.end())
+				throw std::runtime_error("Can not merge the statistics of " + statisticsFilename + " into " + filename + ": a statistic has an unknown kind");
+			const Key key(kind->second, hasTime ? sourceTimeCol.asdouble(sourceRow) : 0.0, sourceFrequencyCol.asdouble(sourceRow),
+				hasAntennas ? sourceAntenna1Col.asInt(sourceRow) : 0, hasAntennas ? sourceAntenna2Col.asInt(sourceRow) : 0);
+			const std::map<Key, rownr_t>::const_iterator existing = rows.find(key);
+			if(existing != rows.end())
+			{
+				casacore::Array<std::complex<float>> value = valueCol(existing->second);
+				value += sourceValueCol(sourceRow);
+				valueCol.put(existing->second, value);
+			}
+			else {
+				const rownr_t row = table.nrow();
+				table.addRow();
+				kindCol.putScalar(row, kind->second);
+				frequencyCol.putScalar(row, std::get<2>(key));
+				if(hasTime)
+					timeCol.putScalar(row, std::get<1>(key));
+				if(hasAntennas)
+				{
+					antenna1Col.putScalar(row, std::get<3>(key));
+					antenna2Col.putScalar(row, std::get<4>(key));
+				}
+				valueCol.put(row, sourceValueCol(sourceRow));
+				rows.emplace(key, row);
+			}
+		}
+	}
 }
 
 void MSWriter::writeHistoryItem()
@@ -1,6 +1,7 @@
 #ifndef MSWRITER_H
 #define MSWRITER_H
 
+#include "profiler.h"
 #include "writer.h"
 
 #include <complex>
@@ -15,6 +16,29 @@ class MSWriter : public Writer
 		
 		void EnableCompression(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization);
 		
+		/**
+		 * Write only a range of the channels of the band, so that a band can be written in several passes.
+		 * The first partition creates the set with all channels of the band and adds the rows. Later
+		 * partitions open the existing set and fill in their channels of the same rows.
+		 * Band info that is given to WriteBandInfo() only determines the number of channels in the partition.
+		 */
+		void SetChannelPartition(const std::string& bandName, const std::vector<ChannelInfo>& bandChannels, double refFreq, double totalBandwidth, size_t channelStart, bool isFirstPartition);
+		
+		/**
+		 * Copy the channels of the set partFilename into the channels from channelStart onwards of the set
+		 * filename, and add its weights. Both sets should have the same rows, as when they were written
+		 * from different subbands of the same observation with the same settings.
+		 */
+		static void MergeChannelPartition(const std::string& filename, const std::string& partFilename, size_t channelStart);
+		
+		/**
+		 * Add the quality statistics tables of the set statisticsFilename to those of the set filename, as
+		 * written by aoflagger's QualityStatistics::WriteStatistics(). Statistics of the same kind, time,
+		 * frequency and baseline are summed, others are added. This combines the statistics of runs or
+		 * processes that each covered part of an observation.
+		 */
+		static void MergeQualityStatistics(const std::string& filename, const std::string& statisticsFilename);
+		
 		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
 		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override;
 		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
@@ -26,6 +50,14 @@ class MSWriter : public Writer
 		virtual void AddRows(size_t count) final override;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		
+		/** Saves the number of added and written rows, after the rows have been flushed to disk. */
+		virtual void SaveState(std::ostream& stream) final override;
+		/**
+		 * Opens the existing set instead of creating it, and removes the rows that were added after
+		 * the state was saved. These may have been partially written by the interrupted run.
+		 */
+		virtual void RestoreState(std::istream& stream) final override;
+		
 		virtual bool CanWriteStatistics() const final override
 		{
 			return true;
@@ -41,13 +73,16 @@ class MSWriter : public Writer
 		void writeObservation();
 		void writeHistoryItem();
 		void initialize();
+		void initializeColumns();
 		
 		class MSWriterData *_data;
-		bool _isInitialized;
+		bool _isInitialized, _isResumed;
 		size_t _rowIndex;
 		
 		std::string _filename;
 		bool _useDysco;
+		bool _isPartitioned, _isFirstPartition;
+		size_t _partitionStart, _partitionChannelCount;
 		
 		std::vector<AntennaInfo> _antennae;
 		double _antennaDate;
@@ -67,6 +102,7 @@ class MSWriter : public Writer
 		ObservationInfo _observation;
 		std::string _historyCommandLine, _historyApplication;
 		std::vector<std::string> _historyParams;
+		Profiler::RowTimer _rowTimer;
 };
 
 #endif
@@ -18,6 +18,7 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <new>
 
 #include <stdexcept>
 
@@ -65,6 +66,19 @@ MWAHeaderExt::MWAHeaderExt() :
 	for(size_t i=0; i!=24; ++i) subbandGains[i] = 0;
 }
 
+void MWAConfig::Clear()
+{
+	_antennaXInputs.clear();
+	_antennaYInputs.clear();
+	_inputs.clear();
+	_antennae.clear();
+	// The headers can not be assigned, so they are constructed again in place
+	_header.~MWAHeader();
+	new (&_header) MWAHeader();
+	_headerExt.~MWAHeaderExt();
+	new (&_headerExt) MWAHeaderExt();
+}
+
 double MWAHeader::GetStartDateMJD() const
 {
 	return Geometry::GetMJD(year, month, day, refHour, refMinute, refSecond);
@@ -102,6 +102,9 @@ class MWAConfig
 		
 		void CheckSetup();
 		
+		/** Remove all configuration, so that another observation can be read. */
+		void Clear();
+		
 		const MWAInput &Input(const size_t index) const { return _inputs[index]; }
 		const MWAInput &AntennaXInput(const size_t antennaIndex) const { return *_antennaXInputs.find(antennaIndex)->second; }
 		const MWAInput &AntennaYInput(const size_t antennaIndex) const { return *_antennaYInputs.find(antennaIndex)->second; }
@@ -0,0 +1,89 @@
+#include "numatopology.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+	// Parses a CPU list like "0-7,16-23"
+	std::vector<int> parseCPUList(const std::string& list)
+	{
+		std::vector<int> cpus;
+		size_t pos = 0;
+		while(pos < list.size())
+		{
+			size_t end = list.find(',', pos);
+			if(end == std::string::npos)
+				end = list.size();
+			const std::string range = list.substr(pos, end - pos);
+			const size_t dash = range.find('-');
+			const int first = atoi(range.c_str());
+			const int last = (dash == std::string::npos) ? first : atoi(range.c_str() + dash + 1);
+			for(int cpu = first; cpu <= last; ++cpu)
+				cpus.push_back(cpu);
+			pos = end + 1;
+		}
+		return cpus;
+	}
+}
+
+NumaTopology NumaTopology::Detect()
+{
+	NumaTopology topology;
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return topology;
+
+	const std::string nodeDirectory = "/sys/devices/system/node";
+	DIR* dir = opendir(nodeDirectory.c_str());
+	if(dir == nullptr)
+		return topology;
+	// Ordered by node number
+	std::map<int, std::vector<int>> nodes;
+	while(dirent* entry = readdir(dir))
+	{
+		const std::string name = entry->d_name;
+		if(name.size() <= 4 || name.compare(0, 4, "node") != 0 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+			continue;
+		std::ifstream cpuListFile(nodeDirectory + "/" + name + "/cpulist");
+		std::string cpuList;
+		if(!(cpuListFile >> cpuList))
+			continue;
+		std::vector<int> cpus;
+		for(int cpu : parseCPUList(cpuList))
+		{
+			if(cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+				cpus.push_back(cpu);
+		}
+		// Nodes with only memory, or with none of our CPUs, get no threads
+		if(!cpus.empty())
+			nodes.emplace(atoi(name.c_str() + 4), std::move(cpus));
+	}
+	closedir(dir);
+
+	if(nodes.size() > 1)
+	{
+		topology._nodeCPUs.clear();
+		for(auto& node : nodes)
+			topology._nodeCPUs.push_back(std::move(node.second));
+	}
+	return topology;
+}
+
+void NumaTopology::PinToNode(size_t node) const
+{
+	if(NodeCount() == 1)
+		return;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	for(int cpu : _nodeCPUs[node])
+		CPU_SET(cpu, &cpus);
+	// Failing to pin only costs performance
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
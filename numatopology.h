@@ -0,0 +1,43 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * The NUMA nodes of the machine, with the CPUs of each node that this process may run on.
+ * Work is divided over the nodes in blocks, and the threads that do the work of a node are
+ * pinned to it. Linux allocates memory on the node of the thread that first touches it, so
+ * buffers that are created by a pinned thread are local to the threads of that node.
+ *
+ * Without NUMA information, or when the process may only run on one node, there is a single
+ * node and pinning does nothing.
+ */
+class NumaTopology
+{
+	public:
+		/** A single node with all CPUs. */
+		NumaTopology() : _nodeCPUs(1) { }
+
+		/** Nodes with the given CPUs, e.g. to test the division of work over several nodes. */
+		explicit NumaTopology(const std::vector<std::vector<int>>& nodeCPUs) : _nodeCPUs(nodeCPUs) { }
+
+		/** Read the nodes from /sys/devices/system/node. */
+		static NumaTopology Detect();
+
+		size_t NodeCount() const { return _nodeCPUs.size(); }
+
+		/** The node of item index of count, e.g. of a thread or a baseline, when the items are divided over the nodes in blocks. */
+		size_t NodeOf(size_t index, size_t count) const
+		{
+			return index * NodeCount() / count;
+		}
+
+		/** Restrict the calling thread to the CPUs of the node. */
+		void PinToNode(size_t node) const;
+
+	private:
+		std::vector<std::vector<int>> _nodeCPUs;
+};
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef PIPELINE_TEST_H
+#define PIPELINE_TEST_H
+
+#include "checkpoint.h"
+#include "cotter.h"
+#include "memoryplanner.h"
+#include "syntheticobservation.h"
+
+#include <casacore/casa/Arrays/Array.h>
+#include <casacore/tables/Tables/ArrayColumn.h>
+#include <casacore/tables/Tables/ScalarColumn.h>
+#include <casacore/tables/Tables/Table.h>
+#include <casacore/tables/Tables/TableColumn.h>
+#include <casacore/tables/Tables/TableRecord.h>
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+/**
+ * Fixture of the tests that run the pipeline on a synthetic observation, to compare the
+ * output of a code path with that of the path that it replaces. The observation and the
+ * outputs are written to a temporary directory, and are removed by the destructor.
+ *
+ * RFI detection is turned off, because the flagger sees different data when the band or
+ * the time range is divided differently; the other flags and the statistics should not change.
+ */
+class PipelineTest
+{
+	public:
+		PipelineTest(const std::string& tempDirectory, const std::string& name, size_t subbandCount, size_t scanCount) :
+			_prefix(tempDirectory + "/" + name + "_" + std::to_string(getpid())),
+			_channelsPerSubband(16),
+			_subbandCount(subbandCount),
+			_scanCount(scanCount)
+		{
+			SyntheticObservation observation;
+			observation.SetAntennaCount(AntennaCount);
+			observation.SetSubbandCount(_subbandCount);
+			observation.SetChannelsPerSubband(_channelsPerSubband);
+			observation.SetScanCount(_scanCount);
+			observation.WriteMetafits(metaFilename());
+			for(size_t gpuBox=0; gpuBox!=_subbandCount; ++gpuBox)
+			{
+				_gpuBoxFilenames.push_back(SyntheticObservation::GPUBoxFilename(_prefix, gpuBox));
+				observation.WriteGPUBoxFile(_gpuBoxFilenames.back(), gpuBox);
+			}
+		}
+
+		~PipelineTest()
+		{
+			Checkpoint::Remove(metaFilename());
+			for(const std::string& filename : _gpuBoxFilenames)
+				Checkpoint::Remove(filename);
+			for(const std::string& filename : _outputFilenames)
+				Checkpoint::Remove(filename);
+		}
+
+		size_t ChannelCount() const { return _subbandCount * _channelsPerSubband; }
+		size_t ChannelsPerSubband() const { return _channelsPerSubband; }
+
+		/** Name of a measurement set in the temporary directory, which is removed together with the observation. */
+		std::string OutputFilename(const std::string& name)
+		{
+			_outputFilenames.push_back(_prefix + "_" + name + ".ms");
+			return _outputFilenames.back();
+		}
+
+		/** Set up cotter to write the observation to a measurement set, without averaging. */
+		void Configure(Cotter& cotter, const std::string& outputFilename, size_t threadCount, int64_t memoryLimit) const
+		{
+			cotter.SetMetaFilename(metaFilename().c_str());
+			cotter.SetFileSets(std::vector<std::vector<std::string>>{ _gpuBoxFilenames });
+			cotter.SetOutputFilename(outputFilename);
+			cotter.SetOutputFormat(Cotter::MSOutputFormat);
+			cotter.SetSubbandCount(_subbandCount);
+			cotter.SetNumaAware(false);
+			cotter.SetThreadCount(threadCount);
+			cotter.SetMemoryLimit(memoryLimit);
+			cotter.SetRFIDetection(false);
+			cotter.SetCollectStatistics(true);
+			cotter.SetHistoryInfo("pipeline test");
+		}
+
+		/**
+		 * The memory limit with which the given number of channels can be processed in chunks
+		 * of the given number of scans, according to the MemoryPlanner of cotter.
+		 */
+		int64_t MemoryLimit(size_t channelCount, size_t scansPerChunk, size_t threadCount) const
+		{
+			MemoryPlanner planner(AntennaCount, channelCount, _channelsPerSubband, _scanCount);
+			planner.SetRFIDetection(false);
+			return planner.Estimate(scansPerChunk, threadCount).TotalBytes();
+		}
+
+		/** A memory limit with which the whole observation is processed in one chunk. */
+		int64_t FullMemoryLimit(size_t threadCount) const
+		{
+			return MemoryLimit(ChannelCount(), _scanCount, threadCount);
+		}
+
+		/**
+		 * Returns the number of rows of the main table of which the time, antennas, data, flags
+		 * or weights differ by more than the relative tolerance.
+		 */
+		static size_t CompareRows(const std::string& expectedFilename, const std::string& actualFilename, double tolerance)
+		{
+			const casacore::Table expected(expectedFilename), actual(actualFilename);
+			if(expected.nrow() != actual.nrow())
+				throw std::runtime_error(actualFilename + " has " + std::to_string(actual.nrow()) + " rows, but " + expectedFilename + " has " + std::to_string(expected.nrow()));
+			const bool hasWeights =
+				expected.tableDesc().isColumn("WEIGHT_SPECTRUM") && actual.tableDesc().isColumn("WEIGHT_SPECTRUM");
+			casacore::ScalarColumn<double>
+				expectedTimes(expected, "TIME"), actualTimes(actual, "TIME");
+			casacore::ScalarColumn<int>
+				expectedAntennas1(expected, "ANTENNA1"), actualAntennas1(actual, "ANTENNA1"),
+				expectedAntennas2(expected, "ANTENNA2"), actualAntennas2(actual, "ANTENNA2");
+			casacore::ArrayColumn<std::complex<float>>
+				expectedData(expected, "DATA"), actualData(actual, "DATA");
+			casacore::ArrayColumn<bool>
+				expectedFlags(expected, "FLAG"), actualFlags(actual, "FLAG");
+			casacore::ArrayColumn<float> expectedWeights, actualWeights;
+			if(hasWeights)
+			{
+				expectedWeights.attach(expected, "WEIGHT_SPECTRUM");
+				actualWeights.attach(actual, "WEIGHT_SPECTRUM");
+			}
+			size_t differences = 0;
+			for(casacore::rownr_t row=0; row!=expected.nrow(); ++row)
+			{
+				const bool isEqual =
+					expectedTimes(row) == actualTimes(row) &&
+					expectedAntennas1(row) == actualAntennas1(row) &&
+					expectedAntennas2(row) == actualAntennas2(row) &&
+					arraysMatch(expectedData(row), actualData(row), tolerance) &&
+					arraysMatch(expectedFlags(row), actualFlags(row), tolerance) &&
+					(!hasWeights || arraysMatch(expectedWeights(row), actualWeights(row), tolerance));
+				if(!isEqual)
+					++differences;
+			}
+			return differences;
+		}
+
+		/**
+		 * Returns the number of statistics in the quality tables that are missing or differ by more
+		 * than the relative tolerance. Kinds are matched by name. Only the frequency statistics are
+		 * compared per frequency: the other statistics of a set that was written in parts have a row
+		 * for the central frequency of each part, so these are compared as sums over the frequencies.
+		 */
+		static size_t CompareStatistics(const std::string& expectedFilename, const std::string& actualFilename, double tolerance)
+		{
+			const char* tableNames[] = { "QUALITY_TIME_STATISTIC", "QUALITY_FREQUENCY_STATISTIC", "QUALITY_BASELINE_STATISTIC", "QUALITY_BASELINE_TIME_STATISTIC" };
+			size_t differences = 0, tableCount = 0;
+			for(const char* tableName : tableNames)
+			{
+				const bool perFrequency = std::string(tableName) == "QUALITY_FREQUENCY_STATISTIC";
+				const StatisticMap
+					expected = readStatistics(expectedFilename, tableName, perFrequency),
+					actual = readStatistics(actualFilename, tableName, perFrequency);
+				if(!expected.empty())
+					++tableCount;
+				for(const StatisticMap::value_type& statistic : expected)
+				{
+					const StatisticMap::const_iterator match = actual.find(statistic.first);
+					if(match == actual.end() || match->second.size() != statistic.second.size())
+						++differences;
+					else {
+						for(size_t i=0; i!=statistic.second.size(); ++i)
+						{
+							if(valuesDiffer(statistic.second[i], match->second[i], tolerance))
+							{
+								++differences;
+								break;
+							}
+						}
+					}
+				}
+				for(const StatisticMap::value_type& statistic : actual)
+				{
+					if(expected.find(statistic.first) == expected.end())
+						++differences;
+				}
+			}
+			if(tableCount == 0)
+				throw std::runtime_error(expectedFilename + " has no statistics");
+			return differences;
+		}
+
+		static const size_t AntennaCount = 32;
+
+	private:
+		/** Kind name, time, frequency, antenna1 and antenna2 of a statistic. */
+		typedef std::tuple<std::string, double, double, int, int> StatisticKey;
+		typedef std::map<StatisticKey, std::vector<std::complex<double>>> StatisticMap;
+
+		std::string metaFilename() const { return _prefix + "_metafits.fits"; }
+
+		static bool valuesDiffer(bool expected, bool actual, double) { return expected != actual; }
+
+		template<typename T>
+		static bool valuesDiffer(const T& expected, const T& actual, double tolerance)
+		{
+			// Flagged samples can be nan in both sets
+			if(expected == actual || (std::isnan(std::abs(expected)) && std::isnan(std::abs(actual))))
+				return false;
+			return std::abs(expected - actual) > tolerance * std::max(std::abs(expected), std::abs(actual));
+		}
+
+		template<typename T>
+		static bool arraysMatch(const casacore::Array<T>& expected, const casacore::Array<T>& actual, double tolerance)
+		{
+			if(!expected.shape().isEqual(actual.shape()))
+				return false;
+			bool deleteExpected, deleteActual;
+			const T
+				*expectedValues = expected.getStorage(deleteExpected),
+				*actualValues = actual.getStorage(deleteActual);
+			bool isMatch = true;
+			for(size_t i=0; i!=expected.nelements() && isMatch; ++i)
+				isMatch = !valuesDiffer(expectedValues[i], actualValues[i], tolerance);
+			expected.freeStorage(expectedValues, deleteExpected);
+			actual.freeStorage(actualValues, deleteActual);
+			return isMatch;
+		}
+
+		/** The statistics of one of the quality tables, summed over the frequencies unless perFrequency is set. */
+		static StatisticMap readStatistics(const std::string& filename, const std::string& tableName, bool perFrequency)
+		{
+			StatisticMap statistics;
+			const casacore::Table set(filename);
+			if(!set.keywordSet().isDefined(tableName))
+				return statistics;
+			const casacore::Table
+				kindTable(filename + "/QUALITY_KIND_NAME"),
+				table(filename + "/" + tableName);
+			casacore::TableColumn
+				kindIdCol(kindTable, "KIND_ID"),
+				kindCol(table, "KIND_ID"),
+				frequencyCol(table, "FREQUENCY");
+			casacore::ScalarColumn<casacore::String> kindNameCol(kindTable, "NAME");
+			std::map<int, std::string> kindNames;
+			for(casacore::rownr_t row=0; row!=kindTable.nrow(); ++row)
+				kindNames[kindIdCol.asInt(row)] = kindNameCol(row);
+
+			const bool
+				hasTime = table.tableDesc().isColumn("TIME"),
+				hasAntennas = table.tableDesc().isColumn("ANTENNA1");
+			casacore::TableColumn timeCol, antenna1Col, antenna2Col;
+			if(hasTime)
+				timeCol.attach(table, "TIME");
+			if(hasAntennas)
+			{
+				antenna1Col.attach(table, "ANTENNA1");
+				antenna2Col.attach(table, "ANTENNA2");
+			}
+			casacore::ArrayColumn<std::complex<float>> valueCol(table, "VALUE");
+			for(casacore::rownr_t row=0; row!=table.nrow(); ++row)
+			{
+				const StatisticKey key(kindNames[kindCol.asInt(row)],
+					hasTime ? timeCol.asdouble(row) : 0.0,
+					perFrequency ? frequencyCol.asdouble(row) : 0.0,
+					hasAntennas ? antenna1Col.asInt(row) : 0,
+					hasAntennas ? antenna2Col.asInt(row) : 0);
+				const casacore::Array<std::complex<float>> value = valueCol(row);
+				std::vector<std::complex<double>>& sum = statistics[key];
+				sum.resize(value.nelements());
+				bool deleteValues;
+				const std::complex<float>* values = value.getStorage(deleteValues);
+				for(size_t i=0; i!=value.nelements(); ++i)
+					sum[i] += std::complex<double>(values[i]);
+				value.freeStorage(values, deleteValues);
+			}
+			return statistics;
+		}
+
+		std::string _prefix;
+		size_t _channelsPerSubband, _subbandCount, _scanCount;
+		std::vector<std::string> _gpuBoxFilenames, _outputFilenames;
+};
+
+#endif
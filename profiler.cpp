@@ -0,0 +1,479 @@
+#include "profiler.h"
+#include "jsonescape.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include <time.h>
+
+namespace {
+	thread_local Profiler::Scope* currentScope = nullptr;
+}
+
+const size_t Profiler::NoStage;
+
+Profiler::Scope::Scope(const char* stage, uint64_t bytes) :
+	_active(Profiler::Instance().IsEnabled()),
+	_parent(nullptr),
+	_stage(0),
+	_bytes(bytes),
+	_startCPUTime(0.0),
+	_childTime(0.0)
+{
+	if(_active)
+	{
+		_parent = currentScope;
+		_stage = Profiler::Instance().stageIndex(_parent == nullptr ? NoStage : _parent->_stage, stage);
+		currentScope = this;
+		_startCPUTime = threadCPUTime();
+		_startTime = std::chrono::steady_clock::now();
+	}
+}
+
+Profiler::Scope::~Scope()
+{
+	End();
+}
+
+void Profiler::Scope::End()
+{
+	if(_active)
+	{
+		_active = false;
+		const double
+			wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - _startTime).count(),
+			cpuTime = threadCPUTime() - _startCPUTime;
+		currentScope = _parent;
+		if(_parent != nullptr)
+			_parent->_childTime += wallTime;
+		Profiler::Instance().add(_stage, 1, wallTime, wallTime - _childTime, cpuTime, _bytes);
+	}
+}
+
+Profiler::RowTimer::RowTimer(const char* stage) :
+	_stageName(stage),
+	_isTiming(false),
+	_hasStage(false),
+	_parent(nullptr),
+	_parentStage(NoStage),
+	_stage(0),
+	_calls(0),
+	_time(0.0),
+	_bytes(0),
+	_flushTime(std::chrono::steady_clock::now())
+{
+}
+
+void Profiler::RowTimer::Flush()
+{
+	if(_calls != 0)
+	{
+		Profiler::Instance().add(_stage, _calls, _time, _time, _time, _bytes);
+		_calls = 0;
+		_time = 0.0;
+		_bytes = 0;
+	}
+	_flushTime = std::chrono::steady_clock::now();
+}
+
+void Profiler::RowTimer::setParent()
+{
+	// The rows so far belong to the previous parent
+	Flush();
+	_parent = currentScope;
+	_parentStage = _parent == nullptr ? NoStage : _parent->_stage;
+	_stage = Profiler::Instance().stageIndex(_parentStage, _stageName);
+	_hasStage = true;
+}
+
+Profiler::Scope* Profiler::innermostScope()
+{
+	return currentScope;
+}
+
+Profiler& Profiler::Instance()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+void Profiler::Reset()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	// The totals that the threads have not yet handed in belong to the earlier bands
+	collectThreadStages();
+	_bands.clear();
+	_currentChunk = -1;
+	for(Queue& queue : _queues)
+		queue.lastSample = readCounters(*queue.statistics);
+}
+
+void Profiler::StartBand(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	collectThreadStages();
+	_bands.emplace_back();
+	_bands.back().name = name;
+	_currentChunk = -1;
+}
+
+void Profiler::StartChunk(size_t chunkIndex)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	collectThreadStages();
+	_currentChunk = chunkIndex;
+	_chunkStartTime = std::chrono::steady_clock::now();
+	_queueSampleTime = _chunkStartTime;
+}
+
+void Profiler::EndChunk(const MemoryTracker::Usage& memoryUsage)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(_enabled)
+	{
+		collectThreadStages();
+		Chunk& chunk = currentChunk();
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		chunk.wallTime += std::chrono::duration<double>(now - _chunkStartTime).count();
+		chunk.hasMemoryUsage = true;
+		chunk.memoryUsage = memoryUsage;
+		sampleQueues(chunk, now);
+	}
+	_currentChunk = -1;
+}
+
+void Profiler::Tick()
+{
+	if(!_enabled)
+		return;
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(_currentChunk != -1 && now - _queueSampleTime >= std::chrono::seconds(1))
+		sampleQueues(currentChunk(), now);
+}
+
+ao::lane_statistics* Profiler::QueueStatistics(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	for(Queue& queue : _queues)
+	{
+		if(queue.name == name)
+			return queue.statistics.get();
+	}
+	_queues.emplace_back();
+	_queues.back().name = name;
+	_queues.back().statistics.reset(new ao::lane_statistics());
+	return _queues.back().statistics.get();
+}
+
+void Profiler::sampleQueues(Chunk& chunk, std::chrono::steady_clock::time_point time)
+{
+	QueueSample queueSample;
+	queueSample.time = std::chrono::duration<double>(time - _chunkStartTime).count();
+	queueSample.interval = std::chrono::duration<double>(time - _queueSampleTime).count();
+	_queueSampleTime = time;
+	for(Queue& queue : _queues)
+	{
+		const QueueCounters sample = readCounters(*queue.statistics);
+		QueueCounters delta = sample;
+		const QueueCounters& last = queue.lastSample;
+		delta.writes -= last.writes;
+		delta.reads -= last.reads;
+		delta.writeWaits -= last.writeWaits;
+		delta.readWaits -= last.readWaits;
+		delta.writeWaitNs -= last.writeWaitNs;
+		delta.readWaitNs -= last.readWaitNs;
+		for(size_t i=0; i!=ao::lane_statistics::histogram_size; ++i)
+			delta.histogram[i] -= last.histogram[i];
+		queue.lastSample = sample;
+		if(delta.writes != 0 || delta.reads != 0)
+		{
+			queueSample.queues.emplace_back(queue.name, delta);
+			// The chunk keeps the sum of its samples
+			QueueList::iterator total = chunk.queues.begin();
+			while(total != chunk.queues.end() && total->first != queue.name)
+				++total;
+			if(total == chunk.queues.end())
+				chunk.queues.emplace_back(queue.name, delta);
+			else {
+				QueueCounters& counters = total->second;
+				counters.capacity = delta.capacity;
+				counters.writes += delta.writes;
+				counters.reads += delta.reads;
+				counters.writeWaits += delta.writeWaits;
+				counters.readWaits += delta.readWaits;
+				counters.writeWaitNs += delta.writeWaitNs;
+				counters.readWaitNs += delta.readWaitNs;
+				for(size_t i=0; i!=ao::lane_statistics::histogram_size; ++i)
+					counters.histogram[i] += delta.histogram[i];
+			}
+		}
+	}
+	if(!queueSample.queues.empty())
+		chunk.queueSamples.emplace_back(std::move(queueSample));
+}
+
+Profiler::QueueCounters Profiler::readCounters(const ao::lane_statistics& statistics)
+{
+	QueueCounters counters;
+	counters.capacity = statistics.capacity;
+	counters.writes = statistics.write_count;
+	counters.reads = statistics.read_count;
+	counters.writeWaits = statistics.write_wait_count;
+	counters.readWaits = statistics.read_wait_count;
+	counters.writeWaitNs = statistics.write_wait_ns;
+	counters.readWaitNs = statistics.read_wait_ns;
+	for(size_t i=0; i!=ao::lane_statistics::histogram_size; ++i)
+		counters.histogram[i] = statistics.occupancy_histogram[i];
+	return counters;
+}
+
+Profiler::Chunk& Profiler::currentChunk()
+{
+	if(_bands.empty())
+	{
+		_bands.emplace_back();
+		_bands.back().name = "(none)";
+	}
+	std::vector<Chunk>& chunks = _bands.back().chunks;
+	std::vector<Chunk>::iterator chunk = chunks.begin();
+	while(chunk != chunks.end() && chunk->index != _currentChunk)
+		++chunk;
+	if(chunk == chunks.end())
+	{
+		chunks.emplace_back();
+		chunks.back().index = _currentChunk;
+		chunk = chunks.end() - 1;
+	}
+	return *chunk;
+}
+
+size_t Profiler::stageIndex(size_t parent, const char* stage)
+{
+	struct CachedStage { size_t parent; const char* name; size_t index; };
+	thread_local std::vector<CachedStage> cache;
+	for(const CachedStage& cached : cache)
+	{
+		if(cached.parent == parent && cached.name == stage)
+			return cached.index;
+	}
+	size_t index;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		const std::string path = (parent == NoStage) ? std::string(stage) : _stagePaths[parent] + '/' + stage;
+		index = std::find(_stagePaths.begin(), _stagePaths.end(), path) - _stagePaths.begin();
+		if(index == _stagePaths.size())
+			_stagePaths.push_back(path);
+	}
+	cache.push_back(CachedStage{parent, stage, index});
+	return index;
+}
+
+void Profiler::add(size_t stage, size_t calls, double wallTime, double selfTime, double cpuTime, uint64_t bytes)
+{
+	ThreadStages& local = threadStages();
+	// Only contended while the stages are collected
+	std::lock_guard<std::mutex> lock(local.mutex);
+	if(stage >= local.stages.size())
+		local.stages.resize(stage + 1);
+	StageTotals& totals = local.stages[stage];
+	totals.calls += calls;
+	totals.wallTime += wallTime;
+	totals.selfTime += selfTime;
+	totals.cpuTime += cpuTime;
+	totals.bytes += bytes;
+}
+
+Profiler::ThreadStages& Profiler::threadStages()
+{
+	thread_local ThreadStages stages;
+	return stages;
+}
+
+Profiler::ThreadStages::ThreadStages()
+{
+	Profiler& profiler = Profiler::Instance();
+	std::lock_guard<std::mutex> lock(profiler._mutex);
+	profiler._threadStages.push_back(this);
+}
+
+Profiler::ThreadStages::~ThreadStages()
+{
+	// Threads of the pipeline exit during the chunk, so their stages belong to the current chunk
+	Profiler& profiler = Profiler::Instance();
+	std::lock_guard<std::mutex> lock(profiler._mutex);
+	profiler.collect(*this);
+	profiler._threadStages.erase(std::find(profiler._threadStages.begin(), profiler._threadStages.end(), this));
+}
+
+void Profiler::collectThreadStages()
+{
+	for(ThreadStages* stages : _threadStages)
+		collect(*stages);
+}
+
+void Profiler::collect(ThreadStages& threadStages)
+{
+	std::lock_guard<std::mutex> lock(threadStages.mutex);
+	// Stages are indexed in order of first appearance, which keeps the report readable
+	for(size_t i=0; i!=threadStages.stages.size(); ++i)
+	{
+		StageTotals& local = threadStages.stages[i];
+		if(local.calls != 0)
+		{
+			StageTotals& totals = findStage(currentChunk().stages, _stagePaths[i]);
+			totals.calls += local.calls;
+			totals.wallTime += local.wallTime;
+			totals.selfTime += local.selfTime;
+			totals.cpuTime += local.cpuTime;
+			totals.bytes += local.bytes;
+			local = StageTotals();
+		}
+	}
+}
+
+Profiler::StageTotals& Profiler::findStage(StageList& stages, const std::string& path)
+{
+	// There are only a few stages, and keeping them in order of appearance makes the report readable
+	for(std::pair<std::string, StageTotals>& stage : stages)
+	{
+		if(stage.first == path)
+			return stage.second;
+	}
+	stages.emplace_back(path, StageTotals());
+	return stages.back().second;
+}
+
+void Profiler::WriteReport(const std::string& filename)
+{
+	std::ofstream file(filename);
+	if(!file)
+		throw std::runtime_error("Could not open profile report " + filename + " for writing");
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	collectThreadStages();
+	StageList totals;
+	file << "{\n  \"bands\": [";
+	for(size_t b=0; b!=_bands.size(); ++b)
+	{
+		const Band& band = _bands[b];
+		file << (b==0 ? "\n" : ",\n")
+			<< "    {\n      \"band\": \"" << jsonEscape(band.name) << "\",\n      \"chunks\": [";
+		for(size_t c=0; c!=band.chunks.size(); ++c)
+		{
+			const Chunk& chunk = band.chunks[c];
+			// Stages outside of the chunks, like opening files and writing the MWA fields, have chunk index -1
+			file << (c==0 ? "\n" : ",\n")
+				<< "        {\n          \"chunk\": " << chunk.index << ",\n";
+			if(chunk.index != -1)
+				file << "          \"wall_s\": " << chunk.wallTime << ",\n";
+			file << "          \"stages\": ";
+			writeStages(file, chunk.stages, "          ");
+			if(!chunk.queues.empty())
+			{
+				file << ",\n          \"queues\": ";
+				writeQueues(file, chunk.queues, chunk.wallTime, "          ");
+				file << ",\n          \"queue_samples\": [";
+				for(size_t s=0; s!=chunk.queueSamples.size(); ++s)
+				{
+					const QueueSample& sample = chunk.queueSamples[s];
+					file << (s==0 ? "\n" : ",\n")
+						<< "            { \"time_s\": " << sample.time << ", \"interval_s\": " << sample.interval << ", \"queues\": ";
+					writeQueues(file, sample.queues, sample.interval, "            ");
+					file << " }";
+				}
+				file << "\n          ]";
+			}
+			if(chunk.hasMemoryUsage)
+			{
+				file << ",\n          \"memory\": ";
+				writeMemoryUsage(file, chunk.memoryUsage, "          ");
+			}
+			file << "\n        }";
+			for(const std::pair<std::string, StageTotals>& stage : chunk.stages)
+			{
+				StageTotals& total = findStage(totals, stage.first);
+				total.calls += stage.second.calls;
+				total.wallTime += stage.second.wallTime;
+				total.selfTime += stage.second.selfTime;
+				total.cpuTime += stage.second.cpuTime;
+				total.bytes += stage.second.bytes;
+			}
+		}
+		file << "\n      ]\n    }";
+	}
+	file << "\n  ],\n  \"totals\": ";
+	writeStages(file, totals, "  ");
+	file << "\n}\n";
+}
+
+void Profiler::writeStages(std::ostream& stream, const StageList& stages, const std::string& indent)
+{
+	stream << '[';
+	for(size_t i=0; i!=stages.size(); ++i)
+	{
+		const StageTotals& totals = stages[i].second;
+		stream << (i==0 ? "\n" : ",\n") << indent << "  { "
+			<< "\"stage\": \"" << jsonEscape(stages[i].first) << "\", "
+			<< "\"calls\": " << totals.calls << ", "
+			<< "\"wall_s\": " << totals.wallTime << ", "
+			<< "\"self_s\": " << totals.selfTime << ", "
+			<< "\"cpu_s\": " << totals.cpuTime << ", "
+			<< "\"bytes\": " << totals.bytes << ", "
+			<< "\"throughput_MBps\": " << (totals.wallTime > 0.0 ? double(totals.bytes) / (totals.wallTime * 1e6) : 0.0)
+			<< " }";
+	}
+	stream << '\n' << indent << ']';
+}
+
+void Profiler::writeMemoryUsage(std::ostream& stream, const MemoryTracker::Usage& usage, const std::string& indent)
+{
+	// Current values are at the end of the chunk, peaks are the high-water marks during the chunk
+	stream << "{\n" << indent << "  \"subsystems\": [";
+	for(size_t i=0; i!=MemoryTracker::SubsystemCount; ++i)
+	{
+		stream << (i==0 ? "\n" : ",\n") << indent << "    { "
+			<< "\"subsystem\": \"" << MemoryTracker::Name(MemoryTracker::Subsystem(i)) << "\", "
+			<< "\"current_bytes\": " << usage.current[i] << ", "
+			<< "\"peak_bytes\": " << usage.peak[i] << " }";
+	}
+	stream << '\n' << indent << "  ],\n"
+		<< indent << "  \"tracked_bytes\": " << usage.tracked << ",\n"
+		<< indent << "  \"peak_tracked_bytes\": " << usage.peakTracked << ",\n"
+		<< indent << "  \"resident_bytes\": " << usage.resident << ",\n"
+		<< indent << "  \"peak_resident_bytes\": " << usage.peakResident << ",\n"
+		<< indent << "  \"peak_untracked_bytes\": " << usage.PeakUntracked() << '\n'
+		<< indent << '}';
+}
+
+void Profiler::writeQueues(std::ostream& stream, const QueueList& queues, double wallTime, const std::string& indent)
+{
+	stream << '[';
+	for(size_t i=0; i!=queues.size(); ++i)
+	{
+		const QueueCounters& counters = queues[i].second;
+		stream << (i==0 ? "\n" : ",\n") << indent << "  { "
+			<< "\"queue\": \"" << jsonEscape(queues[i].first) << "\", "
+			<< "\"capacity\": " << counters.capacity << ", "
+			<< "\"writes\": " << counters.writes << ", "
+			<< "\"reads\": " << counters.reads << ", "
+			<< "\"writes_per_s\": " << (wallTime > 0.0 ? counters.writes / wallTime : 0.0) << ", "
+			<< "\"producer_stalls\": " << counters.writeWaits << ", "
+			<< "\"producer_stall_s\": " << counters.writeWaitNs * 1e-9 << ", "
+			<< "\"consumer_stalls\": " << counters.readWaits << ", "
+			<< "\"consumer_stall_s\": " << counters.readWaitNs * 1e-9 << ", "
+			<< "\"occupancy_histogram\": [";
+		for(size_t b=0; b!=ao::lane_statistics::histogram_size; ++b)
+			stream << (b==0 ? "" : ", ") << counters.histogram[b];
+		stream << "] }";
+	}
+	stream << '\n' << indent << ']';
+}
+
+double Profiler::threadCPUTime()
+{
+	timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
@@ -0,0 +1,244 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "lane.h"
+#include "memorytracker.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Collects the time spent in the stages of the pipeline, per band and per chunk.
+ * Stages are timed with a Profiler::Scope. Scopes that are opened inside another
+ * scope on the same thread are reported as sub stages (e.g. "write/casacore put"),
+ * and their time is subtracted from the self time of the enclosing stage.
+ * When the profiler is not enabled, a scope does nothing.
+ *
+ * Each thread adds its times to its own table, and the tables are collected into the
+ * current chunk when a chunk or band starts or ends, when the report is written and when
+ * the thread exits. Work that is done per row is timed with a RowTimer, which only reads
+ * the steady clock per row.
+ *
+ * The profiler also owns the statistics of the queues between the pipeline
+ * threads. Their counters are always kept. When the profiler is enabled, they are
+ * sampled about every second while a chunk runs (from Tick(), which the progress bars
+ * call) and at the end of every chunk, together with the memory usage of the chunk.
+ */
+class Profiler
+{
+	public:
+		class RowTimer;
+		
+		class Scope
+		{
+			public:
+				/** The stage name should be a string literal; threads find the stage by its address. */
+				explicit Scope(const char* stage, uint64_t bytes = 0);
+				~Scope();
+
+				Scope(const Scope&) = delete;
+				Scope& operator=(const Scope&) = delete;
+
+				void AddBytes(uint64_t bytes) { _bytes += bytes; }
+
+				/** Stop timing before the scope is destructed. Scopes on a thread should be ended in reverse order. */
+				void End();
+
+			private:
+				friend class RowTimer;
+				
+				bool _active;
+				Scope* _parent;
+				size_t _stage;
+				uint64_t _bytes;
+				std::chrono::steady_clock::time_point _startTime;
+				double _startCPUTime, _childTime;
+		};
+
+		/**
+		 * Times a stage that runs once per row, like the gather of a baseline, without the
+		 * cost of a Scope per row. Start() and Stop() only read the steady clock. The summed
+		 * time is added to the profile at the end of a block of rows: when the timer has run for
+		 * 0.1 s since it was last flushed, when Flush() is called and when it is destructed. The
+		 * stage is a sub stage of the scope that is open on the thread, and the cpu time of the
+		 * rows is taken to be their wall time. A timer should only be used by one thread at a time.
+		 */
+		class RowTimer
+		{
+			public:
+				/** The stage name should be a string literal, as for a Scope. */
+				explicit RowTimer(const char* stage);
+				~RowTimer() { Flush(); }
+				
+				RowTimer(const RowTimer&) = delete;
+				RowTimer& operator=(const RowTimer&) = delete;
+				
+				void Start()
+				{
+					_isTiming = Profiler::Instance().IsEnabled();
+					if(_isTiming)
+					{
+						// A scope that ended may be followed by another one at the same address
+						Scope* parent = innermostScope();
+						if(!_hasStage || parent != _parent || (parent != nullptr && parent->_stage != _parentStage))
+							setParent();
+						_startTime = std::chrono::steady_clock::now();
+					}
+				}
+				
+				void Stop(uint64_t bytes = 0)
+				{
+					if(_isTiming)
+					{
+						_isTiming = false;
+						const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+						const double time = std::chrono::duration<double>(now - _startTime).count();
+						++_calls;
+						_time += time;
+						_bytes += bytes;
+						if(_parent != nullptr)
+							_parent->_childTime += time;
+						if(now - _flushTime >= std::chrono::milliseconds(100))
+							Flush();
+					}
+				}
+				
+				void Flush();
+				
+			private:
+				void setParent();
+				
+				const char* _stageName;
+				bool _isTiming, _hasStage;
+				Scope* _parent;
+				size_t _parentStage, _stage, _calls;
+				double _time;
+				uint64_t _bytes;
+				std::chrono::steady_clock::time_point _startTime, _flushTime;
+		};
+		
+		static Profiler& Instance();
+
+		void Enable() { _enabled = true; }
+		bool IsEnabled() const { return _enabled; }
+		/**
+		 * Drop the bands and chunks that were recorded, e.g. before the next observation of a batch.
+		 * The queue statistics are sampled again from their current values.
+		 */
+		void Reset();
+
+		/** Stages after this call are attributed to the given band, outside of any chunk. */
+		void StartBand(const std::string& name);
+		void StartChunk(size_t chunkIndex);
+		/** Ends the chunk, samples the queue statistics and stores the memory usage of the chunk. */
+		void EndChunk(const MemoryTracker::Usage& memoryUsage);
+		/** Samples the queue statistics when a chunk runs and the last sample is a second old. */
+		void Tick();
+
+		/**
+		 * Statistics object for the queue with the given name. Queues with the same name
+		 * share their statistics. The object lives as long as the profiler.
+		 */
+		ao::lane_statistics* QueueStatistics(const std::string& name);
+
+		/**
+		 * Write the report as JSON, with for every band and chunk the wall time, self time, cpu time,
+		 * bytes and throughput of each stage, followed by the totals per stage.
+		 */
+		void WriteReport(const std::string& filename);
+
+	private:
+		Profiler() : _enabled(false), _currentChunk(-1) { }
+
+		struct QueueCounters
+		{
+			QueueCounters() : capacity(0), writes(0), reads(0), writeWaits(0), readWaits(0), writeWaitNs(0), readWaitNs(0), histogram() { }
+			size_t capacity;
+			uint64_t writes, reads, writeWaits, readWaits, writeWaitNs, readWaitNs;
+			uint64_t histogram[ao::lane_statistics::histogram_size];
+		};
+		struct Queue
+		{
+			std::string name;
+			std::unique_ptr<ao::lane_statistics> statistics;
+			QueueCounters lastSample;
+		};
+
+		struct StageTotals
+		{
+			StageTotals() : calls(0), wallTime(0.0), selfTime(0.0), cpuTime(0.0), bytes(0) { }
+			size_t calls;
+			double wallTime, selfTime, cpuTime;
+			uint64_t bytes;
+		};
+		typedef std::vector<std::pair<std::string, StageTotals>> StageList;
+		/** Totals of the stages that ended on one thread since they were last collected, indexed by stage. */
+		struct ThreadStages
+		{
+			ThreadStages();
+			~ThreadStages();
+			std::mutex mutex;
+			std::vector<StageTotals> stages;
+		};
+		typedef std::vector<std::pair<std::string, QueueCounters>> QueueList;
+		/** Change of the queue counters over the interval that ends at the given time in the chunk. */
+		struct QueueSample
+		{
+			double time, interval;
+			QueueList queues;
+		};
+		struct Chunk
+		{
+			Chunk() : index(-1), wallTime(0.0), hasMemoryUsage(false) { }
+			int index;
+			double wallTime;
+			bool hasMemoryUsage;
+			MemoryTracker::Usage memoryUsage;
+			StageList stages;
+			QueueList queues;
+			std::vector<QueueSample> queueSamples;
+		};
+		struct Band
+		{
+			std::string name;
+			std::vector<Chunk> chunks;
+		};
+
+		/** Index of the stage in _stagePaths, with parent NoStage for a stage that is not a sub stage. */
+		size_t stageIndex(size_t parent, const char* stage);
+		void add(size_t stage, size_t calls, double wallTime, double selfTime, double cpuTime, uint64_t bytes);
+		/** The innermost open scope of the calling thread. */
+		static Scope* innermostScope();
+		static ThreadStages& threadStages();
+		/** Move the totals of all threads into the current chunk. _mutex should be locked. */
+		void collectThreadStages();
+		void collect(ThreadStages& stages);
+		static StageTotals& findStage(StageList& stages, const std::string& path);
+		Chunk& currentChunk();
+		/** Adds the change of the counters since the previous sample to the chunk. _mutex should be locked. */
+		void sampleQueues(Chunk& chunk, std::chrono::steady_clock::time_point time);
+		static QueueCounters readCounters(const ao::lane_statistics& statistics);
+		static void writeStages(std::ostream& stream, const StageList& stages, const std::string& indent);
+		static void writeMemoryUsage(std::ostream& stream, const MemoryTracker::Usage& usage, const std::string& indent);
+		static void writeQueues(std::ostream& stream, const QueueList& queues, double wallTime, const std::string& indent);
+		static double threadCPUTime();
+
+		static const size_t NoStage = size_t(-1);
+
+		bool _enabled;
+		mutable std::mutex _mutex;
+		std::vector<std::string> _stagePaths;
+		std::vector<ThreadStages*> _threadStages;
+		std::vector<Band> _bands;
+		std::vector<Queue> _queues;
+		int _currentChunk;
+		std::chrono::steady_clock::time_point _chunkStartTime, _queueSampleTime;
+};
+
+#endif
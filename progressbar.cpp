@@ -1,10 +1,18 @@
+#include "profiler.h"
 #include "progressbar.h"
+#include "progressstream.h"
 
 #include <iostream>
+#include <limits>
 
-ProgressBar::ProgressBar(const std::string& taskDescription) :
+ProgressBar::ProgressBar(const std::string& taskDescription, size_t visibilitiesPerTask) :
 	_taskDescription(taskDescription),
-	_displayedDots(0)
+	_displayedDots(0),
+	_visibilitiesPerTask(visibilitiesPerTask),
+	_taskCount(1),
+	_reportedProgress(std::numeric_limits<unsigned>::max()),
+	_startTime(std::chrono::steady_clock::now()),
+	_reportTime(_startTime)
 {
 	std::cout << taskDescription << ":";
 	if(taskDescription.size() < 40)
@@ -15,11 +23,12 @@ ProgressBar::ProgressBar(const std::string& taskDescription) :
 
 ProgressBar::~ProgressBar()
 {
-	SetProgress(1,1);
+	SetProgress(_taskCount, _taskCount);
 }
 
 void ProgressBar::SetProgress(size_t taskIndex, size_t taskCount)
 {
+	_taskCount = taskCount;
 	unsigned progress = (taskIndex * 100 / taskCount);
 	unsigned dots = progress / 2;
 	
@@ -37,4 +46,28 @@ void ProgressBar::SetProgress(size_t taskIndex, size_t taskCount)
 			std::cout << '\n';
 		std::cout << std::flush;
 	}
+	
+	if(ProgressStream::Instance().IsOpen())
+		report(taskIndex, taskCount, progress);
+	Profiler::Instance().Tick();
+}
+
+void ProgressBar::report(size_t taskIndex, size_t taskCount, unsigned progress)
+{
+	// Report when the percentage changes, and otherwise every few seconds
+	// so that a slow but running stage can be told apart from a stalled one
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if(progress == _reportedProgress && now - _reportTime < std::chrono::seconds(5))
+		return;
+	_reportedProgress = progress;
+	_reportTime = now;
+	
+	const double elapsed = std::chrono::duration<double>(now - _startTime).count();
+	double rate = 0.0, remaining = std::numeric_limits<double>::quiet_NaN();
+	if(taskIndex != 0 && elapsed > 0.0)
+	{
+		rate = double(taskIndex * _visibilitiesPerTask) / elapsed;
+		remaining = elapsed * double(taskCount - taskIndex) / double(taskIndex);
+	}
+	ProgressStream::Instance().Progress(_taskDescription, taskIndex, taskCount, rate, remaining);
 }
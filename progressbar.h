@@ -1,19 +1,35 @@
 #ifndef PROGRESSBAR_H
 #define PROGRESSBAR_H
 
+#include <chrono>
 #include <string>
 
+/**
+ * Shows the progress of a task on stdout. When the ProgressStream is open, the progress is
+ * also reported there, with the rate and the estimated remaining time. Those reports are
+ * limited to when the percentage changes or a few seconds have passed, so that SetProgress
+ * stays cheap.
+ */
 class ProgressBar
 {
 	public:
-		ProgressBar(const std::string &taskDescription);
+		/**
+		 * @param visibilitiesPerTask Number of visibilities handled per task, used to report the
+		 * processing rate; zero when the task is not about visibilities.
+		 */
+		ProgressBar(const std::string &taskDescription, size_t visibilitiesPerTask = 0);
 		~ProgressBar();
 	
 		void SetProgress(size_t taskIndex, size_t taskCount);
 		
 	private:
+		void report(size_t taskIndex, size_t taskCount, unsigned progress);
+
 		const std::string _taskDescription;
 		unsigned _displayedDots;
+		size_t _visibilitiesPerTask, _taskCount;
+		unsigned _reportedProgress;
+		std::chrono::steady_clock::time_point _startTime, _reportTime;
 };
 
 #endif
@@ -0,0 +1,139 @@
+#include "progressstream.h"
+#include "jsonescape.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+ProgressStream& ProgressStream::Instance()
+{
+	static ProgressStream stream;
+	return stream;
+}
+
+ProgressStream::~ProgressStream()
+{
+	if(_ownsDescriptor)
+		close(_fd);
+}
+
+void ProgressStream::Open(const std::string& filename)
+{
+	_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(_fd < 0)
+		throw std::runtime_error("Could not open progress file " + filename + ": " + strerror(errno));
+	_ownsDescriptor = true;
+}
+
+void ProgressStream::OpenDescriptor(int fd)
+{
+	if(fcntl(fd, F_GETFD) < 0)
+		throw std::runtime_error("File descriptor " + std::to_string(fd) + " for the progress stream is not open");
+	_fd = fd;
+	_ownsDescriptor = false;
+}
+
+void ProgressStream::StartObservation(const std::string& name, size_t index, size_t count)
+{
+	if(IsOpen())
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_observation = name;
+		_observationIndex = index;
+		_observationCount = count;
+		_band.clear();
+		_chunkIndex = -1;
+		_chunkCount = 0;
+		writeLine("observation", std::string());
+	}
+}
+
+void ProgressStream::FinishObservation()
+{
+	if(IsOpen())
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_band.clear();
+		_chunkIndex = -1;
+		_chunkCount = 0;
+		writeLine("observation_finished", std::string());
+	}
+}
+
+void ProgressStream::StartBand(const std::string& name)
+{
+	if(IsOpen())
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_band = name;
+		_chunkIndex = -1;
+		_chunkCount = 0;
+		writeLine("band", std::string());
+	}
+}
+
+void ProgressStream::StartChunk(size_t chunkIndex, size_t chunkCount)
+{
+	if(IsOpen())
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_chunkIndex = chunkIndex;
+		_chunkCount = chunkCount;
+		writeLine("chunk", std::string());
+	}
+}
+
+void ProgressStream::Progress(const std::string& stage, size_t done, size_t total, double visibilitiesPerSecond, double remainingTime)
+{
+	if(IsOpen())
+	{
+		std::ostringstream fields;
+		fields
+			<< ", \"stage\": \"" << jsonEscape(stage) << "\""
+			<< ", \"done\": " << done
+			<< ", \"total\": " << total
+			<< ", \"visibilities_per_s\": " << std::round(visibilitiesPerSecond);
+		// The remaining time is unknown until the first item is done
+		if(std::isfinite(remainingTime))
+			fields << ", \"eta_s\": " << std::round(remainingTime * 10.0) / 10.0;
+		std::lock_guard<std::mutex> lock(_mutex);
+		writeLine("progress", fields.str());
+	}
+}
+
+void ProgressStream::Finish()
+{
+	if(IsOpen())
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_observation.clear();
+		_band.clear();
+		_chunkIndex = -1;
+		writeLine("finished", std::string());
+	}
+}
+
+void ProgressStream::writeLine(const char* event, const std::string& fields)
+{
+	const double unixTime = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+	std::ostringstream line;
+	line.precision(14);
+	line << "{\"event\": \"" << event << "\", \"time\": " << unixTime << ", \"pid\": " << getpid();
+	if(!_observation.empty())
+		line << ", \"observation\": \"" << jsonEscape(_observation) << "\", \"observation_index\": " << _observationIndex << ", \"observations\": " << _observationCount;
+	if(!_band.empty())
+		line << ", \"band\": \"" << jsonEscape(_band) << "\"";
+	if(_chunkIndex >= 0)
+		line << ", \"chunk\": " << _chunkIndex << ", \"chunks\": " << _chunkCount;
+	line << fields << "}\n";
+	const std::string str = line.str();
+	// A failing progress stream (e.g. a closed pipe) should not stop the processing
+	if(write(_fd, str.data(), str.size()) < 0)
+	{ }
+}
@@ -0,0 +1,59 @@
+#ifndef PROGRESS_STREAM_H
+#define PROGRESS_STREAM_H
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+
+/**
+ * Writes the progress of the pipeline as JSON lines to a file or file descriptor, for
+ * workflow managers that need to detect stalled jobs or schedule work. Every line is
+ * an object with a "event" field:
+ * - "observation" when an observation of a batch starts, and "observation_finished" when it is
+ *   written; later lines carry the "observation" field;
+ * - "band" and "chunk" when a band or chunk starts;
+ * - "progress" with the stage, the items done and in total, the visibilities per second
+ *   and the estimated remaining time of the stage;
+ * - "finished" once at the end of the run, also in batch mode.
+ * Each line is written with a single write() call on a descriptor in append mode, so that
+ * the processes of -parallel-bands can share it; the "pid" field tells them apart.
+ */
+class ProgressStream
+{
+	public:
+		static ProgressStream& Instance();
+
+		/** Truncates and opens the file. Throws a std::runtime_error when this fails. */
+		void Open(const std::string& filename);
+		/** Use an already open descriptor, e.g. a pipe set up by the workflow manager. */
+		void OpenDescriptor(int fd);
+		bool IsOpen() const { return _fd >= 0; }
+
+		void StartObservation(const std::string& name, size_t index, size_t count);
+		void FinishObservation();
+		void StartBand(const std::string& name);
+		void StartChunk(size_t chunkIndex, size_t chunkCount);
+		void Progress(const std::string& stage, size_t done, size_t total, double visibilitiesPerSecond, double remainingTime);
+		void Finish();
+
+	private:
+		ProgressStream() : _fd(-1), _ownsDescriptor(false), _observationIndex(0), _observationCount(0), _chunkIndex(-1), _chunkCount(0) { }
+		~ProgressStream();
+
+		ProgressStream(const ProgressStream&) = delete;
+		ProgressStream& operator=(const ProgressStream&) = delete;
+
+		/** Writes the common fields, the given fields (which should start with a comma) and a newline. */
+		void writeLine(const char* event, const std::string& fields);
+
+		int _fd;
+		bool _ownsDescriptor;
+		std::mutex _mutex;
+		std::string _observation;
+		size_t _observationIndex, _observationCount;
+		std::string _band;
+		int _chunkIndex;
+		size_t _chunkCount;
+};
+
+#endif
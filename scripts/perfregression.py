@@ -0,0 +1,261 @@
+#!/usr/bin/env python3
+"""
+Runs cotter end to end on a small observation generated by synthobs, for a
+matrix of configurations, and compares the per-stage wall times and the
+checksums of the output against a baseline file.
+
+Typical use, from a build directory:
+
+  ../scripts/perfregression.py -update baseline.json .   # record the baseline
+  ../scripts/perfregression.py baseline.json .           # compare against it
+
+CTest runs every configuration as a separate test (perf_<configuration>) with
+-config and a fixed -threads, and skips them until the baseline has been recorded with
+"make perf_baseline". A configuration can be recorded again with -update and
+-config; the other configurations of the baseline are kept.
+
+The exit status is non-zero when a stage became slower than the tolerance
+allows, or when the output of a configuration changed. It is 77 when the
+baseline does not contain the selected configuration. Timings are only
+comparable on the same machine, so baselines should not be shared between
+machines. Checksums are independent of the number of threads: the output of a
+multi-threaded run is also compared with that of the single-threaded run of the
+same configuration, taken from this run or otherwise from the baseline.
+"""
+
+import argparse
+import glob
+import hashlib
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+def configurations(threads, dysco):
+	"""Returns a list of (name, cotter options, output filename) tuples."""
+	result = []
+	for output in ("ms", "uvfits", "mwaf"):
+		for averaging in (False, True):
+			for apply in (False, True):
+				for use_dysco in (False, True):
+					# Flag files are written at full resolution and are not changed by solutions
+					if output == "mwaf" and (averaging or apply):
+						continue
+					if use_dysco and (output != "ms" or not dysco):
+						continue
+					for j in sorted(set([1, threads])):
+						name = output
+						options = []
+						if averaging:
+							name += "-avg"
+							options += ["-timeres", "1", "-freqres", "80"]
+						else:
+							options += ["-timeres", "0.5", "-freqres", "40"]
+						if apply:
+							name += "-apply"
+							options += ["-full-apply", "solutions.bin"]
+						if use_dysco:
+							name += "-dysco"
+							options += ["-use-dysco"]
+						name += "-j" + str(j)
+						options += ["-j", str(j)]
+						filename = "obs_%%.mwaf" if output == "mwaf" else "obs." + output
+						result.append((name, options, filename))
+	return result
+
+def fits_data_units(stream):
+	"""Yields the data unit of every HDU of a FITS file, without the headers."""
+	while True:
+		cards = {}
+		while "END" not in cards:
+			block = stream.read(2880)
+			if len(block) == 0 and not cards:
+				return
+			if len(block) != 2880:
+				raise RuntimeError("Truncated FITS header in " + stream.name)
+			for i in range(0, 2880, 80):
+				card = block[i:i+80].decode("ascii", "replace")
+				key = card[:8].strip()
+				if key == "END":
+					cards["END"] = ""
+					break
+				if card[8:10] == "= ":
+					cards[key] = card[10:].split("/")[0].strip()
+		naxis = int(cards.get("NAXIS", 0))
+		axes = [int(cards["NAXIS%d" % (i + 1)]) for i in range(naxis)]
+		# Random groups (uvfits) have NAXIS1 = 0
+		if axes and axes[0] == 0:
+			axes = axes[1:]
+		elements = 1
+		for axis in axes:
+			elements *= axis
+		if naxis == 0:
+			elements = 0
+		size = abs(int(cards["BITPIX"])) // 8 * int(cards.get("GCOUNT", 1)) * (int(cards.get("PCOUNT", 0)) + elements)
+		data = stream.read(size)
+		if len(data) != size:
+			raise RuntimeError("Truncated FITS data in " + stream.name)
+		yield data
+		stream.seek((2880 - size % 2880) % 2880, os.SEEK_CUR)
+
+def output_checksum(workdir, filename):
+	"""Checksum of the visibilities and flags. For a measurement set, only the storage
+	files of the main table are used, because the subtables contain the processing
+	history and the creation time. For FITS files only the data units are used, because
+	the headers contain the command line, which differs in the number of threads."""
+	if filename.endswith(".ms"):
+		files = sorted(glob.glob(os.path.join(workdir, filename, "table.f*")))
+		files = [f for f in files if os.path.isfile(f)]
+	else:
+		files = sorted(glob.glob(os.path.join(workdir, filename.replace("%%", "*"))))
+	if not files:
+		raise RuntimeError("No output found for " + filename)
+	checksum = hashlib.sha1()
+	for f in files:
+		with open(f, "rb") as stream:
+			if filename.endswith(".ms"):
+				for block in iter(lambda: stream.read(1 << 20), b""):
+					checksum.update(block)
+			else:
+				for data in fits_data_units(stream):
+					checksum.update(data)
+	return checksum.hexdigest()
+
+def stage_times(profile_filename):
+	with open(profile_filename) as stream:
+		profile = json.load(stream)
+	return dict((stage["stage"], stage["wall_s"]) for stage in profile["totals"])
+
+def remove_output(workdir, filename):
+	for path in glob.glob(os.path.join(workdir, filename.replace("%%", "*"))):
+		if os.path.isdir(path):
+			shutil.rmtree(path)
+		else:
+			os.remove(path)
+
+def run(args, workdir, selected):
+	cotter = os.path.join(args.builddir, "cotter")
+	results = {}
+	for name, options, filename in selected:
+		remove_output(workdir, filename)
+		command = [cotter, "-m", "obs_metafits.fits", "-sbcount", str(args.subbands),
+			"-profile", "profile.json", "-o", filename] + options + \
+			sorted(os.path.basename(f) for f in glob.glob(os.path.join(workdir, "obs_gpubox*_00.fits")))
+		start = time.time()
+		with open(os.path.join(workdir, name + ".log"), "w") as log:
+			status = subprocess.call(command, cwd=workdir, stdout=log, stderr=subprocess.STDOUT)
+		wall_time = time.time() - start
+		if status != 0:
+			raise RuntimeError("cotter failed for configuration " + name + ", see " + os.path.join(workdir, name + ".log"))
+		results[name] = {
+			"wall_s": wall_time,
+			"checksum": output_checksum(workdir, filename),
+			"stages": stage_times(os.path.join(workdir, "profile.json"))
+		}
+		print("%-24s %8.2f s  %s" % (name, wall_time, results[name]["checksum"]))
+		remove_output(workdir, filename)
+	return results
+
+def compare(results, baseline, tolerance, min_time):
+	"""Returns the list of regressions."""
+	problems = []
+	for name, result in sorted(results.items()):
+		# The multi-threaded output should be identical to the single-threaded output. With
+		# -config, only one of them runs, and the other is taken from the baseline.
+		if not name.endswith("-j1"):
+			reference_name = name.rsplit("-j", 1)[0] + "-j1"
+			reference = results.get(reference_name, baseline.get(reference_name))
+			if reference is not None and reference["checksum"] != result["checksum"]:
+				problems.append(name + ": output differs from the single-threaded run")
+		if name not in baseline:
+			print(name + ": not in baseline, skipped")
+			continue
+		expected = baseline[name]
+		if expected["checksum"] != result["checksum"]:
+			problems.append(name + ": output checksum changed")
+		times = [("total", expected["wall_s"], result["wall_s"])]
+		for stage, wall_time in sorted(result["stages"].items()):
+			if stage in expected["stages"]:
+				times.append((stage, expected["stages"][stage], wall_time))
+		for stage, before, after in times:
+			# Very short stages are dominated by noise
+			if max(before, after) >= min_time and after > before * (1.0 + tolerance):
+				problems.append("%s: %s took %.3f s, baseline %.3f s (+%.0f%%)" % (name, stage, after, before, (after / before - 1.0) * 100.0))
+	return problems
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+	parser.add_argument("baseline", nargs="?", help="JSON file with the baseline timings and checksums")
+	parser.add_argument("builddir", nargs="?", help="directory with the cotter and synthobs executables")
+	parser.add_argument("-update", action="store_true", help="write the baseline file instead of comparing against it")
+	parser.add_argument("-config", help="only run the configuration with this name")
+	parser.add_argument("-list", action="store_true", help="print the names of the configurations and exit")
+	parser.add_argument("-tolerance", type=float, default=0.25, help="allowed relative slowdown of a stage (default: 0.25)")
+	parser.add_argument("-min-time", type=float, default=0.1, help="ignore stages that take less seconds than this (default: 0.1)")
+	parser.add_argument("-threads", type=int, default=os.cpu_count() or 1, help="number of threads of the multi-threaded runs (default: all)")
+	parser.add_argument("-antennas", type=int, default=128, help="number of antennas of the observation (default: 128)")
+	parser.add_argument("-subbands", type=int, default=2, help="number of subbands of the observation (default: 2)")
+	parser.add_argument("-scans", type=int, default=16, help="number of scans of the observation (default: 16)")
+	parser.add_argument("-no-dysco", action="store_true", help="skip the configurations with Dysco compression")
+	parser.add_argument("-keep", action="store_true", help="keep the working directory with the logs")
+	args = parser.parse_args()
+
+	selected = configurations(args.threads, not args.no_dysco)
+	if args.list:
+		for name, options, filename in selected:
+			print(name)
+		return 0
+	if args.baseline is None or args.builddir is None:
+		parser.error("the baseline and build directory are required")
+	args.builddir = os.path.abspath(args.builddir)
+	if args.config is not None:
+		selected = [c for c in selected if c[0] == args.config]
+		if not selected:
+			print("Error: unknown configuration " + args.config)
+			return 2
+
+	baseline = {}
+	if os.path.exists(args.baseline):
+		with open(args.baseline) as stream:
+			baseline = json.load(stream)["configurations"]
+	if not args.update and all(c[0] not in baseline for c in selected):
+		print("No baseline for the selected configurations in " + args.baseline + ", skipped")
+		return 77
+
+	workdir = tempfile.mkdtemp(prefix="cotter-perf-")
+	try:
+		subprocess.check_call([os.path.join(args.builddir, "synthobs"),
+			"-antennas", str(args.antennas), "-subbands", str(args.subbands), "-scans", str(args.scans),
+			"-solutions", "solutions.bin", "obs"], cwd=workdir, stdout=subprocess.DEVNULL)
+		results = run(args, workdir, selected)
+	except (RuntimeError, subprocess.CalledProcessError) as e:
+		# Keep the logs for inspection
+		print("Error: " + str(e))
+		return 2
+	if args.keep:
+		print("Working directory: " + workdir)
+	else:
+		shutil.rmtree(workdir)
+
+	if args.update:
+		# With -config, the other configurations of an existing baseline are kept
+		if args.config is None:
+			baseline = {}
+		baseline.update(results)
+		with open(args.baseline, "w") as stream:
+			json.dump({"configurations": baseline}, stream, indent=2, sort_keys=True)
+		print("Written baseline to " + args.baseline)
+		return 0
+
+	problems = compare(results, baseline, args.tolerance, args.min_time)
+	for problem in problems:
+		print("REGRESSION " + problem)
+	if not problems:
+		print("No regressions.")
+	return 1 if problems else 0
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,346 @@
+#include "syntheticobservation.h"
+#include "solutionfile.h"
+
+#include <fitsio.h>
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	// Difference between the GPS and unix epochs, and the number of leap seconds since the GPS epoch
+	const long GPSToUnixOffset = 315964800, LeapSeconds = 18;
+
+	// Power of two, larger than the number of correlation products of one channel
+	const size_t NoiseTableSize = 1 << 17;
+
+	void removeIfExists(const std::string& filename)
+	{
+		FILE *fp = std::fopen(filename.c_str(), "r");
+		if(fp != NULL) {
+			std::fclose(fp);
+			std::remove(filename.c_str());
+		}
+	}
+}
+
+SyntheticObservation::SyntheticObservation() :
+	_antennaCount(128),
+	_subbandCount(24),
+	_channelsPerSubband(32),
+	_scanCount(20),
+	_integrationTime(0.5),
+	_firstCoarseChannel(109),
+	_gpsTime(1200000000),
+	_rfiFraction(0.01),
+	_flaggedAntennaCount(0),
+	_offlineFormat(false),
+	_seed(1)
+{ }
+
+void SyntheticObservation::SetAntennaCount(size_t antennaCount)
+{
+	if(antennaCount == 0 || antennaCount > 128 || antennaCount % 32 != 0)
+		throw std::runtime_error("The number of antennas should be a multiple of 32 and at most 128, because the legacy correlator input mapping is used");
+	_antennaCount = antennaCount;
+}
+
+std::time_t SyntheticObservation::startTime() const
+{
+	return _gpsTime + GPSToUnixOffset - LeapSeconds;
+}
+
+std::string SyntheticObservation::dateString(std::time_t time, bool withSeparators)
+{
+	std::tm timeTm;
+	gmtime_r(&time, &timeTm);
+	char str[32];
+	if(withSeparators)
+		std::snprintf(str, sizeof(str), "%04d-%02d-%02dT%02d:%02d:%02d", timeTm.tm_year+1900, timeTm.tm_mon+1, timeTm.tm_mday, timeTm.tm_hour, timeTm.tm_min, timeTm.tm_sec);
+	else
+		std::snprintf(str, sizeof(str), "%04d%02d%02d%02d%02d%02d", timeTm.tm_year+1900, timeTm.tm_mon+1, timeTm.tm_mday, timeTm.tm_hour, timeTm.tm_min, timeTm.tm_sec);
+	return str;
+}
+
+std::string SyntheticObservation::intList(const std::vector<int>& values)
+{
+	std::ostringstream str;
+	for(size_t i=0; i!=values.size(); ++i)
+	{
+		if(i != 0) str << ',';
+		str << values[i];
+	}
+	return str.str();
+}
+
+std::string SyntheticObservation::GPUBoxFilename(const std::string& prefix, size_t gpuBoxIndex)
+{
+	char number[8];
+	std::snprintf(number, sizeof(number), "%02d", int(gpuBoxIndex + 1));
+	return prefix + "_gpubox" + number + "_00.fits";
+}
+
+void SyntheticObservation::WriteMetafits(const std::string& filename) const
+{
+	if(_subbandCount == 0 || _subbandCount > 24)
+		throw std::runtime_error("The number of subbands should be between 1 and 24");
+	if(_firstCoarseChannel + 23 > 255)
+		throw std::runtime_error("The coarse channel numbers should be below 256");
+
+	removeIfExists(filename);
+	int status = 0;
+	fitsfile *fptr;
+	if(fits_create_file(&fptr, filename.c_str(), &status))
+		throwError(status, "Cannot create metafits file " + filename);
+	fits_create_img(fptr, BYTE_IMG, 0, nullptr, &status);
+	checkStatus(status);
+
+	// The band consists of the given subbands; the metafits file always lists 24 coarse channels
+	double
+		bandwidthMHz = 1.28 * _subbandCount,
+		centralFrequencyMHz = (double(_firstCoarseChannel) + 0.5*_subbandCount - 0.5) * 1.28;
+	// This equals MWAConfig::CentreSubbandNumber(), which cotter checks against CENTCHAN
+	int centreChannel = std::round(centralFrequencyMHz / 1.28 + 0.5);
+	long gpsTime = _gpsTime;
+	int nScans = _scanCount, nInputs = _antennaCount*2, nChannels = channelCount(), exposure = std::round(_scanCount * _integrationTime);
+	double integrationTime = _integrationTime, ra = 0.0, dec = -27.0;
+	int calibrator = 0;
+	const std::string
+		name = "synthetic_" + std::to_string(_gpsTime),
+		date = dateString(startTime(), true),
+		delays = intList(std::vector<int>(16, 0));
+	std::vector<int> coarseChannels(24);
+	for(size_t i=0; i!=24; ++i)
+		coarseChannels[i] = _firstCoarseChannel + i;
+	const std::string channels = intList(coarseChannels);
+
+	fits_update_key(fptr, TLONG, "GPSTIME", &gpsTime, "GPS time of the observation start", &status);
+	fits_update_key(fptr, TINT, "EXPOSURE", &exposure, "Duration in seconds", &status);
+	fits_update_key(fptr, TSTRING, "FILENAME", const_cast<char*>(name.c_str()), "Name of the observation", &status);
+	fits_update_key(fptr, TSTRING, "DATE-OBS", const_cast<char*>(date.c_str()), "Start of the observation (UTC)", &status);
+	fits_update_key(fptr, TDOUBLE, "RA", &ra, "Pointing right ascension (degrees)", &status);
+	fits_update_key(fptr, TDOUBLE, "DEC", &dec, "Pointing declination (degrees)", &status);
+	fits_update_key(fptr, TDOUBLE, "RAPHASE", &ra, "Phase centre right ascension (degrees)", &status);
+	fits_update_key(fptr, TDOUBLE, "DECPHASE", &dec, "Phase centre declination (degrees)", &status);
+	fits_update_key(fptr, TSTRING, "GRIDNAME", const_cast<char*>("synthetic"), nullptr, &status);
+	fits_update_key(fptr, TSTRING, "CREATOR", const_cast<char*>("synthobs"), nullptr, &status);
+	fits_update_key(fptr, TSTRING, "PROJECT", const_cast<char*>("SYNTHETIC"), nullptr, &status);
+	fits_update_key(fptr, TSTRING, "MODE", const_cast<char*>("HW_LFILES"), nullptr, &status);
+	fits_update_key(fptr, TSTRING, "DELAYS", const_cast<char*>(delays.c_str()), "Beamformer delays", &status);
+	fits_update_key(fptr, TLOGICAL, "CALIBRAT", &calibrator, nullptr, &status);
+	fits_update_key(fptr, TINT, "CENTCHAN", &centreChannel, "Centre coarse channel", &status);
+	fits_update_key(fptr, TDOUBLE, "INTTIME", &integrationTime, "Integration time (s)", &status);
+	fits_update_key(fptr, TINT, "NSCANS", &nScans, "Number of scans", &status);
+	fits_update_key(fptr, TINT, "NINPUTS", &nInputs, "Number of correlator inputs", &status);
+	fits_update_key(fptr, TINT, "NCHANS", &nChannels, "Number of fine channels", &status);
+	fits_update_key(fptr, TDOUBLE, "BANDWDTH", &bandwidthMHz, "Total bandwidth (MHz)", &status);
+	fits_update_key(fptr, TDOUBLE, "FREQCENT", &centralFrequencyMHz, "Centre frequency (MHz)", &status);
+	fits_write_key_longstr(fptr, "CHANNELS", channels.c_str(), "Coarse channel numbers", &status);
+	fits_update_key(fptr, TSTRING, "TELESCOP", const_cast<char*>("MWA"), nullptr, &status);
+	checkStatus(status);
+
+	const char
+		*columnNames[] = {"Input", "Antenna", "Tile", "TileName", "Pol", "Rx", "Slot", "Flag", "Length", "East", "North", "Height", "Gains"},
+		*columnFormats[] = {"1I", "1I", "1I", "8A", "1A", "1I", "1I", "1I", "14A", "1E", "1E", "1E", "24I"},
+		*columnUnits[] = {"", "", "", "", "", "", "", "", "", "m", "m", "m", ""};
+	const size_t nRows = _antennaCount*2;
+	fits_create_tbl(fptr, BINARY_TBL, nRows, 13,
+		const_cast<char**>(columnNames), const_cast<char**>(columnFormats), const_cast<char**>(columnUnits),
+		"TILEDATA", &status);
+	checkStatus(status);
+
+	std::mt19937 random(_seed);
+	std::uniform_real_distribution<double> position(-750.0, 750.0), height(-2.0, 2.0), cableLength(50.0, 500.0);
+	std::vector<double> east(_antennaCount), north(_antennaCount), up(_antennaCount);
+	for(size_t antenna=0; antenna!=_antennaCount; ++antenna)
+	{
+		east[antenna] = position(random);
+		north[antenna] = position(random);
+		up[antenna] = 377.0 + height(random);
+	}
+	std::vector<int> gains(24, 64);
+	for(size_t row=0; row!=nRows; ++row)
+	{
+		// Every antenna has an X and a Y input, with the inputs in antenna order
+		const size_t antenna = row / 2;
+		int
+			input = row,
+			antennaIndex = antenna,
+			tile = (antenna/8 + 1) * 10 + antenna%8 + 1,
+			receiver = antenna/8 + 1,
+			slot = antenna%8 + 1,
+			flag = (antenna + _flaggedAntennaCount >= _antennaCount) ? 1 : 0;
+		char tileName[16], pol[2] = { (row%2 == 0) ? 'X' : 'Y', 0 }, length[16];
+		std::snprintf(tileName, sizeof(tileName), "Tile%03d", tile);
+		std::snprintf(length, sizeof(length), "EL_%.3f", cableLength(random));
+		char *tileNamePtr = tileName, *polPtr = pol, *lengthPtr = length;
+		const long r = row+1;
+		fits_write_col(fptr, TINT, 1, r, 1, 1, &input, &status);
+		fits_write_col(fptr, TINT, 2, r, 1, 1, &antennaIndex, &status);
+		fits_write_col(fptr, TINT, 3, r, 1, 1, &tile, &status);
+		fits_write_col(fptr, TSTRING, 4, r, 1, 1, &tileNamePtr, &status);
+		fits_write_col(fptr, TSTRING, 5, r, 1, 1, &polPtr, &status);
+		fits_write_col(fptr, TINT, 6, r, 1, 1, &receiver, &status);
+		fits_write_col(fptr, TINT, 7, r, 1, 1, &slot, &status);
+		fits_write_col(fptr, TINT, 8, r, 1, 1, &flag, &status);
+		fits_write_col(fptr, TSTRING, 9, r, 1, 1, &lengthPtr, &status);
+		fits_write_col(fptr, TDOUBLE, 10, r, 1, 1, &east[antenna], &status);
+		fits_write_col(fptr, TDOUBLE, 11, r, 1, 1, &north[antenna], &status);
+		fits_write_col(fptr, TDOUBLE, 12, r, 1, 1, &up[antenna], &status);
+		fits_write_col(fptr, TINT, 13, r, 1, 24, gains.data(), &status);
+		checkStatus(status);
+	}
+
+	if(fits_close_file(fptr, &status))
+		throwError(status, "Could not close metafits file " + filename);
+}
+
+std::vector<bool> SyntheticObservation::makeRFIMask() const
+{
+	const size_t nChannels = channelCount(), sampleCount = _scanCount * nChannels;
+	std::vector<bool> mask(sampleCount, false);
+	const size_t target = std::min<double>(sampleCount, std::round(_rfiFraction * sampleCount));
+	std::mt19937 random(_seed);
+	size_t count = 0;
+	auto set = [&](size_t scan, size_t channel)
+	{
+		std::vector<bool>::reference sample = mask[scan * nChannels + channel];
+		if(!sample)
+		{
+			sample = true;
+			++count;
+		}
+	};
+	while(count < target)
+	{
+		if(random() % 3 == 0)
+		{
+			// Broad-band burst in one scan
+			const size_t scan = random() % _scanCount;
+			for(size_t ch=0; ch!=nChannels && count < target; ++ch)
+				set(scan, ch);
+		}
+		else {
+			// Narrow-band transmitter that is on for a while
+			const size_t
+				channel = random() % nChannels,
+				start = random() % _scanCount,
+				duration = 1 + random() % std::max<size_t>(1, _scanCount/4),
+				end = std::min(start + duration, _scanCount);
+			for(size_t scan=start; scan!=end && count < target; ++scan)
+				set(scan, channel);
+		}
+	}
+	return mask;
+}
+
+void SyntheticObservation::fillHDU(std::vector<std::complex<float>>& matrix, size_t gpuBoxIndex, size_t scan, const std::vector<bool>& rfiMask, const std::vector<std::complex<float>>& noise, unsigned& noiseOffset) const
+{
+	const size_t nPol = 4, nBaselines = baselineCount(), rowSize = nBaselines * nPol;
+	const float sourceFlux = 1.0, autoPower = 1000.0, rfiAmplitude = 50.0;
+	for(size_t ch=0; ch!=_channelsPerSubband; ++ch)
+	{
+		const size_t channel = gpuBoxIndex * _channelsPerSubband + ch;
+		const bool hasRFI = rfiMask[scan * channelCount() + channel];
+		// Take the noise of this row from a pseudo-random position in the table
+		noiseOffset = noiseOffset * 1664525u + 1013904223u;
+		const std::complex<float> *noisePtr = &noise[(noiseOffset >> 8) % (NoiseTableSize - rowSize)];
+		std::complex<float> *dataPtr = &matrix[ch * rowSize];
+		// The correlator writes the baselines as (antenna1, antenna2) with antenna2 <= antenna1
+		for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+		{
+			for(size_t antenna2=0; antenna2<=antenna1; ++antenna2)
+			{
+				const float rfiPhase = 0.3f * float(antenna1 - antenna2) + 0.01f * float(channel);
+				const std::complex<float> rfi = hasRFI ? std::polar(rfiAmplitude, rfiPhase) : std::complex<float>();
+				for(size_t p=0; p!=nPol; ++p)
+				{
+					std::complex<float> value = *noisePtr;
+					if(antenna1 == antenna2)
+					{
+						if(p == 0 || p == 3)
+							value = std::complex<float>(autoPower + std::abs(rfi) + 10.0f * value.real(), 0.0f);
+					}
+					else if(p == 0 || p == 3)
+						value += sourceFlux + rfi;
+					*dataPtr = value;
+					++dataPtr;
+					++noisePtr;
+				}
+			}
+		}
+	}
+}
+
+void SyntheticObservation::WriteGPUBoxFile(const std::string& filename, size_t gpuBoxIndex) const
+{
+	const size_t nPol = 4, rowSize = baselineCount() * nPol;
+	if(rowSize >= NoiseTableSize)
+		throw std::runtime_error("Too many baselines for the noise table");
+
+	std::mt19937 random(_seed + 1 + gpuBoxIndex);
+	std::normal_distribution<float> gaussian;
+	std::vector<std::complex<float>> noise(NoiseTableSize);
+	for(std::complex<float>& value : noise)
+		value = std::complex<float>(gaussian(random), gaussian(random));
+	unsigned noiseOffset = random();
+	const std::vector<bool> rfiMask = makeRFIMask();
+
+	removeIfExists(filename);
+	int status = 0;
+	fitsfile *fptr;
+	if(fits_create_file(&fptr, filename.c_str(), &status))
+		throwError(status, "Cannot create gpubox file " + filename);
+
+	long time = startTime();
+	int milliTime = 0;
+	if(!_offlineFormat)
+	{
+		// The online correlator starts the file with an HDU that only has metadata
+		fits_create_img(fptr, BYTE_IMG, 0, nullptr, &status);
+		fits_update_key(fptr, TLONG, "TIME", &time, "Unix time of the first scan", &status);
+		fits_update_key(fptr, TINT, "MILLITIM", &milliTime, nullptr, &status);
+		checkStatus(status);
+	}
+
+	std::vector<std::complex<float>> matrix(_channelsPerSubband * rowSize);
+	long naxes[2] = { long(rowSize * 2), long(_channelsPerSubband) };
+	for(size_t scan=0; scan!=_scanCount; ++scan)
+	{
+		fillHDU(matrix, gpuBoxIndex, scan, rfiMask, noise, noiseOffset);
+		const double scanTime = startTime() + scan * _integrationTime;
+		long hduTime = std::floor(scanTime);
+		milliTime = std::round((scanTime - hduTime) * 1000.0);
+		fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+		fits_update_key(fptr, TLONG, "TIME", &hduTime, "Unix time of the scan", &status);
+		fits_update_key(fptr, TINT, "MILLITIM", &milliTime, nullptr, &status);
+		fits_write_img(fptr, TFLOAT, 1, matrix.size() * 2, reinterpret_cast<float*>(matrix.data()), &status);
+		checkStatus(status);
+	}
+
+	if(fits_close_file(fptr, &status))
+		throwError(status, "Could not close gpubox file " + filename);
+}
+
+void SyntheticObservation::WriteSolutionFile(const std::string& filename) const
+{
+	SolutionFile file;
+	file.SetAntennaCount(_antennaCount);
+	file.SetChannelCount(channelCount());
+	file.SetPolarizationCount(4);
+	file.OpenForWriting(filename.c_str());
+	// Diagonal gains with a small antenna-dependent phase, so that applying them changes the data
+	for(size_t a=0; a!=_antennaCount; ++a)
+	{
+		const std::complex<double> gain = std::polar(1.0, 0.01 * a);
+		for(size_t ch=0; ch!=channelCount(); ++ch)
+		{
+			file.WriteSolution(gain, 0, a, ch, 0);
+			file.WriteSolution(0.0, 0, a, ch, 1);
+			file.WriteSolution(0.0, 0, a, ch, 2);
+			file.WriteSolution(gain, 0, a, ch, 3);
+		}
+	}
+}
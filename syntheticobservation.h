@@ -0,0 +1,70 @@
+#ifndef SYNTHETIC_OBSERVATION_H
+#define SYNTHETIC_OBSERVATION_H
+
+#include "fitsuser.h"
+
+#include <complex>
+#include <ctime>
+#include <string>
+#include <vector>
+
+/**
+ * Writes a synthetic MWA observation: a metafits file and the gpubox files of the
+ * legacy correlator, in the layout that the GPUFileReader expects. The visibilities
+ * are noise with a point source at the phase centre, and RFI can be injected as
+ * narrow-band lines and broad-band bursts. The same settings and seed always
+ * produce the same files, so that they can be used for repeatable throughput tests.
+ */
+class SyntheticObservation : private FitsUser
+{
+	public:
+		SyntheticObservation();
+
+		/** The legacy correlator input mapping requires a multiple of 32 antennas, up to 128. */
+		void SetAntennaCount(size_t antennaCount);
+		void SetSubbandCount(size_t subbandCount) { _subbandCount = subbandCount; }
+		void SetChannelsPerSubband(size_t channelsPerSubband) { _channelsPerSubband = channelsPerSubband; }
+		void SetScanCount(size_t scanCount) { _scanCount = scanCount; }
+		void SetIntegrationTime(double integrationTime) { _integrationTime = integrationTime; }
+		/** Coarse channel number of the first subband. */
+		void SetFirstCoarseChannel(size_t coarseChannel) { _firstCoarseChannel = coarseChannel; }
+		void SetGPSTime(long gpsTime) { _gpsTime = gpsTime; }
+		/** Approximate fraction of the time-frequency samples that contain RFI. */
+		void SetRFIFraction(double rfiFraction) { _rfiFraction = rfiFraction; }
+		/** Number of antennas, starting with the last one, that are flagged in the metafits file. */
+		void SetFlaggedAntennaCount(size_t flaggedAntennaCount) { _flaggedAntennaCount = flaggedAntennaCount; }
+		/** Write gpubox files without the initial metadata HDU, as in offline correlated VCS observations. */
+		void SetOfflineFormat(bool offlineFormat) { _offlineFormat = offlineFormat; }
+		void SetSeed(unsigned seed) { _seed = seed; }
+
+		size_t SubbandCount() const { return _subbandCount; }
+
+		void WriteMetafits(const std::string& filename) const;
+		void WriteGPUBoxFile(const std::string& filename, size_t gpuBoxIndex) const;
+		/** Writes calibration solutions for all antennas and channels, to be used with cotter's -full-apply. */
+		void WriteSolutionFile(const std::string& filename) const;
+
+		/** Name of a gpubox file as written by the correlator, e.g. prefix_gpubox01_00.fits. */
+		static std::string GPUBoxFilename(const std::string& prefix, size_t gpuBoxIndex);
+
+	private:
+		size_t baselineCount() const { return _antennaCount * (_antennaCount + 1) / 2; }
+		size_t channelCount() const { return _subbandCount * _channelsPerSubband; }
+		std::time_t startTime() const;
+		/** Which time-frequency samples of the full band contain RFI, indexed by scan * channelCount() + channel. */
+		std::vector<bool> makeRFIMask() const;
+		void fillHDU(std::vector<std::complex<float>>& matrix, size_t gpuBoxIndex, size_t scan, const std::vector<bool>& rfiMask, const std::vector<std::complex<float>>& noise, unsigned& noiseOffset) const;
+		static std::string dateString(std::time_t time, bool withSeparators);
+		static std::string intList(const std::vector<int>& values);
+
+		size_t _antennaCount, _subbandCount, _channelsPerSubband, _scanCount;
+		double _integrationTime;
+		size_t _firstCoarseChannel;
+		long _gpsTime;
+		double _rfiFraction;
+		size_t _flaggedAntennaCount;
+		bool _offlineFormat;
+		unsigned _seed;
+};
+
+#endif
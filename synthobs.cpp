@@ -0,0 +1,121 @@
+#include "syntheticobservation.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+void usage()
+{
+	std::cout <<
+		"synthobs writes a synthetic MWA observation: a metafits file and the raw gpubox files of\n"
+		"the legacy correlator, which can be processed by cotter, e.g. to measure its throughput\n"
+		"with 'cotter -profile'. The same options and seed always produce the same files.\n\n"
+		"Syntax: synthobs [options] <prefix>\n\n"
+		"Writes <prefix>_metafits.fits and <prefix>_gpuboxNN_00.fits.\n\n"
+		"Options:\n"
+		"  -antennas <n>      Number of antennas, a multiple of 32 up to 128. Default: 128.\n"
+		"  -subbands <n>      Number of subbands (gpubox files), at most 24. Default: 24.\n"
+		"                     With less than 24, cotter should be run with '-sbcount <n>'.\n"
+		"  -channels <n>      Number of channels per subband. Default: 32.\n"
+		"  -scans <n>         Number of scans. Default: 20.\n"
+		"  -inttime <s>       Integration time in seconds. Default: 0.5.\n"
+		"  -coarsechan <n>    Coarse channel number of the first subband. Default: 109.\n"
+		"  -gpstime <t>       GPS start time, which is also the observation id. Default: 1200000000.\n"
+		"  -rfi <fraction>    Fraction of the samples that contain RFI. Default: 0.01.\n"
+		"  -flagantennas <n>  Number of antennas that are flagged in the metafits file. Default: 0.\n"
+		"  -offline           Write the offline gpubox format, without the initial metadata HDU.\n"
+		"                     Cotter should be run with '-offline-gpubox-format'.\n"
+		"  -seed <n>          Seed for the random numbers. Default: 1.\n"
+		"  -solutions <file>  Also write a calibration solution file for use with cotter's -full-apply.\n";
+}
+
+int main(int argc, char* argv[])
+{
+	SyntheticObservation observation;
+	std::string prefix, solutionFilename;
+	bool offline = false;
+	try {
+		int argi = 1;
+		while(argi != argc)
+		{
+			if(argv[argi][0] == '-' && argi+1 != argc)
+			{
+				const std::string param = &argv[argi][1];
+				if(param == "offline")
+				{
+					offline = true;
+					observation.SetOfflineFormat(true);
+					++argi;
+					continue;
+				}
+				++argi;
+				if(param == "antennas")
+					observation.SetAntennaCount(atoi(argv[argi]));
+				else if(param == "subbands")
+					observation.SetSubbandCount(atoi(argv[argi]));
+				else if(param == "channels")
+					observation.SetChannelsPerSubband(atoi(argv[argi]));
+				else if(param == "scans")
+					observation.SetScanCount(atoi(argv[argi]));
+				else if(param == "inttime")
+					observation.SetIntegrationTime(atof(argv[argi]));
+				else if(param == "coarsechan")
+					observation.SetFirstCoarseChannel(atoi(argv[argi]));
+				else if(param == "gpstime")
+					observation.SetGPSTime(atol(argv[argi]));
+				else if(param == "rfi")
+					observation.SetRFIFraction(atof(argv[argi]));
+				else if(param == "flagantennas")
+					observation.SetFlaggedAntennaCount(atoi(argv[argi]));
+				else if(param == "seed")
+					observation.SetSeed(atoi(argv[argi]));
+				else if(param == "solutions")
+					solutionFilename = argv[argi];
+				else {
+					usage();
+					return -1;
+				}
+			}
+			else if(argv[argi][0] != '-' && argi+1 == argc)
+				prefix = argv[argi];
+			else {
+				usage();
+				return -1;
+			}
+			++argi;
+		}
+		if(prefix.empty())
+		{
+			usage();
+			return -1;
+		}
+
+		const std::string metafitsFilename = prefix + "_metafits.fits";
+		std::cout << "Writing " << metafitsFilename << "...\n";
+		observation.WriteMetafits(metafitsFilename);
+		for(size_t i=0; i!=observation.SubbandCount(); ++i)
+		{
+			const std::string filename = SyntheticObservation::GPUBoxFilename(prefix, i);
+			std::cout << "Writing " << filename << "...\n";
+			observation.WriteGPUBoxFile(filename, i);
+		}
+
+		if(!solutionFilename.empty())
+		{
+			std::cout << "Writing " << solutionFilename << "...\n";
+			observation.WriteSolutionFile(solutionFilename);
+		}
+
+		std::cout << "Process with: cotter -m " << metafitsFilename;
+		if(observation.SubbandCount() != 24)
+			std::cout << " -sbcount " << observation.SubbandCount();
+		if(offline)
+			std::cout << " -offline-gpubox-format";
+		std::cout << " -o " << prefix << ".ms " << prefix << "_gpubox*_00.fits\n";
+	} catch(std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << '\n';
+		return -1;
+	}
+	return 0;
+}
@@ -1,8 +1,10 @@
 #include "threadedwriter.h"
+#include "memorytracker.h"
+#include "profiler.h"
 
 #include <boost/mem_fn.hpp>
 
-ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter) :
+ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter, const std::string& queueName) :
 	ForwardingWriter(std::move(parentWriter)),
 	_isWriterReady(false),
 	_isBufferReady(false),
@@ -10,8 +12,11 @@ ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter) :
 	_bufferedData(0),
 	_bufferedFlags(0),
 	_bufferedWeights(0),
+	_statistics(Profiler::Instance().QueueStatistics(queueName)),
 	_thread(&ThreadedWriter::writerThreadFunc, this)
 {
+	if(_statistics)
+		_statistics->capacity = 1;
 }
 
 ThreadedWriter::~ThreadedWriter()
@@ -24,6 +29,8 @@ ThreadedWriter::~ThreadedWriter()
 	_bufferChangeCondition.notify_all();
 	_thread.join();
 	
+	if(_bufferedData != 0)
+		MemoryTracker::Release(MemoryTracker::WriterRows, rowBytes());
 	delete[] _bufferedData;
 	delete[] _bufferedFlags;
 	delete[] _bufferedWeights;
@@ -35,6 +42,7 @@ void ThreadedWriter::WriteBandInfo(const std::string &name, const std::vector<Wr
 	_bufferedData = new std::complex<float>[_arraySize];
 	_bufferedFlags = new bool[_arraySize];
 	_bufferedWeights = new float[_arraySize];
+	MemoryTracker::Allocate(MemoryTracker::WriterRows, rowBytes());
 	
 	ForwardingWriter::WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
 }
@@ -45,7 +53,7 @@ void ThreadedWriter::AddRows(size_t rowCount)
 	
 	// Wait until the writer is ready AND the buffer is empty
 	while(!_isWriterReady || _isBufferReady)
-		_bufferChangeCondition.wait(lock);
+		waitForBufferChange(lock, true);
 	
 	// Just keep mutex locked (might take time, but this method is not called so often...)
 	ParentWriter().AddRows(rowCount);
@@ -57,7 +65,7 @@ void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1,
 	
 	// Wait until the writer is ready AND the buffer is empty (=not ready)
 	while(!_isWriterReady || _isBufferReady)
-		_bufferChangeCondition.wait(lock);
+		waitForBufferChange(lock, true);
 	
 	_bufferedTime = time;
 	_bufferedTimeCentroid = timeCentroid;
@@ -72,9 +80,34 @@ void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1,
 	memcpy(_bufferedWeights, weights, _arraySize * sizeof(float));
 	
 	_isBufferReady = true;
+	if(_statistics)
+	{
+		_statistics->write_count.fetch_add(1, std::memory_order_relaxed);
+		_statistics->register_occupancy(1, 1);
+	}
 	_bufferChangeCondition.notify_all();
 }
 
+void ThreadedWriter::SaveState(std::ostream& stream)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	
+	while(!_isWriterReady || _isBufferReady)
+		waitForBufferChange(lock, true);
+	
+	ParentWriter().SaveState(stream);
+}
+
+void ThreadedWriter::RestoreState(std::istream& stream)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	
+	while(!_isWriterReady || _isBufferReady)
+		waitForBufferChange(lock, true);
+	
+	ParentWriter().RestoreState(stream);
+}
+
 void ThreadedWriter::writerThreadFunc()
 {
 	std::unique_lock<std::mutex> lock(_mutex);
@@ -86,7 +119,7 @@ void ThreadedWriter::writerThreadFunc()
 
 		// Wait until a buffer is ready OR the writer is shutting down
 		while(!_isBufferReady && !_isFinishing)
-			_bufferChangeCondition.wait(lock);
+			waitForBufferChange(lock, false);
 		
 		_isWriterReady = false;
 		if(_isBufferReady)
@@ -97,6 +130,32 @@ void ThreadedWriter::writerThreadFunc()
 			
 			lock.lock();
 			_isBufferReady = false;
+			if(_statistics)
+			{
+				_statistics->read_count.fetch_add(1, std::memory_order_relaxed);
+				_statistics->register_occupancy(0, 1);
+			}
+		}
+	}
+}
+
+void ThreadedWriter::waitForBufferChange(std::unique_lock<std::mutex>& lock, bool isProducer)
+{
+	if(_statistics)
+	{
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		_bufferChangeCondition.wait(lock);
+		const uint64_t waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		if(isProducer)
+		{
+			_statistics->write_wait_count.fetch_add(1, std::memory_order_relaxed);
+			_statistics->write_wait_ns.fetch_add(waitNs, std::memory_order_relaxed);
+		}
+		else {
+			_statistics->read_wait_count.fetch_add(1, std::memory_order_relaxed);
+			_statistics->read_wait_ns.fetch_add(waitNs, std::memory_order_relaxed);
 		}
 	}
+	else
+		_bufferChangeCondition.wait(lock);
 }
@@ -2,6 +2,7 @@
 #define THREADED_WRITER_H
 
 #include "forwardingwriter.h"
+#include "lane.h"
 
 #include <string.h>
 
@@ -13,7 +14,11 @@
 class ThreadedWriter : public ForwardingWriter
 {
 	public:
-		ThreadedWriter(std::unique_ptr<Writer>&& parentWriter);
+		/**
+		 * @param queueName Name under which the statistics of the hand-off to the writer thread
+		 * are reported in the profile.
+		 */
+		ThreadedWriter(std::unique_ptr<Writer>&& parentWriter, const std::string& queueName = "writer hand-off");
 		
 		virtual ~ThreadedWriter() final override;
 		
@@ -23,6 +28,11 @@ class ThreadedWriter : public ForwardingWriter
 		
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		
+		/** Waits until the writer thread has written the last row, and then saves the state of the parent writer. */
+		virtual void SaveState(std::ostream& stream) final override;
+		
+		virtual void RestoreState(std::istream& stream) final override;
+		
 	private:
 		std::condition_variable _bufferChangeCondition;
 		std::mutex _mutex;
@@ -36,11 +46,14 @@ class ThreadedWriter : public ForwardingWriter
 		std::complex<float> *_bufferedData;
 		bool *_bufferedFlags;
 		float *_bufferedWeights;
+		ao::lane_statistics* _statistics;
 		
 		// Last property, because it needs to be constructed after fields have been initialized
 		std::thread _thread;
 		
+		int64_t rowBytes() const { return _arraySize * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float)); }
 		void writerThreadFunc();
+		void waitForBufferChange(std::unique_lock<std::mutex>& lock, bool isProducer);
 };
 
 #endif
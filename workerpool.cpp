@@ -0,0 +1,89 @@
+#include "workerpool.h"
+
+WorkerPool::WorkerPool(size_t threadCount) :
+	_task(nullptr),
+	_taskCount(0),
+	_nextTask(0),
+	_busyWorkers(0),
+	_loopIndex(0),
+	_isStopping(false)
+{
+	for(size_t i=1; i<threadCount; ++i)
+		_threads.emplace_back(&WorkerPool::workerThreadFunc, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isStopping = true;
+	}
+	_startCondition.notify_all();
+	for(std::thread& thread : _threads)
+		thread.join();
+}
+
+void WorkerPool::Run(size_t taskCount, const std::function<void(size_t)>& task)
+{
+	std::lock_guard<std::mutex> runLock(_runMutex);
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_task = &task;
+		_taskCount = taskCount;
+		_nextTask = 0;
+		_busyWorkers = _threads.size();
+		++_loopIndex;
+	}
+	_startCondition.notify_all();
+	runTasks();
+	
+	std::unique_lock<std::mutex> lock(_mutex);
+	// Every worker takes part in every loop, so the next loop can not start before all have seen this one
+	_finishCondition.wait(lock, [&]() { return _busyWorkers == 0; });
+	_task = nullptr;
+	if(_error)
+	{
+		std::exception_ptr error = _error;
+		_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void WorkerPool::workerThreadFunc()
+{
+	uint64_t lastLoop = 0;
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(true)
+	{
+		_startCondition.wait(lock, [&]() { return _isStopping || _loopIndex != lastLoop; });
+		if(_isStopping)
+			return;
+		lastLoop = _loopIndex;
+		lock.unlock();
+		runTasks();
+		lock.lock();
+		--_busyWorkers;
+		if(_busyWorkers == 0)
+			_finishCondition.notify_one();
+	}
+}
+
+void WorkerPool::runTasks()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(_nextTask != _taskCount)
+	{
+		const size_t taskIndex = _nextTask;
+		++_nextTask;
+		lock.unlock();
+		try {
+			(*_task)(taskIndex);
+		} catch(...) {
+			lock.lock();
+			if(!_error)
+				_error = std::current_exception();
+			continue;
+		}
+		lock.lock();
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of threads that run the iterations of a short loop in parallel. The threads
+ * are started once and wait between loops, so that loops that run often, like the flush
+ * of a timestep to the flag files, do not start threads every time. The calling thread
+ * takes part in the loop, so a pool of one thread runs the loop on the caller.
+ */
+class WorkerPool
+{
+	public:
+		explicit WorkerPool(size_t threadCount);
+		~WorkerPool();
+		
+		WorkerPool(const WorkerPool&) = delete;
+		WorkerPool& operator=(const WorkerPool&) = delete;
+		
+		size_t ThreadCount() const { return _threads.size() + 1; }
+		
+		/**
+		 * Call task(i) for i from 0 to taskCount-1 and return when all calls have finished.
+		 * When a call throws, the other calls still run and the first exception is rethrown.
+		 * Loops of several callers are run one after the other.
+		 */
+		void Run(size_t taskCount, const std::function<void(size_t)>& task);
+		
+	private:
+		void workerThreadFunc();
+		void runTasks();
+		
+		std::mutex _runMutex, _mutex;
+		std::condition_variable _startCondition, _finishCondition;
+		const std::function<void(size_t)>* _task;
+		size_t _taskCount, _nextTask, _busyWorkers;
+		uint64_t _loopIndex;
+		bool _isStopping;
+		std::exception_ptr _error;
+		std::vector<std::thread> _threads;
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <complex>
+#include <iosfwd>
+#include <stdexcept>
 
 class Writer
 {
@@ -74,6 +76,20 @@ class Writer
 		virtual void AddRows(size_t count) = 0;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) = 0;
 		
+		/**
+		 * For checkpointing: save what is needed to continue writing from another process. This is
+		 * called between timesteps. RestoreState() is called on a new writer that has received the
+		 * same meta data, before any rows are added to it.
+		 */
+		virtual void SaveState(std::ostream& stream)
+		{
+			throw std::runtime_error("The output format does not support checkpointing");
+		}
+		virtual void RestoreState(std::istream& stream)
+		{
+			throw std::runtime_error("The output format does not support checkpointing");
+		}
+		
 		virtual bool AreAntennaPositionsLocal() const { return false; }
 		virtual bool CanWriteStatistics() const { return false; }
 		